@@ -172,6 +172,48 @@ def full_build(name, build_tool):
     print('{:.4f}'.format(end_time - start_time), file=nop_time)
     print('    Finished in {:.2f}s with exit code {}'.format(end_time - start_time, rc))
 
+def replay(name):
+  bench_path = path.join(BENCH_DIR, name)
+  checkout_path = path.join(bench_path, 'checkout')
+
+  if 'rkr' not in BENCHMARKS[name]:
+    print('No rkr config for {}'.format(name))
+    return
+
+  print('Replay of {} trace'.format(name))
+  checkout(name)
+
+  reps = DEFAULT_REPS
+  if 'reps' in BENCHMARKS[name]:
+    reps = int(BENCHMARKS[name]['reps'])
+
+  # Run one full build to produce the trace that will be replayed
+  setup(name, 'rkr')
+  copy_files(name, 'rkr')
+  print('  Running build')
+  rc = os.system('cd {}; {} 2> /dev/null 1> /dev/null'.format(checkout_path, BENCHMARKS[name]['rkr']['build']))
+  if rc != 0:
+    raise Exception('Build of {} failed'.format(name))
+
+  replay_rate = open(path.join(bench_path, 'replay-rkr.csv'), 'w')
+  print('steps,time,steps_per_sec', file=replay_rate)
+
+  for i in range(0, reps):
+    # rkr stats loads the trace and emulates every step without running any commands
+    print('  Running replay {}'.format(i+1))
+    start_time = time.perf_counter()
+    output = os.popen('cd {}; rkr stats 2> /dev/null'.format(checkout_path)).read()
+    end_time = time.perf_counter()
+
+    steps = 0
+    for line in output.splitlines():
+      if line.strip().startswith('Steps:'):
+        steps = int(line.split(':')[1])
+
+    elapsed = end_time - start_time
+    print('{},{:.4f},{:.1f}'.format(steps, elapsed, steps / elapsed), file=replay_rate)
+    print('    Replayed {} steps in {:.2f}s ({:.0f} steps/sec)'.format(steps, elapsed, steps / elapsed))
+
 # Count lines in a file (a list of commands) but exclude lines with known prefixes
 def count_lines(filepath, filter=[]):
   f = open(filepath, 'r')
@@ -364,7 +406,8 @@ def show_usage():
   print('Experiments:')
   print('  case-study  Record time and command counts for incremental builds')
   print('  full-build  Record the time to complete a full build')
-  print('  all         Run both experiments')
+  print('  replay      Record the rate of emulated steps when replaying a saved rkr trace')
+  print('  all         Run all experiments')
   print()
   print('Build Tools:')
   print('  default       Use each benchmark\'s default build system')
@@ -385,7 +428,7 @@ if __name__ == '__main__':
     exit(1)
   
   # Validate and unpack the experiment argument
-  if sys.argv[1] not in ['case-study', 'full-build', 'all']:
+  if sys.argv[1] not in ['case-study', 'full-build', 'replay', 'all']:
     print('Invalid experiment name "{}"'.format(sys.argv[1]))
     show_usage()
     exit(1)
@@ -494,3 +537,19 @@ if __name__ == '__main__':
       #    case_study(bench, 'rattle')
       #  except Exception as e:
       #    print(e)
+
+  # Run replay experiments
+  if experiment == 'replay' or experiment == 'all':
+    # Loop over benchmarks
+    for bench in benchmarks:
+      # If the benchmark doesn't support the replay experiment, skip it
+      if 'replay' not in BENCHMARKS[bench]['experiments']:
+        print('Replay experiment is not available for {}'.format(bench))
+        continue
+
+      # Replay only measures riker, so it runs for any build tool that includes rkr
+      if build_tool == 'rkr' or build_tool == 'all':
+        try:
+          replay(bench)
+        except Exception as e:
+          print(e)
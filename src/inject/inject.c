@@ -35,6 +35,11 @@ static bool initialized = false;
 // The shared tracing channel
 static struct shared_tracing_data* shmem = NULL;
 
+// File descriptors this process may read or write without reporting. Each entry holds the pipe
+// epoch slot plus one in the upper half and the expected epoch in the lower half, or zero if every
+// use of the file descriptor must be reported.
+static uint64_t untraced_fds[TRACING_UNTRACED_FD_COUNT];
+
 // The function to initialize the injected library
 void rkr_inject_init();
 
@@ -229,6 +234,7 @@ size_t channel_acquire(pid_t tid) {
       // Successfully acquired the channel
       shmem->channels[i].tid = tid;
       shmem->channels[i].buffer_pos = 0;
+      shmem->channels[i].pipe_slot = -1;
 
       return i;
     }
@@ -388,6 +394,47 @@ long channel_proceed(size_t c,
   return rc;
 }
 
+/// Can this process read or write a file descriptor without reporting it to the tracer?
+bool fd_untraced(int fd) {
+  if (fd < 0 || fd >= TRACING_UNTRACED_FD_COUNT) return false;
+
+  uint64_t entry = __atomic_load_n(&untraced_fds[fd], __ATOMIC_RELAXED);
+  if (entry == 0) return false;
+
+  // The file descriptor can be used without reporting until the pipe's epoch changes
+  uint32_t slot = (entry >> 32) - 1;
+  uint32_t epoch = (uint32_t)entry;
+  return __atomic_load_n(&shmem->pipe_epochs[slot], __ATOMIC_ACQUIRE) == epoch;
+}
+
+/// Require this process to report every use of a file descriptor
+void fd_clear_untraced(int fd) {
+  if (fd < 0 || fd >= TRACING_UNTRACED_FD_COUNT) return;
+  __atomic_store_n(&untraced_fds[fd], 0, __ATOMIC_RELAXED);
+}
+
+/// Record whether the tracer allowed this process to keep using a file descriptor without reporting
+void channel_update_untraced(size_t c, int fd) {
+  if (fd < 0 || fd >= TRACING_UNTRACED_FD_COUNT) return;
+
+  uint64_t entry = 0;
+  int32_t slot = shmem->channels[c].pipe_slot;
+  if (slot >= 0) {
+    entry = ((uint64_t)(slot + 1) << 32) | shmem->channels[c].pipe_epoch;
+  }
+  __atomic_store_n(&untraced_fds[fd], entry, __ATOMIC_RELAXED);
+}
+
+/// Issue a system call without reporting it, and set errno if required
+long untraced_syscall(long syscall_nr, uint64_t arg1, uint64_t arg2, uint64_t arg3) {
+  long rc = safe_syscall(syscall_nr, arg1, arg2, arg3, 0, 0, 0);
+  if (rc < 0) {
+    errno = -rc;
+    return -1;
+  }
+  return rc;
+}
+
 uint64_t channel_buffer_string(size_t c, const char* str) {
   // If the string is null just return null
   if (str == NULL) return (uint64_t)NULL;
@@ -466,11 +513,20 @@ int fast_openat(int dfd, const char* pathname, int flags, mode_t mode) {
   // Inform the tracer that this command is entering a syscall
   channel_enter(c, __NR_openat, dfd, pathname_arg, (uint64_t)flags, (uint64_t)mode, 0, 0);
 
-  // Finish the system call and return
-  return channel_proceed(c, __NR_openat, dfd, (uint64_t)pathname, flags, mode, 0, 0, false);
+  // Finish the system call
+  int fd = channel_proceed(c, __NR_openat, dfd, (uint64_t)pathname, flags, mode, 0, 0, false);
+
+  // The descriptor number may have been closed without reporting, so make sure every use of the
+  // newly opened file is reported
+  fd_clear_untraced(fd);
+
+  return fd;
 }
 
 int fast_close(int fd) {
+  // Once the file descriptor is closed, every use of its number must be reported
+  fd_clear_untraced(fd);
+
   pid_t tid = gettid();
 
   // Find an available channel
@@ -577,6 +633,9 @@ int fast_faccessat(int dfd, const char* pathname, int mode, int flags) {
 }
 
 long fast_read(int fd, void* data, size_t count) {
+  // Skip reporting if the tracer has already seen this command read from a pipe in this epoch
+  if (fd_untraced(fd)) return untraced_syscall(__NR_read, fd, (uint64_t)data, count);
+
   pid_t tid = gettid();
 
   // Find an available channel
@@ -585,6 +644,9 @@ long fast_read(int fd, void* data, size_t count) {
   // Inform the tracer that this command is entering a system call
   channel_enter(c, __NR_read, fd, (uint64_t)data, count, 0, 0, 0);
 
+  // Can later reads skip reporting?
+  channel_update_untraced(c, fd);
+
   // Finish the system call and return. Unblock the channel before issuing the syscall.
   return channel_proceed(c, __NR_read, fd, (uint64_t)data, count, 0, 0, 0, true);
 }
@@ -603,6 +665,9 @@ ssize_t fast_pread(int fd, void* buf, size_t count, off_t offset) {
 }
 
 long fast_write(int fd, const void* data, size_t count) {
+  // Skip reporting if the tracer has already seen this command write to a pipe in this epoch
+  if (fd_untraced(fd)) return untraced_syscall(__NR_write, fd, (uint64_t)data, count);
+
   pid_t tid = gettid();
 
   // Find an available channel
@@ -611,6 +676,9 @@ long fast_write(int fd, const void* data, size_t count) {
   // Inform the tracer that this command is entering a system call
   channel_enter(c, __NR_write, fd, (uint64_t)data, count, 0, 0, 0);
 
+  // Can later writes skip reporting?
+  channel_update_untraced(c, fd);
+
   // Finish the system call and return. Unblock the channel before issuing the syscall.
   return channel_proceed(c, __NR_write, fd, (uint64_t)data, count, 0, 0, 0, true);
 }
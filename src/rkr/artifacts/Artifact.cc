@@ -1,11 +1,13 @@
 #include "Artifact.hh"
 
+#include <algorithm>
 #include <cerrno>
 #include <map>
 #include <memory>
 #include <optional>
 #include <string>
 #include <tuple>
+#include <vector>
 
 #include <fcntl.h>
 
@@ -13,23 +15,26 @@
 #include "runtime/Command.hh"
 #include "runtime/Ref.hh"
 #include "runtime/env.hh"
+#include "util/options.hh"
+#include "util/pool.hh"
+#include "util/stats.hh"
 #include "versions/ContentVersion.hh"
 #include "versions/DirVersion.hh"
 #include "versions/MetadataVersion.hh"
 #include "versions/PipeVersion.hh"
 
-using std::make_shared;
 using std::map;
 using std::nullopt;
 using std::optional;
 using std::shared_ptr;
 using std::string;
 using std::tuple;
+using std::vector;
 
 Artifact::Artifact() noexcept {}
 
 Artifact::Artifact(MetadataVersion v) noexcept {
-  auto mv = make_shared<MetadataVersion>(v);
+  auto mv = make_pooled<MetadataVersion>(v);
   appendVersion(mv);
   _metadata.update(mv);
 }
@@ -75,6 +80,16 @@ string Artifact::getName() const noexcept {
 
 void Artifact::rollback() noexcept {
   _metadata.rollback();
+
+  // The rolled back state has to be checked and cached again
+  markDirty();
+}
+
+// Record that this artifact changed since the last final state check and caching pass
+void Artifact::markDirty() noexcept {
+  if (_dirty_for_check && _dirty_for_cache) return;
+  env::addDirty(shared_from_this(), !std::exchange(_dirty_for_check, true),
+                !std::exchange(_dirty_for_cache, true));
 }
 
 // Model a link to this artifact, but do not commit it to the filesystem
@@ -288,16 +303,39 @@ void Artifact::matchMetadata(const shared_ptr<Command>& c,
 
 /// Apply a new metadata version to this artifact
 void Artifact::updateMetadata(const shared_ptr<Command>& c, MetadataVersion writing) noexcept {
-  auto mv = make_shared<MetadataVersion>(writing);
+  auto mv = make_pooled<MetadataVersion>(writing);
   appendVersion(mv);
   _metadata.update(c, mv);
+  markDirty();
 
   // Report the output to the build
   c->addMetadataOutput(shared_from_this(), mv);
 }
 
 void Artifact::appendVersion(shared_ptr<Version> v) noexcept {
-  if (options::track_inputs_outputs) _versions.push_back(v);
+  if (!options::track_inputs_outputs) return;
+
+  // Drop versions nothing refers to anymore once the history has doubled since the last compaction
+  if (_versions.size() >= _versions_compact_size) {
+    auto last = std::remove_if(_versions.begin(), _versions.end(),
+                               [](const auto& weak_v) { return weak_v.expired(); });
+    _versions.erase(last, _versions.end());
+    _versions_compact_size = std::max(_versions_compact_size, _versions.size() * 2);
+  }
+
+  // Keep a strong reference to every version if the whole history was requested
+  if (options::keep_version_history) _kept_versions.push_back(v);
+
+  _versions.push_back(v);
+}
+
+// Get the versions of this artifact that are still in use
+vector<shared_ptr<Version>> Artifact::getVersions() const noexcept {
+  vector<shared_ptr<Version>> result;
+  for (const auto& weak_v : _versions) {
+    if (auto v = weak_v.lock(); v) result.push_back(std::move(v));
+  }
+  return result;
 }
 
 Ref Artifact::resolve(const shared_ptr<Command>& c,
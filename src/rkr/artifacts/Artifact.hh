@@ -2,19 +2,21 @@
 
 #include <cstddef>
 #include <filesystem>
-#include <list>
 #include <map>
 #include <memory>
 #include <optional>
 #include <ostream>
 #include <string>
 #include <tuple>
+#include <utility>
+#include <vector>
 
 #include "data/AccessFlags.hh"
 #include "data/IRSource.hh"
 #include "runtime/Command.hh"
 #include "runtime/Ref.hh"
 #include "runtime/VersionState.hh"
+#include "util/InternedPath.hh"
 #include "util/log.hh"
 #include "versions/MetadataVersion.hh"
 
@@ -36,6 +38,9 @@ class Version;
  */
 class Artifact : public std::enable_shared_from_this<Artifact> {
  public:
+  /// The number of levels of symlinks a path resolution follows by default
+  enum : size_t { DefaultSymlinkLimit = 40 };
+
   /**
    * Create a new artifact with no existing metadata. This should be followed with updateContent and
    * updateMetadata calls to set initial state for the artifact.
@@ -74,8 +79,8 @@ class Artifact : public std::enable_shared_from_this<Artifact> {
   /// Set the name of this artifact used for pretty-printing
   void setName(std::string newname) noexcept { _name = newname; }
 
-  /// Get a list of all the versions associated with this artifact
-  const std::list<std::shared_ptr<Version>>& getVersions() const noexcept { return _versions; }
+  /// Get a list of the versions associated with this artifact that are still in use
+  std::vector<std::shared_ptr<Version>> getVersions() const noexcept;
 
   /// Get a file descriptor for this artifact
   virtual int getFD(AccessFlags flags) noexcept;
@@ -117,8 +122,18 @@ class Artifact : public std::enable_shared_from_this<Artifact> {
   /// Commit any pending versions and save fingerprints for this artifact
   virtual void applyFinalState(fs::path path) noexcept;
 
-  /// Fingerprint and cache the committed state of this artifact
-  virtual void cacheAll(fs::path path) const noexcept {};
+  /// Fingerprint and cache the committed state of this artifact. Returns false if the artifact has
+  /// uncommitted content, so it must be cached again once that content is committed.
+  virtual bool cacheAll() const noexcept { return true; }
+
+  /// Record that this artifact changed, so the next final state check and caching pass visit it
+  void markDirty() noexcept;
+
+  /// Clear this artifact's pending final state check. Returns true if a check was pending.
+  bool clearDirtyForCheck() noexcept { return std::exchange(_dirty_for_check, false); }
+
+  /// Clear this artifact's pending caching pass. Returns true if a caching pass was pending.
+  bool clearDirtyForCache() noexcept { return std::exchange(_dirty_for_cache, false); }
 
   /************ Path Manipulation ************/
 
@@ -210,6 +225,12 @@ class Artifact : public std::enable_shared_from_this<Artifact> {
     FAIL << c << " attempted to write " << this;
   }
 
+  /// A traced command's write to this artifact failed, so afterWrite will not be called
+  virtual void abortWrite(Build& build,
+                          const IRSource& source,
+                          const std::shared_ptr<Command>& c,
+                          Ref::ID ref) noexcept {}
+
   /// A traced command is about to (possibly) truncate this artifact to length zero
   virtual void beforeTruncate(Build& build,
                               const IRSource& source,
@@ -273,10 +294,24 @@ class Artifact : public std::enable_shared_from_this<Artifact> {
   Ref resolve(const std::shared_ptr<Command>& c,
               fs::path path,
               AccessFlags flags,
-              size_t symlink_limit = 40) noexcept {
+              size_t symlink_limit = DefaultSymlinkLimit) noexcept {
     return resolve(c, nullptr, path.begin(), path.end(), flags, symlink_limit);
   }
 
+  /**
+   * Resolve an interned path relative to this artifact. Directories override this to reuse the
+   * entries found by earlier resolutions of the same path.
+   * \param c     The command this resolution is performed on behalf of
+   * \param path  The interned path being resolved
+   * \param flags The access mode requested
+   * \returns a resolution result, which is either an artifact or an error code
+   */
+  virtual Ref resolve(const std::shared_ptr<Command>& c,
+                      InternedPath path,
+                      AccessFlags flags) noexcept {
+    return resolve(c, path.getPath(), flags);
+  }
+
   /**
    * Resolve a path relative to this artifact.
    * \param c         The command this resolution is performed on behalf of
@@ -322,6 +357,9 @@ class Artifact : public std::enable_shared_from_this<Artifact> {
   /// Take the temporary path from this artifact and return it
   std::optional<fs::path> takeTemporaryPath() noexcept;
 
+  /// Does this artifact have a temporary path?
+  bool hasTemporaryPath() const noexcept { return _temp_path.has_value(); }
+
   /// Remember a version associated with this artifact
   void appendVersion(std::shared_ptr<Version> v) noexcept;
 
@@ -332,12 +370,28 @@ class Artifact : public std::enable_shared_from_this<Artifact> {
   /// A fixed string name assigned to this artifact
   std::string _name;
 
-  /// All of the versions of this artifact
-  std::list<std::shared_ptr<Version>> _versions;
+  /// The versions of this artifact, in the order they were created. The history does not keep
+  /// versions alive; a version stays in memory only while a command's inputs or outputs, a
+  /// predicate, or the artifact's current state refers to it. Entries for destroyed versions are
+  /// compacted away as the history grows.
+  std::vector<std::weak_ptr<Version>> _versions;
+
+  /// The history length that triggers the next compaction
+  size_t _versions_compact_size = 16;
+
+  /// Strong references to every version in the history, held only when the whole history is kept
+  /// for rkr graph and rkr stats
+  std::vector<std::shared_ptr<Version>> _kept_versions;
 
   /// A path to a temporary location where this artifact is linked
   std::optional<fs::path> _temp_path;
 
+  /// Has this artifact changed since the last final state check?
+  bool _dirty_for_check = false;
+
+  /// Has this artifact changed since the last caching pass?
+  bool _dirty_for_cache = false;
+
  protected:
   /// The committed and uncommitted metadata for this artifact
   VersionState<MetadataVersion> _metadata;
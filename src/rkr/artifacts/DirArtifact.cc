@@ -6,7 +6,9 @@
 #include <sstream>
 #include <string>
 #include <tuple>
+#include <vector>
 
+#include "artifacts/FileArtifact.hh"
 #include "artifacts/SymlinkArtifact.hh"
 #include "data/AccessFlags.hh"
 #include "platform-config.h"
@@ -15,6 +17,8 @@
 #include "runtime/Ref.hh"
 #include "runtime/env.hh"
 #include "util/log.hh"
+#include "util/options.hh"
+#include "util/pool.hh"
 #include "versions/ContentVersion.hh"
 #include "versions/DirListVersion.hh"
 #include "versions/DirVersion.hh"
@@ -24,6 +28,7 @@ using std::make_shared;
 using std::shared_ptr;
 using std::string;
 using std::tuple;
+using std::vector;
 
 namespace fs = std::filesystem;
 
@@ -52,7 +57,7 @@ void DirArtifact::createEmptyDir(std::shared_ptr<Command> c) noexcept {
   FAIL_IF(!c) << "A directory cannot be created by a null command";
 
   // Set up the base directory version
-  auto v = make_shared<BaseDirVersion>(true);
+  auto v = make_pooled<BaseDirVersion>(true);
   _base.update(c, v);
   appendVersion(v);
 
@@ -84,7 +89,7 @@ bool DirArtifact::hasUncommittedContent() noexcept {
 }
 
 // Commit all final versions of this artifact to the filesystem
-void DirArtifact::commitAll() noexcept {
+void DirArtifact::commitAll(bool skip_intermediates) noexcept {
   // Get a committed path to this directory
   auto path = commitPath();
   ASSERT(path.has_value()) << "Committing to a directory with no path";
@@ -97,6 +102,7 @@ void DirArtifact::commitAll() noexcept {
 
   // Commit each entry in this directory
   for (auto& [name, entry] : _entries) {
+    if (skip_intermediates && entry->canLeaveUncommitted()) continue;
     entry->commit();
   }
 }
@@ -109,6 +115,15 @@ void DirArtifact::commitEntry(string name) noexcept {
   }
 }
 
+/// Get the names of every entry in this directory that the build has looked up or changed
+vector<string> DirArtifact::getEntryNames() const noexcept {
+  vector<string> names;
+  for (const auto& [name, entry] : _entries) {
+    names.push_back(name);
+  }
+  return names;
+}
+
 /// Commit a link to this artifact at the given path
 void DirArtifact::commitLink(shared_ptr<DirEntry> entry) noexcept {
   // Check for a matching committed link. If we find one, return.
@@ -207,28 +222,11 @@ void DirArtifact::commitUnlink(shared_ptr<DirEntry> entry) noexcept {
   return;
 }
 
-// Compare all final versions of this artifact to the filesystem state
-void DirArtifact::checkFinalState(fs::path path) noexcept {
-  // Recursively check the final state of all known entries
-  for (const auto& [name, entry] : _entries) {
-    // Get the targeted artifact
-    auto artifact = entry->peekTarget();
-
-    // If there is a target, make sure that artifact is in the expected final state
-    if (artifact) artifact->checkFinalState(path / name);
-
-    // If the entry doesn't reference an artifact, we don't need to check for its absence. We only
-    // have a record of this artifact being missing because some other part of the build accessed
-    // it. That means there will be some earlier reference that was expected to succeed or fail
-    // that will now have changed.
-  }
-}
-
 // Commit any pending versions and save fingerprints for this artifact
 void DirArtifact::applyFinalState(fs::path path) noexcept {
-  // First, commit this artifact and its metadata
+  // First, commit this artifact and its metadata. Intermediate files can stay in the cache.
   // TODO: Should we just commit the base version, then commit entries on demand?
-  commitAll();
+  commitAll(options::lazy_outputs);
 
   // Fingerprint/commit any remaining metadata
   Artifact::applyFinalState(path);
@@ -243,18 +241,6 @@ void DirArtifact::applyFinalState(fs::path path) noexcept {
   }
 }
 
-// Fingerprint and cache the committed state of this artifact
-void DirArtifact::cacheAll(fs::path path) const noexcept {
-  // Recursively cache all known entries
-  for (const auto& [name, entry] : _entries) {
-    // Get the targeted artifact
-    auto artifact = entry->peekTarget();
-
-    // If there is a target, commit its final state
-    if (artifact) artifact->cacheAll(path / name);
-  }
-}
-
 /// A traced command is about to (possibly) read from this artifact
 void DirArtifact::beforeRead(Build& build,
                              const IRSource& source,
@@ -276,7 +262,7 @@ void DirArtifact::afterRead(Build& build,
 // Get a version that lists all the entries in this directory
 shared_ptr<ContentVersion> DirArtifact::getContent(const shared_ptr<Command>& c) noexcept {
   // Create a DirListVersion to hold the list of directory entries
-  auto result = make_shared<DirListVersion>();
+  auto result = make_pooled<DirListVersion>();
 
   // Get the committed base version (if there is one)
   auto [committed_base, weak_committed_creator] = _base.getCommitted();
@@ -365,8 +351,9 @@ Ref DirArtifact::resolve(const shared_ptr<Command>& c,
   // iterator
   const auto& entry = *current++;
 
-  // Are we looking for the current directory?
-  auto entry_str = entry.string();
+  // Are we looking for the current directory? Compare and look up the entry name in place rather
+  // than copying it to a new string.
+  const auto& entry_str = entry.native();
 
   if (entry_str == ".") {
     return resolve(c, shared_from_this(), current, end, flags, symlink_limit);
@@ -428,7 +415,7 @@ Ref DirArtifact::resolve(const shared_ptr<Command>& c,
 
       // Add the entry to this directory's map of entries
       auto entry_object = make_shared<DirEntry>(this->as<DirArtifact>(), entry);
-      auto entry_version = make_shared<DirEntryVersion>(entry, artifact);
+      auto entry_version = make_pooled<DirEntryVersion>(entry, artifact);
       appendVersion(entry_version);
       entry_object->setCommittedState(entry_version);
       _entries.emplace_hint(entries_iter, entry, entry_object);
@@ -494,6 +481,75 @@ Ref DirArtifact::resolve(const shared_ptr<Command>& c,
   }
 }
 
+// Resolve an interned path, reusing the entries an earlier resolution of the path passed through
+Ref DirArtifact::resolve(const shared_ptr<Command>& c,
+                         InternedPath path,
+                         AccessFlags flags) noexcept {
+  // An exclusive create has to check the final entry itself
+  if (flags.create && flags.exclusive) return resolve(c, path.getPath(), flags);
+
+  auto iter = _resolutions.find(path.getID());
+  if (iter != _resolutions.end()) {
+    const auto& cached = iter->second;
+
+    // The cached resolution is only valid if none of its entries have changed since
+    bool valid = true;
+    for (const auto& [entry, generation] : cached) {
+      if (entry->getGeneration() != generation) valid = false;
+    }
+
+    if (valid) {
+      // Visit each directory and entry as a full resolution would, so the command records the
+      // same dependencies. Every entry but the last links to the directory of the next entry.
+      shared_ptr<Artifact> dir = shared_from_this();
+      shared_ptr<Artifact> target;
+      for (const auto& [entry, generation] : cached) {
+        if (target) dir = std::move(target);
+        if (!dir->checkAccess(c, ExecAccess)) return EACCES;
+        target = entry->getTarget(c);
+      }
+
+      // Finish resolution at the final artifact, which may follow a symlink
+      return target->resolve(c, dir, path.getPath().end(), path.getPath().end(), flags,
+                             DefaultSymlinkLimit);
+    }
+
+    _resolutions.erase(iter);
+  }
+
+  auto result = resolve(c, path.getPath(), flags);
+  cacheResolution(path);
+  return result;
+}
+
+// Remember the entries a resolution of an interned path from this directory passes through
+void DirArtifact::cacheResolution(InternedPath path) noexcept {
+  const auto& p = path.getPath();
+
+  vector<CachedEntry> cached;
+  DirArtifact* dir = this;
+  for (auto iter = p.begin(); iter != p.end(); iter++) {
+    // Paths with empty, ".", or ".." components, or that resolve through a symlink, are not cached
+    if (dir == nullptr) return;
+
+    const auto& name = iter->native();
+    if (name.empty() || name == "." || name == "..") return;
+
+    auto entry_iter = dir->_entries.find(name);
+    if (entry_iter == dir->_entries.end()) return;
+
+    const auto& entry = entry_iter->second;
+    auto target = entry->peekTarget();
+    if (!target) return;
+
+    cached.push_back({entry, entry->getGeneration()});
+    dir = dynamic_cast<DirArtifact*>(target.get());
+  }
+
+  if (cached.empty()) return;
+  _resolutions.emplace(path.getID(), std::move(cached));
+}
+
 // Add a directory entry to this artifact
 void DirArtifact::addEntry(const shared_ptr<Command>& c,
                            string name,
@@ -506,11 +562,14 @@ void DirArtifact::addEntry(const shared_ptr<Command>& c,
   }
 
   // Create a version to represent this update
-  auto version = make_shared<DirEntryVersion>(name, target);
+  auto version = make_pooled<DirEntryVersion>(name, target);
   appendVersion(version);
 
   // Update the entry
   iter->second->updateEntry(c, version);
+
+  // The target now has a new path, so it has to be checked and cached there
+  if (target) target->markDirty();
 }
 
 // Remove a directory entry from this artifact
@@ -525,11 +584,14 @@ void DirArtifact::removeEntry(const shared_ptr<Command>& c,
   }
 
   // Create a version to represent this update
-  auto version = make_shared<DirEntryVersion>(name, nullptr);
+  auto version = make_pooled<DirEntryVersion>(name, nullptr);
   appendVersion(version);
 
   // Update the entry
   iter->second->updateEntry(c, version);
+
+  // The target may no longer be reachable at the path it was last checked and cached
+  if (target) target->markDirty();
 }
 
 DirEntry::DirEntry(shared_ptr<DirArtifact> dir, string name) noexcept : _dir(dir), _name(name) {}
@@ -565,6 +627,19 @@ void DirEntry::commit() noexcept {
   _state.setCommitted();
 }
 
+// Can this entry be left uncommitted at the end of the build?
+bool DirEntry::canLeaveUncommitted() const noexcept {
+  // Only a new link where there is nothing on the filesystem yet can be left uncommitted
+  if (_state.isCommitted()) return false;
+  if (auto [v, _] = _state.getCommitted(); v && v->getTarget()) return false;
+
+  // The new link must be to an intermediate file
+  auto [v, _] = _state.getUncommitted();
+  if (!v || !v->getTarget()) return false;
+  auto file = v->getTarget()->as<FileArtifact>();
+  return file && file->canLeaveUncommitted();
+}
+
 /// Reset this entry to its committed state
 void DirEntry::rollback() noexcept {
   // Get the committed and uncommitted versions of this entry
@@ -589,6 +664,9 @@ void DirEntry::rollback() noexcept {
 
   // Discard uncommitted state
   _state.rollback();
+
+  // Any cached resolution through this entry may now reach a different target
+  _generation++;
 }
 
 // Update this entry with a new version
@@ -608,6 +686,9 @@ void DirEntry::updateEntry(shared_ptr<Command> c, shared_ptr<DirEntryVersion> ve
   // Record the version as output from command c
   c->addDirectoryOutput(_dir.lock(), version);
 
+  // Any cached resolution through this entry may now reach a different target
+  _generation++;
+
   // Now update the state with the new version
   if (c->mustRun()) {
     // The command is running or has already run, so all effects are automatically committed
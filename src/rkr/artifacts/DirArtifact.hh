@@ -2,15 +2,17 @@
 
 #include <cstddef>
 #include <filesystem>
-#include <map>
 #include <memory>
 #include <optional>
 #include <string>
 #include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #include "artifacts/Artifact.hh"
 #include "runtime/Ref.hh"
 #include "runtime/VersionState.hh"
+#include "util/InternedPath.hh"
 
 namespace fs = std::filesystem;
 
@@ -45,21 +47,23 @@ class DirArtifact final : public Artifact {
   /// Does this artifact have any uncommitted content?
   virtual bool hasUncommittedContent() noexcept override;
 
-  /// Commit all entries in this directory
-  void commitAll() noexcept;
+  /// Commit all entries in this directory. If skip_intermediates is true, new links to
+  /// intermediate files that can stay in the cache are left uncommitted.
+  void commitAll(bool skip_intermediates = false) noexcept;
 
   /// Commit a specific entry in this directory
   void commitEntry(std::string name) noexcept;
 
-  /// Compare all final versions of this artifact to the filesystem state
-  virtual void checkFinalState(fs::path path) noexcept override;
+  /// Get the names of every entry in this directory that the build has looked up or changed
+  std::vector<std::string> getEntryNames() const noexcept;
+
+  /// Directories have no final state of their own to check. Their entries are checked as the
+  /// targeted artifacts change.
+  virtual void checkFinalState(fs::path path) noexcept override {}
 
   /// Commit any pending versions and save fingerprints for this artifact
   virtual void applyFinalState(fs::path path) noexcept override;
 
-  /// Fingerprint and cache the committed state of this artifact
-  virtual void cacheAll(fs::path path) const noexcept override;
-
   /// Revert this artifact to its committed state
   virtual void rollback() noexcept override;
 
@@ -121,9 +125,30 @@ class DirArtifact final : public Artifact {
                       AccessFlags flags,
                       size_t symlink_limit) noexcept override;
 
+  /// Resolve an interned path relative to this directory. If the same path was resolved from this
+  /// directory before, the entries it passed through are visited again without looking up each
+  /// name, as long as none of them has changed since.
+  virtual Ref resolve(const std::shared_ptr<Command>& c,
+                      InternedPath path,
+                      AccessFlags flags) noexcept override;
+
  private:
-  /// A map of entries in this directory
-  std::map<std::string, std::shared_ptr<DirEntry>> _entries;
+  /// Remember the entries a resolution of an interned path from this directory passes through
+  void cacheResolution(InternedPath path) noexcept;
+
+  /// An entry passed through by a cached resolution, and the entry's generation at the time
+  struct CachedEntry {
+    std::shared_ptr<DirEntry> entry;
+    size_t generation;
+  };
+
+  /// A map of entries in this directory. Entries are never removed from the map, so each name
+  /// resolves to the same DirEntry for the rest of the build.
+  std::unordered_map<std::string, std::shared_ptr<DirEntry>> _entries;
+
+  /// The entries passed through by earlier resolutions of interned paths from this directory. Only
+  /// paths where every entry exists and every entry but the last links to a directory are cached.
+  std::unordered_map<InternedPath::ID, std::vector<CachedEntry>> _resolutions;
 
   /// The base directory content is the backstop for all resolution queries
   VersionState<BaseDirVersion> _base;
@@ -158,6 +183,10 @@ class DirEntry : public std::enable_shared_from_this<DirEntry> {
   /// Commit this entry's modeled state to the filesystem
   void commit() noexcept;
 
+  /// Can this entry be left uncommitted at the end of the build? This is true for a new link to an
+  /// intermediate file that can stay in the cache until a traced command needs it.
+  bool canLeaveUncommitted() const noexcept;
+
   /// Reset this entry to its committed state
   void rollback() noexcept;
 
@@ -186,6 +215,10 @@ class DirEntry : public std::enable_shared_from_this<DirEntry> {
   /// Get the name of this entry in its containing directory
   std::string getName() const noexcept { return _name; }
 
+  /// Get this entry's generation, which changes whenever the entry is updated or rolled back. A
+  /// cached resolution through this entry is only valid while its generation is unchanged.
+  size_t getGeneration() const noexcept { return _generation; }
+
  private:
   /// The directory that contains this entry
   std::weak_ptr<DirArtifact> _dir;
@@ -195,6 +228,9 @@ class DirEntry : public std::enable_shared_from_this<DirEntry> {
 
   /// The committed and uncommitted state of this entry
   VersionState<DirEntryVersion> _state;
+
+  /// The number of times this entry has been updated or rolled back
+  size_t _generation = 0;
 };
 
 template <>
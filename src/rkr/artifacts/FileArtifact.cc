@@ -4,6 +4,8 @@
 #include <memory>
 #include <optional>
 
+#include <sys/stat.h>
+
 #include "artifacts/Artifact.hh"
 #include "artifacts/DirArtifact.hh"
 #include "runtime/Build.hh"
@@ -11,11 +13,11 @@
 #include "runtime/policy.hh"
 #include "util/log.hh"
 #include "util/options.hh"
+#include "util/pool.hh"
 #include "versions/ContentVersion.hh"
 #include "versions/FileVersion.hh"
 #include "versions/MetadataVersion.hh"
 
-using std::make_shared;
 using std::optional;
 using std::shared_ptr;
 
@@ -31,9 +33,38 @@ FileArtifact::FileArtifact(MetadataVersion mv, shared_ptr<FileVersion> cv) noexc
 /// Revert this artifact to its committed state
 void FileArtifact::rollback() noexcept {
   _content.rollback();
+  _content_readers.clear();
+  _writes_in_progress = 0;
   Artifact::rollback();
 }
 
+// Can this file be left off the filesystem at the end of the build?
+bool FileArtifact::canLeaveUncommitted() const noexcept {
+  if (!options::lazy_outputs || !options::enable_cache) return false;
+
+  // Only files that are not on the filesystem at all can be left off of it
+  if (!_committed_links.empty() || hasTemporaryPath()) return false;
+
+  // It must be possible to commit the file later
+  if (_content.isCommitted()) return false;
+  auto [version, _] = _content.getLatest();
+  if (!version->canCommit()) return false;
+
+  // Executables are usually final products, even if a later command such as a test runs them
+  auto [metadata_version, metadata_writer] = _metadata.getLatest();
+  if (metadata_version->getMode() & (S_IXUSR | S_IXGRP | S_IXOTH)) return false;
+
+  // The file is an intermediate only if every command that read it used it to produce files of its
+  // own. A command that only reports on the file, or copies it to a pipe, does not make it one.
+  if (_content_readers.empty()) return false;
+  for (const auto& [_, weak_reader] : _content_readers) {
+    auto reader = weak_reader.lock();
+    if (!reader || !reader->wroteFile()) return false;
+  }
+
+  return true;
+}
+
 // Commit the content of this artifact to the filesystem
 void FileArtifact::commitContentTo(fs::path path) noexcept {
   // If content is already committed, do nothing
@@ -183,6 +214,12 @@ void FileArtifact::checkFinalState(fs::path path) noexcept {
 
 /// Commit any pending versions and save fingerprints for this artifact
 void FileArtifact::applyFinalState(fs::path path) noexcept {
+  // Intermediate files can stay in the cache until a traced command needs them
+  if (canLeaveUncommitted()) {
+    LOG(artifact) << "Leaving intermediate file " << this << " at " << path << " uncommitted";
+    return;
+  }
+
   // Get the content version and creator
   auto [version, weak_creator] = _content.getLatest();
   auto creator = weak_creator.lock();
@@ -217,8 +254,12 @@ void FileArtifact::applyFinalState(fs::path path) noexcept {
 }
 
 /// Fingerprint and cache the committed state of this artifact
-void FileArtifact::cacheAll(fs::path path) const noexcept {
-  fingerprintAndCache(nullptr);
+bool FileArtifact::cacheAll() const noexcept {
+  // The file on disk may already include a write that has not been recorded. Wait to cache it.
+  if (_writes_in_progress > 0) return false;
+
+  fingerprintAndCache(nullptr, true);
+  return _content.isCommitted();
 }
 
 /// A traced command is about to stat this artifact
@@ -259,6 +300,17 @@ void FileArtifact::beforeWrite(Build& build,
                                Ref::ID ref) noexcept {
   // The command now depends on the content of this file
   build.matchContent(source, c, Scenario::Build, ref, getContent(c));
+
+  // Other traced events may be handled while the write runs
+  _writes_in_progress++;
+}
+
+/// A traced command's write to this artifact failed
+void FileArtifact::abortWrite(Build& build,
+                              const IRSource& source,
+                              const shared_ptr<Command>& c,
+                              Ref::ID ref) noexcept {
+  if (_writes_in_progress > 0) _writes_in_progress--;
 }
 
 /// A traced command just wrote to this artifact
@@ -266,8 +318,10 @@ void FileArtifact::afterWrite(Build& build,
                               const IRSource& source,
                               const shared_ptr<Command>& c,
                               Ref::ID ref) noexcept {
+  if (_writes_in_progress > 0) _writes_in_progress--;
+
   // Create a new version
-  auto writing = make_shared<FileVersion>();
+  auto writing = make_pooled<FileVersion>();
 
   // The command wrote to this file
   build.updateContent(source, c, ref, writing);
@@ -287,7 +341,7 @@ void FileArtifact::afterTruncate(Build& build,
                                  const shared_ptr<Command>& c,
                                  Ref::ID ref) noexcept {
   // The command wrote an empty content version to this artifact
-  auto written = make_shared<FileVersion>();
+  auto written = make_pooled<FileVersion>();
   written->makeEmptyFingerprint();
 
   build.updateContent(source, c, ref, written);
@@ -302,6 +356,12 @@ shared_ptr<ContentVersion> FileArtifact::getContent(const shared_ptr<Command>& c
   // If there is a reading command, record the input
   if (c) c->addContentInput(shared_from_this(), version, writer);
 
+  // Remember the commands other than the writer that used this content. Only lazy outputs need
+  // the readers, to decide whether the file can be left off the filesystem.
+  if (options::lazy_outputs && options::enable_cache && c && writer && c != writer) {
+    _content_readers.try_emplace(c.get(), c);
+  }
+
   return version;
 }
 
@@ -349,12 +409,16 @@ void FileArtifact::updateContent(const shared_ptr<Command>& c,
 
   // Update the content version(s)
   _content.update(c, fv);
+  _content_readers.clear();
+  markDirty();
 
   // Report the output to the build
   c->addContentOutput(shared_from_this(), writing);
+  c->setWroteFile();
 }
 
-void FileArtifact::fingerprintAndCache(const shared_ptr<Command>& reader) const noexcept {
+void FileArtifact::fingerprintAndCache(const shared_ptr<Command>& reader,
+                                       bool background) const noexcept {
   // If this artifact is not committed in its latest state, we can't fingerprint or cache it
   if (!_content.isCommitted()) return;
 
@@ -370,11 +434,13 @@ void FileArtifact::fingerprintAndCache(const shared_ptr<Command>& reader) const
   // If the artifact has a committed path, we may fingerprint or cache it
   if (path.has_value()) {
     auto fingerprint_type = policy::chooseFingerprintType(reader, writer, path.value());
-    version->fingerprint(path.value(), fingerprint_type);
+    bool cache = !version->canCommit() && policy::isCacheable(reader, writer, path.value());
 
-    // cache?
-    if (!version->canCommit() && policy::isCacheable(reader, writer, path.value())) {
-      version->cache(path.value());
+    if (background) {
+      version->fingerprintInBackground(path.value(), fingerprint_type, cache);
+    } else {
+      version->fingerprint(path.value(), fingerprint_type);
+      if (cache) version->cache(path.value());
     }
   }
 }
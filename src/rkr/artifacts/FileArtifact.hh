@@ -4,6 +4,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <unordered_map>
 
 #include "artifacts/Artifact.hh"
 #include "runtime/Ref.hh"
@@ -49,11 +50,17 @@ class FileArtifact : public Artifact {
   virtual void applyFinalState(fs::path path) noexcept override;
 
   /// Fingerprint and cache the committed state of this artifact
-  virtual void cacheAll(fs::path path) const noexcept override;
+  virtual bool cacheAll() const noexcept override;
 
   /// Revert this artifact to its committed state
   virtual void rollback() noexcept override;
 
+  /// Can this file be left off the filesystem at the end of the build? When lazy outputs are
+  /// enabled, a cached file is an intermediate if it is not executable and every command that read
+  /// it, other than its writer, wrote files of its own. An intermediate does not need to be
+  /// committed until a traced command needs it.
+  bool canLeaveUncommitted() const noexcept;
+
   /************ Path Operations ************/
 
   /// Commit a link to this artifact at the given path
@@ -94,6 +101,12 @@ class FileArtifact : public Artifact {
                           const std::shared_ptr<Command>& c,
                           Ref::ID ref) noexcept override;
 
+  /// A traced command's write to this artifact failed
+  virtual void abortWrite(Build& build,
+                          const IRSource& source,
+                          const std::shared_ptr<Command>& c,
+                          Ref::ID ref) noexcept override;
+
   /// A traced command is about to (possibly) truncate this artifact to length zero
   virtual void beforeTruncate(Build& build,
                               const IRSource& source,
@@ -122,12 +135,21 @@ class FileArtifact : public Artifact {
                              std::shared_ptr<ContentVersion> writing) noexcept override;
 
  protected:
-  /// Cache and fingerprint this file's content if necessary
-  void fingerprintAndCache(const std::shared_ptr<Command>& reader) const noexcept;
+  /// Cache and fingerprint this file's content if necessary. If background is true, the work is
+  /// done on a background thread and the version waits for it when its fingerprint is needed.
+  void fingerprintAndCache(const std::shared_ptr<Command>& reader,
+                           bool background = false) const noexcept;
 
  private:
   /// The committed and uncommitted state that represent this file's content
   VersionState<FileVersion> _content;
+
+  /// The commands other than its writer that have read the latest content. These are only
+  /// recorded for lazy outputs.
+  std::unordered_map<Command*, std::weak_ptr<Command>> _content_readers;
+
+  /// How many traced writes have started but not yet been recorded or aborted?
+  size_t _writes_in_progress = 0;
 };
 
 template <>
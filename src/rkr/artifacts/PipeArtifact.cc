@@ -10,10 +10,10 @@
 #include "runtime/Build.hh"
 #include "runtime/Command.hh"
 #include "util/log.hh"
+#include "util/pool.hh"
 #include "versions/ContentVersion.hh"
 #include "versions/PipeVersion.hh"
 
-using std::make_shared;
 using std::shared_ptr;
 using std::tuple;
 
@@ -23,6 +23,9 @@ void PipeArtifact::rollback() noexcept {
   _last_read.reset();
   _writes.clear();
   _committed_mode.reset();
+  _epoch_reader.reset();
+  _epoch_writer.reset();
+  _epoch++;
 
   Artifact::rollback();
 }
@@ -53,7 +56,10 @@ void PipeArtifact::beforeClose(Build& build,
                                Ref::ID ref) noexcept {
   // Is the command closing the last writable reference to this pipe?
   if (c->getRef(ref)->getFlags().w) {
-    auto final_write = make_shared<PipeCloseVersion>();
+    // Readers must see the close, so end the current epoch
+    _epoch++;
+
+    auto final_write = make_pooled<PipeCloseVersion>();
 
     // Intentionally not calling build.traceUpdateContent here. That will implicitly be invoked when
     // the final reference to this pipe is closed.
@@ -61,6 +67,18 @@ void PipeArtifact::beforeClose(Build& build,
   }
 }
 
+// A traced command is about to (possibly) read from this artifact
+void PipeArtifact::beforeRead(Build& build,
+                              const IRSource& source,
+                              const shared_ptr<Command>& c,
+                              Ref::ID ref) noexcept {
+  // A new reader starts a new epoch
+  if (_epoch_reader.lock() != c) {
+    _epoch_reader = c;
+    _epoch++;
+  }
+}
+
 // A traced command just read from this artifact
 void PipeArtifact::afterRead(Build& build,
                              const IRSource& source,
@@ -90,7 +108,7 @@ void PipeArtifact::afterRead(Build& build,
   }
 
   // Create a new version to track this read
-  auto read_version = make_shared<PipeReadVersion>();
+  auto read_version = make_pooled<PipeReadVersion>();
 
   LOG(artifact) << "Creating pipe read version " << read_version;
 
@@ -106,8 +124,14 @@ void PipeArtifact::beforeWrite(Build& build,
                                const IRSource& source,
                                const shared_ptr<Command>& c,
                                Ref::ID ref) noexcept {
+  // A new writer starts a new epoch
+  if (_epoch_writer.lock() != c) {
+    _epoch_writer = c;
+    _epoch++;
+  }
+
   // Create a new version
-  auto writing = make_shared<PipeWriteVersion>();
+  auto writing = make_pooled<PipeWriteVersion>();
 
   // The command writes this version to the pipe
   build.updateContent(source, c, ref, writing);
@@ -126,7 +150,7 @@ shared_ptr<ContentVersion> PipeArtifact::getContent(const shared_ptr<Command>& c
         c->addContentInput(shared_from_this(), write, writer.lock());
       }
     }
-    return make_shared<PipeReadVersion>();
+    return make_pooled<PipeReadVersion>();
   }
 }
 
@@ -203,6 +227,18 @@ void PipeArtifact::updateContent(const shared_ptr<Command>& c,
   }
 }
 
+// Can a command keep reading from this pipe without tracing each read until the epoch ends?
+bool PipeArtifact::canReadUntraced(const shared_ptr<Command>& c) const noexcept {
+  // Reads in the current epoch only repeat the dependency from the command's first read, as long
+  // as the pipe is being used by running commands
+  return _committed_mode.value_or(true) && _epoch_reader.lock() == c;
+}
+
+// Can a command keep writing to this pipe without tracing each write until the epoch ends?
+bool PipeArtifact::canWriteUntraced(const shared_ptr<Command>& c) const noexcept {
+  return _committed_mode.value_or(true) && _epoch_writer.lock() == c;
+}
+
 int PipeArtifact::getFD(AccessFlags flags) noexcept {
   ASSERT((flags.r && !flags.w) || (flags.w && !flags.r))
       << "Invalid access flags for pipe: " << flags;
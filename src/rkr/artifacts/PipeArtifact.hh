@@ -73,7 +73,7 @@ class PipeArtifact : public Artifact {
   virtual void beforeRead(Build& build,
                           const IRSource& source,
                           const std::shared_ptr<Command>& c,
-                          Ref::ID ref) noexcept override {}
+                          Ref::ID ref) noexcept override;
 
   /// A traced command just read from this artifact
   virtual void afterRead(Build& build,
@@ -115,6 +115,21 @@ class PipeArtifact : public Artifact {
   /// Set file descriptors for this pipe
   void setFDs(int read_fd, int write_fd) noexcept { _fds = {read_fd, write_fd}; }
 
+  /************ Pipe Epochs ************/
+
+  /**
+   * Get this pipe's current epoch. An epoch ends when a different command starts reading or
+   * writing the pipe, or when a writer closes it. Within an epoch, repeated reads or writes by the
+   * same command add no new dependencies.
+   */
+  size_t getEpoch() const noexcept { return _epoch; }
+
+  /// Can a command keep reading from this pipe without tracing each read until the epoch ends?
+  bool canReadUntraced(const std::shared_ptr<Command>& c) const noexcept;
+
+  /// Can a command keep writing to this pipe without tracing each write until the epoch ends?
+  bool canWriteUntraced(const std::shared_ptr<Command>& c) const noexcept;
+
  protected:
   /// Skip committing metadata to pipes
   virtual void commitMetadata() noexcept override { _metadata.setCommitted(); }
@@ -138,6 +153,15 @@ class PipeArtifact : public Artifact {
 
   /// File descriptors for an actual opened pipe
   std::optional<std::tuple<int, int>> _fds;
+
+  /// The current epoch for this pipe
+  size_t _epoch = 0;
+
+  /// The command reading from this pipe in the current epoch
+  std::weak_ptr<Command> _epoch_reader;
+
+  /// The command writing to this pipe in the current epoch
+  std::weak_ptr<Command> _epoch_writer;
 };
 
 template <>
@@ -10,11 +10,11 @@
 #include "runtime/Command.hh"
 #include "util/log.hh"
 #include "util/options.hh"
+#include "util/pool.hh"
 #include "versions/ContentVersion.hh"
 #include "versions/MetadataVersion.hh"
 #include "versions/SpecialVersion.hh"
 
-using std::make_shared;
 using std::optional;
 using std::shared_ptr;
 
@@ -25,7 +25,7 @@ class MetadataVersion;
 SpecialArtifact::SpecialArtifact(MetadataVersion mv, bool always_changed) noexcept :
     Artifact(mv), _always_changed(always_changed) {
   // Create an initial committed version
-  auto cv = make_shared<SpecialVersion>(!always_changed);
+  auto cv = make_pooled<SpecialVersion>(!always_changed);
   _content.update(cv);
   appendVersion(cv);
 }
@@ -133,7 +133,7 @@ void SpecialArtifact::afterWrite(Build& build,
                                  const shared_ptr<Command>& c,
                                  Ref::ID ref) noexcept {
   // Create a new version
-  auto writing = make_shared<SpecialVersion>(!_always_changed);
+  auto writing = make_pooled<SpecialVersion>(!_always_changed);
 
   // The command wrote to this special artifact
   build.updateContent(source, c, ref, writing);
@@ -153,7 +153,7 @@ void SpecialArtifact::afterTruncate(Build& build,
                                     const shared_ptr<Command>& c,
                                     Ref::ID ref) noexcept {
   // The command wrote an empty content version to this artifact
-  auto written = make_shared<SpecialVersion>(!_always_changed);
+  auto written = make_pooled<SpecialVersion>(!_always_changed);
 
   build.updateContent(source, c, ref, written);
 }
@@ -189,6 +189,7 @@ void SpecialArtifact::updateContent(const shared_ptr<Command>& c,
 
   // Update the content
   _content.update(c, sv);
+  markDirty();
 
   // Report the output to the build
   c->addContentOutput(shared_from_this(), writing);
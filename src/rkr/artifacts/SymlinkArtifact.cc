@@ -82,6 +82,7 @@ void SymlinkArtifact::updateContent(const std::shared_ptr<Command>& c,
 
   // Update the content
   _content.update(c, sv);
+  markDirty();
 }
 
 // Commit the content of this artifact to the filesystem
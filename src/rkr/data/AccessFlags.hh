@@ -65,6 +65,12 @@ class AccessType {
                       _rc_dir == SUCCESS ? other._rc_dir : _rc_dir);
   }
 
+  // Declare fields for serialization
+  template <class Archive>
+  void serialize(Archive& archive) {
+    archive(_rc_file, _rc_symlink, _rc_dir);
+  }
+
  private:
   int8_t _rc_file = SUCCESS;
   int8_t _rc_symlink = SUCCESS;
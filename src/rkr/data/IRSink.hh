@@ -8,6 +8,7 @@
 #include "data/AccessFlags.hh"
 #include "data/IRSource.hh"
 #include "runtime/Command.hh"
+#include "util/InternedPath.hh"
 #include "versions/MetadataVersion.hh"
 
 class Command;
@@ -53,7 +54,7 @@ class IRSink {
   /// Handle a SymlinkRef IR step
   virtual void symlinkRef(const IRSource& source,
                           const std::shared_ptr<Command>& command,
-                          fs::path target,
+                          const fs::path& target,
                           Ref::ID output) noexcept {}
 
   /// Handle a DirRef IR step
@@ -66,7 +67,7 @@ class IRSink {
   virtual void pathRef(const IRSource& source,
                        const std::shared_ptr<Command>& command,
                        Ref::ID base,
-                       fs::path path,
+                       InternedPath path,
                        AccessFlags flags,
                        Ref::ID output) noexcept {}
 
@@ -106,7 +107,7 @@ class IRSink {
                             const std::shared_ptr<Command>& command,
                             Scenario scenario,
                             Ref::ID ref,
-                            std::shared_ptr<ContentVersion> version) noexcept {}
+                            const std::shared_ptr<ContentVersion>& version) noexcept {}
 
   /// Handle an UpdateMetadata IR step
   virtual void updateMetadata(const IRSource& source,
@@ -118,27 +119,27 @@ class IRSink {
   virtual void updateContent(const IRSource& source,
                              const std::shared_ptr<Command>& command,
                              Ref::ID ref,
-                             std::shared_ptr<ContentVersion> version) noexcept {}
+                             const std::shared_ptr<ContentVersion>& version) noexcept {}
 
   /// Handle an AddEntry IR step
   virtual void addEntry(const IRSource& source,
                         const std::shared_ptr<Command>& command,
                         Ref::ID dir,
-                        std::string name,
+                        const std::string& name,
                         Ref::ID target) noexcept {}
 
   /// Handle a RemoveEntry IR step
   virtual void removeEntry(const IRSource& source,
                            const std::shared_ptr<Command>& command,
                            Ref::ID dir,
-                           std::string name,
+                           const std::string& name,
                            Ref::ID target) noexcept {}
 
   /// Handle a Launch IR step
   virtual void launch(const IRSource& source,
                       const std::shared_ptr<Command>& command,
                       const std::shared_ptr<Command>& child,
-                      std::list<std::tuple<Ref::ID, Ref::ID>> refs) noexcept {}
+                      const std::list<std::tuple<Ref::ID, Ref::ID>>& refs) noexcept {}
 
   /// Handle a Join IR step
   virtual void join(const IRSource& source,
@@ -11,3 +11,8 @@ class TracedIRSource : public IRSource {
  public:
   virtual bool isExecuting() const override { return true; }
 };
+
+class SavedIRSource : public IRSource {
+ public:
+  virtual bool isExecuting() const override { return false; }
+};
@@ -72,7 +72,7 @@ class PostBuildChecker : public Next {
                             const std::shared_ptr<Command>& command,
                             Scenario scenario,
                             Ref::ID ref,
-                            std::shared_ptr<ContentVersion> expected) noexcept override {
+                            const std::shared_ptr<ContentVersion>& expected) noexcept override {
     if (scenario & Scenario::Build) {
       // Did the reference resolve in the post-build state?
       if (command->getRef(ref)->isResolved()) {
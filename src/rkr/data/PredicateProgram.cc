@@ -0,0 +1,746 @@
+#include "PredicateProgram.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "artifacts/Artifact.hh"
+#include "artifacts/DirArtifact.hh"
+#include "artifacts/FileArtifact.hh"
+#include "artifacts/SpecialArtifact.hh"
+#include "runtime/Command.hh"
+#include "runtime/env.hh"
+#include "util/log.hh"
+#include "util/options.hh"
+#include "util/wrappers.hh"
+#include "versions/DirListVersion.hh"
+#include "versions/FileVersion.hh"
+#include "versions/MetadataVersion.hh"
+
+using std::nullopt;
+using std::optional;
+using std::set;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+// The header at the start of a saved predicate program
+struct PredicateProgramHeader {
+  char magic[4];            //< Always "RKRP"
+  uint32_t version;         //< The predicate program format version
+  uint64_t db_dev;          //< The device of the database this program was compiled for
+  uint64_t db_ino;          //< The inode of the database this program was compiled for
+  uint64_t db_size;         //< The size of the database this program was compiled for
+  int64_t db_mtime_sec;     //< The modification time of the database (seconds)
+  int64_t db_mtime_nsec;    //< The modification time of the database (nanoseconds)
+  uint32_t strings_count;   //< The number of strings in the strings table
+  uint32_t metadata_count;  //< The number of entries in the metadata table
+  uint32_t content_count;   //< The number of entries in the content table
+  uint32_t code_length;     //< The number of bytes in the program's code
+  uint32_t graph_length;    //< The number of entries in the saved model of the build
+  uint32_t command_count;   //< The number of commands in the saved model of the build
+  uint8_t lazy_outputs;     //< Could intermediate files be left off the filesystem?
+} __attribute__((packed));
+
+// Increment this when the predicate program format changes
+enum : uint32_t { PredicateProgramVersion = 4 };
+
+// Fill in the database fields of a header. Returns false if the database could not be found
+static bool getDatabaseIdentity(const fs::path& db, PredicateProgramHeader& header) noexcept {
+  struct stat statbuf;
+  if (::stat(db.c_str(), &statbuf)) return false;
+
+  header.db_dev = statbuf.st_dev;
+  header.db_ino = statbuf.st_ino;
+  header.db_size = statbuf.st_size;
+  header.db_mtime_sec = statbuf.st_mtim.tv_sec;
+  header.db_mtime_nsec = statbuf.st_mtim.tv_nsec;
+  return true;
+}
+
+// Is timespec a at or after timespec b?
+static bool notBefore(const struct timespec& a, const struct timespec& b) noexcept {
+  return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec >= b.tv_nsec);
+}
+
+// Hash the content of a regular file. Returns nullopt if the file could not be read.
+static optional<FileVersion::Hash> hashFile(const string& path,
+                                           const struct stat& statbuf) noexcept {
+  FileVersion version(statbuf);
+  version.fingerprint(path, FingerprintType::Full);
+  return version.getHash();
+}
+
+// Read a value from the program's code and advance past it
+template <typename T>
+static T takeOperand(const uint8_t*& pc) noexcept {
+  T result;
+  memcpy(&result, pc, sizeof(T));
+  pc += sizeof(T);
+  return result;
+}
+
+// Read a list of IDs below a limit from a saved build model and advance past it. Returns false if
+// the list is malformed.
+static bool takeList(const uint32_t*& pos,
+                     const uint32_t* end,
+                     uint32_t limit,
+                     vector<uint32_t>& list) noexcept {
+  if (pos == end) return false;
+  uint32_t count = *pos++;
+  if (static_cast<size_t>(end - pos) < count) return false;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (pos[i] >= limit) return false;
+    list.push_back(pos[i]);
+  }
+  pos += count;
+  return true;
+}
+
+// Append a list of IDs to a saved build model
+static void addList(vector<uint32_t>& graph, vector<uint32_t> list) noexcept {
+  std::sort(list.begin(), list.end());
+  list.erase(std::unique(list.begin(), list.end()), list.end());
+  graph.push_back(list.size());
+  graph.insert(graph.end(), list.begin(), list.end());
+}
+
+// Compile a predicate program for the committed state of a build
+optional<PredicateProgram> PredicateProgram::compile(
+    const shared_ptr<Command>& root,
+    const vector<shared_ptr<Command>>& commands) noexcept {
+  PredicateProgram program;
+
+  for (uint32_t id = 0; id < commands.size(); id++) {
+    if (commands[id]) program._command_ids.emplace(commands[id].get(), id);
+  }
+  program._in_build.resize(commands.size(), false);
+  program._input_checks.resize(commands.size());
+
+  // Emit sections for every command, starting with the root
+  program.compileCommand(root);
+
+  // Check any remaining artifacts the build observed, such as directories that were searched
+  program.emitCommand(root);
+  env::getArtifacts().forEach([&](const auto& a) { program.emitArtifact(a); });
+
+  // A program that misses some of the build's inputs could pass while the build is out of date
+  if (!program._complete) {
+    LOG(phase) << "Not saving a predicate program for inputs it cannot check";
+    return nullopt;
+  }
+
+  // Save the model of the build so the next build can restore it
+  program.compileGraph(commands);
+
+  return program;
+}
+
+// Compile the section for a command and its descendants
+void PredicateProgram::compileCommand(const shared_ptr<Command>& c) noexcept {
+  emitCommand(c);
+
+  // The model can only be saved if every command has an ID in the database
+  auto id_iter = _command_ids.find(c.get());
+  if (id_iter == _command_ids.end() || !c->canRestore()) {
+    _restorable = false;
+  } else {
+    _in_build[id_iter->second] = true;
+  }
+
+  // Check inputs that come from outside the build. Other inputs are checked as their writer's
+  // outputs. A change to the content of a file this command read is a change to this command.
+  // New content cannot be attributed to the commands that read it if some command observed the
+  // same artifact in any other way, except through its metadata, which must match before its
+  // content is checked.
+  for (const auto& [a, v, weak_writer] : c->getInputs()) {
+    if (weak_writer.lock()) continue;
+    auto check = emitArtifact(a);
+    if (check.has_value() && v->is_a<FileVersion>()) {
+      if (_restorable) _input_checks[id_iter->second].push_back(check.value());
+    } else if (check.has_value() && !v->is_a<MetadataVersion>()) {
+      _unattributable.insert(check.value());
+    }
+
+    // Special artifacts never need checks, but any other input must be visible on the filesystem
+    if (!check.has_value() && !a->as<SpecialArtifact>()) _complete = false;
+
+    // Only the entries the build looked up in /tmp are checked, so a listing of /tmp cannot be
+    if (v->is_a<DirListVersion>() && a->getCommittedPath() == fs::path("/tmp")) {
+      _complete = false;
+    }
+  }
+
+  // Check the outputs this command left on the filesystem
+  for (const auto& [a, v] : c->getOutputs()) {
+    auto check = emitArtifact(a);
+    if (check.has_value()) _output_checks.push_back(check.value());
+  }
+
+  for (const auto& child : c->getChildren()) {
+    compileCommand(child);
+  }
+}
+
+// Save the children and edges of every command in the build
+void PredicateProgram::compileGraph(const vector<shared_ptr<Command>>& commands) noexcept {
+  if (!_restorable) return;
+
+  // Get the ID of a command in the build, or nullopt if it has none
+  auto get_id = [&](Command* c) -> optional<uint32_t> {
+    auto iter = _command_ids.find(c);
+    if (iter == _command_ids.end() || !_in_build[iter->second]) return nullopt;
+    return iter->second;
+  };
+
+  vector<uint32_t> graph;
+  for (uint32_t id = 0; id < commands.size(); id++) {
+    // Leave out checks whose changes cannot be attributed, so a change to one is never restored
+    vector<CheckID> input_checks;
+    for (auto check : _input_checks[id]) {
+      if (_unattributable.count(check) == 0) input_checks.push_back(check);
+    }
+    addList(graph, std::move(input_checks));
+
+    // Commands from the database that are no longer part of the build have no children or edges
+    vector<uint32_t> children;
+    if (_in_build[id]) {
+      for (const auto& child : commands[id]->getChildren()) {
+        auto child_id = get_id(child.get());
+        if (!child_id.has_value()) return;
+        children.push_back(child_id.value());
+      }
+    }
+    graph.push_back(children.size());
+    graph.insert(graph.end(), children.begin(), children.end());
+
+    for (auto type : {Command::Edge::UsesOutputFrom, Command::Edge::NeedsOutputFrom,
+                      Command::Edge::OutputUsedBy, Command::Edge::OutputNeededBy}) {
+      vector<uint32_t> edges;
+      if (_in_build[id]) {
+        for (auto other : commands[id]->getEdges(type)) {
+          auto other_id = get_id(other);
+          if (!other_id.has_value()) return;
+          edges.push_back(other_id.value());
+        }
+      }
+      addList(graph, std::move(edges));
+    }
+  }
+
+  addList(graph, _output_checks);
+
+  _graph = std::move(graph);
+  _command_count = commands.size();
+}
+
+// Begin a new section for a command
+void PredicateProgram::emitCommand(const shared_ptr<Command>& c) noexcept {
+  // If the previous section is empty, drop it
+  if (_section_start > 0 && _code.size() == _section_start) {
+    _code.resize(_section_start - 1 - sizeof(StringID));
+  }
+
+  emit(Op::Command, getStringID(c->getShortName()));
+  _section_start = _code.size();
+}
+
+// Emit predicates for an artifact's current state on the filesystem
+optional<PredicateProgram::CheckID> PredicateProgram::emitArtifact(
+    const shared_ptr<Artifact>& a) noexcept {
+  // Reuse the check for an artifact that was already visited
+  auto [iter, added] = _checks.emplace(a, nullopt);
+  if (!added) return iter->second;
+
+  // Skip special artifacts like terminals
+  if (a->as<SpecialArtifact>()) return nullopt;
+
+  // Only artifacts with a committed path are visible on the filesystem
+  auto path = a->getCommittedPath();
+  if (!path.has_value()) return nullopt;
+
+  iter->second = _check_count++;
+
+  // Check the path's current state. A missing path is checked by expecting the same error
+  struct stat statbuf;
+  if (::lstat(path.value().c_str(), &statbuf)) {
+    emit(Op::ExpectResult, getStringID(path.value().string()), static_cast<int8_t>(errno));
+    return iter->second;
+  }
+
+  emit(Op::ExpectResult, getStringID(path.value().string()), static_cast<int8_t>(SUCCESS));
+  emit(Op::MatchMetadata, getMetadataID(statbuf));
+
+  // Entries in /tmp come and go with every build, and commands' temporary files are matched by
+  // path substitution instead, so the content of /tmp itself is not checked. Instead, check that
+  // every name the build looked up in /tmp still resolves the same way.
+  if (path.value() != "/tmp") {
+    emit(Op::MatchContent, getContentID(a, statbuf));
+  } else if (auto dir = a->as<DirArtifact>(); dir) {
+    for (const auto& name : dir->getEntryNames()) {
+      emitPath(path.value() / name);
+    }
+  }
+
+  return iter->second;
+}
+
+// Emit a check that a path resolves with the same result as it does now
+void PredicateProgram::emitPath(const fs::path& path) noexcept {
+  if (!_checked_paths.insert(path).second) return;
+
+  _check_count++;
+
+  struct stat statbuf;
+  int8_t result = SUCCESS;
+  if (::lstat(path.c_str(), &statbuf)) result = errno;
+  emit(Op::ExpectResult, getStringID(path.string()), result);
+}
+
+// Emit an instruction with its operands
+template <typename... Args>
+void PredicateProgram::emit(Op op, Args... args) noexcept {
+  _code.push_back(static_cast<uint8_t>(op));
+  (_code.insert(_code.end(), reinterpret_cast<const uint8_t*>(&args),
+                reinterpret_cast<const uint8_t*>(&args) + sizeof(args)),
+   ...);
+}
+
+// Get the ID for a string, adding it to the strings table if necessary
+PredicateProgram::StringID PredicateProgram::getStringID(const string& s) noexcept {
+  auto [iter, added] = _string_ids.emplace(s, _strings.size());
+  if (added) _strings.push_back(s);
+  return iter->second;
+}
+
+// Get the ID for a metadata version, adding it to the metadata table if necessary
+PredicateProgram::VersionID PredicateProgram::getMetadataID(const struct stat& statbuf) noexcept {
+  auto [iter, added] = _metadata_ids.emplace(
+      std::tuple{statbuf.st_uid, statbuf.st_gid, statbuf.st_mode}, _metadata.size());
+  if (added) _metadata.push_back(Metadata{statbuf.st_uid, statbuf.st_gid, statbuf.st_mode});
+  return iter->second;
+}
+
+// Get the ID for a content version, adding it to the content table
+PredicateProgram::VersionID PredicateProgram::getContentID(const shared_ptr<Artifact>& a,
+                                                           const struct stat& statbuf) noexcept {
+  Content content{statbuf.st_ino, static_cast<uint64_t>(statbuf.st_size), statbuf.st_mtim.tv_sec,
+                  statbuf.st_mtim.tv_nsec, false, {}};
+
+  // Save the hash the build collected for a regular file, as long as the file has not been modified
+  // since it was fingerprinted. Files the build only fingerprinted by mtime have no hash.
+  if (S_ISREG(statbuf.st_mode) && a->as<FileArtifact>()) {
+    auto version = a->peekContent()->as<FileVersion>();
+    if (version) {
+      const auto& mtime = version->getModificationTime();
+      const auto& hash = version->getHash();
+      if (mtime.has_value() && hash.has_value() && mtime->tv_sec == statbuf.st_mtim.tv_sec &&
+          mtime->tv_nsec == statbuf.st_mtim.tv_nsec) {
+        content.hashed = true;
+        memcpy(content.hash, hash->data(), sizeof(content.hash));
+      }
+    }
+  }
+
+  _content.push_back(content);
+  return _content.size() - 1;
+}
+
+// Load a saved predicate program
+optional<PredicateProgram> PredicateProgram::load(const fs::path& path,
+                                                  const fs::path& db) noexcept {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) return nullopt;
+
+  // Read the whole file
+  struct stat statbuf;
+  vector<uint8_t> data;
+  if (::fstat(fd, &statbuf) == 0) {
+    data.resize(statbuf.st_size);
+    if (::read(fd, data.data(), data.size()) != statbuf.st_size) data.clear();
+  }
+  ::close(fd);
+
+  // Check the header
+  PredicateProgramHeader header;
+  if (data.size() < sizeof(header)) return nullopt;
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, "RKRP", 4) != 0 || header.version != PredicateProgramVersion) {
+    return nullopt;
+  }
+
+  // Make sure the program was compiled for this version of the database
+  PredicateProgramHeader current;
+  if (!getDatabaseIdentity(db, current)) return nullopt;
+  if (header.db_dev != current.db_dev || header.db_ino != current.db_ino ||
+      header.db_size != current.db_size || header.db_mtime_sec != current.db_mtime_sec ||
+      header.db_mtime_nsec != current.db_mtime_nsec) {
+    LOG(phase) << "Ignoring predicate program compiled for a different database";
+    return nullopt;
+  }
+
+  // A build with lazy outputs may have left intermediate files out of the program. If lazy
+  // outputs are now off, those files have to be committed.
+  if (header.lazy_outputs && !options::lazy_outputs) {
+    LOG(phase) << "Ignoring predicate program compiled with lazy outputs";
+    return nullopt;
+  }
+
+  PredicateProgram program;
+  program._saved = statbuf.st_mtim;
+
+  // Unpack the tables and code
+  const uint8_t* pos = data.data() + sizeof(header);
+  const uint8_t* end = data.data() + data.size();
+
+  for (uint32_t i = 0; i < header.strings_count; i++) {
+    auto nul = static_cast<const uint8_t*>(memchr(pos, '\0', end - pos));
+    if (nul == nullptr) return nullopt;
+    program._strings.emplace_back(reinterpret_cast<const char*>(pos), nul - pos);
+    pos = nul + 1;
+  }
+
+  size_t metadata_bytes = header.metadata_count * sizeof(Metadata);
+  size_t content_bytes = header.content_count * sizeof(Content);
+  size_t graph_bytes = header.graph_length * sizeof(uint32_t);
+  if (static_cast<size_t>(end - pos) !=
+      metadata_bytes + content_bytes + header.code_length + graph_bytes) {
+    return nullopt;
+  }
+
+  program._metadata.resize(header.metadata_count);
+  memcpy(program._metadata.data(), pos, metadata_bytes);
+  pos += metadata_bytes;
+
+  program._content.resize(header.content_count);
+  memcpy(program._content.data(), pos, content_bytes);
+  pos += content_bytes;
+
+  program._code.assign(pos, pos + header.code_length);
+  pos += header.code_length;
+
+  program._graph.resize(header.graph_length);
+  memcpy(program._graph.data(), pos, graph_bytes);
+  program._command_count = header.command_count;
+
+  // Evaluation trusts the operands in the code, so check each of them once here
+  if (!program.checkCode()) {
+    LOG(phase) << "Ignoring malformed predicate program";
+    return nullopt;
+  }
+
+  return program;
+}
+
+// Check that every instruction in a loaded program is complete and refers to valid table entries
+bool PredicateProgram::checkCode() noexcept {
+  const uint8_t* pc = _code.data();
+  const uint8_t* end = _code.data() + _code.size();
+
+  // Make sure an operand of type T fits in the code and is below a limit
+  auto check_operand = [&](auto limit) {
+    using T = decltype(limit);
+    if (static_cast<size_t>(end - pc) < sizeof(T)) return false;
+    return takeOperand<T>(pc) < limit;
+  };
+
+  while (pc < end) {
+    switch (static_cast<Op>(*pc++)) {
+      case Op::Command:
+        if (!check_operand(static_cast<StringID>(_strings.size()))) return false;
+        break;
+
+      case Op::ExpectResult:
+        if (!check_operand(static_cast<StringID>(_strings.size()))) return false;
+        if (pc == end) return false;
+        pc += sizeof(int8_t);
+        _check_count++;
+        break;
+
+      case Op::MatchMetadata:
+        if (!check_operand(static_cast<VersionID>(_metadata.size()))) return false;
+        break;
+
+      case Op::MatchContent:
+        if (!check_operand(static_cast<VersionID>(_content.size()))) return false;
+        break;
+
+      default:
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// Save this predicate program
+void PredicateProgram::save(const fs::path& path, const fs::path& db) const noexcept {
+  PredicateProgramHeader header;
+  memcpy(header.magic, "RKRP", 4);
+  header.version = PredicateProgramVersion;
+  if (!getDatabaseIdentity(db, header)) {
+    WARN << "Unable to save predicate program without a database at " << db;
+    return;
+  }
+  header.strings_count = _strings.size();
+  header.metadata_count = _metadata.size();
+  header.content_count = _content.size();
+  header.code_length = _code.size();
+  header.graph_length = _graph.size();
+  header.command_count = _command_count;
+  header.lazy_outputs = options::lazy_outputs;
+
+  // Lay out the file contents
+  vector<uint8_t> data(reinterpret_cast<const uint8_t*>(&header),
+                       reinterpret_cast<const uint8_t*>(&header) + sizeof(header));
+  for (const auto& s : _strings) {
+    data.insert(data.end(), s.c_str(), s.c_str() + s.size() + 1);
+  }
+  data.insert(data.end(), reinterpret_cast<const uint8_t*>(_metadata.data()),
+              reinterpret_cast<const uint8_t*>(_metadata.data() + _metadata.size()));
+  data.insert(data.end(), reinterpret_cast<const uint8_t*>(_content.data()),
+              reinterpret_cast<const uint8_t*>(_content.data() + _content.size()));
+  data.insert(data.end(), _code.begin(), _code.end());
+  data.insert(data.end(), reinterpret_cast<const uint8_t*>(_graph.data()),
+              reinterpret_cast<const uint8_t*>(_graph.data() + _graph.size()));
+
+  // Write the program to a temporary file next to its final path. Renaming it into place once its
+  // contents are on disk means a crash never leaves a truncated program behind.
+  fs::path tmp_path = path;
+  tmp_path += ".tmp";
+
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    WARN << "Failed to open predicate program " << tmp_path << ": " << ERR;
+    return;
+  }
+
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t rc = ::write(fd, data.data() + written, data.size() - written);
+    if (rc == -1 && errno == EINTR) continue;
+    if (rc <= 0) {
+      WARN << "Failed to write predicate program " << tmp_path << ": " << ERR;
+      ::close(fd);
+      ::unlink(tmp_path.c_str());
+      return;
+    }
+    written += rc;
+  }
+
+  if (::fsync(fd) != 0) {
+    WARN << "Failed to sync predicate program " << tmp_path << ": " << ERR;
+    ::close(fd);
+    ::unlink(tmp_path.c_str());
+    return;
+  }
+
+  ::close(fd);
+
+  if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    WARN << "Failed to move predicate program into place at " << path << ": " << ERR;
+    ::unlink(tmp_path.c_str());
+  }
+}
+
+// Evaluate this program against the filesystem
+bool PredicateProgram::evaluate() const noexcept {
+  return evaluateEach([](CheckID, bool) { return false; });
+}
+
+// Restore the saved model of the build, marking each command whose inputs changed
+bool PredicateProgram::restore(const vector<shared_ptr<Command>>& commands) const noexcept {
+  if (_command_count == 0 || commands.size() != _command_count) return false;
+
+  // Evaluate every predicate, collecting the checks that found new content in a file
+  set<CheckID> changed;
+  bool attributable = evaluateEach([&](CheckID check, bool new_content) {
+    if (new_content) changed.insert(check);
+    return new_content;
+  });
+  if (!attributable || changed.empty()) return false;
+
+  // Unpack the model, checking that it is well formed before any command is changed
+  struct SavedCommand {
+    vector<CheckID> input_checks;
+    vector<uint32_t> children;
+    vector<uint32_t> edges[4];
+  };
+
+  vector<SavedCommand> saved(_command_count);
+  const uint32_t* pos = _graph.data();
+  const uint32_t* end = _graph.data() + _graph.size();
+  for (auto& c : saved) {
+    if (!takeList(pos, end, _check_count, c.input_checks)) return false;
+    if (!takeList(pos, end, _command_count, c.children)) return false;
+    for (auto& edges : c.edges) {
+      if (!takeList(pos, end, _command_count, edges)) return false;
+    }
+  }
+
+  vector<CheckID> output_checks;
+  if (!takeList(pos, end, _check_count, output_checks) || pos != end) return false;
+
+  // A changed output has to be handled by emulating its writer, which may restore it from the cache
+  for (auto check : output_checks) {
+    if (changed.count(check)) return false;
+  }
+
+  // Every change must be to an input of some command
+  set<CheckID> attributed;
+  for (const auto& c : saved) {
+    for (auto check : c.input_checks) {
+      if (changed.count(check)) attributed.insert(check);
+    }
+  }
+  if (attributed.size() != changed.size()) return false;
+
+  // Every command in the model must have been loaded
+  for (const auto& c : commands) {
+    if (!c) return false;
+  }
+
+  // Restore the model
+  for (uint32_t id = 0; id < _command_count; id++) {
+    const auto& c = commands[id];
+    for (auto child : saved[id].children) {
+      c->restoreChild(commands[child]);
+    }
+
+    const Command::Edge types[] = {Command::Edge::UsesOutputFrom, Command::Edge::NeedsOutputFrom,
+                                   Command::Edge::OutputUsedBy, Command::Edge::OutputNeededBy};
+    for (size_t i = 0; i < 4; i++) {
+      for (auto other : saved[id].edges[i]) {
+        c->restoreEdge(types[i], commands[other]);
+      }
+    }
+
+    for (auto check : saved[id].input_checks) {
+      if (changed.count(check)) {
+        c->restoreChange();
+        break;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Evaluate each predicate in this program
+template <typename Handler>
+bool PredicateProgram::evaluateEach(Handler handler) const noexcept {
+  const uint8_t* pc = _code.data();
+  const uint8_t* end = _code.data() + _code.size();
+
+  // The command whose section is being evaluated
+  StringID command = 0;
+
+  // The path and result of the most recent lstat
+  StringID path = 0;
+  struct stat statbuf;
+
+  // The current check, whether it has already failed, and the next check in the program
+  CheckID check = 0;
+  bool failed = false;
+  CheckID next_check = 0;
+
+  while (pc < end) {
+    switch (static_cast<Op>(*pc++)) {
+      case Op::Command: {
+        command = takeOperand<StringID>(pc);
+        break;
+      }
+
+      case Op::ExpectResult: {
+        check = next_check++;
+        path = takeOperand<StringID>(pc);
+        auto expected = takeOperand<int8_t>(pc);
+        int8_t result = SUCCESS;
+        if (::lstat(_strings[path].c_str(), &statbuf)) result = errno;
+
+        failed = result != expected;
+        if (failed) {
+          LOGF(rebuild, "{}: {} did not resolve as expected (expected {}, observed {})",
+               _strings[command], _strings[path], getErrorName(expected), getErrorName(result));
+          if (!handler(check, false)) return false;
+        }
+        break;
+      }
+
+      case Op::MatchMetadata: {
+        const auto& expected = _metadata[takeOperand<VersionID>(pc)];
+        if (failed) break;
+
+        if (statbuf.st_uid != expected.uid || statbuf.st_gid != expected.gid ||
+            statbuf.st_mode != expected.mode) {
+          LOGF(rebuild, "{}: metadata for {} changed", _strings[command], _strings[path]);
+          failed = true;
+          if (!handler(check, false)) return false;
+        }
+        break;
+      }
+
+      case Op::MatchContent: {
+        const auto& expected = _content[takeOperand<VersionID>(pc)];
+        if (failed) break;
+
+        struct timespec mtime = {expected.mtime_sec, expected.mtime_nsec};
+        if (statbuf.st_ino != expected.ino ||
+            static_cast<uint64_t>(statbuf.st_size) != expected.size ||
+            statbuf.st_mtim.tv_sec != expected.mtime_sec ||
+            statbuf.st_mtim.tv_nsec != expected.mtime_nsec) {
+          // A regular file with a saved hash can be compared by content. If the hash matches, the
+          // file was only touched or replaced with the same bytes.
+          optional<bool> same_hash;
+          if (S_ISREG(statbuf.st_mode) && expected.hashed &&
+              static_cast<uint64_t>(statbuf.st_size) == expected.size) {
+            if (auto hash = hashFile(_strings[path], statbuf); hash.has_value()) {
+              same_hash = memcmp(hash->data(), expected.hash, sizeof(expected.hash)) == 0;
+            }
+          }
+          if (same_hash == true) break;
+
+          LOGF(rebuild, "{}: content of {} changed", _strings[command], _strings[path]);
+          failed = true;
+
+          // A regular file with a different size or hash certainly has new content. Anything else
+          // could still match by fingerprint, which only emulation can tell.
+          bool new_content = S_ISREG(statbuf.st_mode) &&
+                             (static_cast<uint64_t>(statbuf.st_size) != expected.size ||
+                              same_hash == false);
+          if (!handler(check, new_content)) return false;
+          break;
+        }
+
+        // A path modified in the same tick the program was saved may have been modified again
+        if (notBefore(mtime, _saved)) {
+          LOGF(rebuild, "{}: {} was modified too recently to compare", _strings[command],
+               _strings[path]);
+          failed = true;
+          if (!handler(check, false)) return false;
+        }
+        break;
+      }
+
+      default:
+        WARN << "Invalid instruction in predicate program";
+        return false;
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+class Artifact;
+class Command;
+
+/**
+ * A PredicateProgram is a compact bytecode encoding of the filesystem state a build depends on.
+ * Programs are compiled at the end of every build, either after a phase 0 that found no commands
+ * to run or after the post-build checks, and are saved next to the build database. Before the
+ * next build emulates the database, it evaluates the saved program. If every predicate still
+ * holds, the filesystem is in exactly the state the previous build left it in, so emulating the
+ * trace again would find no commands to run and can be skipped.
+ *
+ * The program is divided into sections for each command. A command's section checks its inputs
+ * from outside the build and the outputs it left on the filesystem. Any other path the build
+ * observed is checked in a final section for the root command. Paths, command names, and the
+ * expected metadata and content for each path are interned in tables, and the bytecode refers to
+ * them by ID.
+ *
+ * A program also saves the model of the build it was compiled from: each command's children and
+ * dependency edges, and the checks on its inputs, with commands identified by their IDs in the
+ * database. If the only predicates that fail find new content in files that commands read from
+ * outside the build, that model is restored with those commands marked as changed, and the build
+ * plans its first phase from it instead of emulating the whole trace in phase 0. Any other failure
+ * falls back to full step-by-step emulation.
+ */
+class PredicateProgram {
+ public:
+  /// The type used to refer to an interned string
+  using StringID = uint32_t;
+
+  /// The type used to refer to an interned metadata or content version
+  using VersionID = uint32_t;
+
+  /// The type used to refer to the checks on a path, numbered in program order
+  using CheckID = uint32_t;
+
+  /// Compile a predicate program for the committed state of a build. Commands must have tracked
+  /// their inputs and outputs during the build. The commands in the build's database are passed
+  /// in, indexed by ID, so the program can save the build's model. Returns nullopt if the build
+  /// depends on state a program cannot check, such as a pipe or a listing of /tmp.
+  static std::optional<PredicateProgram> compile(
+      const std::shared_ptr<Command>& root,
+      const std::vector<std::shared_ptr<Command>>& commands) noexcept;
+
+  /// Load a saved predicate program. Returns nullopt if there is no program, or if it was not
+  /// compiled for the current version of the given database.
+  static std::optional<PredicateProgram> load(const fs::path& path, const fs::path& db) noexcept;
+
+  /// Save this predicate program for the current version of the given database
+  void save(const fs::path& path, const fs::path& db) const noexcept;
+
+  /// Evaluate this program against the filesystem. Returns true if every predicate holds.
+  bool evaluate() const noexcept;
+
+  /// Restore the saved model of the build onto the commands loaded from its database, indexed by
+  /// ID, and mark each command whose inputs changed. Returns false without changing any command
+  /// if there is no saved model, or if some failing predicate cannot be attributed to a change in
+  /// a command's inputs.
+  bool restore(const std::vector<std::shared_ptr<Command>>& commands) const noexcept;
+
+ private:
+  /// Instructions in a predicate program
+  enum class Op : uint8_t {
+    Command,        //< Begin the section for a command. Operands: StringID name
+    ExpectResult,   //< lstat a path and check the result. Operands: StringID path, int8_t result
+    MatchMetadata,  //< Check the metadata from the last lstat. Operands: VersionID metadata
+    MatchContent,   //< Check the content from the last lstat. Operands: VersionID content
+  };
+
+  /// The expected owner, group, and mode for a path
+  struct Metadata {
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mode;
+  } __attribute__((packed));
+
+  /// The expected identity, size, and modification time for a path, and the hash of a regular
+  /// file's content if the build fingerprinted it
+  struct Content {
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint8_t hashed;
+    uint8_t hash[32];
+  } __attribute__((packed));
+
+  /// Compile the section for a command and its descendants
+  void compileCommand(const std::shared_ptr<Command>& c) noexcept;
+
+  /// Save the children and edges of every command in the build, unless some command cannot be
+  /// restored from them
+  void compileGraph(const std::vector<std::shared_ptr<Command>>& commands) noexcept;
+
+  /// Begin a new section for a command
+  void emitCommand(const std::shared_ptr<Command>& c) noexcept;
+
+  /// Emit predicates for an artifact's current state on the filesystem, unless it has no path or
+  /// was already checked. Returns the check for the artifact, if it has one.
+  std::optional<CheckID> emitArtifact(const std::shared_ptr<Artifact>& a) noexcept;
+
+  /// Emit a check that a path resolves with the same result, unless the path was already checked
+  void emitPath(const fs::path& path) noexcept;
+
+  /// Check that every instruction in a loaded program is complete and that its operands refer to
+  /// entries in the program's tables. Also counts the program's checks.
+  bool checkCode() noexcept;
+
+  /// Evaluate each predicate in this program. When a check fails, the handler is called with the
+  /// check and whether it found new content in a regular file, and the rest of that check is
+  /// skipped. Evaluation stops and returns false as soon as the handler returns false. A regular
+  /// file whose identity or modification time changed passes its check if its content still has
+  /// the saved hash.
+  template <typename Handler>
+  bool evaluateEach(Handler handler) const noexcept;
+
+  /// Emit an instruction with its operands
+  template <typename... Args>
+  void emit(Op op, Args... args) noexcept;
+
+  /// Get the ID for a string, adding it to the strings table if necessary
+  StringID getStringID(const std::string& s) noexcept;
+
+  /// Get the ID for a metadata version, adding it to the metadata table if necessary
+  VersionID getMetadataID(const struct stat& statbuf) noexcept;
+
+  /// Get the ID for a content version, adding it to the content table. The artifact's fingerprint
+  /// is saved with it if the fingerprint describes the file as it is now.
+  VersionID getContentID(const std::shared_ptr<Artifact>& a, const struct stat& statbuf) noexcept;
+
+ private:
+  /// The table of interned strings
+  std::vector<std::string> _strings;
+
+  /// The table of expected metadata versions
+  std::vector<Metadata> _metadata;
+
+  /// The table of expected content versions
+  std::vector<Content> _content;
+
+  /// The encoded program
+  std::vector<uint8_t> _code;
+
+  /// The saved model of the build. For each command in ID order, this holds the checks on inputs
+  /// it read from outside the build, its children, and its four edge sets, each stored as a count
+  /// followed by IDs. The checks on outputs left on the filesystem are listed last.
+  std::vector<uint32_t> _graph;
+
+  /// The number of commands in the database the model was saved for, or zero if there is no model
+  uint32_t _command_count = 0;
+
+  /// The number of checks in this program
+  CheckID _check_count = 0;
+
+  /// The time this program was saved. Paths modified at or after this time may have changed
+  /// again without a visible change in mtime, so they never match.
+  struct timespec _saved = {0, 0};
+
+  /********** Transient state used while compiling a program **********/
+
+  /// Map from strings to their IDs
+  std::map<std::string, StringID> _string_ids;
+
+  /// Map from metadata to their IDs
+  std::map<std::tuple<uint32_t, uint32_t, uint32_t>, VersionID> _metadata_ids;
+
+  /// The check emitted for each artifact that has been visited, if it has one
+  std::map<std::shared_ptr<Artifact>, std::optional<CheckID>> _checks;
+
+  /// Map from commands to their IDs in the database
+  std::map<Command*, uint32_t> _command_ids;
+
+  /// Which commands, indexed by ID, were compiled as part of the build
+  std::vector<bool> _in_build;
+
+  /// The checks on each command's inputs from outside the build, indexed by command ID
+  std::vector<std::vector<CheckID>> _input_checks;
+
+  /// The checks on outputs commands left on the filesystem
+  std::vector<CheckID> _output_checks;
+
+  /// Checks on artifacts that some command observed other than through their content or metadata
+  std::set<CheckID> _unattributable;
+
+  /// Has every command in the build been given an ID that its model can be saved under?
+  bool _restorable = true;
+
+  /// Can every input the build read from outside the build be checked by this program?
+  bool _complete = true;
+
+  /// The paths checked by emitPath
+  std::set<fs::path> _checked_paths;
+
+  /// The position in the code just after the most recent Command instruction
+  size_t _section_start = 0;
+};
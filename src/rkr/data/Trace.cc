@@ -1,11 +1,13 @@
 #include "Trace.hh"
 
+#include <algorithm>
 #include <filesystem>
-#include <limits>
 #include <list>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <vector>
@@ -15,9 +17,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "blake3.h"
 #include "data/IRSink.hh"
+#include "runtime/Build.hh"
 #include "runtime/Command.hh"
 #include "util/log.hh"
+#include "util/pool.hh"
+#include "util/stats.hh"
 #include "versions/ContentVersion.hh"
 #include "versions/DirListVersion.hh"
 #include "versions/FileVersion.hh"
@@ -32,13 +38,18 @@ using std::list;
 using std::make_shared;
 using std::nullopt;
 using std::optional;
+using std::pair;
 using std::shared_ptr;
 using std::string;
+using std::string_view;
 using std::tuple;
 using std::vector;
 
-// Grow the trace file by 2MB as needed
-enum : size_t { TraceFileSizeIncrement = 2 * 1024 * 1024 };
+// Trace files start at 2MB, and double in size each time they fill up
+enum : size_t { TraceFileInitialSize = 2 * 1024 * 1024 };
+
+// Only split loading across threads when each thread has at least this many records to decode
+enum : size_t { MinimumIDsPerThread = 1024 };
 
 /********** Trace File Operations **********/
 
@@ -69,38 +80,81 @@ TraceFile TraceFile::open(string path) noexcept {
   return result;
 }
 
-// Create an anonymous trace file for writing
-TraceFile TraceFile::create() noexcept {
+// Open an existing trace file at a given path to append to it
+TraceFile TraceFile::append(string path) noexcept {
   TraceFile result;
 
-  // Create a temporary file to hold the trace
-  result.fd = ::open(".", O_RDWR | O_TMPFILE, 0644);
+  // Open the file for reading and writing
+  result.fd = ::open(path.c_str(), O_RDWR);
   if (result.fd == -1) {
-    // Did the open fail because O_TMPFILE isn't supported?
-    if (errno == EOPNOTSUPP) {
-      // Try mkstemp instead
-      char tempname[] = "/tmp/rkr-XXXXXX";
-      result.fd = ::mkstemp(tempname);
-
-      // Did mkstemp fail too?
-      if (result.fd == -1) {
-        WARN << "Failed to create temporary file with mkstemp: " << ERR;
-        return result;
-      }
+    WARN << "Failed to open trace file " << path << " for appending: " << ERR;
+    return result;
+  }
 
-      // Unlink the temporary file so it is anonymous
-      if (::unlink(tempname)) {
-        WARN << "Failed to unlink temporary file: " << ERR;
-      }
+  // Get the length of the opened file. New records are written at the end.
+  struct stat statbuf;
+  int rc = fstat(result.fd, &statbuf);
+  if (rc != 0) {
+    WARN << "Failed to get size of opened trace file " << path;
+    return result;
+  }
+  result.length = statbuf.st_size;
+  result.pos = statbuf.st_size;
 
-    } else {
-      WARN << "Failed to open temporary file: " << ERR;
+  // Map the file
+  result.data =
+      (uint8_t*)mmap(nullptr, result.length, PROT_READ | PROT_WRITE, MAP_SHARED, result.fd, 0);
+  if (result.data == MAP_FAILED) {
+    WARN << "Failed to mmap trace file " << path << ": " << ERR;
+    result.data = nullptr;
+  }
+
+  return result;
+}
+
+// Create an anonymous trace file for writing
+TraceFile TraceFile::create(optional<string> dir) noexcept {
+  TraceFile result;
+
+  if (!dir.has_value()) {
+    // A trace that will not be linked into the filesystem is kept in memory
+    result.fd = ::memfd_create("rkr-trace", MFD_CLOEXEC);
+    if (result.fd == -1) {
+      WARN << "Failed to create in-memory trace file: " << ERR;
       return result;
     }
+    result.in_memory = true;
+
+  } else {
+    // Create a temporary file in the directory the trace will be linked into
+    result.fd = ::open(dir.value().c_str(), O_RDWR | O_TMPFILE | O_CLOEXEC, 0644);
+    if (result.fd == -1) {
+      // Did the open fail because O_TMPFILE isn't supported?
+      if (errno == EOPNOTSUPP) {
+        // Try mkstemp instead
+        char tempname[] = "/tmp/rkr-XXXXXX";
+        result.fd = ::mkstemp(tempname);
+
+        // Did mkstemp fail too?
+        if (result.fd == -1) {
+          WARN << "Failed to create temporary file with mkstemp: " << ERR;
+          return result;
+        }
+
+        // Unlink the temporary file so it is anonymous
+        if (::unlink(tempname)) {
+          WARN << "Failed to unlink temporary file: " << ERR;
+        }
+
+      } else {
+        WARN << "Failed to open temporary file: " << ERR;
+        return result;
+      }
+    }
   }
 
   // Make space in the backing file
-  result.length = TraceFileSizeIncrement;
+  result.length = TraceFileInitialSize;
   int rc = ftruncate(result.fd, result.length);
   if (rc != 0) {
     WARN << "Failed to extend trace file: " << ERR;
@@ -115,6 +169,9 @@ TraceFile TraceFile::create() noexcept {
     result.data = nullptr;
   }
 
+  // Ask for huge pages to back in-memory traces. This is only a hint, so errors are ignored.
+  if (result.in_memory && result.data) madvise(result.data, result.length, MADV_HUGEPAGE);
+
   return result;
 }
 
@@ -130,12 +187,14 @@ TraceFile::TraceFile(TraceFile&& other) noexcept {
   length = other.length;
   pos = other.pos;
   data = other.data;
+  in_memory = other.in_memory;
 
   // Reset state in the other trace file
   other.fd = -1;
   other.length = 0;
   other.pos = 0;
   other.data = nullptr;
+  other.in_memory = false;
 }
 
 // Move assignment operator for trace file
@@ -148,12 +207,14 @@ TraceFile& TraceFile::operator=(TraceFile&& other) noexcept {
   length = other.length;
   pos = other.pos;
   data = other.data;
+  in_memory = other.in_memory;
 
   // Reset state in the other trace file
   other.fd = -1;
   other.length = 0;
   other.pos = 0;
   other.data = nullptr;
+  other.in_memory = false;
 
   return *this;
 }
@@ -177,7 +238,9 @@ void* TraceFile::advance(size_t bytes, bool grow) noexcept {
   if (pos + bytes > length) {
     // Yes. Are we permitted to grow the file?
     if (grow) {
-      size_t new_length = length + TraceFileSizeIncrement;
+      // Double the size of the file until the new data fits
+      size_t new_length = std::max(length, static_cast<size_t>(TraceFileInitialSize));
+      while (pos + bytes > new_length) new_length *= 2;
 
       // Extend the trace file
       int rc = ftruncate(fd, new_length);
@@ -188,6 +251,7 @@ void* TraceFile::advance(size_t bytes, bool grow) noexcept {
       if (data == MAP_FAILED) {
         FAIL << "Failed to map extended trace file";
       }
+      if (in_memory) madvise(data, new_length, MADV_HUGEPAGE);
 
       // Save the extended size
       length = new_length;
@@ -202,6 +266,20 @@ void* TraceFile::advance(size_t bytes, bool grow) noexcept {
   return result;
 }
 
+// Wait until a range of the trace data has been written out to disk
+void TraceFile::sync(size_t offset, size_t bytes) noexcept {
+  ASSERT(data != nullptr) << "Cannot sync an unopened trace file";
+
+  // msync needs a page-aligned start address
+  size_t start = offset & ~(static_cast<size_t>(sysconf(_SC_PAGESIZE)) - 1);
+  int rc = msync(&data[start], offset + bytes - start, MS_SYNC);
+  FAIL_IF(rc != 0) << "Failed to write trace data to disk: " << ERR;
+
+  // The file's size may also have changed
+  rc = fdatasync(fd);
+  FAIL_IF(rc != 0) << "Failed to sync the trace file: " << ERR;
+}
+
 // Clean up state from this trace file by closing, unmapping, etc.
 void TraceFile::destroy() noexcept {
   if (fd != -1) {
@@ -216,14 +294,13 @@ void TraceFile::destroy() noexcept {
 
   length = 0;
   pos = 0;
+  in_memory = false;
 }
 
 /********** Trace Record Types **********/
 
 /// Tags to identify each type of record
 enum class RecordType : uint8_t {
-  Start = 0,
-  Finish = 1,
   SpecialRef = 2,
   PipeRef = 3,
   FileRef = 4,
@@ -245,8 +322,7 @@ enum class RecordType : uint8_t {
   Exit = 20,
   Command = 21,
   String = 22,
-  NewStrtab = 23,
-  End = 24,
+  Path = 23,
 
   // Content version subtypes
   FileVersion = 32,
@@ -261,6 +337,317 @@ enum class RecordType : uint8_t {
   SetCommand = 64
 };
 
+/********** Trace Encoding **********/
+
+// Every trace file starts with a header that identifies the encoding used for its records
+struct TraceHeader {
+  char magic[4];     //< Always "RKRT"
+  uint32_t version;  //< The trace encoding version
+  uint64_t index;    //< The offset of the current index, or zero if there is none
+} __attribute__((packed));
+
+// Increment this when the trace encoding changes
+enum : uint32_t { TraceEncodingVersion = 5 };
+
+// A trace file holds definition records for strings, paths, commands, and content versions, and
+// segments of steps from each command. A segment begins with a SetCommand record and may include
+// definitions used by its steps. The index lists every definition and the order the segments are
+// replayed in, so segments do not need to be stored in order. When a trace is saved after a
+// build, new segments are appended to the existing file along with a new index, and any segment
+// that did not change refers back to its earlier copy.
+
+// Each record is a RecordType tag followed by its fields. Integer fields are written as varints:
+// seven bits per byte, low bits first, with the high bit set on every byte except the last.
+// Signed fields are zigzag-encoded first so small negative values stay small.
+
+// Commands number the refs they create in order, so a ref created by a step is written as the
+// difference from the last ref created by the same command. This is almost always one.
+struct NewRef {
+  Ref::ID& id;
+};
+
+// A ref used by a step is usually one of a command's first few refs (e.g. stdin, root, or cwd) or
+// a ref it created recently. These are written as either an absolute ID or the difference from
+// the last ref the command created, whichever is shorter. The low bit records which one is used.
+struct UsedRef {
+  Ref::ID& id;
+};
+
+// Map a signed value to an unsigned value so numbers near zero have short varint encodings
+static uint64_t zigzag(int64_t value) noexcept {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+// Recover a signed value from its zigzag encoding
+static int64_t unzigzag(uint64_t value) noexcept {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Writes the fields of a record or value to a TraceWriter's file
+class TraceWriter::Encoder {
+ public:
+  Encoder(TraceWriter& writer) noexcept : _writer(writer) {}
+
+  // Write a sequence of fields
+  template <typename... Fields>
+  void operator()(Fields&&... fields) noexcept {
+    (write(fields), ...);
+  }
+
+ private:
+  // Write a single field
+  template <typename T>
+  void write(T& value) noexcept {
+    if constexpr (std::is_empty_v<T>) {
+      // Nothing to write
+
+    } else if constexpr (std::is_same_v<T, NewRef>) {
+      Ref::ID& last = _writer._last_refs[_writer._current_command_id];
+      writeVarint(zigzag(static_cast<int64_t>(value.id) - static_cast<int64_t>(last)));
+      last = value.id;
+
+    } else if constexpr (std::is_same_v<T, UsedRef>) {
+      Ref::ID last = _writer._last_refs[_writer._current_command_id];
+      uint64_t absolute = static_cast<uint64_t>(value.id) << 1;
+      uint64_t relative =
+          zigzag(static_cast<int64_t>(value.id) - static_cast<int64_t>(last)) << 1 | 1;
+      writeVarint(std::min(absolute, relative));
+
+    } else if constexpr (std::is_enum_v<T>) {
+      auto raw = static_cast<std::underlying_type_t<T>>(value);
+      write(raw);
+
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+      writeVarint(zigzag(value));
+
+    } else if constexpr (std::is_integral_v<T>) {
+      writeVarint(value);
+
+    } else if constexpr (std::is_same_v<T, struct timespec>) {
+      write(value.tv_sec);
+      write(value.tv_nsec);
+
+    } else if constexpr (std::is_same_v<T, FileVersion::Hash> ||
+                         std::is_same_v<T, DirListVersion::Digest>) {
+      memcpy(_writer._file.advance(value.size(), true), value.data(), value.size());
+
+    } else {
+      value.serialize(*this);
+    }
+  }
+
+  // Write an unsigned value as a varint
+  void writeVarint(uint64_t value) noexcept {
+    uint8_t buffer[10];
+    size_t length = 0;
+    while (value >= 0x80) {
+      buffer[length++] = static_cast<uint8_t>(value) | 0x80;
+      value >>= 7;
+    }
+    buffer[length++] = static_cast<uint8_t>(value);
+    memcpy(_writer._file.advance(length, true), buffer, length);
+  }
+
+ private:
+  TraceWriter& _writer;
+};
+
+// Reads the fields of a record or value directly from a TraceReader's mapped file. The decoder
+// works from a local cursor and stores the final position back to the file when it is destroyed.
+class TraceReader::Decoder {
+ public:
+  Decoder(TraceReader& reader) noexcept :
+      Decoder(reader._file, reader._last_refs[reader._current_command_id]) {}
+
+  Decoder(TraceFile& file, Ref::ID& last_ref) noexcept :
+      _file(file), _pos(file.data + file.pos), _end(file.data + file.length), _last_ref(last_ref) {}
+
+  ~Decoder() noexcept { _file.pos = _pos - _file.data; }
+
+  // Read a sequence of fields
+  template <typename... Fields>
+  __attribute__((always_inline)) void operator()(Fields&&... fields) noexcept {
+    (read(fields), ...);
+  }
+
+ private:
+  // Read a single field. The decoder is always inlined into each record's handler so its cursor
+  // can stay in a register while the record is read.
+  template <typename T>
+  __attribute__((always_inline)) void read(T& value) noexcept {
+    if constexpr (std::is_empty_v<T>) {
+      // Nothing to read
+
+    } else if constexpr (std::is_same_v<T, NewRef>) {
+      _last_ref += unzigzag(readVarint());
+      value.id = _last_ref;
+
+    } else if constexpr (std::is_same_v<T, UsedRef>) {
+      uint64_t encoded = readVarint();
+      if (encoded & 1) {
+        value.id = _last_ref + unzigzag(encoded >> 1);
+      } else {
+        value.id = encoded >> 1;
+      }
+
+    } else if constexpr (std::is_enum_v<T>) {
+      std::underlying_type_t<T> raw;
+      read(raw);
+      value = static_cast<T>(raw);
+
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+      value = static_cast<T>(unzigzag(readVarint()));
+
+    } else if constexpr (std::is_integral_v<T>) {
+      value = static_cast<T>(readVarint());
+
+    } else if constexpr (std::is_same_v<T, struct timespec>) {
+      read(value.tv_sec);
+      read(value.tv_nsec);
+
+    } else if constexpr (std::is_same_v<T, FileVersion::Hash> ||
+                         std::is_same_v<T, DirListVersion::Digest>) {
+      FAIL_IF(_end - _pos < static_cast<ptrdiff_t>(value.size()))
+          << "Reached the end of the trace while reading a hash";
+      memcpy(value.data(), _pos, value.size());
+      _pos += value.size();
+
+    } else {
+      value.serialize(*this);
+    }
+  }
+
+  // Read a varint from the trace
+  __attribute__((always_inline)) uint64_t readVarint() noexcept {
+    // Most fields fit in a single byte, and path and version IDs usually fit in two
+    if (_end - _pos >= 2) {
+      if (_pos[0] < 0x80) return *_pos++;
+      if (_pos[1] < 0x80) {
+        uint64_t result = (_pos[0] & 0x7F) | (static_cast<uint64_t>(_pos[1]) << 7);
+        _pos += 2;
+        return result;
+      }
+    }
+
+    return readLongVarint();
+  }
+
+  // Read a varint that spans multiple bytes. Kept out of line so the common case stays small.
+  __attribute__((noinline)) uint64_t readLongVarint() noexcept {
+    uint64_t result = 0;
+    uint8_t byte;
+    int shift = 0;
+    do {
+      FAIL_IF(_pos >= _end) << "Reached the end of the trace while reading a value";
+      FAIL_IF(shift >= 64) << "Invalid varint in trace at offset " << (_pos - _file.data);
+      byte = *_pos++;
+      result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    return result;
+  }
+
+ private:
+  /// The file being decoded
+  TraceFile& _file;
+
+  /// The current position in the file
+  const uint8_t* _pos;
+
+  /// The end of the file
+  const uint8_t* _end;
+
+  /// The last ref created by the current command
+  Ref::ID& _last_ref;
+};
+
+// Loads definition records on a worker thread. Each worker reads from its own position in the
+// file and stores definitions directly in the reader's tables. The tables are sized before any
+// workers start, and each worker loads a different range of IDs, so no locking is needed.
+class TraceReader::Worker {
+ public:
+  // Workers read through their own view of the reader's mapped file
+  Worker(TraceReader& reader) noexcept : _reader(reader) {
+    _file.data = reader._file.data;
+    _file.length = reader._file.length;
+  }
+
+  // The view does not own the mapping, so detach it before it is destroyed
+  ~Worker() noexcept { _file.data = nullptr; }
+
+  // Load the definition record with a given ID from an offset in the trace
+  void load(size_t offset, size_t id) noexcept;
+
+  // Decode the next record
+  template <RecordType T>
+  Record<T> takeRecord() noexcept {
+    _file.pos += sizeof(RecordType);
+    return takeValue<Record<T>>();
+  }
+
+  // Decode a value of a requested type
+  template <typename T>
+  T takeValue() noexcept {
+    T value{};
+    Decoder decode(_file, _last_ref);
+    decode(value);
+    return value;
+  }
+
+  // Get a view of a string and advance to the end of the string
+  string_view takeString() noexcept {
+    string_view result(reinterpret_cast<const char*>(_file.peek()));
+    _file.pos += result.size() + 1;
+    return result;
+  }
+
+  // Strings and paths are loaded before any records that refer to them
+  string_view getString(StringID id) const noexcept { return _reader._strings[id]; }
+  const fs::path& getPath(PathID id) const noexcept { return _reader._paths[id]; }
+
+  // Store the loaded definition
+  void addString(string_view s) noexcept { _reader._strings[_id] = s; }
+  void addVersion(shared_ptr<ContentVersion> v) noexcept { _reader._versions[_id] = std::move(v); }
+
+ private:
+  /// The reader whose tables are being filled
+  TraceReader& _reader;
+
+  /// A view of the reader's file with this worker's position
+  TraceFile _file;
+
+  /// The ID of the definition being loaded
+  size_t _id = 0;
+
+  /// Definition records do not use refs, but the decoder needs somewhere to keep the last ref
+  Ref::ID _last_ref = 0;
+};
+
+// Split the IDs from zero to count into contiguous ranges, and call a function on each ID from a
+// separate thread for each range
+template <class Func>
+static void parallelFor(size_t count, Func func) noexcept {
+  size_t threads = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()),
+                                    (count + MinimumIDsPerThread - 1) / MinimumIDsPerThread);
+
+  // Small tables, or a single core, are not worth the cost of starting threads
+  if (threads <= 1) {
+    for (size_t id = 0; id < count; id++) func(id);
+    return;
+  }
+
+  vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([=] {
+      for (size_t id = count * t / threads; id < count * (t + 1) / threads; id++) func(id);
+    });
+  }
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
 /********** TraceReader Constructor and Destructor **********/
 
 optional<TraceReader> TraceReader::load(string path) noexcept {
@@ -268,7 +655,23 @@ optional<TraceReader> TraceReader::load(string path) noexcept {
   auto file = TraceFile::open(path);
   if (!file) return nullopt;
 
-  return TraceReader(std::move(file));
+  // Make sure the trace was written with the current encoding
+  auto header = reinterpret_cast<const TraceHeader*>(file.data);
+  if (file.length < sizeof(TraceHeader) || memcmp(header->magic, "RKRT", 4) != 0 ||
+      header->version != TraceEncodingVersion || header->index == 0 ||
+      header->index >= file.length) {
+    WARN << "Ignoring trace " << path << " because it uses an unsupported encoding";
+    return nullopt;
+  }
+
+  // Read the index so segments and definitions can be found
+  TraceReader reader(std::move(file));
+  if (!reader.loadIndex()) {
+    WARN << "Ignoring trace " << path << " because its index is corrupt";
+    return nullopt;
+  }
+
+  return reader;
 }
 
 // Create an empty trace reader
@@ -278,9 +681,6 @@ TraceReader::TraceReader() noexcept {
 
 // Create a trace reader from an already open trace file
 TraceReader::TraceReader(TraceFile&& file) noexcept : _file(std::move(file)) {
-  // Jump back to the beginning of the file
-  _file.pos = 0;
-
   // Create a root command
   setCommand(0, make_shared<Command>());
 }
@@ -289,17 +689,109 @@ shared_ptr<Command> TraceReader::getRootCommand() const noexcept {
   return _commands[0];
 }
 
+// Check if most of this trace file is taken up by segments and definitions that are no longer used
+bool TraceReader::needsCompaction() noexcept {
+  // The header, the index, and the segments it lists are in use
+  vector<pair<size_t, size_t>> used = {{0, sizeof(TraceHeader)},
+                                       {reinterpret_cast<const TraceHeader*>(_file.data)->index,
+                                        _index_end}};
+  for (const auto& segment : _segments) {
+    used.emplace_back(segment.offset, segment.offset + segment.length);
+  }
+  std::sort(used.begin(), used.end());
+  size_t segments = used.size();
+
+  // Definitions are also in use, unless they define a version no segment uses. Definitions written
+  // inside a segment are already counted, but any other definition has to be measured.
+  auto add_definition = [&](size_t offset) {
+    auto next = std::upper_bound(used.begin(), used.begin() + segments, pair(offset, SIZE_MAX));
+    if (next != used.begin() && offset < std::prev(next)->second) return;
+    used.emplace_back(offset, offset + loadDefinition(offset));
+  };
+
+  for (auto offsets : {&_string_offsets, &_path_offsets, &_command_offsets}) {
+    for (size_t offset : *offsets) add_definition(offset);
+  }
+
+  for (ContentVersion::ID id = 0; id < _version_offsets.size(); id++) {
+    if (!_unused_versions[id]) add_definition(_version_offsets[id]);
+  }
+
+  // Everything else is left over from earlier traces, and would be dropped by compaction
+  size_t total = 0;
+  for (auto [start, end] : used) {
+    total += end - start;
+  }
+
+  return _file.length > 2 * total + TraceFileInitialSize;
+}
+
 /********** TraceWriter Constructor and Destructor **********/
 
+// Get the directory a trace will be linked into, or nullopt if the trace stays in memory
+static optional<string> getTraceDirectory(const optional<string>& path) noexcept {
+  if (!path.has_value()) return nullopt;
+  auto dir = fs::path(path.value()).parent_path();
+  return dir.empty() ? "." : dir.string();
+}
+
 TraceWriter::TraceWriter(optional<string> path) noexcept :
-    _id(getNextID()), _path(path), _file(TraceFile::create()) {
+    _id(getNextID()), _path(path), _file(TraceFile::create(getTraceDirectory(path))) {
   ASSERT(_file) << "Failed to create backing file for TraceWrite";
   ASSERT(_file.pos == 0) << "File is not at the beginning";
+
+  // Write the header
+  auto header = reinterpret_cast<TraceHeader*>(_file.advance(sizeof(TraceHeader), true));
+  memcpy(header->magic, "RKRT", 4);
+  header->version = TraceEncodingVersion;
+  header->index = 0;
+}
+
+TraceWriter::TraceWriter(string path, TraceReader& base) noexcept :
+    _id(getNextID()), _append(true), _file(TraceFile::append(path)) {
+  FAIL_IF(!_file) << "Failed to open trace file " << path << " for appending";
+  _initial_length = _file.length;
+
+  // Commands, content versions, strings, and paths keep the IDs they have in the base trace, so
+  // segments from the base trace can be reused without changes
+  _command_offsets = base._command_offsets;
+  _version_offsets = base._version_offsets;
+  _string_offsets = base._string_offsets;
+  _path_offsets = base._path_offsets;
+  _parents = base._parents;
+
+  // Commands and content versions may have changed since they were loaded, so they are only
+  // reused once their records are checked against the base trace
+  for (Command::ID id = 0; id < base._commands.size(); id++) {
+    if (base._commands[id]) _base_commands.emplace(base._commands[id], id);
+  }
+
+  for (ContentVersion::ID id = 0; id < base._versions.size(); id++) {
+    if (base._versions[id]) _base_versions.emplace(base._versions[id], id);
+  }
+
+  for (StringID id = 0; id < base._strings.size(); id++) {
+    if (base._strings[id].data() != nullptr) _strtab.emplace(base._strings[id], id);
+  }
+
+  for (PathID id = 1; id < base._paths.size(); id++) {
+    if (!base._paths[id].empty()) {
+      _path_entries.emplace(base._path_keys[id], id);
+      _path_ids.emplace(base._paths[id].native(), id);
+    }
+  }
+
+  // Group the base trace's segments by command so each new segment can be compared to the
+  // segment in the same position from the base trace
+  _base_segments.resize(_command_offsets.size());
+  for (const auto& segment : base._segments) {
+    _base_segments[segment.command].push_back(segment);
+  }
 }
 
 TraceWriter::~TraceWriter() noexcept {
-  // If there is an active trace file, write an end record
-  if (_file) emitEnd();
+  // If there is an active trace file, finish it with an index
+  if (_file) emitIndex();
 
   // Link the file if necessary
   link();
@@ -307,14 +799,15 @@ TraceWriter::~TraceWriter() noexcept {
 
 // Create a TraceReader to traverse this trace. Makes the writer unusable
 TraceReader TraceWriter::getReader() noexcept {
-  // Emit an end record to mark the end of the trace
-  emitEnd();
+  // Write the index so the reader can find the trace's segments
+  emitIndex();
 
   // Link the written trace if necessary
   link();
 
-  // Create a trace reader
+  // Create a trace reader and read the index it was just given
   TraceReader result(std::move(_file));
+  FAIL_IF(!result.loadIndex()) << "Failed to read the index of a trace that was just written";
 
   // Transfer commands over to the reader
   for (const auto& [c, id] : _commands) {
@@ -330,29 +823,41 @@ TraceReader TraceWriter::getReader() noexcept {
   return result;
 }
 
+// Get every command written to this trace, indexed by ID
+vector<shared_ptr<Command>> TraceWriter::getCommands() const noexcept {
+  vector<shared_ptr<Command>> result(_command_offsets.size());
+  for (const auto& [c, id] : _commands) {
+    result[id] = c;
+  }
+  return result;
+}
+
 void TraceWriter::link() const noexcept {
   // Is there an open file? If not, just return
   if (!_file) return;
 
   // Was a path provided?
   if (_path.has_value()) {
-    // Yes. Link the trace onto the filesystem before it vanishes
+    // Yes. Link the trace onto the filesystem before it vanishes. The trace is linked at a
+    // temporary path first, then renamed into place, so a build that stops at any point leaves
+    // either the old trace or the new one at the output path.
+    string tmp_path = _path.value() + ".tmp";
 
-    // First make sure the output path doesn't exist
-    int rc = ::unlink(_path.value().c_str());
+    // First make sure the temporary path doesn't exist
+    int rc = ::unlink(tmp_path.c_str());
 
-    // The output file may not exist, but if the unlink failed for some other reason give up
+    // The file may not exist, but if the unlink failed for some other reason give up
     FAIL_IF(rc != 0 && errno != ENOENT)
-        << "Failed to unlink old trace output file " << _path.value() << ": " << ERR;
+        << "Failed to unlink old temporary trace file " << tmp_path << ": " << ERR;
 
     // Now link in the temporary file from the /proc filesystem
     string fdpath = "/proc/self/fd/" + std::to_string(_file.fd);
-    rc = linkat(AT_FDCWD, fdpath.c_str(), AT_FDCWD, _path.value().c_str(), AT_SYMLINK_FOLLOW);
+    rc = linkat(AT_FDCWD, fdpath.c_str(), AT_FDCWD, tmp_path.c_str(), AT_SYMLINK_FOLLOW);
 
     // Did the link fail with a cross-device error?
     if (rc != 0 && errno == EXDEV) {
       // Create the output file
-      int outfd = ::open(_path.value().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      int outfd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
       FAIL_IF(outfd < 0) << "Failed to create trace database file: " << ERR;
 
       // Get the size of the input file
@@ -368,10 +873,20 @@ void TraceWriter::link() const noexcept {
         FAIL_IF(bytes < 0) << "Failed to copy trace data: " << ERR;
         copied += bytes;
       } while (copied < info.st_size);
+
+      // The copy must be on disk before it is renamed into place
+      rc = ::fsync(outfd);
+      FAIL_IF(rc != 0) << "Failed to sync trace database file: " << ERR;
+      ::close(outfd);
+
     } else {
-      FAIL_IF(rc != 0) << "Failed to link trace from " << fdpath << " to " << _path.value() << ": "
+      FAIL_IF(rc != 0) << "Failed to link trace from " << fdpath << " to " << tmp_path << ": "
                        << ERR << " (" << errno << ")";
     }
+
+    // Replace the output file with the new trace
+    rc = ::rename(tmp_path.c_str(), _path.value().c_str());
+    FAIL_IF(rc != 0) << "Failed to move trace into place at " << _path.value() << ": " << ERR;
   }
 }
 
@@ -382,29 +897,29 @@ RecordType TraceReader::peek() const noexcept {
   return *reinterpret_cast<RecordType*>(_file.peek());
 }
 
-// Get a reference to a record in the input trace
+// Decode the next record in the input trace
 template <RecordType T>
-const Record<T>& TraceReader::takeRecord() noexcept {
+Record<T> TraceReader::takeRecord() noexcept {
+  // Remember where the record starts, then skip over the record type, which the caller has
+  // already checked with peek()
+  _record = _file.pos;
+  _file.pos += sizeof(RecordType);
   return takeValue<Record<T>>();
 }
 
-// Get reference to data in the trace of a requested type
-template <typename T>
-const T& TraceReader::takeValue() noexcept {
-  return *reinterpret_cast<T*>(_file.advance(sizeof(T), false));
-}
-
-// Get a reference to an array in the trace
+// Decode a value of a requested type from the trace
 template <typename T>
-const T* TraceReader::takeArray(size_t count) noexcept {
-  return reinterpret_cast<T*>(_file.advance(count * sizeof(T), false));
+T TraceReader::takeValue() noexcept {
+  T value{};
+  Decoder decode(*this);
+  decode(value);
+  return value;
 }
 
-// Get a pointer to a string and advance the current position to the end of the string
-const char* TraceReader::takeString() noexcept {
-  const char* result = reinterpret_cast<const char*>(_file.peek());
-  size_t len = strlen(result);
-  _file.advance(len + 1, false);
+// Get a view of a string and advance the current position to the end of the string
+string_view TraceReader::takeString() noexcept {
+  string_view result(reinterpret_cast<const char*>(_file.peek()));
+  _file.advance(result.size() + 1, false);
   return result;
 }
 
@@ -413,16 +928,27 @@ const char* TraceReader::takeString() noexcept {
 // Write a record to the trace
 template <RecordType T, typename... Args>
 void TraceWriter::emitRecord(Args... args) noexcept {
-  using R = Record<T>;
-  R* r = reinterpret_cast<R*>(_file.advance(sizeof(R), true));
-  *r = R{T, args...};
+  // Save the offsets of records that are listed in the index
+  if constexpr (T == RecordType::String) {
+    _string_offsets.push_back(_file.pos);
+  } else if constexpr (T == RecordType::Path) {
+    _path_offsets.push_back(_file.pos);
+  } else if constexpr (T == RecordType::Command) {
+    _command_offsets.push_back(_file.pos);
+  } else if constexpr (T >= RecordType::FileVersion && T <= RecordType::SpecialVersion) {
+    _version_offsets.push_back(_file.pos);
+  }
+
+  *reinterpret_cast<RecordType*>(_file.advance(sizeof(RecordType), true)) = T;
+  emitValue<Record<T>>(args...);
 }
 
 // Write a value to the trace
 template <typename T, typename... Args>
 void TraceWriter::emitValue(Args... args) noexcept {
-  T* p = reinterpret_cast<T*>(_file.advance(sizeof(T), true));
-  *p = T{args...};
+  T value{args...};
+  Encoder encode(*this);
+  encode(value);
 }
 
 // Emit an array to the trace
@@ -435,7 +961,11 @@ void TraceWriter::emitArray(T* src, size_t count) noexcept {
 /********** Instance ID Methods **********/
 
 // Get a command from the table of commands
-const shared_ptr<Command>& TraceReader::getCommand(Command::ID id) const noexcept {
+const shared_ptr<Command>& TraceReader::getCommand(Command::ID id) noexcept {
+  if (id >= _commands.size() || !_commands[id]) {
+    ASSERT(id < _command_offsets.size()) << "Command " << id << " is not in the trace index";
+    loadDefinition(_command_offsets[id]);
+  }
   return _commands[id];
 }
 
@@ -446,12 +976,23 @@ Command::ID TraceWriter::getCommandID(const std::shared_ptr<Command>& c) noexcep
   // Look for the provided command in the map of known commands
   auto iter = _commands.find(c);
   if (iter == _commands.end()) {
-    // The command was not found. Add it now
-    Command::ID id = _commands.size();
+    // The command was not found. Write it to the trace
+    Command::ID id = _command_offsets.size();
+    size_t start = _file.pos;
+    emitCommand(c);
+
+    // A command loaded from the base trace keeps its ID if its record has not changed
+    auto base = _base_commands.find(c);
+    if (base != _base_commands.end() && reuseDefinition(start, _command_offsets, base->second)) {
+      id = base->second;
+    } else {
+      addDefinition(start);
+    }
+
     iter = _commands.emplace_hint(iter, c, id);
 
-    // Write the command to the trace
-    emitCommand(c);
+    // Make space for the command in the index
+    _parents.resize(_command_offsets.size(), 0);
   }
 
   c->setID(_id, iter->second);
@@ -464,10 +1005,10 @@ void TraceReader::setCommand(Command::ID id, std::shared_ptr<Command> c) noexcep
   _commands[id] = c;
 }
 
-// Add a command to the commands table and assign a new ID
+// Add the command defined by the current record to the commands table
 void TraceReader::addCommand(std::shared_ptr<Command> c) noexcept {
-  // Assign an ID for the new command
-  size_t id = _next_command_id++;
+  // Look up the ID for the command
+  size_t id = getDefinitionID(_command_offsets);
 
   // Make sure the commands array has space for the new command
   if (id >= _commands.size()) _commands.resize(id + 1);
@@ -477,8 +1018,11 @@ void TraceReader::addCommand(std::shared_ptr<Command> c) noexcept {
 }
 
 // Get a content version from the table of content versions
-const shared_ptr<ContentVersion>& TraceReader::getContentVersion(
-    ContentVersion::ID id) const noexcept {
+const shared_ptr<ContentVersion>& TraceReader::getContentVersion(ContentVersion::ID id) noexcept {
+  if (id >= _versions.size() || !_versions[id]) {
+    ASSERT(id < _version_offsets.size()) << "Version " << id << " is not in the trace index";
+    loadDefinition(_version_offsets[id]);
+  }
   return _versions[id];
 }
 
@@ -490,11 +1034,9 @@ ContentVersion::ID TraceWriter::getContentVersionID(const shared_ptr<ContentVers
   // Look for the provided content version in the map of known versions
   auto iter = _versions.find(v);
   if (iter == _versions.end()) {
-    // If the version wasn't found, add it now
-    ContentVersion::ID id = _versions.size();
-    iter = _versions.emplace_hint(iter, v, id);
-
-    // Write the content version to the trace
+    // If the version wasn't found, write it to the trace
+    ContentVersion::ID id = _version_offsets.size();
+    size_t start = _file.pos;
     if (auto fv = v->as<FileVersion>(); fv) {
       emitFileVersion(fv);
 
@@ -519,6 +1061,16 @@ ContentVersion::ID TraceWriter::getContentVersionID(const shared_ptr<ContentVers
     } else {
       FAIL << "Unrecognized version type " << v;
     }
+
+    // A version loaded from the base trace keeps its ID if its record has not changed
+    auto base = _base_versions.find(v);
+    if (base != _base_versions.end() && reuseDefinition(start, _version_offsets, base->second)) {
+      id = base->second;
+    } else {
+      addDefinition(start);
+    }
+
+    iter = _versions.emplace_hint(iter, v, id);
   }
 
   // Return the ID
@@ -532,10 +1084,10 @@ void TraceReader::setVersion(ContentVersion::ID id, std::shared_ptr<ContentVersi
   _versions[id] = v;
 }
 
-// Add a content version to the table and assign a new ID
+// Add the content version defined by the current record to the versions table
 void TraceReader::addVersion(std::shared_ptr<ContentVersion> v) noexcept {
-  // Assign an ID for the new version
-  size_t id = _next_version_id++;
+  // Look up the ID for the version
+  size_t id = getDefinitionID(_version_offsets);
 
   // Make sure the versions array has space for the new version
   if (id >= _versions.size()) _versions.resize(id + 1);
@@ -546,24 +1098,51 @@ void TraceReader::addVersion(std::shared_ptr<ContentVersion> v) noexcept {
 
 /********** String and Path Table Methods **********/
 
-void TraceWriter::reserveStrings(size_t n) noexcept {
-  ASSERT(n < std::numeric_limits<StringID>::max())
-      << "Requested number of strings is larger than the total string table size";
+/// Get a string from the table of strings
+string_view TraceReader::getString(StringID id) noexcept {
+  // Loaded strings always point into the trace, even when they are empty
+  if (id >= _strings.size() || _strings[id].data() == nullptr) {
+    ASSERT(id < _string_offsets.size()) << "String " << id << " is not in the trace index";
+    loadDefinition(_string_offsets[id]);
+  }
+  return _strings[id];
+}
 
-  // Check if the string table will fill before n strings are emitted
-  if (std::numeric_limits<StringID>::max() - _strtab.size() < n) {
-    // Make room by starting a fresh string table
-    emitNewStrtab();
+/// Get a path from the table of paths
+const fs::path& TraceReader::getPath(PathID id) noexcept {
+  // Every path other than path zero has at least one component
+  if (id != 0 && (id >= _paths.size() || _paths[id].empty())) {
+    ASSERT(id <= _path_offsets.size()) << "Path " << id << " is not in the trace index";
+    loadDefinition(_path_offsets[id - 1]);
   }
+  return _paths[id];
 }
 
-void TraceWriter::reservePaths(size_t n) noexcept {
-  reserveStrings(n);
+/// Get the interned handle for a path in the table of paths
+InternedPath TraceReader::getInternedPath(PathID id) noexcept {
+  if (id >= _interned_paths.size()) _interned_paths.resize(id + 1);
+  auto& handle = _interned_paths[id];
+  if (id != 0 && handle.getID() == 0) handle = InternedPath::intern(getPath(id).native());
+  return handle;
 }
 
-/// Get a string from the table of strings
-const string& TraceReader::getString(StringID id) const noexcept {
-  return _strings[id];
+/// Add the string defined by the current record to the strings table
+void TraceReader::addString(string_view s) noexcept {
+  size_t id = getDefinitionID(_string_offsets);
+  if (id >= _strings.size()) _strings.resize(id + 1);
+  _strings[id] = s;
+}
+
+/// Add the path defined by the current record to the paths table
+void TraceReader::addPath(PathID parent, StringID component) noexcept {
+  // Path IDs start at one, since path zero is the empty path
+  size_t id = getDefinitionID(_path_offsets) + 1;
+  if (id >= _paths.size()) {
+    _paths.resize(id + 1);
+    _path_keys.resize(id + 1);
+  }
+  _path_keys[id] = (static_cast<uint64_t>(parent) << 32) | component;
+  _paths[id] = getPath(parent) / getString(component);
 }
 
 StringID TraceWriter::getStringID(const std::string& str) noexcept {
@@ -575,83 +1154,81 @@ StringID TraceWriter::getStringID(const std::string& str) noexcept {
 
   } else {
     // The string was not found. Assign an ID
-    StringID id = _strtab.size();
-
-    // Is the string table full?
-    if (id >= std::numeric_limits<StringID>::max()) {
-      // Start a fresh string table
-      emitNewStrtab();
-      id = 0;
-    }
-
+    StringID id = _string_offsets.size();
     _strtab.emplace_hint(iter, str, id);
 
     // Write out the string record
+    size_t start = _file.pos;
     emitString(str);
+    addDefinition(start);
 
     return id;
   }
 }
 
 PathID TraceWriter::getPathID(const fs::path& path) noexcept {
-  return getStringID(path.string());
-}
-
-/********** Start Record **********/
-
-template <>
-struct Record<RecordType::Start> {
-  RecordType type;
-  Command::ID root_command;
-} __attribute__((packed));
+  // Have we already seen this exact path?
+  auto iter = _path_ids.find(path.native());
+  if (iter != _path_ids.end()) return iter->second;
+
+  // No. Walk through the path's components, starting from the empty path with ID zero
+  PathID id = 0;
+  for (const auto& component : path) {
+    StringID name = getStringID(component.native());
+
+    // Look for an existing path made up of the current prefix and this component
+    uint64_t key = (static_cast<uint64_t>(id) << 32) | name;
+    auto [entry, added] = _path_entries.emplace(key, _path_offsets.size() + 1);
+
+    // If the path is new, write it to the output
+    if (added) {
+      size_t start = _file.pos;
+      emitPath(id, name);
+      addDefinition(start);
+    }
 
-// Read a Start record from the input trace
-template <>
-void TraceReader::handleRecord<RecordType::Start>(IRSink& sink) noexcept {
-  ASSERT(_file.pos == 6) << "Reading a start record at a weird place (" << _file.pos << ")";
-  const auto& data = takeRecord<RecordType::Start>();
-  sink.start(getCommand(data.root_command));
-}
+    id = entry->second;
+  }
 
-// Write a Start record to the output trace
-void TraceWriter::start(const shared_ptr<Command>& c) noexcept {
-  emitRecord<RecordType::Start>(getCommandID(c));
+  _path_ids.emplace_hint(iter, path.native(), id);
+  return id;
 }
 
-/********** Finish Record **********/
+/********** Build Start and Finish **********/
 
-template <>
-struct Record<RecordType::Finish> {
-  RecordType type;
-} __attribute__((packed));
-
-// Read a Finish record from the input trace
-template <>
-void TraceReader::handleRecord<RecordType::Finish>(IRSink& sink) noexcept {
-  takeRecord<RecordType::Finish>();
-  sink.finish();
+// The start and finish of a build are recorded as flags in the trace index
+void TraceWriter::start(const shared_ptr<Command>& c) noexcept {
+  ASSERT(getCommandID(c) == 0) << "The root command must be the first command in the trace";
+  _started = true;
 }
 
-// Write a Finish record to the output trace
 void TraceWriter::finish() noexcept {
-  emitRecord<RecordType::Finish>();
+  endSegment();
+  _finished = true;
 }
 
 /********** SpecialRef Record **********/
 
 template <>
 struct Record<RecordType::SpecialRef> {
-  RecordType type;
   SpecialRef entity;
   Ref::ID output;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(entity, NewRef{output});
+  }
+};
 
 // Read a SpecialRef record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::SpecialRef>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::SpecialRef>();
-  sink.specialRef(*this, _current_command, data.entity, data.output);
-}
+struct TraceReader::Handler<RecordType::SpecialRef> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::SpecialRef>();
+    sink.specialRef(reader, reader._current_command, data.entity, data.output);
+  }
+};
 
 // Write a SpecialRef record to the output trace
 void TraceWriter::specialRef(const IRSource& source,
@@ -666,17 +1243,24 @@ void TraceWriter::specialRef(const IRSource& source,
 
 template <>
 struct Record<RecordType::PipeRef> {
-  RecordType type;
   Ref::ID read_end;
   Ref::ID write_end;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(NewRef{read_end}, NewRef{write_end});
+  }
+};
 
 // Read a PipeRef record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::PipeRef>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::PipeRef>();
-  sink.pipeRef(*this, _current_command, data.read_end, data.write_end);
-}
+struct TraceReader::Handler<RecordType::PipeRef> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::PipeRef>();
+    sink.pipeRef(reader, reader._current_command, data.read_end, data.write_end);
+  }
+};
 
 // Write a PipeRef record to the output trace
 void TraceWriter::pipeRef(const IRSource& source,
@@ -691,17 +1275,24 @@ void TraceWriter::pipeRef(const IRSource& source,
 
 template <>
 struct Record<RecordType::FileRef> {
-  RecordType type;
   mode_t mode;
   Ref::ID output;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(mode, NewRef{output});
+  }
+};
 
 // Read a FileRef record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::FileRef>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::FileRef>();
-  sink.fileRef(*this, _current_command, data.mode, data.output);
-}
+struct TraceReader::Handler<RecordType::FileRef> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::FileRef>();
+    sink.fileRef(reader, reader._current_command, data.mode, data.output);
+  }
+};
 
 // Write a FileRef record to the output trace
 void TraceWriter::fileRef(const IRSource& source,
@@ -716,22 +1307,29 @@ void TraceWriter::fileRef(const IRSource& source,
 
 template <>
 struct Record<RecordType::SymlinkRef> {
-  RecordType type;
   PathID target;
   Ref::ID output;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(target, NewRef{output});
+  }
+};
 
 // Read a SymlinkRef record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::SymlinkRef>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::SymlinkRef>();
-  sink.symlinkRef(*this, _current_command, getString(data.target), data.output);
-}
+struct TraceReader::Handler<RecordType::SymlinkRef> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::SymlinkRef>();
+    sink.symlinkRef(reader, reader._current_command, reader.getPath(data.target), data.output);
+  }
+};
 
 // Write a SymlinkRef record to the output trace
 void TraceWriter::symlinkRef(const IRSource& source,
                              const shared_ptr<Command>& c,
-                             fs::path target,
+                             const fs::path& target,
                              Ref::ID output) noexcept {
   setCommand(c);
   emitRecord<RecordType::SymlinkRef>(getPathID(target), output);
@@ -741,17 +1339,24 @@ void TraceWriter::symlinkRef(const IRSource& source,
 
 template <>
 struct Record<RecordType::DirRef> {
-  RecordType type;
   mode_t mode;
   Ref::ID output;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(mode, NewRef{output});
+  }
+};
 
 // Read a DirRef record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::DirRef>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::DirRef>();
-  sink.dirRef(*this, _current_command, data.mode, data.output);
-}
+struct TraceReader::Handler<RecordType::DirRef> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::DirRef>();
+    sink.dirRef(reader, reader._current_command, data.mode, data.output);
+  }
+};
 
 // Write a DirRef record to the output trace
 void TraceWriter::dirRef(const IRSource& source,
@@ -766,46 +1371,66 @@ void TraceWriter::dirRef(const IRSource& source,
 
 template <>
 struct Record<RecordType::PathRef> {
-  RecordType type;
   Ref::ID base;
   PathID path;
   AccessFlags flags;
   Ref::ID output;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{base}, path, flags, NewRef{output});
+  }
+};
 
 // Read a PathRef record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::PathRef>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::PathRef>();
-  sink.pathRef(*this, _current_command, data.base, getString(data.path), data.flags,
-               data.output);
-}
+struct TraceReader::Handler<RecordType::PathRef> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::PathRef>();
+    sink.pathRef(reader, reader._current_command, data.base, reader.getInternedPath(data.path),
+                 data.flags, data.output);
+  }
+};
 
 // Write a PathRef record to the output trace
 void TraceWriter::pathRef(const IRSource& source,
                           const shared_ptr<Command>& c,
                           Ref::ID base,
-                          fs::path path,
+                          InternedPath path,
                           AccessFlags flags,
                           Ref::ID output) noexcept {
   setCommand(c);
-  emitRecord<RecordType::PathRef>(base, getPathID(path), flags, output);
+
+  // Interned paths map directly to their IDs in the output trace once they have been looked up
+  if (path.getID() >= _interned_path_ids.size()) _interned_path_ids.resize(path.getID() + 1);
+  auto& id = _interned_path_ids[path.getID()];
+  if (id == 0) id = getPathID(path.getPath());
+
+  emitRecord<RecordType::PathRef>(base, id, flags, output);
 }
 
 /********** UsingRef Record **********/
 
 template <>
 struct Record<RecordType::UsingRef> {
-  RecordType type;
   Ref::ID ref;
-} __attribute__((packed));
 
-// Read a UsingRef record from the input trace
-template <>
-void TraceReader::handleRecord<RecordType::UsingRef>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::UsingRef>();
-  sink.usingRef(*this, _current_command, data.ref);
-}
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{ref});
+  }
+};
+
+// Read a UsingRef record from the input trace
+template <>
+struct TraceReader::Handler<RecordType::UsingRef> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::UsingRef>();
+    sink.usingRef(reader, reader._current_command, data.ref);
+  }
+};
 
 // Write a UsingRef record to the output trace
 void TraceWriter::usingRef(const IRSource& source,
@@ -819,16 +1444,23 @@ void TraceWriter::usingRef(const IRSource& source,
 
 template <>
 struct Record<RecordType::DoneWithRef> {
-  RecordType type;
   Ref::ID ref;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{ref});
+  }
+};
 
 // Read a DoneWithRef record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::DoneWithRef>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::DoneWithRef>();
-  sink.doneWithRef(*this, _current_command, data.ref);
-}
+struct TraceReader::Handler<RecordType::DoneWithRef> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::DoneWithRef>();
+    sink.doneWithRef(reader, reader._current_command, data.ref);
+  }
+};
 
 // Write a DoneWithRef record to the output trace
 void TraceWriter::doneWithRef(const IRSource& source,
@@ -842,18 +1474,25 @@ void TraceWriter::doneWithRef(const IRSource& source,
 
 template <>
 struct Record<RecordType::CompareRefs> {
-  RecordType type;
   Ref::ID ref1;
   Ref::ID ref2;
   RefComparison cmp;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{ref1}, UsedRef{ref2}, cmp);
+  }
+};
 
 // Read a CompareRefs record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::CompareRefs>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::CompareRefs>();
-  sink.compareRefs(*this, _current_command, data.ref1, data.ref2, data.cmp);
-}
+struct TraceReader::Handler<RecordType::CompareRefs> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::CompareRefs>();
+    sink.compareRefs(reader, reader._current_command, data.ref1, data.ref2, data.cmp);
+  }
+};
 
 // Write a CompareRefs record to the output trace
 void TraceWriter::compareRefs(const IRSource& source,
@@ -869,18 +1508,25 @@ void TraceWriter::compareRefs(const IRSource& source,
 
 template <>
 struct Record<RecordType::ExpectResult> {
-  RecordType type;
   Scenario scenario;
   Ref::ID ref;
   int8_t expected;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(scenario, UsedRef{ref}, expected);
+  }
+};
 
 // Read an ExpectResult record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::ExpectResult>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::ExpectResult>();
-  sink.expectResult(*this, _current_command, data.scenario, data.ref, data.expected);
-}
+struct TraceReader::Handler<RecordType::ExpectResult> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::ExpectResult>();
+    sink.expectResult(reader, reader._current_command, data.scenario, data.ref, data.expected);
+  }
+};
 
 // Write an ExpectResult record to the output trace
 void TraceWriter::expectResult(const IRSource& source,
@@ -896,18 +1542,28 @@ void TraceWriter::expectResult(const IRSource& source,
 
 template <>
 struct Record<RecordType::MatchMetadata> {
-  RecordType type;
   Scenario scenario;
   Ref::ID ref;
-  MetadataVersion version;
-} __attribute__((packed));
+  uid_t uid;
+  gid_t gid;
+  mode_t mode;
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(scenario, UsedRef{ref}, uid, gid, mode);
+  }
+};
 
 // Read a MatchMetadata record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::MatchMetadata>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::MatchMetadata>();
-  sink.matchMetadata(*this, _current_command, data.scenario, data.ref, data.version);
-}
+struct TraceReader::Handler<RecordType::MatchMetadata> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::MatchMetadata>();
+    sink.matchMetadata(reader, reader._current_command, data.scenario, data.ref,
+                       MetadataVersion(data.uid, data.gid, data.mode));
+  }
+};
 
 // Write a MatchMetadata record to the output trace
 void TraceWriter::matchMetadata(const IRSource& source,
@@ -916,33 +1572,41 @@ void TraceWriter::matchMetadata(const IRSource& source,
                                 Ref::ID ref,
                                 MetadataVersion version) noexcept {
   setCommand(c);
-  emitRecord<RecordType::MatchMetadata>(scenario, ref, version);
+  emitRecord<RecordType::MatchMetadata>(scenario, ref, version.getUID(), version.getGID(),
+                                        version.getMode());
 }
 
 /********** MatchContent Record **********/
 
 template <>
 struct Record<RecordType::MatchContent> {
-  RecordType type;
   Scenario scenario;
   Ref::ID ref;
   ContentVersion::ID version;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(scenario, UsedRef{ref}, version);
+  }
+};
 
 // Read a MatchContent record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::MatchContent>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::MatchContent>();
-  sink.matchContent(*this, _current_command, data.scenario, data.ref,
-                    getContentVersion(data.version));
-}
+struct TraceReader::Handler<RecordType::MatchContent> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::MatchContent>();
+    sink.matchContent(reader, reader._current_command, data.scenario, data.ref,
+                      reader.getContentVersion(data.version));
+  }
+};
 
 // Write a MatchContent record to the output trace
 void TraceWriter::matchContent(const IRSource& source,
                                const shared_ptr<Command>& c,
                                Scenario scenario,
                                Ref::ID ref,
-                               shared_ptr<ContentVersion> version) noexcept {
+                               const shared_ptr<ContentVersion>& version) noexcept {
   setCommand(c);
   emitRecord<RecordType::MatchContent>(scenario, ref, getContentVersionID(version));
 }
@@ -951,17 +1615,27 @@ void TraceWriter::matchContent(const IRSource& source,
 
 template <>
 struct Record<RecordType::UpdateMetadata> {
-  RecordType type;
   Ref::ID ref;
-  MetadataVersion version;
-} __attribute__((packed));
+  uid_t uid;
+  gid_t gid;
+  mode_t mode;
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{ref}, uid, gid, mode);
+  }
+};
 
 // Read an UpdateMetadata record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::UpdateMetadata>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::UpdateMetadata>();
-  sink.updateMetadata(*this, _current_command, data.ref, data.version);
-}
+struct TraceReader::Handler<RecordType::UpdateMetadata> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::UpdateMetadata>();
+    sink.updateMetadata(reader, reader._current_command, data.ref,
+                        MetadataVersion(data.uid, data.gid, data.mode));
+  }
+};
 
 // Write an UpdateMetadata record to the output trace
 void TraceWriter::updateMetadata(const IRSource& source,
@@ -969,31 +1643,39 @@ void TraceWriter::updateMetadata(const IRSource& source,
                                  Ref::ID ref,
                                  MetadataVersion version) noexcept {
   setCommand(c);
-  emitRecord<RecordType::UpdateMetadata>(ref, version);
+  emitRecord<RecordType::UpdateMetadata>(ref, version.getUID(), version.getGID(),
+                                         version.getMode());
 }
 
 /********** UpdateContent Record **********/
 
 template <>
 struct Record<RecordType::UpdateContent> {
-  RecordType type;
   Ref::ID ref;
   ContentVersion::ID version;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{ref}, version);
+  }
+};
 
 // Read an UpdateContent record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::UpdateContent>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::UpdateContent>();
-  sink.updateContent(*this, _current_command, data.ref,
-                     getContentVersion(data.version));
-}
+struct TraceReader::Handler<RecordType::UpdateContent> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::UpdateContent>();
+    sink.updateContent(reader, reader._current_command, data.ref,
+                       reader.getContentVersion(data.version));
+  }
+};
 
 // Write an UpdateContent record to the output trace
 void TraceWriter::updateContent(const IRSource& source,
                                 const shared_ptr<Command>& c,
                                 Ref::ID ref,
-                                shared_ptr<ContentVersion> version) noexcept {
+                                const shared_ptr<ContentVersion>& version) noexcept {
   setCommand(c);
   emitRecord<RecordType::UpdateContent>(ref, getContentVersionID(version));
 }
@@ -1002,24 +1684,32 @@ void TraceWriter::updateContent(const IRSource& source,
 
 template <>
 struct Record<RecordType::AddEntry> {
-  RecordType type;
   Ref::ID dir;
   StringID name;
   Ref::ID target;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{dir}, name, UsedRef{target});
+  }
+};
 
 // Read an AddEntry record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::AddEntry>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::AddEntry>();
-  sink.addEntry(*this, _current_command, data.dir, getString(data.name), data.target);
-}
+struct TraceReader::Handler<RecordType::AddEntry> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::AddEntry>();
+    sink.addEntry(reader, reader._current_command, data.dir, string(reader.getString(data.name)),
+                  data.target);
+  }
+};
 
 // Write an AddEntry record to the output trace
 void TraceWriter::addEntry(const IRSource& source,
                            const shared_ptr<Command>& c,
                            Ref::ID dir,
-                           string name,
+                           const string& name,
                            Ref::ID target) noexcept {
   setCommand(c);
   emitRecord<RecordType::AddEntry>(dir, getStringID(name), target);
@@ -1029,25 +1719,32 @@ void TraceWriter::addEntry(const IRSource& source,
 
 template <>
 struct Record<RecordType::RemoveEntry> {
-  RecordType type;
   Ref::ID dir;
   StringID name;
   Ref::ID target;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{dir}, name, UsedRef{target});
+  }
+};
 
 // Read a RemoveEntry record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::RemoveEntry>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::RemoveEntry>();
-  sink.removeEntry(*this, _current_command, data.dir, getString(data.name),
-                   data.target);
-}
+struct TraceReader::Handler<RecordType::RemoveEntry> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::RemoveEntry>();
+    sink.removeEntry(reader, reader._current_command, data.dir,
+                     string(reader.getString(data.name)), data.target);
+  }
+};
 
 // Write a RemoveEntry record to the output trace
 void TraceWriter::removeEntry(const IRSource& source,
                               const shared_ptr<Command>& c,
                               Ref::ID dir,
-                              string name,
+                              const string& name,
                               Ref::ID target) noexcept {
   setCommand(c);
   emitRecord<RecordType::RemoveEntry>(dir, getStringID(name), target);
@@ -1057,43 +1754,59 @@ void TraceWriter::removeEntry(const IRSource& source,
 
 template <>
 struct Record<RecordType::Launch> {
-  RecordType type;
   Command::ID child;
-  uint16_t refs_length;
-} __attribute__((packed));
+  uint32_t refs_length;
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(child, refs_length);
+  }
+};
 
 struct RefMapping {
   Ref::ID in_parent;
   Ref::ID in_child;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(UsedRef{in_parent}, in_child);
+  }
+};
 
 // Read a Launch record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::Launch>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::Launch>();
-  const RefMapping* refs = takeArray<RefMapping>(data.refs_length);
+struct TraceReader::Handler<RecordType::Launch> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::Launch>();
 
-  list<tuple<Ref::ID, Ref::ID>> refs_list;
-  for (size_t i = 0; i < data.refs_length; i++) {
-    refs_list.push_back(tuple{refs[i].in_parent, refs[i].in_child});
-  }
+    list<tuple<Ref::ID, Ref::ID>> refs_list;
+    for (size_t i = 0; i < data.refs_length; i++) {
+      auto mapping = reader.takeValue<RefMapping>();
+      refs_list.push_back(tuple{mapping.in_parent, mapping.in_child});
+    }
 
-  sink.launch(*this, _current_command, getCommand(data.child), refs_list);
-}
+    sink.launch(reader, reader._current_command, reader.getCommand(data.child), refs_list);
+  }
+};
 
 // Write a Launch record to the output trace
 void TraceWriter::launch(const IRSource& source,
                          const shared_ptr<Command>& parent,
                          const shared_ptr<Command>& child,
-                         list<tuple<Ref::ID, Ref::ID>> refs) noexcept {
-  // Compute the length of the ref mapping list, which should fit in a 16-bit integer
-  uint16_t refs_length = refs.size();
+                         const list<tuple<Ref::ID, Ref::ID>>& refs) noexcept {
+  // Compute the length of the ref mapping list
+  uint32_t refs_length = refs.size();
 
   // Set the current command
   setCommand(parent);
 
+  // Record the parent of the child command in the index
+  Command::ID child_id = getCommandID(child);
+  _parents[child_id] = _current_command_id;
+
   // Emit the fixed-length portion of the record
-  emitRecord<RecordType::Launch>(getCommandID(child), refs_length);
+  emitRecord<RecordType::Launch>(child_id, refs_length);
 
   // Now emit the ref mappings
   for (auto [a, b] : refs) {
@@ -1105,17 +1818,24 @@ void TraceWriter::launch(const IRSource& source,
 
 template <>
 struct Record<RecordType::Join> {
-  RecordType type;
   Command::ID child;
   int exit_status;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(child, exit_status);
+  }
+};
 
 // Read a Join record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::Join>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::Join>();
-  sink.join(*this, _current_command, getCommand(data.child), data.exit_status);
-}
+struct TraceReader::Handler<RecordType::Join> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::Join>();
+    sink.join(reader, reader._current_command, reader.getCommand(data.child), data.exit_status);
+  }
+};
 
 // Write a Join record to the output trace
 void TraceWriter::join(const IRSource& source,
@@ -1130,16 +1850,23 @@ void TraceWriter::join(const IRSource& source,
 
 template <>
 struct Record<RecordType::Exit> {
-  RecordType type;
   int exit_status;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(exit_status);
+  }
+};
 
 // Read an Exit record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::Exit>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::Exit>();
-  sink.exit(*this, _current_command, data.exit_status);
-}
+struct TraceReader::Handler<RecordType::Exit> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::Exit>();
+    sink.exit(reader, reader._current_command, data.exit_status);
+  }
+};
 
 // Write an Exit record to the output trace
 void TraceWriter::exit(const IRSource& source,
@@ -1154,49 +1881,58 @@ void TraceWriter::exit(const IRSource& source,
 // The fixed-size data written for each command in the trace
 template <>
 struct Record<RecordType::Command> {
-  RecordType type;
   bool has_executed;
-  uint16_t argv_length;
-  uint16_t initial_fds_length;
-} __attribute__((packed));
+  uint32_t argv_length;
+  uint32_t initial_fds_length;
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(has_executed, argv_length, initial_fds_length);
+  }
+};
 
 // A struct used to map a file descriptor to a reference ID
 struct FDRecord2 {
   int fd;
   Ref::ID ref;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(fd, ref);
+  }
+};
 
 // Read a Command record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::Command>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::Command>();
-  const StringID* arg_ids = takeArray<StringID>(data.argv_length);
-  const FDRecord2* fds = takeArray<FDRecord2>(data.initial_fds_length);
+struct TraceReader::Handler<RecordType::Command> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::Command>();
 
-  // Get argument strings
-  vector<string> args;
-  for (size_t i = 0; i < data.argv_length; i++) {
-    args.push_back(getString(arg_ids[i]));
-  }
+    // Get argument strings
+    vector<string> args;
+    args.reserve(data.argv_length);
+    for (size_t i = 0; i < data.argv_length; i++) {
+      args.emplace_back(reader.getString(reader.takeValue<StringID>()));
+    }
 
-  // Create a command
-  auto cmd = make_shared<Command>(args);
-  if (data.has_executed) cmd->setExecuted();
+    // Create a command
+    auto cmd = make_shared<Command>(args);
+    if (data.has_executed) cmd->setExecuted();
 
-  // Add initial file descriptors
-  for (size_t i = 0; i < data.initial_fds_length; i++) {
-    cmd->addInitialFD(fds[i].fd, fds[i].ref);
-  }
+    // Add initial file descriptors
+    for (size_t i = 0; i < data.initial_fds_length; i++) {
+      auto fd = reader.takeValue<FDRecord2>();
+      cmd->addInitialFD(fd.fd, fd.ref);
+    }
 
-  // Save the command in the commands table
-  addCommand(cmd);
-}
+    // Save the command in the commands table
+    reader.addCommand(cmd);
+  }
+};
 
 // Write a Command record to the output trace
 void TraceWriter::emitCommand(const std::shared_ptr<Command>& c) noexcept {
-  // We're going to emit argv strings. Make sure there's room for all of them in the string table
-  reserveStrings(c->getArguments().size());
-
   // Emit each of the strings in the argv array
   vector<StringID> args;
   for (const auto& arg : c->getArguments()) {
@@ -1204,14 +1940,16 @@ void TraceWriter::emitCommand(const std::shared_ptr<Command>& c) noexcept {
   }
 
   // Get the lengths of the variable-length parts of a command record
-  uint16_t argv_length = args.size();
-  uint16_t initial_fds_length = c->getInitialFDs().size();
+  uint32_t argv_length = args.size();
+  uint32_t initial_fds_length = c->getInitialFDs().size();
 
   // Write out the fixed-length portion of the command record
   emitRecord<RecordType::Command>(c->hasExecuted(), argv_length, initial_fds_length);
 
   // Write out the argv string IDs
-  emitArray(args.data(), args.size());
+  for (auto id : args) {
+    emitValue<StringID>(id);
+  }
 
   // Write out the initial FDs
   for (auto [fd, ref] : c->getInitialFDs()) {
@@ -1222,17 +1960,17 @@ void TraceWriter::emitCommand(const std::shared_ptr<Command>& c) noexcept {
 /********** String Record **********/
 
 template <>
-struct Record<RecordType::String> {
-  RecordType type;
-} __attribute__((packed));
+struct Record<RecordType::String> {};
 
 // Read a String record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::String>(IRSink& sink) noexcept {
-  takeRecord<RecordType::String>();
-  const char* str = takeString();
-  _strings.emplace_back(str);
-}
+struct TraceReader::Handler<RecordType::String> {
+  template <class Reader, class Sink>
+  static void handle(Reader& reader, Sink& sink) noexcept {
+    reader.template takeRecord<RecordType::String>();
+    reader.addString(reader.takeString());
+  }
+};
 
 // Write a String record to the output trace
 void TraceWriter::emitString(const string& str) noexcept {
@@ -1241,71 +1979,255 @@ void TraceWriter::emitString(const string& str) noexcept {
   emitArray(str.c_str(), str.size() + 1);
 }
 
-/********** NewStrtab Record **********/
+/********** Path Record **********/
 
+// A path is stored as the ID of its parent path and a string ID for its final component
 template <>
-struct Record<RecordType::NewStrtab> {
-  RecordType type;
-} __attribute__((packed));
+struct Record<RecordType::Path> {
+  PathID parent;
+  StringID component;
 
-// Read a NewStrtab record from the input trace
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(parent, component);
+  }
+};
+
+// Read a Path record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::NewStrtab>(IRSink& sink) noexcept {
-  takeRecord<RecordType::NewStrtab>();
-  _strings.clear();
+struct TraceReader::Handler<RecordType::Path> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::Path>();
+    reader.addPath(data.parent, data.component);
+  }
+};
+
+// Write a Path record to the output trace
+void TraceWriter::emitPath(PathID parent, StringID component) noexcept {
+  emitRecord<RecordType::Path>(parent, component);
 }
 
-// Write a NewStrtab record to the output trace
-void TraceWriter::emitNewStrtab() noexcept {
-  emitRecord<RecordType::NewStrtab>();
-  _strtab.clear();
+/********** Trace Index **********/
+
+// The index holds the number of strings, paths, commands, content versions, and segments, and
+// flags that record whether the trace starts and finishes a build. Then it lists the offsets of
+// the records that define each string, path, command, and content version, the command that
+// launched each command, the content versions that are no longer used by any segment, and the
+// segments in the order they are replayed. Each segment is written as its command, offset, length,
+// and hash. Offsets and IDs in lists are written as the difference from the previous entry.
+
+// Write the trace index and point the header at it
+void TraceWriter::emitIndex() noexcept {
+  // Finish the last segment
+  endSegment();
+
+  size_t index = _file.pos;
+
+  emitValue<uint64_t>(_string_offsets.size());
+  emitValue<uint64_t>(_path_offsets.size());
+  emitValue<uint64_t>(_command_offsets.size());
+  emitValue<uint64_t>(_version_offsets.size());
+  emitValue<uint64_t>(_segments.size());
+  emitValue<bool>(_started);
+  emitValue<bool>(_finished);
+
+  for (auto offsets : {&_string_offsets, &_path_offsets, &_command_offsets, &_version_offsets}) {
+    size_t last = 0;
+    for (size_t offset : *offsets) {
+      emitValue<uint64_t>(offset - last);
+      last = offset;
+    }
+  }
+
+  for (Command::ID id = 0; id < _command_offsets.size(); id++) {
+    emitValue<Command::ID>(_parents[id]);
+  }
+
+  // Every version used by a segment passed through this writer, including segments reused from
+  // the base trace. Any other version from the base trace is no longer used.
+  vector<bool> used(_version_offsets.size(), false);
+  for (const auto& [v, id] : _versions) {
+    used[id] = true;
+  }
+
+  emitValue<uint64_t>(static_cast<uint64_t>(std::count(used.begin(), used.end(), false)));
+  ContentVersion::ID last_unused = 0;
+  for (ContentVersion::ID id = 0; id < used.size(); id++) {
+    if (!used[id]) {
+      emitValue<uint64_t>(id - last_unused);
+      last_unused = id;
+    }
+  }
+
+  // Segments reused from an earlier trace may come before the previous segment in the file
+  size_t last = 0;
+  for (const auto& segment : _segments) {
+    emitValue<Command::ID>(segment.command);
+    emitValue<int64_t>(static_cast<int64_t>(segment.offset) - static_cast<int64_t>(last));
+    emitValue<uint64_t>(segment.length);
+    emitValue<uint64_t>(segment.hash);
+    last = segment.offset;
+  }
+
+  // Trim the unused space at the end of the file
+  int rc = ftruncate(_file.fd, _file.pos);
+  FAIL_IF(rc != 0) << "Failed to truncate the trace file: " << ERR;
+  _file.data = (uint8_t*)mremap(_file.data, _file.length, _file.pos, 0);
+  FAIL_IF(_file.data == MAP_FAILED) << "Failed to map truncated trace file: " << ERR;
+  _file.length = _file.pos;
+
+  // A trace on disk must have its segments and index written out before the header points to the
+  // new index. Appending changes no other bytes the old index refers to, so a build that stops at
+  // any point leaves either the old index or the new one in effect.
+  if (!_file.in_memory) _file.sync(0, _file.length);
+
+  // The file may have been remapped while writing, so look up the header again
+  reinterpret_cast<TraceHeader*>(_file.data)->index = index;
+  if (!_file.in_memory) _file.sync(0, sizeof(TraceHeader));
+
+  // Count the bytes written to the build database
+  if (_path.has_value() || _append) stats::db_bytes_written += _file.pos - _initial_length;
+}
+
+// Read the trace index that lists the definitions and segments in the trace
+bool TraceReader::loadIndex() noexcept {
+  // The index has to start inside the file
+  size_t index = reinterpret_cast<const TraceHeader*>(_file.data)->index;
+  if (index == 0 || index >= _file.length) return false;
+
+  // Jump to the index, saving the current position
+  size_t pos = _file.pos;
+  _file.pos = index;
+
+  // Every entry takes at least one byte, so a count larger than the file is corrupt
+  size_t counts[5];
+  for (size_t& count : counts) {
+    count = takeValue<uint64_t>();
+    if (count > _file.length) {
+      _file.pos = pos;
+      return false;
+    }
+  }
+
+  _string_offsets.resize(counts[0]);
+  _path_offsets.resize(counts[1]);
+  _command_offsets.resize(counts[2]);
+  _version_offsets.resize(counts[3]);
+  _segments.resize(counts[4]);
+  _started = takeValue<bool>();
+  _finished = takeValue<bool>();
+
+  for (auto offsets : {&_string_offsets, &_path_offsets, &_command_offsets, &_version_offsets}) {
+    size_t last = 0;
+    for (size_t& offset : *offsets) {
+      offset = last + takeValue<uint64_t>();
+      last = offset;
+    }
+  }
+
+  _parents.resize(_command_offsets.size());
+  for (Command::ID id = 0; id < _command_offsets.size(); id++) {
+    _parents[id] = takeValue<Command::ID>();
+  }
+
+  _unused_versions.resize(_version_offsets.size(), false);
+  size_t unused_count = takeValue<uint64_t>();
+  ContentVersion::ID last_unused = 0;
+  for (size_t i = 0; i < unused_count; i++) {
+    last_unused += takeValue<uint64_t>();
+    if (last_unused >= _version_offsets.size()) {
+      _file.pos = pos;
+      return false;
+    }
+    _unused_versions[last_unused] = true;
+  }
+
+  size_t last = 0;
+  for (auto& segment : _segments) {
+    segment.command = takeValue<Command::ID>();
+    segment.offset = last + takeValue<int64_t>();
+    segment.length = takeValue<uint64_t>();
+    segment.hash = takeValue<uint64_t>();
+    last = segment.offset;
+  }
+
+  _index_end = _file.pos;
+  _file.pos = pos;
+
+  // A truncated index runs past the end of the file
+  return _index_end <= _file.length;
 }
 
-/********** End Record **********/
-template <>
-struct Record<RecordType::End> {
-  RecordType type;
-} __attribute__((packed));
+// Load a single definition record at a known offset, then return to the current position
+size_t TraceReader::loadDefinition(size_t offset) noexcept {
+  size_t pos = _file.pos;
+  size_t record = _record;
 
-// Read an end record from the input trace
-template <>
-void TraceReader::handleRecord<RecordType::End>(IRSink& sink) noexcept {
-  takeRecord<RecordType::End>();
-  // The reader is finished
-  _done = true;
+  _file.pos = offset;
+
+  // Definition records do not send any steps
+  IRSink ignored;
+  handleNext(ignored);
+  size_t length = _file.pos - offset;
+
+  _record = record;
+  _file.pos = pos;
+
+  return length;
 }
 
-// Write an end record to the output trace
-void TraceWriter::emitEnd() noexcept {
-  emitRecord<RecordType::End>();
+// Definitions may be read in any order, so look up the ID of the current one from its offset
+size_t TraceReader::getDefinitionID(const vector<size_t>& offsets) const noexcept {
+  auto iter = std::lower_bound(offsets.begin(), offsets.end(), _record);
+  ASSERT(iter != offsets.end() && *iter == _record)
+      << "Definition at offset " << _record << " is not in the trace index";
+  return iter - offsets.begin();
 }
 
 /********** FileVersion Record **********/
 
 template <>
 struct Record<RecordType::FileVersion> {
-  RecordType type;
-  bool is_empty : 1;
-  bool is_cached : 1;
-  bool has_mtime : 1;
-  bool has_hash : 1;
+  bool is_empty;
+  bool is_cached;
+  bool has_mtime;
+  bool has_hash;
   struct timespec mtime;
   FileVersion::Hash hash;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    // Pack the flags into a single byte, then unpack them in case we are reading
+    uint8_t flags = is_empty | is_cached << 1 | has_mtime << 2 | has_hash << 3;
+    archive(flags);
+    is_empty = flags & 1;
+    is_cached = flags & 2;
+    has_mtime = flags & 4;
+    has_hash = flags & 8;
+
+    // The mtime and hash are only present in the trace if the version has them
+    if (has_mtime) archive(mtime);
+    if (has_hash) archive(hash);
+  }
+};
 
 // Read a FileVersion record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::FileVersion>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::FileVersion>();
+struct TraceReader::Handler<RecordType::FileVersion> {
+  template <class Reader, class Sink>
+  static void handle(Reader& reader, Sink& sink) noexcept {
+    const auto& data = reader.template takeRecord<RecordType::FileVersion>();
 
-  optional<struct timespec> mtime;
-  if (data.has_mtime) mtime = data.mtime;
+    optional<struct timespec> mtime;
+    if (data.has_mtime) mtime = data.mtime;
 
-  optional<FileVersion::Hash> hash;
-  if (data.has_hash) hash = data.hash;
+    optional<FileVersion::Hash> hash;
+    if (data.has_hash) hash = data.hash;
 
-  addVersion(make_shared<FileVersion>(data.is_empty, data.is_cached, mtime, hash));
-}
+    reader.addVersion(make_pooled<FileVersion>(data.is_empty, data.is_cached, mtime, hash));
+  }
+};
 
 // Write a FileVersion record to the output trace
 void TraceWriter::emitFileVersion(const shared_ptr<FileVersion>& v) noexcept {
@@ -1324,16 +2246,23 @@ void TraceWriter::emitFileVersion(const shared_ptr<FileVersion>& v) noexcept {
 
 template <>
 struct Record<RecordType::SymlinkVersion> {
-  RecordType type;
-  StringID dest;
-} __attribute__((packed));
+  PathID dest;
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(dest);
+  }
+};
 
 // Read a SymlinkVersion record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::SymlinkVersion>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::SymlinkVersion>();
-  addVersion(make_shared<SymlinkVersion>(getString(data.dest)));
-}
+struct TraceReader::Handler<RecordType::SymlinkVersion> {
+  template <class Reader, class Sink>
+  static void handle(Reader& reader, Sink& sink) noexcept {
+    const auto& data = reader.template takeRecord<RecordType::SymlinkVersion>();
+    reader.addVersion(make_pooled<SymlinkVersion>(reader.getPath(data.dest)));
+  }
+};
 
 // Write a SymlinkVersion record to the output trace
 void TraceWriter::emitSymlinkVersion(const shared_ptr<SymlinkVersion>& v) noexcept {
@@ -1342,64 +2271,48 @@ void TraceWriter::emitSymlinkVersion(const shared_ptr<SymlinkVersion>& v) noexce
 
 /********** DirListVersion Record **********/
 
+// A directory list is stored as the number of entries and a digest of the sorted entry names
 template <>
 struct Record<RecordType::DirListVersion> {
-  RecordType type;
-  uint16_t entry_count;
-} __attribute__((packed));
+  uint32_t entry_count;
+  DirListVersion::Digest digest;
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(entry_count, digest);
+  }
+};
 
 // Read a DirListVersion record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::DirListVersion>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::DirListVersion>();
-  const PathID* entry_ids = takeArray<PathID>(data.entry_count);
-
-  auto v = make_shared<DirListVersion>();
-  for (size_t i = 0; i < data.entry_count; i++) {
-    v->addEntry(getString(entry_ids[i]));
+struct TraceReader::Handler<RecordType::DirListVersion> {
+  template <class Reader, class Sink>
+  static void handle(Reader& reader, Sink& sink) noexcept {
+    const auto& data = reader.template takeRecord<RecordType::DirListVersion>();
+    reader.addVersion(make_pooled<DirListVersion>(data.digest, data.entry_count));
   }
-
-  addVersion(v);
-}
+};
 
 // Write a DirListVersion record to the output trace
 void TraceWriter::emitDirListVersion(const shared_ptr<DirListVersion>& v) noexcept {
-  // Get the number of directory entries, which should fit in a uint16_t
-  uint16_t entry_count = v->getEntries().size();
-
-  ASSERT(entry_count == v->getEntries().size())
-      << "A directory has too many entries to fit in a uint16_t...";
-
-  // Now build a vector of IDs for each of the paths
-  vector<PathID> entries;
-  entries.reserve(entry_count);
-
-  // Reserve enough paths so they all fit in the current path/string table
-  reservePaths(entry_count);
-  for (const auto& entry : v->getEntries()) {
-    entries.push_back(getPathID(entry));
-  }
-
-  // Write out the fixed-length portion of the directory list version
-  emitRecord<RecordType::DirListVersion>(entry_count);
-
-  // And write out the entry string ID list
-  emitArray(entries.data(), entries.size());
+  uint32_t entry_count = v->getEntryCount();
+  emitRecord<RecordType::DirListVersion>(entry_count, v->getDigest());
 }
 
 /********** PipeWriteVersion Record **********/
 
 template <>
-struct Record<RecordType::PipeWriteVersion> {
-  RecordType type;
-} __attribute__((packed));
+struct Record<RecordType::PipeWriteVersion> {};
 
 // Read a PipeWriteVersion record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::PipeWriteVersion>(IRSink& sink) noexcept {
-  takeRecord<RecordType::PipeWriteVersion>();
-  addVersion(make_shared<PipeWriteVersion>());
-}
+struct TraceReader::Handler<RecordType::PipeWriteVersion> {
+  template <class Reader, class Sink>
+  static void handle(Reader& reader, Sink& sink) noexcept {
+    reader.template takeRecord<RecordType::PipeWriteVersion>();
+    reader.addVersion(make_pooled<PipeWriteVersion>());
+  }
+};
 
 // Write a PipeWriteVersion record to the output trace
 void TraceWriter::emitPipeWriteVersion(const shared_ptr<PipeWriteVersion>& v) noexcept {
@@ -1409,16 +2322,17 @@ void TraceWriter::emitPipeWriteVersion(const shared_ptr<PipeWriteVersion>& v) no
 /********** PipeCloseVersion Record **********/
 
 template <>
-struct Record<RecordType::PipeCloseVersion> {
-  RecordType type;
-} __attribute__((packed));
+struct Record<RecordType::PipeCloseVersion> {};
 
 // Read a PipeCloseVersion record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::PipeCloseVersion>(IRSink& sink) noexcept {
-  takeRecord<RecordType::PipeCloseVersion>();
-  addVersion(make_shared<PipeCloseVersion>());
-}
+struct TraceReader::Handler<RecordType::PipeCloseVersion> {
+  template <class Reader, class Sink>
+  static void handle(Reader& reader, Sink& sink) noexcept {
+    reader.template takeRecord<RecordType::PipeCloseVersion>();
+    reader.addVersion(make_pooled<PipeCloseVersion>());
+  }
+};
 
 // Write a PipeCloseVersion record to the output trace
 void TraceWriter::emitPipeCloseVersion(const shared_ptr<PipeCloseVersion>& v) noexcept {
@@ -1428,16 +2342,17 @@ void TraceWriter::emitPipeCloseVersion(const shared_ptr<PipeCloseVersion>& v) no
 /********** PipeReadVersion Record **********/
 
 template <>
-struct Record<RecordType::PipeReadVersion> {
-  RecordType type;
-} __attribute__((packed));
+struct Record<RecordType::PipeReadVersion> {};
 
 // Read a PipeReadVersion record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::PipeReadVersion>(IRSink& sink) noexcept {
-  takeRecord<RecordType::PipeReadVersion>();
-  addVersion(make_shared<PipeReadVersion>());
-}
+struct TraceReader::Handler<RecordType::PipeReadVersion> {
+  template <class Reader, class Sink>
+  static void handle(Reader& reader, Sink& sink) noexcept {
+    reader.template takeRecord<RecordType::PipeReadVersion>();
+    reader.addVersion(make_pooled<PipeReadVersion>());
+  }
+};
 
 // Write a PipeReadVersion record to the output trace
 void TraceWriter::emitPipeReadVersion(const shared_ptr<PipeReadVersion>& v) noexcept {
@@ -1448,16 +2363,23 @@ void TraceWriter::emitPipeReadVersion(const shared_ptr<PipeReadVersion>& v) noex
 
 template <>
 struct Record<RecordType::SpecialVersion> {
-  RecordType type;
   bool can_commit;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(can_commit);
+  }
+};
 
 // Read a SpecialVersion record from the input trace
 template <>
-void TraceReader::handleRecord<RecordType::SpecialVersion>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::SpecialVersion>();
-  addVersion(make_shared<SpecialVersion>(data.can_commit));
-}
+struct TraceReader::Handler<RecordType::SpecialVersion> {
+  template <class Reader, class Sink>
+  static void handle(Reader& reader, Sink& sink) noexcept {
+    const auto& data = reader.template takeRecord<RecordType::SpecialVersion>();
+    reader.addVersion(make_pooled<SpecialVersion>(data.can_commit));
+  }
+};
 
 // Write a SpecialVersion record to the output trace
 void TraceWriter::emitSpecialVersion(const shared_ptr<SpecialVersion>& v) noexcept {
@@ -1468,162 +2390,383 @@ void TraceWriter::emitSpecialVersion(const shared_ptr<SpecialVersion>& v) noexce
 
 template <>
 struct Record<RecordType::SetCommand> {
-  RecordType type;
   Command::ID c;
-} __attribute__((packed));
+
+  template <class Archive>
+  void serialize(Archive& archive) noexcept {
+    archive(c);
+  }
+};
 
 // Read a SetCommand record from the trace
 template <>
-void TraceReader::handleRecord<RecordType::SetCommand>(IRSink& sink) noexcept {
-  const auto& data = takeRecord<RecordType::SetCommand>();
-  _current_command = getCommand(data.c);
-}
+struct TraceReader::Handler<RecordType::SetCommand> {
+  template <class Sink>
+  static void handle(TraceReader& reader, Sink& sink) noexcept {
+    const auto& data = reader.takeRecord<RecordType::SetCommand>();
+    reader._current_command_id = data.c;
+    reader._current_command = reader.getCommand(data.c);
+    if (reader._last_refs.size() <= data.c) reader._last_refs.resize(data.c + 1);
+  }
+};
 
 // Write a SetCommand record to the output trace
 void TraceWriter::setCommand(std::shared_ptr<Command> c) noexcept {
   if (c != _current_command) {
+    // Finish the previous command's segment before writing any definitions for the new command
+    endSegment();
+
     _current_command = c;
-    emitRecord<RecordType::SetCommand>(getCommandID(c));
+    _current_command_id = getCommandID(c);
+    if (_last_refs.size() <= _current_command_id) _last_refs.resize(_current_command_id + 1);
+
+    // Begin a new segment
+    _segments.push_back({_current_command_id, _file.pos, 0, 0});
+    _segment_ref = _last_refs[_current_command_id];
+    _in_segment = true;
+
+    emitRecord<RecordType::SetCommand>(_current_command_id);
   }
 }
 
+// Note that a definition record was written between a start offset and the current position
+void TraceWriter::addDefinition(size_t start) noexcept {
+  if (!_in_segment) return;
+
+  // This definition contains any definitions it needed that were written just before it
+  while (!_segment_definitions.empty() && _segment_definitions.back().first >= start) {
+    _segment_definitions.pop_back();
+  }
+  _segment_definitions.emplace_back(start, _file.pos);
+}
+
+// Check if the definition record just written matches the definition with a given ID in the
+// base trace. If it does, discard the new record so the existing definition is used instead.
+bool TraceWriter::reuseDefinition(size_t start, vector<size_t>& offsets, size_t id) noexcept {
+  // Records that needed new definitions of their own can never match
+  size_t record = offsets.back();
+  if (record != start) return false;
+
+  // Records are self-delimiting, so the base record matches if it begins with the new record
+  size_t length = _file.pos - record;
+  size_t base = offsets[id];
+  if (base + length > _initial_length) return false;
+  if (memcmp(&_file.data[base], &_file.data[record], length) != 0) return false;
+
+  _file.pos = start;
+  offsets.pop_back();
+  return true;
+}
+
+// Finish the current segment, reusing a matching segment from the base trace if there is one
+void TraceWriter::endSegment() noexcept {
+  if (!_in_segment) return;
+  _in_segment = false;
+
+  // The next step from any command will begin a new segment
+  _current_command = nullptr;
+
+  auto& segment = _segments.back();
+  segment.length = _file.pos - segment.offset;
+
+  // Hash the segment's command, its starting ref, and its steps. The refs in a segment are encoded
+  // relative to its starting ref. Definitions are skipped, since they are listed in the index and
+  // can be read from anywhere in the file.
+  if (_path.has_value() || _append) {
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, &segment.command, sizeof(segment.command));
+    blake3_hasher_update(&hasher, &_segment_ref, sizeof(_segment_ref));
+
+    size_t pos = segment.offset;
+    for (auto [start, end] : _segment_definitions) {
+      blake3_hasher_update(&hasher, &_file.data[pos], start - pos);
+      pos = end;
+    }
+    blake3_hasher_update(&hasher, &_file.data[pos], _file.pos - pos);
+
+    blake3_hasher_finalize(&hasher, reinterpret_cast<uint8_t*>(&segment.hash), sizeof(uint64_t));
+  }
+
+  // When appending, compare the segment to the segment in the same position for this command in
+  // the base trace. If they match, drop the new copy and use the existing segment instead. The hash
+  // only rules out segments quickly, so the bytes of a candidate segment are compared as well.
+  if (_append) {
+    if (_segment_counts.size() <= segment.command) _segment_counts.resize(segment.command + 1);
+    size_t k = _segment_counts[segment.command]++;
+
+    if (_segment_definitions.empty() && segment.command < _base_segments.size() &&
+        k < _base_segments[segment.command].size()) {
+      const auto& base = _base_segments[segment.command][k];
+      if (base.hash == segment.hash && base.length == segment.length &&
+          base.offset + base.length <= _initial_length &&
+          memcmp(&_file.data[base.offset], &_file.data[segment.offset], segment.length) == 0) {
+        _file.pos = segment.offset;
+        segment = base;
+      }
+    }
+  }
+
+  _segment_definitions.clear();
+}
+
 /********** Process an input trace **********/
 
+// Send a loaded trace to any IRSink. Each step is a virtual call on the sink
 void TraceReader::sendTo(IRSink& sink) noexcept {
-  while (!done()) {
-    // Handle the next record
-    switch (peek()) {
-      case RecordType::Start:
-        handleRecord<RecordType::Start>(sink);
-        break;
+  dispatch(sink);
+}
 
-      case RecordType::Finish:
-        handleRecord<RecordType::Finish>(sink);
-        break;
+// Send a loaded trace to a build. Build is final, so each step is called directly
+void TraceReader::sendTo(Build& build) noexcept {
+  dispatch(build);
+}
 
-      case RecordType::SpecialRef:
-        handleRecord<RecordType::SpecialRef>(sink);
-        break;
+// Get every command in the trace, loading only the command records
+vector<shared_ptr<Command>> TraceReader::getCommands() noexcept {
+  vector<shared_ptr<Command>> result;
+  result.reserve(_command_offsets.size());
+  for (Command::ID id = 0; id < _command_offsets.size(); id++) {
+    result.push_back(getCommand(id));
+  }
+  return result;
+}
+
+// Send the steps from a set of commands and their descendants to a sink, in trace order
+void TraceReader::sendTo(IRSink& sink, const vector<shared_ptr<Command>>& commands) noexcept {
+  // Find the IDs of the requested commands. Only commands that are already loaded can match.
+  vector<bool> selected(_command_offsets.size(), false);
+  for (Command::ID id = 0; id < _commands.size() && id < selected.size(); id++) {
+    if (_commands[id] &&
+        std::find(commands.begin(), commands.end(), _commands[id]) != commands.end()) {
+      selected[id] = true;
+    }
+  }
+
+  // Mark each command with a selected ancestor. Commands are always launched by a command with a
+  // lower ID, so parents are visited first.
+  for (Command::ID id = 1; id < selected.size(); id++) {
+    if (selected[_parents[id]]) selected[id] = true;
+  }
+
+  // Walk the segments of the selected commands
+  for (const auto& segment : _segments) {
+    if (selected[segment.command]) walkSegment(segment, sink);
+  }
+}
 
-      case RecordType::PipeRef:
-        handleRecord<RecordType::PipeRef>(sink);
-        break;
+// Send every segment in the trace to a sink
+template <class Sink>
+void TraceReader::dispatch(Sink& sink) noexcept {
+  // Every definition will be needed, so load them all up front
+  loadDefinitions();
 
-      case RecordType::FileRef:
-        handleRecord<RecordType::FileRef>(sink);
-        break;
+  if (_started) sink.start(getRootCommand());
 
-      case RecordType::SymlinkRef:
-        handleRecord<RecordType::SymlinkRef>(sink);
-        break;
+  for (const auto& segment : _segments) {
+    walkSegment(segment, sink);
+  }
 
-      case RecordType::DirRef:
-        handleRecord<RecordType::DirRef>(sink);
-        break;
+  if (_finished) sink.finish();
+}
 
-      case RecordType::PathRef:
-        handleRecord<RecordType::PathRef>(sink);
-        break;
-
-      case RecordType::UsingRef:
-        handleRecord<RecordType::UsingRef>(sink);
-        break;
-
-      case RecordType::DoneWithRef:
-        handleRecord<RecordType::DoneWithRef>(sink);
-        break;
-
-      case RecordType::CompareRefs:
-        handleRecord<RecordType::CompareRefs>(sink);
-        break;
-
-      case RecordType::ExpectResult:
-        handleRecord<RecordType::ExpectResult>(sink);
-        break;
-
-      case RecordType::MatchMetadata:
-        handleRecord<RecordType::MatchMetadata>(sink);
-        break;
-
-      case RecordType::MatchContent:
-        handleRecord<RecordType::MatchContent>(sink);
-        break;
-
-      case RecordType::UpdateMetadata:
-        handleRecord<RecordType::UpdateMetadata>(sink);
-        break;
-
-      case RecordType::UpdateContent:
-        handleRecord<RecordType::UpdateContent>(sink);
-        break;
-
-      case RecordType::AddEntry:
-        handleRecord<RecordType::AddEntry>(sink);
-        break;
-
-      case RecordType::RemoveEntry:
-        handleRecord<RecordType::RemoveEntry>(sink);
-        break;
-
-      case RecordType::Launch:
-        handleRecord<RecordType::Launch>(sink);
-        break;
-
-      case RecordType::Join:
-        handleRecord<RecordType::Join>(sink);
-        break;
-
-      case RecordType::Exit:
-        handleRecord<RecordType::Exit>(sink);
-        break;
-
-      case RecordType::Command:
-        handleRecord<RecordType::Command>(sink);
-        break;
-
-      case RecordType::String:
-        handleRecord<RecordType::String>(sink);
-        break;
-
-      case RecordType::NewStrtab:
-        handleRecord<RecordType::NewStrtab>(sink);
-        break;
-
-      case RecordType::End:
-        handleRecord<RecordType::End>(sink);
-        break;
-
-      case RecordType::FileVersion:
-        handleRecord<RecordType::FileVersion>(sink);
-        break;
+// Read every record in a segment, beginning with its SetCommand record
+template <class Sink>
+void TraceReader::walkSegment(const TraceSegment& segment, Sink& sink) noexcept {
+  _file.pos = segment.offset;
+  while (_file.pos < segment.offset + segment.length) {
+    handleNext(sink);
+  }
+}
 
-      case RecordType::SymlinkVersion:
-        handleRecord<RecordType::SymlinkVersion>(sink);
-        break;
+// Load every string, path, and content version listed in the index, skipping versions that are
+// no longer used. Strings and versions are split across worker threads. Paths refer to their
+// parents, so they are loaded in order once the strings are ready. Commands are still loaded when
+// they are first used.
+void TraceReader::loadDefinitions() noexcept {
+  _strings.resize(_string_offsets.size());
+  parallelFor(_string_offsets.size(), [this](size_t id) {
+    if (_strings[id].data() == nullptr) Worker(*this).load(_string_offsets[id], id);
+  });
 
-      case RecordType::DirListVersion:
-        handleRecord<RecordType::DirListVersion>(sink);
-        break;
+  for (PathID id = 1; id <= _path_offsets.size(); id++) {
+    if (id >= _paths.size() || _paths[id].empty()) loadDefinition(_path_offsets[id - 1]);
+  }
+
+  _versions.resize(_version_offsets.size());
+  parallelFor(_version_offsets.size(), [this](size_t id) {
+    if (!_versions[id] && !_unused_versions[id]) Worker(*this).load(_version_offsets[id], id);
+  });
+}
 
-      case RecordType::PipeWriteVersion:
-        handleRecord<RecordType::PipeWriteVersion>(sink);
-        break;
+// Load a definition record on a worker thread
+void TraceReader::Worker::load(size_t offset, size_t id) noexcept {
+  _file.pos = offset;
+  _id = id;
 
-      case RecordType::PipeCloseVersion:
-        handleRecord<RecordType::PipeCloseVersion>(sink);
-        break;
+  // Definition records do not send any steps
+  IRSink ignored;
 
-      case RecordType::PipeReadVersion:
-        handleRecord<RecordType::PipeReadVersion>(sink);
-        break;
+  switch (*reinterpret_cast<const RecordType*>(_file.peek())) {
+    case RecordType::String:
+      Handler<RecordType::String>::handle(*this, ignored);
+      break;
 
-      case RecordType::SpecialVersion:
-        handleRecord<RecordType::SpecialVersion>(sink);
-        break;
+    case RecordType::FileVersion:
+      Handler<RecordType::FileVersion>::handle(*this, ignored);
+      break;
 
-      case RecordType::SetCommand:
-        handleRecord<RecordType::SetCommand>(sink);
-        break;
-    }
+    case RecordType::SymlinkVersion:
+      Handler<RecordType::SymlinkVersion>::handle(*this, ignored);
+      break;
+
+    case RecordType::DirListVersion:
+      Handler<RecordType::DirListVersion>::handle(*this, ignored);
+      break;
+
+    case RecordType::PipeWriteVersion:
+      Handler<RecordType::PipeWriteVersion>::handle(*this, ignored);
+      break;
+
+    case RecordType::PipeCloseVersion:
+      Handler<RecordType::PipeCloseVersion>::handle(*this, ignored);
+      break;
+
+    case RecordType::PipeReadVersion:
+      Handler<RecordType::PipeReadVersion>::handle(*this, ignored);
+      break;
+
+    case RecordType::SpecialVersion:
+      Handler<RecordType::SpecialVersion>::handle(*this, ignored);
+      break;
+
+    default:
+      FAIL << "Unexpected record at offset " << _file.pos << " while loading definitions";
+  }
+}
+
+// Read the next record in the trace and send its step to a sink
+template <class Sink>
+void TraceReader::handleNext(Sink& sink) noexcept {
+  switch (peek()) {
+    case RecordType::SpecialRef:
+      handleRecord<RecordType::SpecialRef>(sink);
+      break;
+
+    case RecordType::PipeRef:
+      handleRecord<RecordType::PipeRef>(sink);
+      break;
+
+    case RecordType::FileRef:
+      handleRecord<RecordType::FileRef>(sink);
+      break;
+
+    case RecordType::SymlinkRef:
+      handleRecord<RecordType::SymlinkRef>(sink);
+      break;
+
+    case RecordType::DirRef:
+      handleRecord<RecordType::DirRef>(sink);
+      break;
+
+    case RecordType::PathRef:
+      handleRecord<RecordType::PathRef>(sink);
+      break;
+
+    case RecordType::UsingRef:
+      handleRecord<RecordType::UsingRef>(sink);
+      break;
+
+    case RecordType::DoneWithRef:
+      handleRecord<RecordType::DoneWithRef>(sink);
+      break;
+
+    case RecordType::CompareRefs:
+      handleRecord<RecordType::CompareRefs>(sink);
+      break;
+
+    case RecordType::ExpectResult:
+      handleRecord<RecordType::ExpectResult>(sink);
+      break;
+
+    case RecordType::MatchMetadata:
+      handleRecord<RecordType::MatchMetadata>(sink);
+      break;
+
+    case RecordType::MatchContent:
+      handleRecord<RecordType::MatchContent>(sink);
+      break;
+
+    case RecordType::UpdateMetadata:
+      handleRecord<RecordType::UpdateMetadata>(sink);
+      break;
+
+    case RecordType::UpdateContent:
+      handleRecord<RecordType::UpdateContent>(sink);
+      break;
+
+    case RecordType::AddEntry:
+      handleRecord<RecordType::AddEntry>(sink);
+      break;
+
+    case RecordType::RemoveEntry:
+      handleRecord<RecordType::RemoveEntry>(sink);
+      break;
+
+    case RecordType::Launch:
+      handleRecord<RecordType::Launch>(sink);
+      break;
+
+    case RecordType::Join:
+      handleRecord<RecordType::Join>(sink);
+      break;
+
+    case RecordType::Exit:
+      handleRecord<RecordType::Exit>(sink);
+      break;
+
+    case RecordType::Command:
+      handleRecord<RecordType::Command>(sink);
+      break;
+
+    case RecordType::String:
+      handleRecord<RecordType::String>(sink);
+      break;
+
+    case RecordType::Path:
+      handleRecord<RecordType::Path>(sink);
+      break;
+
+    case RecordType::FileVersion:
+      handleRecord<RecordType::FileVersion>(sink);
+      break;
+
+    case RecordType::SymlinkVersion:
+      handleRecord<RecordType::SymlinkVersion>(sink);
+      break;
+
+    case RecordType::DirListVersion:
+      handleRecord<RecordType::DirListVersion>(sink);
+      break;
+
+    case RecordType::PipeWriteVersion:
+      handleRecord<RecordType::PipeWriteVersion>(sink);
+      break;
+
+    case RecordType::PipeCloseVersion:
+      handleRecord<RecordType::PipeCloseVersion>(sink);
+      break;
+
+    case RecordType::PipeReadVersion:
+      handleRecord<RecordType::PipeReadVersion>(sink);
+      break;
+
+    case RecordType::SpecialVersion:
+      handleRecord<RecordType::SpecialVersion>(sink);
+      break;
+
+    case RecordType::SetCommand:
+      handleRecord<RecordType::SetCommand>(sink);
+      break;
   }
 }
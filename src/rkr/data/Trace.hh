@@ -4,14 +4,18 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "data/IRSink.hh"
 #include "data/IRSource.hh"
 #include "runtime/Command.hh"
 #include "versions/ContentVersion.hh"
 
+class Build;
 class MetadataVersion;
 class FileVersion;
 class SymlinkVersion;
@@ -26,20 +30,33 @@ enum class RecordType : uint8_t;
 template <RecordType T>
 struct Record;
 
-using StringID = uint16_t;
-using PathID = StringID;
+using StringID = uint32_t;
+using PathID = uint32_t;
+
+/// A run of consecutive steps from a single command, stored contiguously in a trace file
+struct TraceSegment {
+  Command::ID command;  //< The command that issued the steps in this segment
+  size_t offset;        //< The offset of the SetCommand record that begins the segment
+  size_t length;        //< The length of the segment in bytes
+  uint64_t hash;        //< A hash of the steps in the segment, used to find reusable segments
+};
 
 struct TraceFile {
   int fd = -1;              //< The file descriptor for the open file
   size_t length = 0;        //< The total size of the mapped file
   size_t pos = 0;           //< The current position in the mapped file
   uint8_t* data = nullptr;  //< A pointer to the beginning of the mapped file
+  bool in_memory = false;   //< Is this file kept in memory instead of the filesystem?
 
   /// Open a trace file at a given path for reading
   static TraceFile open(std::string path) noexcept;
 
-  /// Create an anonymous trace file for writing
-  static TraceFile create() noexcept;
+  /// Open an existing trace file at a given path to append to it
+  static TraceFile append(std::string path) noexcept;
+
+  /// Create an anonymous trace file for writing. The file is created in the given directory if
+  /// it will be linked into the filesystem later, and is kept in memory otherwise.
+  static TraceFile create(std::optional<std::string> dir = std::nullopt) noexcept;
 
   /// Default constructor
   TraceFile() noexcept = default;
@@ -64,6 +81,9 @@ struct TraceFile {
   /// Grab a pointer into the trace data and advance the position by a requested size
   void* advance(size_t bytes, bool grow) noexcept;
 
+  /// Wait until a range of the trace data has been written out to disk
+  void sync(size_t offset, size_t bytes) noexcept;
+
  private:
   /// Clean up state from this trace file by unmapping, closing, etc.
   void destroy() noexcept;
@@ -91,86 +111,195 @@ class TraceReader : public IRSource {
   /// Accept r-value reference to a sink
   void sendTo(IRSink&& handler) noexcept { return sendTo(handler); }
 
+  /// Send a loaded trace to a Build, calling its step handlers without virtual dispatch
+  void sendTo(Build& build) noexcept;
+
+  /// Accept r-value reference to a Build
+  void sendTo(Build&& build) noexcept { return sendTo(build); }
+
+  /// Send only the steps from a set of commands and their descendants to an IRSink, in the order
+  /// they are replayed. The trace index is used to skip over the segments for every other command,
+  /// so only the visited commands and the strings, paths, and versions they use are loaded.
+  void sendTo(IRSink& sink, const std::vector<std::shared_ptr<Command>>& commands) noexcept;
+
+  /// Accept r-value reference to a sink
+  void sendTo(IRSink&& sink, const std::vector<std::shared_ptr<Command>>& commands) noexcept {
+    return sendTo(sink, commands);
+  }
+
   /// Get the root command
   std::shared_ptr<Command> getRootCommand() const noexcept;
 
+  /// Get every command in the trace. This loads the command records through the trace index
+  /// without reading any steps.
+  std::vector<std::shared_ptr<Command>> getCommands() noexcept;
+
+  /// Check if most of the space in this trace file is taken up by segments and definitions that
+  /// are no longer used. A trace that needs compaction should be rewritten instead of appended to.
+  bool needsCompaction() noexcept;
+
   /// A saved trace is never an executing IRSource
   virtual bool isExecuting() const override { return false; }
 
  private:
-  // Allow TraceWriter to call the constructor below
+  // Allow TraceWriter to call the constructor below and reuse this trace's tables
   friend class TraceWriter;
 
   /// Create a trace reader from an already open trace file
   TraceReader(TraceFile&& file) noexcept;
 
-  /// Check if we've hit the end of the trace
-  bool done() const noexcept { return _done; }
-
   /// Peek at the type of the next record
   RecordType peek() const noexcept;
 
-  /// Get a reference to a record in the trace
+  /// Decode the next record in the trace. Decoding is inlined into each record's handler, so the
+  /// handler reads decoded fields directly instead of reloading a record returned through memory.
   template <RecordType T>
-  const Record<T>& takeRecord() noexcept;
+  inline __attribute__((always_inline)) Record<T> takeRecord() noexcept;
 
-  /// Get a reference to data in the trace of a requested type
+  /// Decode a value of a requested type from the trace
   template <typename T>
-  const T& takeValue() noexcept;
+  inline __attribute__((always_inline)) T takeValue() noexcept;
 
-  /// Get a reference to an array in the trace
-  template <typename T>
-  const T* takeArray(size_t count) noexcept;
+  /// Get a view of a string in the trace and advance the current position past the string
+  std::string_view takeString() noexcept;
+
+  /// Decodes the fields of records and values directly from the mapped trace (defined in Trace.cc)
+  class Decoder;
+
+  /// Loads definition records on a worker thread (defined in Trace.cc)
+  class Worker;
+
+  /// Send every segment of the trace to a sink of a known type, in order
+  template <class Sink>
+  void dispatch(Sink& sink) noexcept;
+
+  /// Read the records in a segment, sending steps to a sink of a known type
+  template <class Sink>
+  void walkSegment(const TraceSegment& segment, Sink& sink) noexcept;
+
+  /// Read the next record from the trace and send any step it holds to a sink of a known type.
+  /// This is inlined into the loop in walkSegment so replay does not make a call for every step.
+  template <class Sink>
+  inline __attribute__((always_inline)) void handleNext(Sink& sink) noexcept;
 
-  /// Get a pointer to a string in the trace and advance the current position past the string
-  const char* takeString() noexcept;
+  /// Read the index that lists the trace's definition records and segments. Returns false if the
+  /// index is corrupt.
+  bool loadIndex() noexcept;
 
-  /// Handle a record from the trace (specialized in Trace.cc)
+  /// Load every string, path, and content version in the trace, using multiple threads
+  void loadDefinitions() noexcept;
+
+  /// Load a single string, path, command, or content version record from a known offset, then
+  /// return to the current position in the trace. Returns the length of the loaded record.
+  size_t loadDefinition(size_t offset) noexcept;
+
+  /// Find the ID of the definition record that is currently being read
+  size_t getDefinitionID(const std::vector<size_t>& offsets) const noexcept;
+
+  /// Handlers for each record type (specialized in Trace.cc). Each specialization has a static
+  /// handle(reader, sink) function that is templated on the sink type. Handlers for strings and
+  /// content versions are also templated on the reader type so they can run on a Worker.
   template <RecordType T>
-  void handleRecord(IRSink& sink) noexcept;
+  struct Handler;
+
+  /// Handle a record from the trace
+  template <RecordType T, class Sink>
+  void handleRecord(Sink& sink) noexcept {
+    Handler<T>::handle(*this, sink);
+  }
+
+  /// Get a command from the table of commands, loading it from the index if necessary
+  const std::shared_ptr<Command>& getCommand(Command::ID id) noexcept;
 
-  /// Get a command from the table of commands
-  const std::shared_ptr<Command>& getCommand(Command::ID id) const noexcept;
+  /// Get a content version from the table of content versions, loading it from the index if
+  /// necessary
+  const std::shared_ptr<ContentVersion>& getContentVersion(ContentVersion::ID id) noexcept;
 
-  /// Get a content version from the table of content versions
-  const std::shared_ptr<ContentVersion>& getContentVersion(ContentVersion::ID id) const noexcept;
+  /// Get a string from the table of strings, loading it from the index if necessary
+  std::string_view getString(StringID id) noexcept;
 
-  /// Get a string from the table of strings
-  const std::string& getString(StringID id) const noexcept;
+  /// Get a path from the table of paths, loading it from the index if necessary
+  const fs::path& getPath(PathID id) noexcept;
+
+  /// Get the interned handle for a path in the table of paths, interning it on first use
+  InternedPath getInternedPath(PathID id) noexcept;
+
+  /// Add the string defined by the current record to the strings table
+  void addString(std::string_view s) noexcept;
+
+  /// Add the path defined by the current record to the paths table
+  void addPath(PathID parent, StringID component) noexcept;
 
   /// Set a command in the commands table using a known ID
   void setCommand(Command::ID id, std::shared_ptr<Command> c) noexcept;
 
-  /// Add a command to the commands table and assign a new ID
+  /// Add the command defined by the current record to the commands table
   void addCommand(std::shared_ptr<Command> c) noexcept;
 
   /// Set a content version in the versions table using a known ID
   void setVersion(ContentVersion::ID id, std::shared_ptr<ContentVersion> v) noexcept;
 
-  /// Add a content version to the table and assign a new ID
+  /// Add the content version defined by the current record to the versions table
   void addVersion(std::shared_ptr<ContentVersion> v) noexcept;
 
  private:
   /// The trace file mapped for this TraceReader
   TraceFile _file;
 
-  /// When true, the reader has reached the end of the trace
-  bool _done = false;
+  /// The offset of the record that is currently being read
+  size_t _record = 0;
 
   /// The table of commands indexed by ID
   std::vector<std::shared_ptr<Command>> _commands;
 
-  /// The next command ID that will be assigned in the trace
-  size_t _next_command_id = 0;
-
   /// The table of content versions indexed by ID
   std::vector<std::shared_ptr<ContentVersion>> _versions;
 
-  /// The next content version ID that will be assigned in the trace
-  size_t _next_version_id = 0;
+  /// The table of strings indexed by ID. Strings point into the mapped trace, so they are only
+  /// copied when they are stored in a command, version, or path. A missing entry has no data.
+  std::vector<std::string_view> _strings;
+
+  /// The table of paths indexed by ID. Path zero is always the empty path.
+  std::vector<fs::path> _paths = {fs::path()};
+
+  /// The interned handles for paths, indexed by path ID. A path has not been interned yet if its
+  /// handle is the empty path.
+  std::vector<InternedPath> _interned_paths;
+
+  /// The parent path and final component of each loaded path, packed into one value
+  std::vector<uint64_t> _path_keys = {0};
+
+  /// The offsets of the records that define each string, indexed by ID
+  std::vector<size_t> _string_offsets;
+
+  /// The offsets of the records that define each path, starting with path one
+  std::vector<size_t> _path_offsets;
+
+  /// The offsets of the records that define each command, indexed by ID
+  std::vector<size_t> _command_offsets;
+
+  /// The offsets of the records that define each content version, indexed by ID
+  std::vector<size_t> _version_offsets;
+
+  /// The segments of steps in the trace, in the order they are replayed
+  std::vector<TraceSegment> _segments;
 
-  /// The table of strings indexed by ID
-  std::vector<std::string> _strings;
+  /// The ID of the command that launched each command, indexed by command ID
+  std::vector<Command::ID> _parents;
+
+  /// Content versions that are no longer used by any segment, and do not need to be loaded
+  std::vector<bool> _unused_versions;
+
+  /// The offset just past the end of the index. A build that stopped while appending to the trace
+  /// may have left unused bytes after it.
+  size_t _index_end = 0;
+
+  /// Does the trace include the steps that start and finish a build?
+  bool _started = false;
+  bool _finished = false;
+
+  /// The last ref created by each command, indexed by command ID. Ref IDs are delta-coded.
+  std::vector<Ref::ID> _last_refs = {0};
 
   /// The ID of the current command
   Command::ID _current_command_id = 0;
@@ -185,6 +314,10 @@ class TraceWriter : public IRSink {
   /// stored only in a temporary file.
   TraceWriter(std::optional<std::string> path = std::nullopt) noexcept;
 
+  /// Create a TraceWriter that appends to the existing trace at path, which base was loaded from.
+  /// Segments that match a segment in the base trace are written as references to the base.
+  TraceWriter(std::string path, TraceReader& base) noexcept;
+
   /// Destroy a TraceWriter and clean up any remaining state
   virtual ~TraceWriter() noexcept override;
 
@@ -199,6 +332,9 @@ class TraceWriter : public IRSink {
   /// Create a TraceReader to traverse this trace. Makes the writer unusable
   TraceReader getReader() noexcept;
 
+  /// Get every command written to this trace, indexed by the ID a reader of the trace will use
+  std::vector<std::shared_ptr<Command>> getCommands() const noexcept;
+
   /// Called when starting a trace. The root command is passed in.
   virtual void start(const std::shared_ptr<Command>& c) noexcept override;
 
@@ -226,7 +362,7 @@ class TraceWriter : public IRSink {
   /// Handle a SymlinkRef IR step
   virtual void symlinkRef(const IRSource& source,
                           const std::shared_ptr<Command>& command,
-                          fs::path target,
+                          const fs::path& target,
                           Ref::ID output) noexcept override;
 
   /// Handle a DirRef IR step
@@ -239,7 +375,7 @@ class TraceWriter : public IRSink {
   virtual void pathRef(const IRSource& source,
                        const std::shared_ptr<Command>& command,
                        Ref::ID base,
-                       fs::path path,
+                       InternedPath path,
                        AccessFlags flags,
                        Ref::ID output) noexcept override;
 
@@ -279,7 +415,7 @@ class TraceWriter : public IRSink {
                             const std::shared_ptr<Command>& command,
                             Scenario scenario,
                             Ref::ID ref,
-                            std::shared_ptr<ContentVersion> version) noexcept override;
+                            const std::shared_ptr<ContentVersion>& version) noexcept override;
 
   /// Handle an UpdateMetadata IR step
   virtual void updateMetadata(const IRSource& source,
@@ -291,27 +427,27 @@ class TraceWriter : public IRSink {
   virtual void updateContent(const IRSource& source,
                              const std::shared_ptr<Command>& command,
                              Ref::ID ref,
-                             std::shared_ptr<ContentVersion> version) noexcept override;
+                             const std::shared_ptr<ContentVersion>& version) noexcept override;
 
   /// Handle an AddEntry IR step
   virtual void addEntry(const IRSource& source,
                         const std::shared_ptr<Command>& command,
                         Ref::ID dir,
-                        std::string name,
+                        const std::string& name,
                         Ref::ID target) noexcept override;
 
   /// Handle a RemoveEntry IR step
   virtual void removeEntry(const IRSource& source,
                            const std::shared_ptr<Command>& command,
                            Ref::ID dir,
-                           std::string name,
+                           const std::string& name,
                            Ref::ID target) noexcept override;
 
   /// Handle a Launch IR step
   virtual void launch(const IRSource& source,
                       const std::shared_ptr<Command>& command,
                       const std::shared_ptr<Command>& child,
-                      std::list<std::tuple<Ref::ID, Ref::ID>> refs) noexcept override;
+                      const std::list<std::tuple<Ref::ID, Ref::ID>>& refs) noexcept override;
 
   /// Handle a Join IR step
   virtual void join(const IRSource& source,
@@ -333,10 +469,13 @@ class TraceWriter : public IRSink {
   template <typename T, typename... Args>
   void emitValue(Args... args) noexcept;
 
-  /// Emit an array to the trace
+  /// Emit an array of raw bytes to the trace
   template <typename T>
   void emitArray(T* src, size_t count) noexcept;
 
+  /// Encodes the fields of records and values into the trace (defined in Trace.cc)
+  class Encoder;
+
   /// Get the ID of a command, possibly writing it to the output if it is new
   Command::ID getCommandID(const std::shared_ptr<Command>& command) noexcept;
 
@@ -367,30 +506,33 @@ class TraceWriter : public IRSink {
   /// Emit a special version to the trace
   void emitSpecialVersion(const std::shared_ptr<SpecialVersion>& v) noexcept;
 
-  /// Set the current command
+  /// Set the current command, beginning a new segment if the command changes
   void setCommand(std::shared_ptr<Command> c) noexcept;
 
+  /// Finish the current segment. If it matches a segment from the base trace, reuse that segment
+  /// and discard the newly written copy.
+  void endSegment() noexcept;
+
+  /// Note that a definition record was written starting at a given offset
+  void addDefinition(size_t start) noexcept;
+
+  /// Check if the definition record written at start matches the definition with a given ID in
+  /// the base trace. If so, the new record is discarded and this returns true.
+  bool reuseDefinition(size_t start, std::vector<size_t>& offsets, size_t id) noexcept;
+
   /// Emit a string record to the trace
   void emitString(const std::string& str) noexcept;
 
-  /// Emit a new string table record to the trace
-  void emitNewStrtab() noexcept;
-
-  /// Emit an end record to the trace
-  void emitEnd() noexcept;
+  /// Emit a path record to the trace
+  void emitPath(PathID parent, StringID component) noexcept;
 
-  /// Make sure there is space for at least n strings in the current string table. If there isn't
-  /// room in the current string table this will start a new one.
-  void reserveStrings(size_t n) noexcept;
+  /// Emit the index of definition records and segments, then point the header at it
+  void emitIndex() noexcept;
 
   /// Get the ID of a string, possibly writing it to the output if it is new
   StringID getStringID(const std::string& str) noexcept;
 
-  /// Make sure there is space for at least n paths in the current path table. If there isn't
-  /// room in the current path table this will start a new one.
-  void reservePaths(size_t n) noexcept;
-
-  /// Get the ID of a path, possibly writing it to the output if it is new
+  /// Get the ID of a path, possibly writing records for any of its prefixes that are new
   PathID getPathID(const fs::path& path) noexcept;
 
   /// Get the next ID for a TraceWriter
@@ -409,6 +551,12 @@ class TraceWriter : public IRSink {
   /// The filename where this trace should be saved, or nullopt if the trace is not saved
   std::optional<std::string> _path = std::nullopt;
 
+  /// Is this writer appending to an existing trace file?
+  bool _append = false;
+
+  /// The length of the trace file when this writer opened it
+  size_t _initial_length = 0;
+
   /// The file that holds data for this TraceWriter
   TraceFile _file;
 
@@ -421,6 +569,65 @@ class TraceWriter : public IRSink {
   /// The map from strings to their ID in the string table
   std::unordered_map<std::string, StringID> _strtab;
 
+  /// The map from a parent path ID and component string ID to the ID of the resulting path
+  std::unordered_map<uint64_t, PathID> _path_entries;
+
+  /// The map from full paths to their IDs, so repeated paths skip the walk over components
+  std::unordered_map<std::string, PathID> _path_ids;
+
+  /// The IDs of interned paths in the output trace, indexed by interned path ID. A zero entry has
+  /// not been looked up yet.
+  std::vector<PathID> _interned_path_ids;
+
   /// The current command
   std::shared_ptr<Command> _current_command;
+
+  /// The ID of the current command
+  Command::ID _current_command_id = 0;
+
+  /// The last ref created by each command, indexed by command ID. Ref IDs are delta-coded.
+  std::vector<Ref::ID> _last_refs = {0};
+
+  /// The offsets of the records that define each string, indexed by ID
+  std::vector<size_t> _string_offsets;
+
+  /// The offsets of the records that define each path, starting with path one
+  std::vector<size_t> _path_offsets;
+
+  /// The offsets of the records that define each command, indexed by ID
+  std::vector<size_t> _command_offsets;
+
+  /// The offsets of the records that define each content version, indexed by ID
+  std::vector<size_t> _version_offsets;
+
+  /// The segments of steps in the trace, in the order they are written
+  std::vector<TraceSegment> _segments;
+
+  /// Is a segment currently being written?
+  bool _in_segment = false;
+
+  /// The last ref created by the current segment's command when the segment began
+  Ref::ID _segment_ref = 0;
+
+  /// The definition records written inside the current segment, as start and end offsets
+  std::vector<std::pair<size_t, size_t>> _segment_definitions;
+
+  /// The ID of the command that launched each command, indexed by command ID
+  std::vector<Command::ID> _parents;
+
+  /// Were the steps that start and finish a build written to the trace?
+  bool _started = false;
+  bool _finished = false;
+
+  /// The commands loaded from the base trace, which keep their IDs if they have not changed
+  std::map<std::shared_ptr<Command>, Command::ID> _base_commands;
+
+  /// The content versions loaded from the base trace, which keep their IDs if they have not changed
+  std::map<std::shared_ptr<ContentVersion>, ContentVersion::ID> _base_versions;
+
+  /// The segments of the base trace for each command, indexed by command ID
+  std::vector<std::vector<TraceSegment>> _base_segments;
+
+  /// The number of segments written for each command, indexed by command ID
+  std::vector<size_t> _segment_counts;
 };
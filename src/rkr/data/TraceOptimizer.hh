@@ -0,0 +1,517 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "data/AccessFlags.hh"
+#include "data/IRSink.hh"
+#include "runtime/Command.hh"
+#include "runtime/Ref.hh"
+#include "versions/ContentVersion.hh"
+#include "versions/MetadataVersion.hh"
+
+/**
+ * This class removes redundant steps from a completed build trace before it is saved, so the next
+ * build has less of the trace to emulate. Unlike the ReadWriteCombiner, which only compares a step
+ * to the one immediately before it, the optimizer remembers what each command has already checked:
+ *
+ * - A path lookup that repeats an earlier failed lookup by the same command is dropped. Any later
+ *   steps that use the dropped reference use the earlier reference instead.
+ * - An ExpectResult, MatchMetadata, or MatchContent predicate is dropped if the command already
+ *   checked the same outcome through the same reference.
+ * - A UsingRef step that is immediately undone by a DoneWithRef step is dropped if the command
+ *   already holds the reference, since the pair cannot close anything.
+ * - A path lookup whose reference is never used is dropped. Lookups are held until a later step
+ *   uses their reference, and are emitted just before that step. A held lookup is dropped if its
+ *   reference is redefined or its command exits first. All held lookups are emitted before any
+ *   step that could change the filesystem, so every lookup resolves against the same state.
+ *
+ * Lookups and metadata or content predicates are only reused until the next step that could change
+ * the filesystem: a write, a directory entry change, a lookup that creates or truncates a file, or
+ * a launch or join that could start or wait for a command that is running for real.
+ *
+ * The TraceOptimizer class expects a template parameter that is an IRSink, which will receive the
+ * trace steps that are not removed.
+ */
+template <class Next>
+class TraceOptimizer : public Next {
+ public:
+  /// The constructor for a trace optimizer passes any arguments along to the next layer
+  template <typename... Args>
+  TraceOptimizer(Args&&... args) noexcept : Next(std::forward<Args>(args)...) {}
+
+  /// Emit any held step when the trace is finished. Lookups still held at this point are dead.
+  virtual void finish() noexcept override {
+    flushUsingRef();
+    for (auto& [command, state] : _states) {
+      state.pending.clear();
+    }
+    _pending.clear();
+    Next::finish();
+  }
+
+  /// Handle a SpecialRef IR step
+  virtual void specialRef(const IRSource& source,
+                          const std::shared_ptr<Command>& command,
+                          SpecialRef entity,
+                          Ref::ID output) noexcept override {
+    flushUsingRef();
+    defineRef(getState(command), output);
+    Next::specialRef(source, command, entity, output);
+  }
+
+  /// Handle a PipeRef IR step
+  virtual void pipeRef(const IRSource& source,
+                       const std::shared_ptr<Command>& command,
+                       Ref::ID read_end,
+                       Ref::ID write_end) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    defineRef(state, read_end);
+    defineRef(state, write_end);
+    Next::pipeRef(source, command, read_end, write_end);
+  }
+
+  /// Handle a FileRef IR step
+  virtual void fileRef(const IRSource& source,
+                       const std::shared_ptr<Command>& command,
+                       mode_t mode,
+                       Ref::ID output) noexcept override {
+    flushUsingRef();
+    defineRef(getState(command), output);
+    Next::fileRef(source, command, mode, output);
+  }
+
+  /// Handle a SymlinkRef IR step
+  virtual void symlinkRef(const IRSource& source,
+                          const std::shared_ptr<Command>& command,
+                          const fs::path& target,
+                          Ref::ID output) noexcept override {
+    flushUsingRef();
+    defineRef(getState(command), output);
+    Next::symlinkRef(source, command, target, output);
+  }
+
+  /// Handle a DirRef IR step
+  virtual void dirRef(const IRSource& source,
+                      const std::shared_ptr<Command>& command,
+                      mode_t mode,
+                      Ref::ID output) noexcept override {
+    flushUsingRef();
+    defineRef(getState(command), output);
+    Next::dirRef(source, command, mode, output);
+  }
+
+  /// Handle a PathRef IR step
+  virtual void pathRef(const IRSource& source,
+                       const std::shared_ptr<Command>& command,
+                       Ref::ID base,
+                       InternedPath path,
+                       AccessFlags flags,
+                       Ref::ID output) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    base = useRef(state, base);
+    defineRef(state, output);
+
+    // A lookup that can create or truncate a file changes the filesystem, so it is never reused
+    if (flags.create || flags.exclusive || flags.truncate) {
+      flushPending();
+      Next::pathRef(source, command, base, path, flags, output);
+      _generation++;
+      return;
+    }
+
+    // Has this command already made the same lookup?
+    auto key = std::make_tuple(base, getFlagsKey(flags), path.getID());
+    auto iter = state.lookups.find(key);
+    if (iter != state.lookups.end()) {
+      // Yes. If the lookup failed, it has no artifact that could be opened, so later steps can use
+      // the earlier reference in place of this one without changing when anything is closed.
+      auto earlier = iter->second;
+      if (earlier < state.failed.size() && state.failed[earlier]) {
+        state.aliases[output] = earlier;
+        return;
+      }
+
+    } else if (output >= Ref::ReservedRefs) {
+      // No. Remember the lookup. Lookups never write their output to a reserved reference, and
+      // commands allocate a new ID for every other reference, so this reference stays valid.
+      state.lookups.emplace(key, output);
+    }
+
+    // Hold the lookup until a later step uses its reference
+    state.pending.emplace(output, _pending.size());
+    _pending.push_back(PendingLookup{source.isExecuting(), command, base, path, flags, output});
+  }
+
+  /// Handle a UsingRef IR step
+  virtual void usingRef(const IRSource& source,
+                        const std::shared_ptr<Command>& command,
+                        Ref::ID ref) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    ref = useRef(state, ref);
+
+    // If the command already holds this reference, hold the step in case it is undone right away
+    if (state.uses[ref]++ > 0) {
+      _held_executing = source.isExecuting();
+      _held_command = command;
+      _held_ref = ref;
+      return;
+    }
+
+    Next::usingRef(source, command, ref);
+  }
+
+  /// Handle a DoneWithRef IR step
+  virtual void doneWithRef(const IRSource& source,
+                           const std::shared_ptr<Command>& command,
+                           Ref::ID ref) noexcept override {
+    auto& state = getState(command);
+    ref = useRef(state, ref);
+
+    // Does this step undo a held UsingRef step? If so, drop both
+    if (_held_command == command && _held_ref == ref) {
+      _held_command.reset();
+      state.uses[ref]--;
+      return;
+    }
+
+    flushUsingRef();
+    if (state.uses[ref] > 0) state.uses[ref]--;
+    Next::doneWithRef(source, command, ref);
+  }
+
+  /// Handle a CompareRefs IR step
+  virtual void compareRefs(const IRSource& source,
+                           const std::shared_ptr<Command>& command,
+                           Ref::ID ref1,
+                           Ref::ID ref2,
+                           RefComparison type) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    ref1 = useRef(state, ref1);
+    ref2 = useRef(state, ref2);
+    Next::compareRefs(source, command, ref1, ref2, type);
+  }
+
+  /// Handle an ExpectResult IR step
+  virtual void expectResult(const IRSource& source,
+                            const std::shared_ptr<Command>& command,
+                            Scenario scenario,
+                            Ref::ID ref,
+                            int8_t expected) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    ref = useRef(state, ref);
+
+    // A reference's result does not change once it is resolved, so each result is checked once
+    if (!state.results.emplace(ref, scenario, expected).second) return;
+
+    // Remember references that failed to resolve during the build
+    if ((scenario & Scenario::Build) && expected != SUCCESS) {
+      if (state.failed.size() <= ref) state.failed.resize(ref + 1);
+      state.failed[ref] = true;
+    }
+
+    Next::expectResult(source, command, scenario, ref, expected);
+  }
+
+  /// Handle a MatchMetadata IR step
+  virtual void matchMetadata(const IRSource& source,
+                             const std::shared_ptr<Command>& command,
+                             Scenario scenario,
+                             Ref::ID ref,
+                             MetadataVersion version) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    ref = useRef(state, ref);
+
+    // Skip the predicate if the command already matched this metadata since the last write
+    auto iter = state.metadata.find({ref, scenario});
+    if (iter != state.metadata.end() && iter->second.matches(version)) return;
+    state.metadata.insert_or_assign({ref, scenario}, version);
+
+    Next::matchMetadata(source, command, scenario, ref, version);
+  }
+
+  /// Handle a MatchContent IR step
+  virtual void matchContent(const IRSource& source,
+                            const std::shared_ptr<Command>& command,
+                            Scenario scenario,
+                            Ref::ID ref,
+                            const std::shared_ptr<ContentVersion>& version) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    ref = useRef(state, ref);
+
+    // Skip the predicate if the command already matched this content since the last write
+    auto& last = state.content[{ref, scenario}];
+    if (last == version) return;
+    last = version;
+
+    Next::matchContent(source, command, scenario, ref, version);
+  }
+
+  /// Handle an UpdateMetadata IR step
+  virtual void updateMetadata(const IRSource& source,
+                              const std::shared_ptr<Command>& command,
+                              Ref::ID ref,
+                              MetadataVersion version) noexcept override {
+    flushUsingRef();
+    ref = useRef(getState(command), ref);
+    flushPending();
+    Next::updateMetadata(source, command, ref, version);
+    _generation++;
+  }
+
+  /// Handle an UpdateContent IR step
+  virtual void updateContent(const IRSource& source,
+                             const std::shared_ptr<Command>& command,
+                             Ref::ID ref,
+                             const std::shared_ptr<ContentVersion>& version) noexcept override {
+    flushUsingRef();
+    ref = useRef(getState(command), ref);
+    flushPending();
+    Next::updateContent(source, command, ref, version);
+    _generation++;
+  }
+
+  /// Handle an AddEntry IR step
+  virtual void addEntry(const IRSource& source,
+                        const std::shared_ptr<Command>& command,
+                        Ref::ID dir,
+                        const std::string& name,
+                        Ref::ID target) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    dir = useRef(state, dir);
+    target = useRef(state, target);
+    flushPending();
+    Next::addEntry(source, command, dir, name, target);
+    _generation++;
+  }
+
+  /// Handle a RemoveEntry IR step
+  virtual void removeEntry(const IRSource& source,
+                           const std::shared_ptr<Command>& command,
+                           Ref::ID dir,
+                           const std::string& name,
+                           Ref::ID target) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    dir = useRef(state, dir);
+    target = useRef(state, target);
+    flushPending();
+    Next::removeEntry(source, command, dir, name, target);
+    _generation++;
+  }
+
+  /// Handle a Launch IR step
+  virtual void launch(const IRSource& source,
+                      const std::shared_ptr<Command>& command,
+                      const std::shared_ptr<Command>& child,
+                      const std::list<std::tuple<Ref::ID, Ref::ID>>& refs) noexcept override {
+    flushUsingRef();
+    auto& state = getState(command);
+    auto& child_state = getState(child);
+
+    // Replace any dropped references passed to the child
+    std::list<std::tuple<Ref::ID, Ref::ID>> child_refs;
+    for (auto [parent_ref, child_ref] : refs) {
+      child_refs.emplace_back(useRef(state, parent_ref), child_ref);
+      defineRef(child_state, child_ref);
+    }
+
+    flushPending();
+    Next::launch(source, command, child, child_refs);
+    _generation++;
+  }
+
+  /// Handle a Join IR step
+  virtual void join(const IRSource& source,
+                    const std::shared_ptr<Command>& command,
+                    const std::shared_ptr<Command>& child,
+                    int exit_status) noexcept override {
+    flushUsingRef();
+    flushPending();
+    Next::join(source, command, child, exit_status);
+    _generation++;
+  }
+
+  /// Handle an Exit IR step
+  virtual void exit(const IRSource& source,
+                    const std::shared_ptr<Command>& command,
+                    int exit_status) noexcept override {
+    flushUsingRef();
+
+    // Any lookups the command made but never used are dead
+    auto& state = getState(command);
+    for (auto [ref, index] : state.pending) {
+      _pending[index].command.reset();
+    }
+    state.pending.clear();
+
+    Next::exit(source, command, exit_status);
+  }
+
+ private:
+  /// The steps each command has already made that later steps may be able to reuse
+  struct CommandState {
+    /// Dropped references, mapped to the earlier references that replace them
+    std::unordered_map<Ref::ID, Ref::ID> aliases;
+
+    /// The number of times this command is using each reference
+    std::unordered_map<Ref::ID, size_t> uses;
+
+    /// References defined by held lookups, mapped to the lookup's index in the pending list
+    std::unordered_map<Ref::ID, size_t> pending;
+
+    /// The results this command has checked for each reference and scenario
+    std::set<std::tuple<Ref::ID, Scenario, int8_t>> results;
+
+    /// Which references failed to resolve during the build?
+    std::vector<bool> failed;
+
+    /// Lookups by base reference, flags, and path, mapped to the reference they produced
+    std::map<std::tuple<Ref::ID, uint64_t, InternedPath::ID>, Ref::ID> lookups;
+
+    /// The metadata this command has matched for each reference and scenario
+    std::map<std::pair<Ref::ID, Scenario>, MetadataVersion> metadata;
+
+    /// The content this command has matched for each reference and scenario
+    std::map<std::pair<Ref::ID, Scenario>, std::shared_ptr<ContentVersion>> content;
+
+    /// The generation the lookups and matched versions were recorded in
+    size_t generation = 0;
+  };
+
+  /// Get the state for a command, discarding anything that may have changed since it was recorded
+  CommandState& getState(const std::shared_ptr<Command>& command) noexcept {
+    auto& state = _states[command.get()];
+    if (state.generation != _generation) {
+      state.lookups.clear();
+      state.metadata.clear();
+      state.content.clear();
+      state.generation = _generation;
+    }
+    return state;
+  }
+
+  /// Get the reference that a command's steps should use in place of a given reference
+  Ref::ID getRef(const CommandState& state, Ref::ID ref) const noexcept {
+    auto iter = state.aliases.find(ref);
+    return iter == state.aliases.end() ? ref : iter->second;
+  }
+
+  /// A step uses a reference. Emit the lookup that defines it if the lookup is still held.
+  Ref::ID useRef(CommandState& state, Ref::ID ref) noexcept {
+    ref = getRef(state, ref);
+
+    auto iter = state.pending.find(ref);
+    if (iter != state.pending.end()) {
+      auto& lookup = _pending[iter->second];
+      state.pending.erase(iter);
+      Next::pathRef(getSource(lookup.executing), lookup.command, lookup.base, lookup.path,
+                    lookup.flags, lookup.output);
+      lookup.command.reset();
+    }
+
+    return ref;
+  }
+
+  /// Emit every held lookup, in order, before a step that could change what they resolve to
+  void flushPending() noexcept {
+    for (auto& lookup : _pending) {
+      if (!lookup.command) continue;
+      _states[lookup.command.get()].pending.erase(lookup.output);
+      Next::pathRef(getSource(lookup.executing), lookup.command, lookup.base, lookup.path,
+                    lookup.flags, lookup.output);
+    }
+    _pending.clear();
+  }
+
+  /// A step assigns a new value to a reference, so forget anything known about its old value
+  void defineRef(CommandState& state, Ref::ID ref) noexcept {
+    // If a held lookup defined the reference, nothing used it. Drop the lookup.
+    if (auto iter = state.pending.find(ref); iter != state.pending.end()) {
+      _pending[iter->second].command.reset();
+      state.pending.erase(iter);
+    }
+
+    state.aliases.erase(ref);
+    state.uses.erase(ref);
+    if (ref < state.failed.size()) state.failed[ref] = false;
+
+    state.results.erase(state.results.lower_bound({ref, Scenario::None, INT8_MIN}),
+                        state.results.upper_bound({ref, Scenario::Both, INT8_MAX}));
+
+    for (auto scenario : {Scenario::Build, Scenario::PostBuild, Scenario::Both}) {
+      state.metadata.erase({ref, scenario});
+      state.content.erase({ref, scenario});
+    }
+  }
+
+  /// Pack the fields of an access that affect its result into a single value
+  static uint64_t getFlagsKey(AccessFlags flags) noexcept {
+    return static_cast<uint64_t>(flags._data) |
+           static_cast<uint64_t>(flags.type.getResult(ArtifactType::File) & 0xFF) << 16 |
+           static_cast<uint64_t>(flags.type.getResult(ArtifactType::Symlink) & 0xFF) << 24 |
+           static_cast<uint64_t>(flags.type.getResult(ArtifactType::Dir) & 0xFF) << 32 |
+           static_cast<uint64_t>(flags.mode) << 40;
+  }
+
+  /// Emit a held UsingRef step, if there is one
+  void flushUsingRef() noexcept {
+    if (_held_command) {
+      Next::usingRef(getSource(_held_executing), _held_command, _held_ref);
+      _held_command.reset();
+    }
+  }
+
+  /// Get a source to send a held step with. Sinks only borrow a step's source for the duration of
+  /// the call, so held steps keep whether their source was executing and use a static source.
+  static const IRSource& getSource(bool executing) noexcept {
+    static const TracedIRSource traced;
+    static const SavedIRSource saved;
+    if (executing) return traced;
+    return saved;
+  }
+
+  /// A lookup that is held until a later step uses the reference it defines
+  struct PendingLookup {
+    bool executing;
+    std::shared_ptr<Command> command;  // Reset once the lookup is emitted or dropped
+    Ref::ID base;
+    InternedPath path;
+    AccessFlags flags;
+    Ref::ID output;
+  };
+
+  /// The state for each command in the trace
+  std::unordered_map<Command*, CommandState> _states;
+
+  /// Lookups held since the last step that could change the filesystem, in trace order
+  std::vector<PendingLookup> _pending;
+
+  /// The generation counter advances at every step that could change the filesystem
+  size_t _generation = 0;
+
+  /// Was the source of a held UsingRef step executing?
+  bool _held_executing = false;
+
+  /// The command for a held UsingRef step, or nullptr if no step is held
+  std::shared_ptr<Command> _held_command;
+
+  /// The reference for a held UsingRef step
+  Ref::ID _held_ref = 0;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+class Artifact;
+
+/**
+ * An ArtifactRegistry tracks every artifact created during a build without keeping any of them
+ * alive. Artifacts are stored in a slab of slots. When an artifact is destroyed its slot is
+ * reclaimed by a later sweep and reused, so the registry grows with the number of live artifacts
+ * rather than the number of artifacts ever created.
+ *
+ * Artifacts that represent an inode on the filesystem can also be found by device and inode
+ * number through a hash index. Index entries refer to a slot and the slot's generation, which is
+ * bumped each time the slot is reclaimed, so a stale index entry never finds a reused slot.
+ */
+class ArtifactRegistry {
+ public:
+  /// Add an artifact to the registry
+  void add(const std::shared_ptr<Artifact>& a) noexcept { allocate(a); }
+
+  /// Add an artifact that represents an inode on the filesystem to the registry
+  void add(dev_t dev, ino_t ino, const std::shared_ptr<Artifact>& a) noexcept {
+    _inodes[{dev, ino}] = allocate(a);
+  }
+
+  /// Find the artifact for an inode, or return nullptr if there is no live artifact for it
+  std::shared_ptr<Artifact> find(dev_t dev, ino_t ino) noexcept {
+    auto iter = _inodes.find({dev, ino});
+    if (iter == _inodes.end()) return nullptr;
+
+    auto a = get(iter->second);
+    if (!a) _inodes.erase(iter);
+    return a;
+  }
+
+  /// Call a function with each live artifact in the registry
+  template <typename F>
+  void forEach(F f) const noexcept {
+    for (const auto& slot : _slots) {
+      if (auto a = slot.artifact.lock(); a) f(a);
+    }
+  }
+
+ private:
+  /// A handle refers to a slot, and is only valid while the slot has the same generation
+  struct Handle {
+    uint32_t index;
+    uint32_t generation;
+  };
+
+  /// Each slot holds a weak pointer to an artifact, or nothing if the slot is free
+  struct Slot {
+    std::weak_ptr<Artifact> artifact;
+    uint32_t generation = 0;
+  };
+
+  /// Hash a device and inode number pair
+  struct InodeHash {
+    size_t operator()(const std::pair<dev_t, ino_t>& key) const noexcept {
+      return std::hash<ino_t>()(key.second) ^ (std::hash<dev_t>()(key.first) * 0x9e3779b97f4a7c15);
+    }
+  };
+
+  /// Slots are not reclaimed until the slab reaches at least this size
+  static constexpr size_t MinSweepSize = 1024;
+
+  /// Get the artifact a handle refers to, or nullptr if the artifact or its slot is gone
+  std::shared_ptr<Artifact> get(Handle h) const noexcept {
+    const auto& slot = _slots[h.index];
+    if (slot.generation != h.generation) return nullptr;
+    return slot.artifact.lock();
+  }
+
+  /// Store an artifact in a free slot, reclaiming dead slots first if the slab is full
+  Handle allocate(const std::shared_ptr<Artifact>& a) noexcept {
+    if (_free.empty() && _slots.size() >= _sweep_size) sweep();
+
+    uint32_t index;
+    if (!_free.empty()) {
+      index = _free.back();
+      _free.pop_back();
+    } else {
+      index = _slots.size();
+      _slots.emplace_back();
+    }
+
+    _slots[index].artifact = a;
+    return Handle{index, _slots[index].generation};
+  }
+
+  /// Reclaim the slots of artifacts that have been destroyed, and drop their index entries
+  void sweep() noexcept {
+    size_t live = 0;
+    for (uint32_t index = 0; index < _slots.size(); index++) {
+      auto& slot = _slots[index];
+      if (slot.artifact.expired()) {
+        // Releasing the weak pointer also frees the memory of an artifact made with make_shared
+        slot.artifact.reset();
+        slot.generation++;
+        _free.push_back(index);
+      } else {
+        live++;
+      }
+    }
+
+    for (auto iter = _inodes.begin(); iter != _inodes.end();) {
+      if (_slots[iter->second.index].generation != iter->second.generation) {
+        iter = _inodes.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+
+    // Sweep again once the slab has doubled, so the cost of sweeping is spread over allocations
+    _sweep_size = std::max(MinSweepSize, live * 2);
+  }
+
+  /// The slab of artifact slots
+  std::vector<Slot> _slots;
+
+  /// The indices of free slots
+  std::vector<uint32_t> _free;
+
+  /// The index of artifacts by device and inode number
+  std::unordered_map<std::pair<dev_t, ino_t>, Handle, InodeHash> _inodes;
+
+  /// The slab size that triggers the next sweep for dead artifacts
+  size_t _sweep_size = MinSweepSize;
+};
@@ -2,6 +2,7 @@
 
 #include <cstdio>
 #include <filesystem>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -26,6 +27,7 @@
 #include "util/TracePrinter.hh"
 #include "util/log.hh"
 #include "util/options.hh"
+#include "util/pool.hh"
 #include "util/stats.hh"
 #include "util/wrappers.hh"
 #include "versions/ContentVersion.hh"
@@ -34,6 +36,7 @@
 
 using std::cout;
 using std::endl;
+using std::function;
 using std::list;
 using std::make_shared;
 using std::make_unique;
@@ -50,15 +53,35 @@ namespace fs = std::filesystem;
 Build::Build(IRSink& output, std::ostream& print_to) noexcept :
     _output(output), _print_to(print_to) {}
 
-void Build::runDeferredSteps() noexcept {
-  // Create a TraceReader to emit deferred steps
-  auto input = _deferred_steps.getReader();
+// Defer an IR step from a command that has not been launched yet
+void Build::deferStep(const shared_ptr<Command>& c, function<void()> step) noexcept {
+  _deferred_commands.emplace(c);
+  _deferred_steps[c].emplace_back(_next_deferred_step++, std::move(step));
+}
 
-  // Create a new buffer to hold new deferred steps
-  _deferred_steps = TraceWriter();
+// Run the steps deferred for a command now that it has been launched
+void Build::runDeferredSteps(const shared_ptr<Command>& c) noexcept {
+  // Are there any steps queued for this command? If so, they are ready to run.
+  auto iter = _deferred_steps.find(c);
+  if (iter == _deferred_steps.end()) return;
+  for (auto& [index, step] : iter->second) {
+    _ready_steps.emplace(index, std::move(step));
+  }
+  _deferred_steps.erase(iter);
+
+  // Running a ready step may launch another command and release its steps. Those are run from the
+  // loop below, so every released step runs in the order it was deferred.
+  if (_running_deferred_steps) return;
+  _running_deferred_steps = true;
+
+  while (!_ready_steps.empty()) {
+    auto step = std::move(_ready_steps.begin()->second);
+    _ready_steps.erase(_ready_steps.begin());
+    stats::replayed_steps++;
+    step();
+  }
 
-  // Feed all deferred IR steps back through for emulation
-  input.sendTo(*this);
+  _running_deferred_steps = false;
 }
 
 /// Start a build with the given root command
@@ -76,8 +99,8 @@ void Build::finish() noexcept {
   // Wait for all remaining processes to exit
   _tracer.wait(*this);
 
-  // Compare the final state of all artifacts to the actual filesystem
-  env::getRootDir()->checkFinalState("/");
+  // Compare the final state of all artifacts that changed to the actual filesystem
+  env::checkFinalState();
 
   // Finish the run of the root command and all descendants (recursively)
   _root_command->finishRun();
@@ -101,8 +124,7 @@ void Build::specialRef(const IRSource& source,
 
   // If this step comes from a command that hasn't been launched, we need to defer this step
   if (!c->isLaunched()) {
-    _deferred_commands.emplace(c);
-    _deferred_steps.specialRef(source, c, entity, output);
+    deferStep(c, [=] { specialRef(_deferred_source, c, entity, output); });
     return;
   }
 
@@ -119,28 +141,28 @@ void Build::specialRef(const IRSource& source,
   if (entity == SpecialRef::stdin) {
     // Create the stdin ref. Add one user, which accounts for the build tool itself
     // That way we won't close stdin when the build is finishing
-    auto stdin_ref = make_shared<Ref>(ReadAccess, env::getStdin(c));
+    auto stdin_ref = make_pooled<Ref>(ReadAccess, env::getStdin(c));
     stdin_ref->addUser();
     c->setRef(output, stdin_ref);
 
   } else if (entity == SpecialRef::stdout) {
     // Create the stdout ref and add one user (the build tool)
-    auto stdout_ref = make_shared<Ref>(WriteAccess, env::getStdout(c));
+    auto stdout_ref = make_pooled<Ref>(WriteAccess, env::getStdout(c));
     stdout_ref->addUser();
     c->setRef(output, stdout_ref);
 
   } else if (entity == SpecialRef::stderr) {
     // Create the stderr ref and add one user (the build tool)
-    auto stderr_ref = make_shared<Ref>(WriteAccess, env::getStderr(c));
+    auto stderr_ref = make_pooled<Ref>(WriteAccess, env::getStderr(c));
     stderr_ref->addUser();
     c->setRef(output, stderr_ref);
 
   } else if (entity == SpecialRef::root) {
-    c->setRef(output, make_shared<Ref>(ReadAccess + ExecAccess, env::getRootDir()));
+    c->setRef(output, make_pooled<Ref>(ReadAccess + ExecAccess, env::getRootDir()));
 
   } else if (entity == SpecialRef::cwd) {
     auto cwd_path = fs::current_path().relative_path();
-    auto ref = make_shared<Ref>(env::getRootDir()->resolve(c, cwd_path, ReadAccess + ExecAccess));
+    auto ref = make_pooled<Ref>(env::getRootDir()->resolve(c, cwd_path, ReadAccess + ExecAccess));
     c->setRef(output, ref);
 
     ASSERT(ref->isSuccess()) << "Failed to resolve current working directory";
@@ -150,7 +172,7 @@ void Build::specialRef(const IRSource& source,
     auto rkr = readlink("/proc/self/exe");
     auto rkr_launch = (rkr.parent_path() / "rkr-launch").relative_path();
 
-    auto ref = make_shared<Ref>(env::getRootDir()->resolve(c, rkr_launch, ReadAccess + ExecAccess));
+    auto ref = make_pooled<Ref>(env::getRootDir()->resolve(c, rkr_launch, ReadAccess + ExecAccess));
     c->setRef(output, ref);
 
   } else {
@@ -179,8 +201,7 @@ void Build::pipeRef(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.pipeRef(source, c, read_end, write_end);
+      deferStep(c, [=] { pipeRef(_deferred_source, c, read_end, write_end); });
       return;
     }
   }
@@ -190,8 +211,8 @@ void Build::pipeRef(const IRSource& source,
 
   // Resolve the reference and save the result in output
   auto pipe = env::getPipe(c);
-  c->setRef(read_end, make_shared<Ref>(ReadAccess, pipe));
-  c->setRef(write_end, make_shared<Ref>(WriteAccess, pipe));
+  c->setRef(read_end, make_pooled<Ref>(ReadAccess, pipe));
+  c->setRef(write_end, make_pooled<Ref>(WriteAccess, pipe));
 }
 
 // A command references a new anonymous file
@@ -215,8 +236,7 @@ void Build::fileRef(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.fileRef(source, c, mode, output);
+      deferStep(c, [=] { fileRef(_deferred_source, c, mode, output); });
       return;
     }
   }
@@ -225,13 +245,13 @@ void Build::fileRef(const IRSource& source,
   _output.fileRef(source, c, mode, output);
 
   // Resolve the reference and save the result in output
-  c->setRef(output, make_shared<Ref>(ReadAccess + WriteAccess, env::createFile(c, mode)));
+  c->setRef(output, make_pooled<Ref>(ReadAccess + WriteAccess, env::createFile(c, mode)));
 }
 
 // A command references a new anonymous symlink
 void Build::symlinkRef(const IRSource& source,
                        const shared_ptr<Command>& c,
-                       fs::path target,
+                       const fs::path& target,
                        Ref::ID output) noexcept {
   // If the command must run but the step comes from a saved source, skip it
   if (c->mustRun() && !source.isExecuting()) return;
@@ -249,8 +269,7 @@ void Build::symlinkRef(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.symlinkRef(source, c, target, output);
+      deferStep(c, [=] { symlinkRef(_deferred_source, c, target, output); });
       return;
     }
   }
@@ -260,7 +279,7 @@ void Build::symlinkRef(const IRSource& source,
 
   // Resolve the reference and save the result in output
   c->setRef(output,
-            make_shared<Ref>(ReadAccess + WriteAccess + ExecAccess, env::getSymlink(c, target)));
+            make_pooled<Ref>(ReadAccess + WriteAccess + ExecAccess, env::getSymlink(c, target)));
 }
 
 // A command references a new anonymous directory
@@ -284,8 +303,7 @@ void Build::dirRef(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.dirRef(source, c, mode, output);
+      deferStep(c, [=] { dirRef(_deferred_source, c, mode, output); });
       return;
     }
   }
@@ -294,14 +312,14 @@ void Build::dirRef(const IRSource& source,
   _output.dirRef(source, c, mode, output);
 
   // Resolve the reference and save the result in output
-  c->setRef(output, make_shared<Ref>(ReadAccess + WriteAccess + ExecAccess, env::getDir(c, mode)));
+  c->setRef(output, make_pooled<Ref>(ReadAccess + WriteAccess + ExecAccess, env::getDir(c, mode)));
 }
 
 // A command makes a reference with a path
 void Build::pathRef(const IRSource& source,
                     const shared_ptr<Command>& c,
                     Ref::ID base,
-                    fs::path path,
+                    InternedPath path,
                     AccessFlags flags,
                     Ref::ID output) noexcept {
   // If the command must run but the step comes from a saved source, skip it
@@ -320,8 +338,7 @@ void Build::pathRef(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.pathRef(source, c, base, path, flags, output);
+      deferStep(c, [=] { pathRef(_deferred_source, c, base, path, flags, output); });
       return;
     }
   }
@@ -330,17 +347,17 @@ void Build::pathRef(const IRSource& source,
   auto base_dir = c->getRef(base)->getArtifact();
 
   // Is this a path to a temporary file?
-  bool is_tempfile = false;
-  if (base_dir == env::getRootDir() && path.string().substr(0, 4) == "tmp/") {
-    is_tempfile = true;
+  bool is_tempfile =
+      base_dir == env::getRootDir() && path.getPath().native().compare(0, 4, "tmp/") == 0;
 
-    // The command may be running different temporary file paths. Substitute the path now
-    string newpath = c->substitutePath("/" + path.string());
-    path = fs::path(newpath.substr(1));
+  // The command may be running different temporary file paths. Substitute the path now
+  auto ref_path = path;
+  if (is_tempfile) {
+    ref_path = InternedPath::intern(c->substitutePath("/" + path.getPath().string()).substr(1));
   }
 
   // Create an IR step and add it to the output trace
-  _output.pathRef(source, c, base, path, flags, output);
+  _output.pathRef(source, c, base, ref_path, flags, output);
 
   // Is the base directory available?
   if (!base_dir) {
@@ -349,7 +366,7 @@ void Build::pathRef(const IRSource& source,
   }
 
   // Resolve the reference
-  shared_ptr<Ref> result = make_shared<Ref>(base_dir->resolve(c, path, flags));
+  shared_ptr<Ref> result = make_pooled<Ref>(base_dir->resolve(c, ref_path, flags));
 
   // If this reference was to a temporary file, inform the command
   if (result->isSuccess() && is_tempfile) c->addTempfile(result->getArtifact());
@@ -376,8 +393,7 @@ void Build::usingRef(const IRSource& source, const shared_ptr<Command>& c, Ref::
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.usingRef(source, c, ref);
+      deferStep(c, [=] { usingRef(_deferred_source, c, ref); });
       return;
     }
   }
@@ -409,8 +425,7 @@ void Build::doneWithRef(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.doneWithRef(source, c, ref_id);
+      deferStep(c, [=] { doneWithRef(_deferred_source, c, ref_id); });
       return;
     }
   }
@@ -453,8 +468,7 @@ void Build::compareRefs(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.compareRefs(source, c, ref1_id, ref2_id, type);
+      deferStep(c, [=] { compareRefs(_deferred_source, c, ref1_id, ref2_id, type); });
       return;
     }
   }
@@ -508,8 +522,7 @@ void Build::expectResult(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.expectResult(source, c, scenario, ref_id, expected);
+      deferStep(c, [=] { expectResult(_deferred_source, c, scenario, ref_id, expected); });
       return;
     }
   }
@@ -557,8 +570,7 @@ void Build::matchMetadata(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.matchMetadata(source, c, scenario, ref_id, expected);
+      deferStep(c, [=] { matchMetadata(_deferred_source, c, scenario, ref_id, expected); });
       return;
     }
   }
@@ -589,7 +601,7 @@ void Build::matchContent(const IRSource& source,
                          const shared_ptr<Command>& c,
                          Scenario scenario,
                          Ref::ID ref_id,
-                         shared_ptr<ContentVersion> expected) noexcept {
+                         const shared_ptr<ContentVersion>& expected) noexcept {
   // If the command must run but the step comes from a saved source, skip it
   if (c->mustRun() && !source.isExecuting()) return;
 
@@ -606,8 +618,7 @@ void Build::matchContent(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.matchContent(source, c, scenario, ref_id, expected);
+      deferStep(c, [=] { matchContent(_deferred_source, c, scenario, ref_id, expected); });
       return;
     }
   }
@@ -648,8 +659,7 @@ void Build::updateMetadata(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.updateMetadata(source, c, ref_id, written);
+      deferStep(c, [=] { updateMetadata(_deferred_source, c, ref_id, written); });
       return;
     }
   }
@@ -682,7 +692,7 @@ void Build::updateMetadata(const IRSource& source,
 void Build::updateContent(const IRSource& source,
                           const shared_ptr<Command>& c,
                           Ref::ID ref_id,
-                          shared_ptr<ContentVersion> written) noexcept {
+                          const shared_ptr<ContentVersion>& written) noexcept {
   // If the command must run but the step comes from a saved source, skip it
   if (c->mustRun() && !source.isExecuting()) return;
 
@@ -699,8 +709,7 @@ void Build::updateContent(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.updateContent(source, c, ref_id, written);
+      deferStep(c, [=] { updateContent(_deferred_source, c, ref_id, written); });
       return;
     }
   }
@@ -733,7 +742,7 @@ void Build::updateContent(const IRSource& source,
 void Build::addEntry(const IRSource& source,
                      const shared_ptr<Command>& c,
                      Ref::ID dir_id,
-                     string name,
+                     const string& name,
                      Ref::ID target_id) noexcept {
   // If the command must run but the step comes from a saved source, skip it
   if (c->mustRun() && !source.isExecuting()) return;
@@ -751,8 +760,7 @@ void Build::addEntry(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.addEntry(source, c, dir_id, name, target_id);
+      deferStep(c, [=] { addEntry(_deferred_source, c, dir_id, name, target_id); });
       return;
     }
   }
@@ -761,6 +769,9 @@ void Build::addEntry(const IRSource& source,
   auto dir = c->getRef(dir_id);
   auto target = c->getRef(target_id);
 
+  // The entry name may be changed by path substitution below
+  string entry_name = name;
+
   // Did both references resolve?
   if (dir->isResolved() && target->isResolved()) {
     // Is this adding an entry in /tmp/? If so, do path substitution
@@ -771,11 +782,11 @@ void Build::addEntry(const IRSource& source,
       if (newname != name) {
         LOG(exec) << "Replaced " << name << " with " << newname;
       }
-      name = newname;
+      entry_name = newname;
     }
 
     // Yes. Add the entry to the directory
-    dir->getArtifact()->addEntry(c, name, target->getArtifact());
+    dir->getArtifact()->addEntry(c, entry_name, target->getArtifact());
 
   } else {
     // No. Are we emulating or tracing?
@@ -791,14 +802,14 @@ void Build::addEntry(const IRSource& source,
   }
 
   // Create an IR step and add it to the output trace
-  _output.addEntry(source, c, dir_id, name, target_id);
+  _output.addEntry(source, c, dir_id, entry_name, target_id);
 }
 
 // Command c removes an entry from a directory
 void Build::removeEntry(const IRSource& source,
                         const shared_ptr<Command>& c,
                         Ref::ID dir_id,
-                        string name,
+                        const string& name,
                         Ref::ID target_id) noexcept {
   // If the command must run but the step comes from a saved source, skip it
   if (c->mustRun() && !source.isExecuting()) return;
@@ -816,8 +827,7 @@ void Build::removeEntry(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.removeEntry(source, c, dir_id, name, target_id);
+      deferStep(c, [=] { removeEntry(_deferred_source, c, dir_id, name, target_id); });
       return;
     }
   }
@@ -826,6 +836,9 @@ void Build::removeEntry(const IRSource& source,
   auto dir = c->getRef(dir_id);
   auto target = c->getRef(target_id);
 
+  // The entry name may be changed by path substitution below
+  string entry_name = name;
+
   // Did both references resolve?
   if (dir->isResolved() && target->isResolved()) {
     // Is this removing an entry in /tmp/? If so, do path substitution
@@ -836,11 +849,11 @@ void Build::removeEntry(const IRSource& source,
       if (newname != name) {
         LOG(exec) << "Replaced " << name << " with " << newname;
       }
-      name = newname;
+      entry_name = newname;
     }
 
     // Yes. Remove the entry from the directory
-    dir->getArtifact()->removeEntry(c, name, target->getArtifact());
+    dir->getArtifact()->removeEntry(c, entry_name, target->getArtifact());
 
   } else {
     // No. Are we emulating or tracing?
@@ -856,14 +869,14 @@ void Build::removeEntry(const IRSource& source,
   }
 
   // Create an IR step and add it to the output trace
-  _output.removeEntry(source, c, dir_id, name, target_id);
+  _output.removeEntry(source, c, dir_id, entry_name, target_id);
 }
 
 // A parent command launches a child command
 void Build::launch(const IRSource& source,
                    const shared_ptr<Command>& parent,
                    const shared_ptr<Command>& child,
-                   list<tuple<Ref::ID, Ref::ID>> refs) noexcept {
+                   const list<tuple<Ref::ID, Ref::ID>>& refs) noexcept {
   // If the command must run but the step comes from a saved source, skip it
   if (parent->mustRun() && !source.isExecuting()) return;
 
@@ -880,8 +893,7 @@ void Build::launch(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!parent->isLaunched()) {
-      _deferred_commands.emplace(parent);
-      _deferred_steps.launch(source, parent, child, refs);
+      deferStep(parent, [=] { launch(_deferred_source, parent, child, refs); });
       return;
     }
   }
@@ -935,6 +947,9 @@ void Build::launch(const IRSource& source,
       // The child command is launched, and has no associated process
       child->setLaunched();
     }
+
+    // Run any steps the child issued before it was launched
+    runDeferredSteps(child);
   }
 
   // Print the command if requested
@@ -968,8 +983,7 @@ void Build::join(const IRSource& source,
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.join(source, c, child, exit_status);
+      deferStep(c, [=] { join(_deferred_source, c, child, exit_status); });
       return;
     }
   }
@@ -1012,8 +1026,7 @@ void Build::exit(const IRSource& source, const shared_ptr<Command>& c, int exit_
 
     // If this step comes from a command that hasn't been launched, we need to defer this step
     if (!c->isLaunched()) {
-      _deferred_commands.emplace(c);
-      _deferred_steps.exit(source, c, exit_status);
+      deferStep(c, [=] { exit(_deferred_source, c, exit_status); });
       return;
     }
   }
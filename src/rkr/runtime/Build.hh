@@ -1,6 +1,7 @@
 #pragma once
 
 #include <filesystem>
+#include <functional>
 #include <iostream>
 #include <list>
 #include <map>
@@ -9,6 +10,7 @@
 #include <set>
 #include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include <sys/types.h>
@@ -30,8 +32,11 @@ class Process;
 /**
  * A Build instance manages the execution of a build. This instance is responsible for setting up
  * the build environment, emulating or running each of the commands, and concluding the build.
+ *
+ * Build is final so steps sent from a TraceReader are dispatched statically. The output IRSink
+ * is the only virtual boundary a step crosses while a trace is replayed.
  */
-class Build : public IRSink {
+class Build final : public IRSink {
  public:
   /// Create a build runner
   Build(IRSink& output, std::ostream& print_to = std::cout) noexcept;
@@ -43,8 +48,9 @@ class Build : public IRSink {
   Build(const Build&) = delete;
   Build& operator=(const Build&) = delete;
 
-  /// Try to run any steps that were deferred because they came from commands that had not launched
-  void runDeferredSteps() noexcept;
+  /// Run any steps that were deferred because they came from a command that had not launched yet.
+  /// This should be called once the command is launched.
+  void runDeferredSteps(const std::shared_ptr<Command>& c) noexcept;
 
   /// Print information about this build
   std::ostream& print(std::ostream& o) const noexcept;
@@ -75,7 +81,7 @@ class Build : public IRSink {
   /// A command references a new anonymous symlink
   virtual void symlinkRef(const IRSource& source,
                           const std::shared_ptr<Command>& c,
-                          fs::path target,
+                          const fs::path& target,
                           Ref::ID output) noexcept override;
 
   /// A command references a new anonymous directory
@@ -88,7 +94,7 @@ class Build : public IRSink {
   virtual void pathRef(const IRSource& source,
                        const std::shared_ptr<Command>& c,
                        Ref::ID base,
-                       fs::path path,
+                       InternedPath path,
                        AccessFlags flags,
                        Ref::ID output) noexcept override;
 
@@ -128,7 +134,7 @@ class Build : public IRSink {
                             const std::shared_ptr<Command>& c,
                             Scenario scenario,
                             Ref::ID ref,
-                            std::shared_ptr<ContentVersion> expected) noexcept override;
+                            const std::shared_ptr<ContentVersion>& expected) noexcept override;
 
   /// A command modifies the metadata for an artifact
   virtual void updateMetadata(const IRSource& source,
@@ -140,27 +146,27 @@ class Build : public IRSink {
   virtual void updateContent(const IRSource& source,
                              const std::shared_ptr<Command>& c,
                              Ref::ID ref,
-                             std::shared_ptr<ContentVersion> written) noexcept override;
+                             const std::shared_ptr<ContentVersion>& written) noexcept override;
 
   /// A command adds an entry to a directory
   virtual void addEntry(const IRSource& source,
                         const std::shared_ptr<Command>& command,
                         Ref::ID dir,
-                        std::string name,
+                        const std::string& name,
                         Ref::ID target) noexcept override;
 
   /// A command removes an entry from a directory
   virtual void removeEntry(const IRSource& source,
                            const std::shared_ptr<Command>& command,
                            Ref::ID dir,
-                           std::string name,
+                           const std::string& name,
                            Ref::ID target) noexcept override;
 
   /// A parent command is launching a child command
   virtual void launch(const IRSource& source,
                       const std::shared_ptr<Command>& parent,
                       const std::shared_ptr<Command>& child,
-                      std::list<std::tuple<Ref::ID, Ref::ID>> refs) noexcept override;
+                      const std::list<std::tuple<Ref::ID, Ref::ID>>& refs) noexcept override;
 
   /// A command is joining with a child command
   virtual void join(const IRSource& source,
@@ -181,12 +187,30 @@ class Build : public IRSink {
                                        std::vector<std::string> args,
                                        const std::map<int, Ref::ID>& fds) noexcept;
 
+ private:
+  /// Defer an IR step from a command that has not been launched yet
+  void deferStep(const std::shared_ptr<Command>& c, std::function<void()> step) noexcept;
+
  private:
   /// Trace steps are sent to this trace handler, typically an OutputTrace
   IRSink& _output;
 
-  /// Deferred trace steps are placed in this buffer for later running
-  TraceWriter _deferred_steps;
+  /// Deferred trace steps are queued in order for each command until that command is launched.
+  /// Each step is numbered in the order it was deferred.
+  std::map<std::shared_ptr<Command>, std::list<std::pair<size_t, std::function<void()>>>>
+      _deferred_steps;
+
+  /// The number for the next deferred step
+  size_t _next_deferred_step = 0;
+
+  /// Steps from launched commands that are waiting to run, ordered by when they were deferred
+  std::map<size_t, std::function<void()>> _ready_steps;
+
+  /// Are ready steps being run right now?
+  bool _running_deferred_steps = false;
+
+  /// Deferred steps are replayed as if they came from a saved trace
+  SavedIRSource _deferred_source;
 
   /// The set of deferred commands
   std::set<std::shared_ptr<Command>> _deferred_commands;
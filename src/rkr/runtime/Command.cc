@@ -1,5 +1,6 @@
 #include "Command.hh"
 
+#include <algorithm>
 #include <filesystem>
 #include <list>
 #include <map>
@@ -7,6 +8,7 @@
 #include <optional>
 #include <set>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "artifacts/Artifact.hh"
@@ -38,11 +40,18 @@ map<string, size_t> argument_counts;
 /// Keep track of the total number of commands with arguments
 size_t command_count = 0;
 
+/// Every command created so far, indexed by its dense index. Destroyed commands are null.
+vector<Command*> commands_by_index;
+
 // Create a command
 Command::Command(vector<string> args) noexcept : _args(args) {
   // If this is a null command with no arguments, mark it as executed
   if (args.size() == 0) _executed = true;
 
+  // Assign the next dense index
+  _index = commands_by_index.size();
+  commands_by_index.push_back(this);
+
   command_count++;
 
   // Add each argument (other than the first) to the argument_counts map
@@ -53,7 +62,14 @@ Command::Command(vector<string> args) noexcept : _args(args) {
 
 // Destroy a command. The destructor has to be declared in the .cc file where we have a complete
 // definition of Run
-Command::~Command() noexcept = default;
+Command::~Command() noexcept {
+  commands_by_index[_index] = nullptr;
+}
+
+// Get a live command from its dense index
+Command* Command::getByIndex(Index index) noexcept {
+  return commands_by_index[index];
+}
 
 // Get a short, length-limited name for this command
 string Command::getShortName(size_t limit) const noexcept {
@@ -232,6 +248,34 @@ void Command::finishRun() noexcept {
   _previous_run = std::move(_current_run);
   _current_run = Command::Run();
 
+  // Sort and deduplicate the dependency edges added during the run
+  for (auto set : {&_previous_run._uses_output_from, &_previous_run._needs_output_from,
+                   &_previous_run._output_used_by, &_previous_run._output_needed_by}) {
+    std::sort(set->begin(), set->end());
+    set->erase(std::unique(set->begin(), set->end()), set->end());
+  }
+
+  // The set of recorded inputs is only needed while inputs are being added
+  _previous_run._input_versions = {};
+
+  // A command that writes an artifact many times records an output for every write. Keep only the
+  // final metadata and content versions for each artifact, so superseded versions can be freed and
+  // compacted out of artifact histories. Each entry a command adds to or removes from a directory
+  // is a separate output, so directory entries are kept per entry name. Outputs are walked from the
+  // end to find the final ones. When the whole version history is kept, so are all the outputs.
+  if (!options::keep_version_history) {
+    auto& outputs = _previous_run._outputs;
+    set<std::tuple<Artifact*, bool, optional<string>>> outputs_seen;
+    auto outputs_begin = std::remove_if(outputs.rbegin(), outputs.rend(), [&](const auto& output) {
+      const auto& [a, v] = output;
+      optional<string> entry;
+      if (auto dv = dynamic_cast<const DirVersion*>(v.get()); dv) entry = dv->getEntry();
+      return !outputs_seen.emplace(a.get(), v->template is_a<MetadataVersion>(), std::move(entry))
+                  .second;
+    });
+    outputs.erase(outputs.begin(), outputs_begin.base());
+  }
+
   // At the end of a build phase, all commands return to the Emulate marking
   _marking = RebuildMarking::Emulate;
 
@@ -332,10 +376,10 @@ bool Command::mark(RebuildMarking m) noexcept {
     _marking = RebuildMarking::MustRun;
 
     // Rule 3: For each command D that produces uncached input V to C: mark D as MustRun
-    for (const auto& weak_producer : _previous_run._needs_output_from) {
-      auto producer = weak_producer.lock();
+    for (auto index : _previous_run._needs_output_from) {
+      auto producer = getByIndex(index);
       if (producer->mark(RebuildMarking::MustRun)) {
-        LOGF(rebuild, "{} must run: {} requires output for its run", producer, *this);
+        LOGF(rebuild, "{} must run: {} requires output for its run", *producer, *this);
       }
     }
 
@@ -357,18 +401,18 @@ bool Command::mark(RebuildMarking m) noexcept {
     // not, mark D as MustRun.
 
     // Mark the MustRun commands first to avoid marking them a second time
-    for (const auto& weak_user : _previous_run._output_needed_by) {
-      auto user = weak_user.lock();
+    for (auto index : _previous_run._output_needed_by) {
+      auto user = getByIndex(index);
       if (user->mark(RebuildMarking::MustRun)) {
-        LOGF(rebuild, "{} must run: {} may change uncached input during its run", user, *this);
+        LOGF(rebuild, "{} must run: {} may change uncached input during its run", *user, *this);
       }
     }
 
     // Now do the MayRun markings
-    for (const auto& weak_user : _previous_run._output_used_by) {
-      auto user = weak_user.lock();
+    for (auto index : _previous_run._output_used_by) {
+      auto user = getByIndex(index);
       if (user->mark(RebuildMarking::MayRun)) {
-        LOGF(rebuild, "{} may run: {} may change input during its run", user, *this);
+        LOGF(rebuild, "{} may run: {} may change input during its run", *user, *this);
       }
     }
 
@@ -386,18 +430,18 @@ bool Command::mark(RebuildMarking m) noexcept {
     _marking = RebuildMarking::MayRun;
 
     // Rule 6: For each command D that produces uncached input V to C: mark D as MayRun.
-    for (const auto& weak_producer : _previous_run._needs_output_from) {
-      auto producer = weak_producer.lock();
+    for (auto index : _previous_run._needs_output_from) {
+      auto producer = getByIndex(index);
       if (producer->mark(RebuildMarking::MayRun)) {
-        LOGF(rebuild, "{} may run: {} will require output if it runs", producer, *this);
+        LOGF(rebuild, "{} may run: {} will require output if it runs", *producer, *this);
       }
     }
 
     // Rule 7: For each command D that consumes output V from C: mark D as MayRun
-    for (const auto& weak_user : _previous_run._output_used_by) {
-      auto user = weak_user.lock();
+    for (auto index : _previous_run._output_used_by) {
+      auto user = getByIndex(index);
       if (user->mark(RebuildMarking::MayRun)) {
-        LOGF(rebuild, "{} may run: {} may change input if it runs", user, *this);
+        LOGF(rebuild, "{} may run: {} may change input if it runs", *user, *this);
       }
     }
 
@@ -426,7 +470,7 @@ bool Command::mark(RebuildMarking m) noexcept {
 // Prepare this command to execute by creating dependencies and committing state
 void Command::createLaunchDependencies() noexcept {
   for (Ref::ID id = 0; id < _current_run._refs.size(); id++) {
-    const auto& ref = _current_run._refs[id];
+    const auto& ref = _current_run._refs[id].ref;
 
     // Is the ref assigned? If not, skip ahead
     if (!ref) continue;
@@ -463,6 +507,11 @@ void Command::setLaunched(shared_ptr<Process> p) noexcept {
   _current_run._process = p;
 }
 
+// Record that the latest run of this command wrote to a file
+void Command::setWroteFile() noexcept {
+  _current_run._wrote_file = true;
+}
+
 const shared_ptr<Process>& Command::getProcess() noexcept {
   return _current_run._process;
 }
@@ -511,8 +560,9 @@ void Command::addTempfile(shared_ptr<Artifact> tempfile) noexcept {
 const shared_ptr<Ref>& Command::getRef(Ref::ID id) noexcept {
   ASSERT(id >= 0 && id < _current_run._refs.size())
       << "Invalid reference ID " << id << " in " << this;
-  ASSERT(_current_run._refs[id]) << "Access to null reference ID " << id << " in " << this;
-  return _current_run._refs[id];
+  const auto& ref = _current_run._refs[id].ref;
+  ASSERT(ref) << "Access to null reference ID " << id << " in " << this;
+  return ref;
 }
 
 // Store a reference at a known index of this command's local reference table
@@ -523,17 +573,18 @@ void Command::setRef(Ref::ID id, shared_ptr<Ref> ref) noexcept {
   if (id >= _current_run._refs.size()) _current_run._refs.resize(id + 1);
 
   // Make sure the ref we're assigning to is null
-  ASSERT(!_current_run._refs[id]) << "Attempted to overwrite reference ID " << id << " in " << this;
+  ASSERT(!_current_run._refs[id].ref)
+      << "Attempted to overwrite reference ID " << id << " in " << this;
 
   // Save the ref
-  _current_run._refs[id] = ref;
+  _current_run._refs[id].ref = ref;
 }
 
 // Store a reference at the next available index of this command's local reference table
 Ref::ID Command::setRef(shared_ptr<Ref> ref) noexcept {
   Ref::ID id = nextRef();
   ASSERT(ref) << "Attempted to store null ref at ID " << id << " in " << this;
-  _current_run._refs[id] = ref;
+  _current_run._refs[id].ref = ref;
 
   return id;
 }
@@ -555,14 +606,12 @@ Ref::ID Command::nextRef() noexcept {
 // Return true if this is the first use by this command.
 bool Command::usingRef(Ref::ID id) noexcept {
   ASSERT(id >= 0 && id < _current_run._refs.size()) << "Invalid ref ID " << id << " in " << this;
-
-  // Expand the use count vector if necessary
-  if (_current_run._refs_use_count.size() <= id) _current_run._refs_use_count.resize(id + 1);
+  auto& entry = _current_run._refs[id];
 
   // Increment the ref count. Is this the first use of the ref?
-  if (_current_run._refs_use_count[id]++ == 0) {
+  if (entry.uses++ == 0) {
     // This was the first use. Increment the user count in the ref, and return true
-    _current_run._refs[id]->addUser();
+    entry.ref->addUser();
     return true;
   }
 
@@ -573,13 +622,13 @@ bool Command::usingRef(Ref::ID id) noexcept {
 // Return true if that was the last use by this command.
 bool Command::doneWithRef(Ref::ID id) noexcept {
   ASSERT(id >= 0 && id < _current_run._refs.size()) << "Invalid ref ID " << id << " in " << this;
-  ASSERT(id < _current_run._refs_use_count.size() && _current_run._refs_use_count[id] > 0)
-      << "Attempted to end an unknown use of ref r" << id << " in " << this;
+  auto& entry = _current_run._refs[id];
+  ASSERT(entry.uses > 0) << "Attempted to end an unknown use of ref r" << id << " in " << this;
 
   // Decrement the ref count. Was this the last use of the ref?
-  if (--_current_run._refs_use_count[id] == 0) {
+  if (--entry.uses == 0) {
     // This was the last use. Decrement the user count in the ref and return true
-    _current_run._refs[id]->removeUser();
+    entry.ref->removeUser();
     return true;
   }
 
@@ -611,7 +660,7 @@ void Command::inputChanged(shared_ptr<Artifact> artifact,
 void Command::addMetadataInput(shared_ptr<Artifact> a,
                                shared_ptr<MetadataVersion> v,
                                shared_ptr<Command> writer) noexcept {
-  if (options::track_inputs_outputs) _current_run._inputs.emplace_back(a, v, writer);
+  recordInput(a, v, writer);
 
   // If this command wrote the version there's no need to do any additional tracking
   if (writer.get() == this) return;
@@ -622,10 +671,10 @@ void Command::addMetadataInput(shared_ptr<Artifact> a,
   // If the version was created by another command, track the use of that command's output
   if (writer) {
     // This command uses output from writer
-    _current_run._uses_output_from.emplace(writer);
+    addEdge(_current_run._uses_output_from, writer);
 
     // Otherwise, add this command run to the creator's set of output users
-    writer->_current_run._output_used_by.emplace(shared_from_this());
+    writer->addEdge(writer->_current_run._output_used_by, shared_from_this());
   }
 }
 
@@ -633,7 +682,7 @@ void Command::addMetadataInput(shared_ptr<Artifact> a,
 void Command::addContentInput(shared_ptr<Artifact> a,
                               shared_ptr<ContentVersion> v,
                               shared_ptr<Command> writer) noexcept {
-  if (options::track_inputs_outputs) _current_run._inputs.emplace_back(a, v, writer);
+  recordInput(a, v, writer);
 
   // Is the artifact one of our temporary files?
   if (auto iter = _current_run._tempfiles.find(a); iter != _current_run._tempfiles.end()) {
@@ -665,18 +714,18 @@ void Command::addContentInput(shared_ptr<Artifact> a,
   // If the version was created by another command, track the use of that command's output
   if (writer) {
     // This command uses output from writer
-    _current_run._uses_output_from.emplace(writer);
-    writer->_current_run._output_used_by.emplace(shared_from_this());
+    addEdge(_current_run._uses_output_from, writer);
+    writer->addEdge(writer->_current_run._output_used_by, shared_from_this());
 
     // Is the version committable?
     if (!v->canCommit()) {
       // No. Is the input uncommitted? If so, the writer must produce it for this command
       if (a->hasUncommittedContent()) {
-        _current_run._needs_output_from.emplace(writer);
+        addEdge(_current_run._needs_output_from, writer);
       }
 
       // If the writer has to run, the reader must also run.
-      writer->_current_run._output_needed_by.emplace(shared_from_this());
+      writer->addEdge(writer->_current_run._output_needed_by, shared_from_this());
     }
   }
 }
@@ -687,7 +736,7 @@ void Command::addDirectoryInput(std::shared_ptr<Artifact> a,
                                 std::shared_ptr<Command> writer) noexcept {
   if (!v) return;
 
-  if (options::track_inputs_outputs) _current_run._inputs.emplace_back(a, v, writer);
+  recordInput(a, v, writer);
 
   // If this command is running, make sure the directory version is committed
   if (mustRun()) {
@@ -709,11 +758,24 @@ void Command::addDirectoryInput(std::shared_ptr<Artifact> a,
   // If the version was created by another command, track the use of that command's output
   if (writer) {
     // This command uses output from writer
-    _current_run._uses_output_from.emplace(writer);
-    writer->_current_run._output_used_by.emplace(shared_from_this());
+    addEdge(_current_run._uses_output_from, writer);
+    writer->addEdge(writer->_current_run._output_used_by, shared_from_this());
   }
 }
 
+// Record an input in the current run's input list when inputs and outputs are tracked
+void Command::recordInput(const shared_ptr<Artifact>& a,
+                          const shared_ptr<Version>& v,
+                          const shared_ptr<Command>& writer) noexcept {
+  if (!options::track_inputs_outputs) return;
+
+  // Reading this command's own output is not a dependency, and a repeated read adds nothing new
+  if (writer.get() == this) return;
+  if (!_current_run._input_versions.emplace(a.get(), v.get()).second) return;
+
+  _current_run._inputs.emplace_back(a, v, writer);
+}
+
 // Add an output to this command
 void Command::addMetadataOutput(shared_ptr<Artifact> a, shared_ptr<MetadataVersion> v) noexcept {
   if (options::track_inputs_outputs) _current_run._outputs.emplace_back(a, v);
@@ -750,7 +812,7 @@ const list<shared_ptr<Command>>& Command::getChildren() noexcept {
 }
 
 // Get the set of commands that produce inputs to this command
-const Command::WeakCommandSet& Command::getInputProducers() const noexcept {
+const Command::CommandIndexSet& Command::getInputProducers() const noexcept {
   return _previous_run._uses_output_from;
 }
 
@@ -821,3 +883,59 @@ const Command::OutputList& Command::getOutputs() noexcept {
          "options::track_inputs_outputs to true for this command.";
   return _previous_run._outputs;
 }
+
+/// Check if the previous run of this command wrote to a file
+bool Command::wroteFile() const noexcept {
+  return _previous_run._wrote_file;
+}
+
+/******************** Restoring a Saved Build ********************/
+
+// Get the edge set of a given type from a run
+template <class R>
+static auto& getEdgeSet(R& run, Command::Edge type) noexcept {
+  switch (type) {
+    case Command::Edge::UsesOutputFrom:
+      return run._uses_output_from;
+    case Command::Edge::NeedsOutputFrom:
+      return run._needs_output_from;
+    case Command::Edge::OutputUsedBy:
+      return run._output_used_by;
+    default:
+      return run._output_needed_by;
+  }
+}
+
+// Get the commands connected to this one by a type of edge in the previous run
+vector<Command*> Command::getEdges(Edge type) const noexcept {
+  vector<Command*> result;
+  for (auto index : getEdgeSet(_previous_run, type)) {
+    result.push_back(getByIndex(index));
+  }
+  return result;
+}
+
+// Can the previous run of this command be restored from a saved build?
+bool Command::canRestore() const noexcept {
+  // Matching a launch of this command checks the content of any temporary file in its arguments
+  for (const auto& arg : _args) {
+    if (_previous_run._tempfile_expected_content.count(arg)) return false;
+  }
+  return true;
+}
+
+// Restore a child launched by the previous run of this command
+void Command::restoreChild(shared_ptr<Command> child) noexcept {
+  child->_previous_run._parent = shared_from_this();
+  _previous_run._children.push_back(std::move(child));
+}
+
+// Restore a dependency edge from the previous run of this command
+void Command::restoreEdge(Edge type, const shared_ptr<Command>& other) noexcept {
+  addEdge(getEdgeSet(_previous_run, type), other);
+}
+
+// Record that the previous run of this command observed a change
+void Command::restoreChange() noexcept {
+  _previous_run._changed = Scenario::Both;
+}
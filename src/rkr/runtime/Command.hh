@@ -8,7 +8,9 @@
 #include <memory>
 #include <optional>
 #include <ostream>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "runtime/Ref.hh"
@@ -104,6 +106,10 @@ class Command : public std::enable_shared_from_this<Command> {
   /// The type of a command ID
   using ID = uint32_t;
 
+  /// The type of a command's dense index. Indices are assigned in creation order and are never
+  /// reused within a run of rkr.
+  using Index = uint32_t;
+
   /// Create a new command
   Command(std::vector<std::string> args = {}) noexcept;
 
@@ -203,23 +209,31 @@ class Command : public std::enable_shared_from_this<Command> {
 
   /****** Types and struct used to track run-specific data ******/
 
-  using WeakCommandSet = std::set<std::weak_ptr<Command>, std::owner_less<std::weak_ptr<Command>>>;
+  /// A set of commands stored as a flat vector of command indices. Indices are appended as edges
+  /// are added during a run, and the vector is sorted and deduplicated when the run finishes.
+  using CommandIndexSet = std::vector<Index>;
 
   using InputList =
-      std::list<std::tuple<std::shared_ptr<Artifact>,  // The artifact that was accessed
-                           std::shared_ptr<Version>,   // The input version
-                           std::weak_ptr<Command>>>;   // The command that created theinput
+      std::vector<std::tuple<std::shared_ptr<Artifact>,  // The artifact that was accessed
+                             std::shared_ptr<Version>,   // The input version
+                             std::weak_ptr<Command>>>;   // The command that created theinput
 
   using OutputList =
-      std::list<std::tuple<std::shared_ptr<Artifact>,   // The artifact that was written
-                           std::shared_ptr<Version>>>;  // The version written to that artifact
+      std::vector<std::tuple<std::shared_ptr<Artifact>,   // The artifact that was written
+                             std::shared_ptr<Version>>>;  // The version written to that artifact
 
-  struct Run {
-    /// The command's local references
-    std::vector<std::shared_ptr<Ref>> _refs;
+  /// An entry in a command's reference table
+  struct RefEntry {
+    /// The reference stored at this ID, or nullptr if the ID is unassigned
+    std::shared_ptr<Ref> ref;
+
+    /// The number of times this command is currently using the reference
+    size_t uses = 0;
+  };
 
-    /// This command's use countn for each of its references
-    std::vector<size_t> _refs_use_count;
+  struct Run {
+    /// The command's local references, indexed by Ref::ID, with this command's use count for each
+    std::vector<RefEntry> _refs;
 
     /// This command's parent, if any
     std::weak_ptr<Command> _parent;
@@ -234,6 +248,9 @@ class Command : public std::enable_shared_from_this<Command> {
     /// The process this command's run was launched in, or nullptr if there is no process
     std::shared_ptr<Process> _process;
 
+    /// Has this command run written to any file, whether the run was emulated or traced?
+    bool _wrote_file = false;
+
     /// The temporary files used by this command. The value is set to true once the tempfile has
     /// been accessed
     std::map<std::shared_ptr<Artifact>, bool> _tempfiles;
@@ -250,23 +267,26 @@ class Command : public std::enable_shared_from_this<Command> {
     /// Keep track of the scenarios where this command has observed a change
     Scenario _changed = Scenario::None;
 
-    /// Inputs to this command
+    /// Inputs to this command. Each version read from another command is listed once.
     InputList _inputs;
 
+    /// The artifacts and versions already in the input list
+    std::set<std::pair<Artifact*, Version*>> _input_versions;
+
     /// Outputs from this command
     OutputList _outputs;
 
     /// The set of commands that produce any inputs to this command
-    WeakCommandSet _uses_output_from;
+    CommandIndexSet _uses_output_from;
 
     /// The set of commands that produce uncached inputs to this command
-    WeakCommandSet _needs_output_from;
+    CommandIndexSet _needs_output_from;
 
     /// The set of commands that use this command's outputs
-    WeakCommandSet _output_used_by;
+    CommandIndexSet _output_used_by;
 
     /// The set of commands that require uncached outputs from this command
-    WeakCommandSet _output_needed_by;
+    CommandIndexSet _output_needed_by;
   };
 
   /****** Data for the current run ******/
@@ -283,6 +303,9 @@ class Command : public std::enable_shared_from_this<Command> {
   /// Mark the latest run of this command as launched
   void setLaunched(std::shared_ptr<Process> p = nullptr) noexcept;
 
+  /// Record that the latest run of this command wrote to a file
+  void setWroteFile() noexcept;
+
   /// Get the process this command is running in
   const std::shared_ptr<Process>& getProcess() noexcept;
 
@@ -371,7 +394,7 @@ class Command : public std::enable_shared_from_this<Command> {
   const std::list<std::shared_ptr<Command>>& getChildren() noexcept;
 
   /// Get the set of commands that produce inputs to this command
-  const WeakCommandSet& getInputProducers() const noexcept;
+  const CommandIndexSet& getInputProducers() const noexcept;
 
   /**
    * Does this command match a given set of launch arguments? If so, return a set of
@@ -392,6 +415,30 @@ class Command : public std::enable_shared_from_this<Command> {
   /// Get the outputs from this command
   const OutputList& getOutputs() noexcept;
 
+  /// Did the previous run of this command write to any file?
+  bool wroteFile() const noexcept;
+
+  /****** Restoring the previous run from a saved build ******/
+
+  /// The dependency edge sets recorded for a run
+  enum class Edge : uint8_t { UsesOutputFrom, NeedsOutputFrom, OutputUsedBy, OutputNeededBy };
+
+  /// Get the commands connected to this one by a type of edge in the previous run
+  std::vector<Command*> getEdges(Edge type) const noexcept;
+
+  /// Can the previous run of this command be restored from its children, edges, and changes
+  /// alone? A command that is matched by the content of temporary files in its arguments cannot be.
+  bool canRestore() const noexcept;
+
+  /// Restore a child launched by the previous run of this command
+  void restoreChild(std::shared_ptr<Command> child) noexcept;
+
+  /// Restore a dependency edge from the previous run of this command
+  void restoreEdge(Edge type, const std::shared_ptr<Command>& other) noexcept;
+
+  /// Record that the previous run of this command observed a change
+  void restoreChange() noexcept;
+
   std::optional<Command::ID> getID(size_t buffer_id) {
     if (_buffer_id == buffer_id) return _id;
     return std::nullopt;
@@ -407,6 +454,19 @@ class Command : public std::enable_shared_from_this<Command> {
   /// marking.
   bool mark(RebuildMarking marking) noexcept;
 
+  /// Add a command to one of this command's dependency edge sets
+  void addEdge(CommandIndexSet& set, const std::shared_ptr<Command>& c) noexcept {
+    if (set.empty() || set.back() != c->_index) set.push_back(c->_index);
+  }
+
+  /// Get a live command from its dense index, or nullptr if the command has been destroyed
+  static Command* getByIndex(Index index) noexcept;
+
+  /// Record an input in the current run's input list, if inputs and outputs are tracked
+  void recordInput(const std::shared_ptr<Artifact>& a,
+                   const std::shared_ptr<Version>& v,
+                   const std::shared_ptr<Command>& writer) noexcept;
+
  private:
   /// The arguments passed to this command on startup
   std::vector<std::string> _args;
@@ -432,6 +492,9 @@ class Command : public std::enable_shared_from_this<Command> {
   /// The total count of commands the last time the short name was computed
   mutable size_t _short_name_command_count = 0;
 
+  /// The dense index for this command
+  Index _index;
+
   // ID for this command and the buffer it is identified in
   Command::ID _id;
   size_t _buffer_id;
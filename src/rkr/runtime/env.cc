@@ -2,12 +2,12 @@
 
 #include <cstddef>
 #include <filesystem>
-#include <list>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -20,8 +20,10 @@
 #include "artifacts/PipeArtifact.hh"
 #include "artifacts/SpecialArtifact.hh"
 #include "artifacts/SymlinkArtifact.hh"
+#include "runtime/ArtifactRegistry.hh"
 #include "runtime/Command.hh"
 #include "util/log.hh"
+#include "util/pool.hh"
 #include "util/stats.hh"
 #include "util/wrappers.hh"
 #include "versions/DirVersion.hh"
@@ -29,13 +31,12 @@
 #include "versions/MetadataVersion.hh"
 #include "versions/SymlinkVersion.hh"
 
-using std::list;
 using std::make_shared;
 using std::map;
-using std::pair;
 using std::set;
 using std::shared_ptr;
 using std::string;
+using std::vector;
 using std::weak_ptr;
 
 namespace fs = std::filesystem;
@@ -50,11 +51,14 @@ namespace env {
   shared_ptr<Artifact> _stderr;       //< Standard error
   shared_ptr<DirArtifact> _root_dir;  //< The root directory
 
-  /// A set of all the artifacts used during the build
-  list<weak_ptr<Artifact>> _artifacts;
+  /// All the artifacts used during the build, indexed by inode where they have one
+  ArtifactRegistry _artifacts;
 
-  /// A map of artifacts identified by inode
-  map<pair<dev_t, ino_t>, weak_ptr<Artifact>> _inodes;
+  /// Artifacts that changed since the last final state check
+  vector<weak_ptr<Artifact>> _dirty_for_check;
+
+  /// Artifacts that changed since the last caching pass, or had uncommitted content during it
+  vector<weak_ptr<Artifact>> _dirty_for_cache;
 
   // Reset the state of the environment by clearing all known artifacts
   void rollback() noexcept {
@@ -64,14 +68,57 @@ namespace env {
     if (_root_dir) _root_dir->rollback();
   }
 
-  // Fingerprint and cache any versions on the filesystem
-  void cacheAll() noexcept { getRootDir()->cacheAll("/"); }
+  // Fingerprint and cache any changed versions on the filesystem
+  void cacheAll() noexcept {
+    auto dirty = std::move(_dirty_for_cache);
+    _dirty_for_cache.clear();
+
+    for (const auto& weak_artifact : dirty) {
+      auto a = weak_artifact.lock();
+      if (!a) continue;
+
+      // An artifact with uncommitted content stays in the list until it can be cached
+      if (a->cacheAll()) {
+        a->clearDirtyForCache();
+      } else {
+        _dirty_for_cache.push_back(a);
+      }
+    }
+  }
+
+  // Compare the final state of changed artifacts to the filesystem
+  void checkFinalState() noexcept {
+    auto dirty = std::move(_dirty_for_check);
+    _dirty_for_check.clear();
+
+    for (const auto& weak_artifact : dirty) {
+      auto a = weak_artifact.lock();
+      if (!a) continue;
+      a->clearDirtyForCheck();
+
+      // Artifacts that are no longer reachable in the filesystem model do not need to be checked
+      auto path = a->getPath();
+      if (path.has_value()) a->checkFinalState(path.value());
+    }
+  }
+
+  // Add an artifact to the lists of changed artifacts
+  void addDirty(shared_ptr<Artifact> a, bool check, bool cache) noexcept {
+    if (check) _dirty_for_check.push_back(a);
+    if (cache) _dirty_for_cache.push_back(a);
+  }
 
   // Commit all changes to the filesystem
-  void commitAll() noexcept { getRootDir()->applyFinalState("/"); }
+  void commitAll() noexcept {
+    // Directories, links, and metadata are committed in order, but the contents of cached files
+    // are copied into place in parallel
+    FileVersion::beginParallelStaging();
+    getRootDir()->applyFinalState("/");
+    FileVersion::finishParallelStaging();
+  }
 
   // Get the set of all artifacts
-  const list<weak_ptr<Artifact>>& getArtifacts() noexcept { return _artifacts; }
+  const ArtifactRegistry& getArtifacts() noexcept { return _artifacts; }
 
   shared_ptr<Artifact> getStdin(const shared_ptr<Command>& c) noexcept {
     if (!_stdin) {
@@ -89,7 +136,7 @@ namespace env {
       a->setName("stdin");
 
       // Record stats for this artifact
-      _artifacts.push_back(_stdin);
+      _artifacts.add(_stdin);
       stats::artifacts++;
     }
 
@@ -112,7 +159,7 @@ namespace env {
       a->setName("stdout");
 
       // Record stats for this artifact
-      _artifacts.push_back(_stdout);
+      _artifacts.add(_stdout);
       stats::artifacts++;
     }
 
@@ -135,7 +182,7 @@ namespace env {
       a->setName("stderr");
 
       // Record stats for this artifact
-      _artifacts.push_back(_stderr);
+      _artifacts.add(_stderr);
       stats::artifacts++;
     }
 
@@ -192,30 +239,22 @@ namespace env {
     if (rc != 0) return nullptr;
 
     // Does the inode for this path match an artifact we've already created?
-    auto inode_iter = _inodes.find({info.st_dev, info.st_ino});
-    if (inode_iter != _inodes.end()) {
-      // Found a match. Is the weak pointer still valid?
-      auto result = inode_iter->second.lock();
-      if (result) return result;
-
-      // Invalid weak pointer, so we can erase the entry
-      _inodes.erase(inode_iter);
-    }
+    if (auto result = _artifacts.find(info.st_dev, info.st_ino); result) return result;
 
     // Create a new artifact for this inode
     shared_ptr<Artifact> a;
     if ((info.st_mode & S_IFMT) == S_IFREG) {
       // The path refers to a regular file
-      auto cv = make_shared<FileVersion>(info);
+      auto cv = make_pooled<FileVersion>(info);
       a = make_shared<FileArtifact>(MetadataVersion(info), cv);
 
     } else if ((info.st_mode & S_IFMT) == S_IFDIR) {
       // The path refers to a directory
-      auto dv = make_shared<BaseDirVersion>(false);
+      auto dv = make_pooled<BaseDirVersion>(false);
       a = make_shared<DirArtifact>(MetadataVersion(info), dv);
 
     } else if ((info.st_mode & S_IFMT) == S_IFLNK) {
-      auto sv = make_shared<SymlinkVersion>(readlink(path));
+      auto sv = make_pooled<SymlinkVersion>(readlink(path));
       a = make_shared<SymlinkArtifact>(MetadataVersion(info), sv);
 
     } else {
@@ -235,16 +274,13 @@ namespace env {
       // The path refers to something else
       if (!a) {
         WARN << "Unexpected filesystem node type at " << path << ". Treating it as a file.";
-        auto cv = make_shared<FileVersion>(info);
+        auto cv = make_pooled<FileVersion>(info);
         a = make_shared<FileArtifact>(MetadataVersion(info), cv);
       }
     }
 
-    // Add the new artifact to the inode map
-    _inodes.emplace_hint(inode_iter, pair{info.st_dev, info.st_ino}, a);
-
-    // Also add the artifact to the set of all artifacts
-    _artifacts.push_back(a);
+    // Add the new artifact to the set of all artifacts, indexed by its inode
+    _artifacts.add(info.st_dev, info.st_ino, a);
     stats::artifacts++;
 
     // Return the artifact
@@ -263,7 +299,7 @@ namespace env {
     // Set the pipe's metadata on behalf of the command
     pipe->updateMetadata(c, MetadataVersion(uid, gid, mode));
 
-    _artifacts.push_back(pipe);
+    _artifacts.add(pipe);
     stats::artifacts++;
 
     return pipe;
@@ -280,9 +316,9 @@ namespace env {
 
     // Set the metadata for the new symlink artifact
     symlink->updateMetadata(c, MetadataVersion(uid, gid, mode));
-    symlink->updateContent(c, make_shared<SymlinkVersion>(target));
+    symlink->updateContent(c, make_pooled<SymlinkVersion>(target));
 
-    _artifacts.push_back(symlink);
+    _artifacts.add(symlink);
     stats::artifacts++;
 
     return symlink;
@@ -303,7 +339,7 @@ namespace env {
     // Set the metadata for the new directory artifact
     dir->updateMetadata(c, MetadataVersion(uid, gid, stat_mode));
 
-    _artifacts.push_back(dir);
+    _artifacts.add(dir);
     stats::artifacts++;
 
     return dir;
@@ -316,7 +352,7 @@ namespace env {
     mode_t stat_mode = S_IFREG | (mode & 0777);
 
     // Create an initial content version
-    auto cv = make_shared<FileVersion>();
+    auto cv = make_pooled<FileVersion>();
     cv->makeEmptyFingerprint();
 
     // Create the artifact and return it
@@ -329,7 +365,7 @@ namespace env {
     // Observe output to metadata and content for the new file
     c->addContentOutput(artifact, cv);
 
-    _artifacts.push_back(artifact);
+    _artifacts.add(artifact);
     stats::artifacts++;
 
     return artifact;
@@ -1,12 +1,13 @@
 #pragma once
 
 #include <filesystem>
-#include <list>
 #include <memory>
 #include <set>
 
 #include <sys/types.h>
 
+#include "runtime/ArtifactRegistry.hh"
+
 namespace fs = std::filesystem;
 
 class Artifact;
@@ -23,9 +24,20 @@ namespace env {
   /// Reset the environment to match filesystem state
   void rollback() noexcept;
 
-  /// Fingerprint and cache any versions on the filesystem
+  /// Fingerprint and cache any versions on the filesystem that changed since the last call
   void cacheAll() noexcept;
 
+  /// Compare the final state of artifacts that changed since the last call to the filesystem
+  void checkFinalState() noexcept;
+
+  /**
+   * Add an artifact to the lists of artifacts that have changed
+   * \param a     The changed artifact
+   * \param check If true, the artifact is added to the list for the next final state check
+   * \param cache If true, the artifact is added to the list for the next caching pass
+   */
+  void addDirty(std::shared_ptr<Artifact> a, bool check, bool cache) noexcept;
+
   /// Commit all changes in the environment to the filesystem
   void commitAll() noexcept;
 
@@ -44,8 +56,8 @@ namespace env {
   /// Get a unique path to a temporary file in the build directory
   fs::path getTempPath() noexcept;
 
-  /// Get a set of all the artifacts in the build
-  const std::list<std::weak_ptr<Artifact>>& getArtifacts() noexcept;
+  /// Get the registry of all the artifacts in the build
+  const ArtifactRegistry& getArtifacts() noexcept;
 
   /**
    * Get an artifact to represent a statted file/dir/pipe/symlink.
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <vector>
+
+#include "runtime/Ref.hh"
+
+/**
+ * An FDTable is a process' file descriptor table. Entries are stored densely, indexed by file
+ * descriptor number, so looking up an fd in a syscall handler is a bounds check and an array
+ * access. Forked processes share their parent's entries until one of them modifies its table, so
+ * copying a table only copies a pointer.
+ */
+class FDTable {
+ public:
+  /// Each entry holds a reference, and a boolean to track whether or not the descriptor is closed
+  /// on an exec syscall
+  using FileDescriptor = std::tuple<Ref::ID, bool>;
+
+  /// Get the entry for a file descriptor, or nullptr if the descriptor is not open
+  const FileDescriptor* find(int fd) const noexcept {
+    if (!_entries || fd < 0 || static_cast<size_t>(fd) >= _entries->size()) return nullptr;
+    const auto& entry = (*_entries)[fd];
+    if (!entry.has_value()) return nullptr;
+    return &entry.value();
+  }
+
+  /// Check if a file descriptor is open
+  bool contains(int fd) const noexcept { return find(fd) != nullptr; }
+
+  /// Set the entry for a file descriptor, replacing any existing entry
+  void set(int fd, FileDescriptor desc) noexcept {
+    auto& entries = getMutableEntries();
+    if (static_cast<size_t>(fd) >= entries.size()) entries.resize(fd + 1);
+    entries[fd] = desc;
+  }
+
+  /// Remove the entry for a file descriptor. Returns true if the descriptor was open.
+  bool erase(int fd) noexcept {
+    if (!contains(fd)) return false;
+    auto& entries = getMutableEntries();
+    entries[fd].reset();
+
+    // Trim closed entries from the end of the table
+    while (!entries.empty() && !entries.back().has_value()) entries.pop_back();
+    return true;
+  }
+
+  /// Remove all entries
+  void clear() noexcept { _entries.reset(); }
+
+  /// Call a function with each open file descriptor and its entry, in file descriptor order
+  template <typename F>
+  void forEach(F f) const noexcept {
+    if (!_entries) return;
+    for (size_t fd = 0; fd < _entries->size(); fd++) {
+      const auto& entry = (*_entries)[fd];
+      if (entry.has_value()) f(static_cast<int>(fd), entry.value());
+    }
+  }
+
+ private:
+  /// Get entries that can be modified, copying them first if they are shared with another table
+  std::vector<std::optional<FileDescriptor>>& getMutableEntries() noexcept {
+    if (!_entries) {
+      _entries = std::make_shared<std::vector<std::optional<FileDescriptor>>>();
+    } else if (_entries.use_count() > 1) {
+      _entries = std::make_shared<std::vector<std::optional<FileDescriptor>>>(*_entries);
+    }
+    return *_entries;
+  }
+
+  /// The table entries, indexed by file descriptor. The entries may be shared with other tables.
+  std::shared_ptr<std::vector<std::optional<FileDescriptor>>> _entries;
+};
@@ -35,9 +35,9 @@ Process::Process(Build& build,
                  pid_t pid,
                  Ref::ID cwd,
                  Ref::ID root,
-                 map<int, FileDescriptor> fds,
+                 FDTable fds,
                  optional<mode_t> umask) noexcept :
-    _command(command), _pid(pid), _cwd(cwd), _root(root), _fds(fds) {
+    _command(command), _pid(pid), _cwd(cwd), _root(root), _fds(std::move(fds)) {
   // Set the process' default umask if one was not provided
   if (!umask.has_value()) {
     _umask = ::umask(0);
@@ -47,10 +47,10 @@ Process::Process(Build& build,
   }
 
   // The new process has an open handle to each file descriptor in the _fds table
-  for (auto& [index, desc] : _fds) {
-    auto& [ref, cloexec] = desc;
+  _fds.forEach([&](int fd, const FileDescriptor& desc) {
+    const auto& [ref, cloexec] = desc;
     build.usingRef(source, _command, ref);
-  }
+  });
 
   // The child process also duplicates references to the root and working directories
   // TODO: Do we need to track _exe here as well?
@@ -75,10 +75,10 @@ void Process::setWorkingDir(Build& build, const IRSource& source, Ref::ID ref) n
 
 // Get a file descriptor entry
 Ref::ID Process::getFD(int fd) noexcept {
-  auto iter = _fds.find(fd);
-  ASSERT(iter != _fds.end()) << "Attempted to access an unknown fd " << fd << " in " << this;
+  auto desc = _fds.find(fd);
+  ASSERT(desc) << "Attempted to access an unknown fd " << fd << " in " << this;
 
-  return std::get<0>(iter->second);
+  return std::get<0>(*desc);
 }
 
 // Add a file descriptor entry
@@ -87,40 +87,39 @@ void Process::addFD(Build& build,
                     int fd,
                     Ref::ID ref,
                     bool cloexec) noexcept {
-  if (auto iter = _fds.find(fd); iter != _fds.end()) {
+  if (auto desc = _fds.find(fd); desc) {
     WARN << "Overwriting an existing fd " << fd << " in " << this;
-    auto& [old_ref, old_cloexec] = iter->second;
+    auto [old_ref, old_cloexec] = *desc;
     WARN << "  Existing fd references " << getCommand()->getRef(old_ref)->getArtifact();
     build.doneWithRef(source, _command, old_ref);
-    _fds.erase(iter);
   }
 
   // The command holds an additional handle to the provided Ref
   build.usingRef(source, _command, ref);
 
   // Add the entry to the process' file descriptor table
-  _fds.emplace(fd, FileDescriptor(ref, cloexec));
+  _fds.set(fd, FileDescriptor(ref, cloexec));
 }
 
 // Close a file descriptor
 void Process::closeFD(Build& build, const IRSource& source, int fd) noexcept {
-  auto iter = _fds.find(fd);
-  if (iter == _fds.end()) {
+  auto desc = _fds.find(fd);
+  if (!desc) {
     LOG(trace) << "Closing an unknown file descriptor " << fd << " in " << this;
   } else {
-    auto& [old_ref, old_cloexec] = iter->second;
+    auto [old_ref, old_cloexec] = *desc;
     build.doneWithRef(source, _command, old_ref);
-    _fds.erase(iter);
+    _fds.erase(fd);
   }
 }
 
 // Remove a file descriptor entry if it exists
 bool Process::tryCloseFD(Build& build, const IRSource& source, int fd) noexcept {
-  auto iter = _fds.find(fd);
-  if (iter != _fds.end()) {
-    auto& [old_ref, old_cloexec] = iter->second;
+  auto desc = _fds.find(fd);
+  if (desc) {
+    auto [old_ref, old_cloexec] = *desc;
     build.doneWithRef(source, _command, old_ref);
-    _fds.erase(iter);
+    _fds.erase(fd);
     return true;
   }
   return false;
@@ -128,17 +127,28 @@ bool Process::tryCloseFD(Build& build, const IRSource& source, int fd) noexcept
 
 // Set a file descriptor's close-on-exec flag
 void Process::setCloexec(int fd, bool cloexec) noexcept {
-  auto iter = _fds.find(fd);
-  ASSERT(iter != _fds.end())
-      << "Attempted to set the cloexec flag for non-existent file descriptor " << fd;
+  auto desc = _fds.find(fd);
+  ASSERT(desc) << "Attempted to set the cloexec flag for non-existent file descriptor " << fd;
 
-  const auto& [ref, old_cloexec] = iter->second;
-  iter->second = FileDescriptor{ref, cloexec};
+  auto [ref, old_cloexec] = *desc;
+  _fds.set(fd, FileDescriptor{ref, cloexec});
+}
+
+// Get the open file descriptors in a range
+vector<int> Process::getFDs(unsigned int first, unsigned int last) const noexcept {
+  vector<int> result;
+  _fds.forEach([&](int fd, const FileDescriptor& desc) {
+    if (static_cast<unsigned int>(fd) >= first && static_cast<unsigned int>(fd) <= last) {
+      result.push_back(fd);
+    }
+  });
+  return result;
 }
 
 // The process is creating a new child
 shared_ptr<Process> Process::fork(Build& build, const IRSource& source, pid_t child_pid) noexcept {
-  // Return the child process object
+  // Return the child process object. The child shares this process' fd table until one of them
+  // modifies it.
   return make_shared<Process>(build, source, _command, child_pid, _cwd, _root, _fds, _umask);
 }
 
@@ -153,12 +163,12 @@ const shared_ptr<Command>& Process::exec(Build& build,
   map<int, Ref::ID> inherited_fds;
 
   // Loop over this process' file descriptors to find the ones that are inherited (not cloexec)
-  for (const auto& [fd, desc] : _fds) {
+  _fds.forEach([&](int fd, const FileDescriptor& desc) {
     const auto& [ref, cloexec] = desc;
 
     // If this fd is inherited by the child, record it
     if (!cloexec) inherited_fds.emplace(fd, ref);
-  }
+  });
 
   // Find (or create) a command for the child
   auto child = build.findCommand(_command, args, inherited_fds);
@@ -197,10 +207,10 @@ const shared_ptr<Command>& Process::exec(Build& build,
   build.doneWithRef(source, _command, _cwd);
   build.doneWithRef(source, _command, _root);
 
-  for (const auto& [fd, desc] : _fds) {
-    auto [ref, cloexec] = desc;
+  _fds.forEach([&](int fd, const FileDescriptor& desc) {
+    const auto& [ref, cloexec] = desc;
     build.doneWithRef(source, _command, ref);
-  }
+  });
 
   // This process is now running the child
   _command = child;
@@ -212,7 +222,7 @@ const shared_ptr<Command>& Process::exec(Build& build,
   _fds.clear();
 
   for (auto& [fd, ref] : child->getInitialFDs()) {
-    _fds.emplace(fd, FileDescriptor{ref, false});
+    _fds.set(fd, FileDescriptor{ref, false});
   }
 
   // Update the cwd and root references for the process to use refs from the new command
@@ -239,10 +249,10 @@ void Process::exit(Build& build, const IRSource& source, int exit_status) noexce
     build.doneWithRef(source, _command, _root);
 
     // Any remaining file descriptors in this process are closed
-    for (const auto& [index, desc] : _fds) {
+    _fds.forEach([&](int fd, const FileDescriptor& desc) {
       const auto& [ref, cloexec] = desc;
       build.doneWithRef(source, _command, ref);
-    }
+    });
 
     // If this process was the primary for its command, trace the exit
     if (_primary) build.exit(source, _command, exit_status);
@@ -14,6 +14,7 @@
 #include "data/IRSource.hh"
 #include "runtime/Command.hh"
 #include "runtime/Ref.hh"
+#include "tracing/FDTable.hh"
 
 class Build;
 
@@ -21,7 +22,7 @@ class Process : public std::enable_shared_from_this<Process> {
  public:
   /// Keep track of file descriptors with a reference, and a boolean to track whether or not the
   /// descriptor is closed on an exec syscall
-  using FileDescriptor = std::tuple<Ref::ID, bool>;
+  using FileDescriptor = FDTable::FileDescriptor;
 
   Process(Build& build,
           const IRSource& source,
@@ -29,7 +30,7 @@ class Process : public std::enable_shared_from_this<Process> {
           pid_t pid,
           Ref::ID cwd,
           Ref::ID root,
-          std::map<int, FileDescriptor> fds,
+          FDTable fds,
           std::optional<mode_t> umask = std::nullopt) noexcept;
 
   /// Get the process ID
@@ -51,7 +52,7 @@ class Process : public std::enable_shared_from_this<Process> {
   Ref::ID getFD(int fd) noexcept;
 
   /// Check if this process has a particular file descriptor
-  bool hasFD(int fd) const noexcept { return _fds.find(fd) != _fds.end(); }
+  bool hasFD(int fd) const noexcept { return _fds.contains(fd); }
 
   /// Add a file descriptor entry
   void addFD(Build& build,
@@ -69,6 +70,9 @@ class Process : public std::enable_shared_from_this<Process> {
   /// Set a file descriptor's close-on-exec flag
   void setCloexec(int fd, bool cloexec) noexcept;
 
+  /// Get the open file descriptors numbered from first to last, inclusive
+  std::vector<int> getFDs(unsigned int first, unsigned int last) const noexcept;
+
   /// Mark this process as the primary process for its command
   void setPrimary() noexcept { _primary = true; }
 
@@ -131,7 +135,7 @@ class Process : public std::enable_shared_from_this<Process> {
   mode_t _umask;
 
   /// The process' file descriptor table
-  std::map<int, FileDescriptor> _fds;
+  FDTable _fds;
 
   /// Has this process exited?
   bool _exited = false;
@@ -1,5 +1,6 @@
 #include "Thread.hh"
 
+#include <algorithm>
 #include <cerrno>
 #include <climits>
 #include <cstdlib>
@@ -9,9 +10,11 @@
 #include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <elf.h>
+#include <linux/close_range.h>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
@@ -32,6 +35,7 @@
 #include "tracing/Flags.hh"
 #include "tracing/SyscallTable.hh"
 #include "tracing/Tracer.hh"
+#include "util/InternedPath.hh"
 #include "util/log.hh"
 #include "util/options.hh"
 #include "util/wrappers.hh"
@@ -41,6 +45,7 @@ using std::function;
 using std::optional;
 using std::shared_ptr;
 using std::string;
+using std::string_view;
 using std::vector;
 
 namespace fs = std::filesystem;
@@ -139,32 +144,60 @@ fs::path Thread::getPath(at_fd fd) const noexcept {
 
 Ref::ID Thread::makePathRef(Build& build,
                             const IRSource& source,
-                            fs::path p,
+                            const fs::path& p,
                             AccessFlags flags,
                             at_fd at) noexcept {
+  // Intern the path without its leading slashes, so later stages can pass the handle along without
+  // copying the path. Looking up a view of the raw string only allocates for a new path.
+  string_view raw = p.native();
+  bool absolute = !raw.empty() && raw.front() == '/';
+  auto path = InternedPath::intern(raw.substr(std::min(raw.find_first_not_of('/'), raw.size())));
+
   // Absolute paths are resolved relative to the process' current root
-  if (p.is_absolute()) {
+  if (absolute) {
     // HACK: Remove the O_EXCL flag when creating files in /tmp
-    if (p.string().find("/tmp/") == 0) flags.exclusive = false;
+    if (raw.rfind("/tmp/", 0) == 0) flags.exclusive = false;
 
     auto ref = getCommand()->nextRef();
-    build.pathRef(source, getCommand(), _process->getRoot(), p.relative_path(), flags, ref);
+    build.pathRef(source, getCommand(), _process->getRoot(), path, flags, ref);
     return ref;
   }
 
   // Handle the special CWD file descriptor to resolve relative to cwd
   if (at.isCWD()) {
     auto ref = getCommand()->nextRef();
-    build.pathRef(source, getCommand(), _process->getWorkingDir(), p.relative_path(), flags, ref);
+    build.pathRef(source, getCommand(), _process->getWorkingDir(), path, flags, ref);
     return ref;
   }
 
   // The path is resolved relative to some file descriptor
   auto ref = getCommand()->nextRef();
-  build.pathRef(source, getCommand(), _process->getFD(at.getFD()), p.relative_path(), flags, ref);
+  build.pathRef(source, getCommand(), _process->getFD(at.getFD()), path, flags, ref);
   return ref;
 }
 
+// Share the outcome of a traced pipe read or write with tracees
+void Thread::sharePipeEpoch(const PipeArtifact& pipe, size_t old_epoch, bool untraced) noexcept {
+  // Tracees that use this pipe without reporting must report their next operation
+  if (pipe.getEpoch() != old_epoch) Tracer::advancePipeEpoch(pipe);
+
+  // Let this thread skip reporting until the epoch ends. This is only possible through the shared
+  // memory channel, since ptrace stops on every read and write.
+  if (untraced && _channel >= 0) Tracer::channelAllowUntraced(_channel, pipe);
+}
+
+// A file descriptor is about to be closed or replaced
+void Thread::endUntracedFD(int fd) noexcept {
+  if (!_process->hasFD(fd)) return;
+
+  // A thread may be allowed to use this descriptor without reporting. Ending the pipe's epoch makes
+  // sure the descriptor is not used that way after it is reused for something else.
+  auto ref_id = _process->getFD(fd);
+  if (auto pipe = getCommand()->getRef(ref_id)->getArtifact()->as<PipeArtifact>(); pipe) {
+    Tracer::advancePipeEpoch(*pipe);
+  }
+}
+
 user_regs_struct Thread::getRegisters() noexcept {
   if (_channel >= 0) {
     return Tracer::getRegisters(_channel);
@@ -518,6 +551,9 @@ void Thread::_mknodat(Build& build,
 void Thread::_close(Build& build, const IRSource& source, int fd) noexcept {
   LOGF(trace, "{}: close({})", *this, fd);
 
+  // Make sure the descriptor cannot be used without reporting once it is closed
+  endUntracedFD(fd);
+
   // Resume the process
   resume();
 
@@ -525,6 +561,36 @@ void Thread::_close(Build& build, const IRSource& source, int fd) noexcept {
   _process->tryCloseFD(build, source, fd);
 }
 
+void Thread::_close_range(Build& build,
+                          const IRSource& source,
+                          unsigned int first,
+                          unsigned int last,
+                          unsigned int flags) noexcept {
+  LOGF(trace, "{}: close_range({}, {}, {})", *this, first, last, flags);
+
+  auto fds = _process->getFDs(first, last);
+
+  // Make sure none of the descriptors can be used without reporting once they are closed
+  if ((flags & CLOSE_RANGE_CLOEXEC) == 0) {
+    for (int fd : fds) endUntracedFD(fd);
+  }
+
+  finishSyscall([=](Build& build, const IRSource& source, long rc) {
+    resume();
+
+    // If the syscall failed, no descriptors were closed
+    if (rc != 0) return;
+
+    for (int fd : fds) {
+      if (flags & CLOSE_RANGE_CLOEXEC) {
+        _process->setCloexec(fd, true);
+      } else {
+        _process->tryCloseFD(build, source, fd);
+      }
+    }
+  });
+}
+
 /************************ Pipes ************************/
 
 void Thread::_pipe2(Build& build, const IRSource& source, int* fds, o_flags flags) noexcept {
@@ -597,6 +663,9 @@ void Thread::_dup3(Build& build,
     return;
   }
 
+  // Make sure newfd cannot be used without reporting once it is replaced
+  endUntracedFD(newfd);
+
   // dup3 returns the new file descriptor, or error
   // Finish the syscall so we know what file descriptor to add to our table
   if (_process->hasFD(oldfd)) {
@@ -919,10 +988,15 @@ void Thread::_read(Build& build, const IRSource& source, int fd) noexcept {
   // Get a reference to the artifact being read
   auto ref_id = _process->getFD(fd);
   const auto& ref = getCommand()->getRef(ref_id);
+  auto pipe = ref->getArtifact()->as<PipeArtifact>();
+  size_t epoch = pipe ? pipe->getEpoch() : 0;
 
   // Inform the artifact that we are about to read
   ref->getArtifact()->beforeRead(build, source, getCommand(), ref_id);
 
+  // Later reads from a pipe in the same epoch may not need to be traced
+  if (pipe) sharePipeEpoch(*pipe, epoch, pipe->canReadUntraced(getCommand()));
+
   // Finish the syscall and resume
   finishSyscall([=](Build& build, const IRSource& source, long rc) {
     resume();
@@ -940,16 +1014,24 @@ void Thread::_write(Build& build, const IRSource& source, int fd) noexcept {
   // Get a reference to the artifact being written
   auto ref_id = _process->getFD(fd);
   const auto& ref = getCommand()->getRef(ref_id);
+  auto pipe = ref->getArtifact()->as<PipeArtifact>();
+  size_t epoch = pipe ? pipe->getEpoch() : 0;
 
   // Inform the artifact that we are about to write
   ref->getArtifact()->beforeWrite(build, source, getCommand(), ref_id);
 
+  // Later writes to a pipe in the same epoch may not need to be traced
+  if (pipe) sharePipeEpoch(*pipe, epoch, pipe->canWriteUntraced(getCommand()));
+
   // Finish the syscall and resume the process
   finishSyscall([=](Build& build, const IRSource& source, long rc) {
     resume();
 
     // If the write syscall failed, there's no need to log a write
-    if (rc < 0) return;
+    if (rc < 0) {
+      ref->getArtifact()->abortWrite(build, source, getCommand(), ref_id);
+      return;
+    }
 
     // Inform the artifact that it was written
     ref->getArtifact()->afterWrite(build, source, getCommand(), ref_id);
@@ -993,6 +1075,7 @@ void Thread::_mmap(Build& build,
 
     // If the map failed there's nothing to log
     if (result == MAP_FAILED) {
+      if (writable) ref->getArtifact()->abortWrite(build, source, getCommand(), ref_id);
       resume();
       return;
     }
@@ -1055,6 +1138,8 @@ void Thread::_truncate(Build& build,
         } else {
           ref->getArtifact()->afterTruncate(build, source, getCommand(), ref_id);
         }
+      } else if (length > 0) {
+        ref->getArtifact()->abortWrite(build, source, getCommand(), ref_id);
       }
     });
   }
@@ -1085,6 +1170,8 @@ void Thread::_ftruncate(Build& build, const IRSource& source, int fd, long lengt
       } else {
         ref->getArtifact()->afterTruncate(build, source, getCommand(), ref_id);
       }
+    } else if (length > 0) {
+      ref->getArtifact()->abortWrite(build, source, getCommand(), ref_id);
     }
   });
 }
@@ -1113,6 +1200,8 @@ void Thread::_tee(Build& build, const IRSource& source, int fd_in, int fd_out) n
       if (rc >= 0) {
         in_ref->getArtifact()->afterRead(build, source, getCommand(), in_ref_id);
         out_ref->getArtifact()->afterWrite(build, source, getCommand(), out_ref_id);
+      } else {
+        out_ref->getArtifact()->abortWrite(build, source, getCommand(), out_ref_id);
       }
     });
   } else {
@@ -1657,8 +1746,8 @@ void Thread::_execveat(Build& build,
       // Leave the process in a stalled state so it can be exited later
       getProcess()->waitForExit([=](int exit_code) { forceExit(exit_code); });
 
-      // Ask the build to process any deferred steps now that the child command is launched
-      build.runDeferredSteps();
+      // Ask the build to process the child's deferred steps now that it is launched
+      build.runDeferredSteps(child);
     }
 
   } else {
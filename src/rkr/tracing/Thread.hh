@@ -28,6 +28,7 @@ namespace fs = std::filesystem;
 class AccessFlags;
 class Build;
 class Command;
+class PipeArtifact;
 class Tracer;
 
 class Thread {
@@ -112,10 +113,24 @@ class Thread {
    */
   Ref::ID makePathRef(Build& build,
                       const IRSource& source,
-                      fs::path p,
+                      const fs::path& p,
                       AccessFlags flags,
                       at_fd at = at_fd::cwd()) noexcept;
 
+  /**
+   * This thread is about to read or write a pipe. If the traced operation ended the pipe's epoch,
+   * other tracees must report their next use of the pipe. Otherwise this thread may be allowed to
+   * keep using the file descriptor without reporting each operation.
+   * \param pipe      The pipe being read or written
+   * \param old_epoch The pipe's epoch before the operation was traced
+   * \param untraced  Can this thread use the pipe without reporting until the epoch ends?
+   */
+  void sharePipeEpoch(const PipeArtifact& pipe, size_t old_epoch, bool untraced) noexcept;
+
+  /// This thread is about to close or replace a file descriptor. If the descriptor refers to a
+  /// pipe, no thread may keep using it without reporting.
+  void endUntracedFD(int fd) noexcept;
+
   /*** Handling for specific system calls ***/
 
   // File Opening, Creation, and Closing
@@ -149,6 +164,11 @@ class Thread {
                 mode_flags mode,
                 unsigned dev) noexcept;
   void _close(Build& build, const IRSource& source, int fd) noexcept;
+  void _close_range(Build& build,
+                    const IRSource& source,
+                    unsigned int first,
+                    unsigned int last,
+                    unsigned int flags) noexcept;
 
   // Pipes
   void _pipe(Build& build, const IRSource& source, int* fds) noexcept {
@@ -18,6 +18,7 @@
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
 #include <linux/audit.h>
 #include <linux/filter.h>
 #include <linux/seccomp.h>
@@ -30,6 +31,7 @@
 #include <unistd.h>
 
 #include "artifacts/Artifact.hh"
+#include "artifacts/PipeArtifact.hh"
 #include "runtime/Build.hh"
 #include "runtime/Command.hh"
 #include "runtime/Ref.hh"
@@ -37,7 +39,9 @@
 #include "tracing/SyscallTable.hh"
 #include "tracing/Thread.hh"
 #include "tracing/inject.h"
+#include "util/InternedPath.hh"
 #include "util/log.hh"
+#include "util/pool.hh"
 #include "util/stats.hh"
 #include "util/wrappers.hh"
 #include "versions/FileVersion.hh"
@@ -303,14 +307,14 @@ void Tracer::handleKilled(Build& build, Thread& t, int exit_status, int term_sig
       if (::stat(core_path.c_str(), &statbuf) == 0) {
         // Make a reference to the core file that creates it
         auto core_ref = t.getCommand()->nextRef();
-        build.pathRef(TracedIRSource(), t.getCommand(), cwd_ref_id, "core",
+        build.pathRef(TracedIRSource(), t.getCommand(), cwd_ref_id, InternedPath::intern("core"),
                       AccessFlags{.w = true, .create = true}, core_ref);
         auto core = t.getCommand()->getRef(core_ref)->getArtifact();
 
         // Make sure the reference resolved
         if (core) {
           // Create a version to represent the core file
-          auto cv = make_shared<FileVersion>(statbuf);
+          auto cv = make_pooled<FileVersion>(statbuf);
 
           // Trace a write to the core file from the command that's exiting
           build.updateContent(TracedIRSource(), t.getCommand(), core_ref, cv);
@@ -570,6 +574,11 @@ shared_ptr<Process> Tracer::launchTraced(Build& build, const shared_ptr<Command>
     bpf.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
   }
 
+  // The child waits on this pipe until the parent has attached to it. Otherwise the child could
+  // reach exec before it is traced, when the parent is slow to be scheduled after the fork.
+  int attach_pipe[2];
+  FAIL_IF(::pipe2(attach_pipe, O_CLOEXEC) != 0) << "Failed to create pipe: " << ERR;
+
   // Launch a child process
   pid_t child_pid = fork();
   FAIL_IF(child_pid == -1) << "Failed to fork: " << ERR;
@@ -577,6 +586,13 @@ shared_ptr<Process> Tracer::launchTraced(Build& build, const shared_ptr<Command>
   if (child_pid == 0) {
     // This is the child
 
+    // Wait until the parent closes its end of the pipe. This has to happen before seccomp is
+    // enabled, since the read could otherwise stop for a tracer that is not attached yet.
+    ::close(attach_pipe[1]);
+    char c;
+    while (::read(attach_pipe[0], &c, 1) == -1 && errno == EINTR) {}
+    ::close(attach_pipe[0]);
+
     // Set up FDs as requested. We assume that all parent FDs are marked CLOEXEC if
     // necessary and that there are no ordering constraints on duping (e.g. if the
     // child fd for one entry matches the parent fd of another).
@@ -668,6 +684,10 @@ shared_ptr<Process> Tracer::launchTraced(Build& build, const shared_ptr<Command>
   FAIL_IF(ptrace(PTRACE_SEIZE, child_pid, nullptr, options))
       << "Failed to seize child pid: " << ERR;
 
+  // Let the child continue now that it is traced
+  ::close(attach_pipe[0]);
+  ::close(attach_pipe[1]);
+
   // The tracee will stop a few times as it issues system calls captured via seccomp. Ignore
   // these.
   int wstatus;
@@ -684,9 +704,9 @@ shared_ptr<Process> Tracer::launchTraced(Build& build, const shared_ptr<Command>
   // Now the tracee can run the launched command
   FAIL_IF(ptrace(PTRACE_CONT, child_pid, nullptr, 0)) << "Failed to resume child: " << ERR;
 
-  map<int, Process::FileDescriptor> fds;
+  FDTable fds;
   for (auto& [fd, ref] : cmd->getInitialFDs()) {
-    fds[fd] = Process::FileDescriptor{ref, false};
+    fds.set(fd, Process::FileDescriptor{ref, false});
   }
 
   auto proc =
@@ -788,3 +808,24 @@ void Tracer::channelSkip(ssize_t i, long result) noexcept {
 void* Tracer::channelGetBuffer(ssize_t i) noexcept {
   return _shmem->channels[i].buffer;
 }
+
+// Get the shared epoch counter for a pipe. Pipes may share a counter, which only means a tracee
+// reports a few more reads and writes than it needs to.
+static uint32_t pipe_epoch_slot(const PipeArtifact& pipe) noexcept {
+  auto p = reinterpret_cast<uintptr_t>(&pipe) / alignof(std::max_align_t);
+  return p % TRACING_PIPE_EPOCH_COUNT;
+}
+
+// Let the tracee use the current file descriptor without reporting until a pipe's epoch changes
+void Tracer::channelAllowUntraced(ssize_t i, const PipeArtifact& pipe) noexcept {
+  ASSERT(_shmem->channels[i].state == CHANNEL_STATE_OBSERVED) << "Channel is not blocked";
+  auto slot = pipe_epoch_slot(pipe);
+  _shmem->channels[i].pipe_slot = slot;
+  _shmem->channels[i].pipe_epoch = __atomic_load_n(&_shmem->pipe_epochs[slot], __ATOMIC_RELAXED);
+}
+
+// Advance the shared epoch counter for a pipe so tracees report their next use of it
+void Tracer::advancePipeEpoch(const PipeArtifact& pipe) noexcept {
+  if (_shmem == nullptr) return;
+  __atomic_fetch_add(&_shmem->pipe_epochs[pipe_epoch_slot(pipe)], 1, __ATOMIC_RELEASE);
+}
@@ -13,6 +13,7 @@
 
 class Build;
 class Command;
+class PipeArtifact;
 class Process;
 
 class Tracer {
@@ -91,6 +92,13 @@ class Tracer {
   /// Get the data buffer associated with a shared memory channel
   static void* channelGetBuffer(ssize_t channel) noexcept;
 
+  /// Let the tracee use the file descriptor in the current system call without reporting it until
+  /// the epoch of the given pipe changes
+  static void channelAllowUntraced(ssize_t channel, const PipeArtifact& pipe) noexcept;
+
+  /// Advance the shared epoch counter for a pipe so tracees report their next use of it
+  static void advancePipeEpoch(const PipeArtifact& pipe) noexcept;
+
  private:
   /// A map from thread IDs to threads
   std::unordered_map<pid_t, Thread> _threads;
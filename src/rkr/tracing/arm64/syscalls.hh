@@ -317,3 +317,4 @@
 /* 433 */ // skip fspick (__NR_fspick)
 /* 434 */ // skip pidfd_open (__NR_pidfd_open)
 /* 435 */ // skip clone3 (__NR_clone3)
+/* 436 */ TRACE(__NR_close_range, close_range);
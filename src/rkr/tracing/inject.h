@@ -21,6 +21,12 @@
 // A special pointer value that indicates the tracing channel buffer should be used
 #define TRACING_CHANNEL_BUFFER_PTR 0x7777777700000000
 
+// The number of epoch counters shared by pipes that tracees can use without reporting
+#define TRACING_PIPE_EPOCH_COUNT 1024
+
+// Tracees only skip reporting for file descriptors below this number
+#define TRACING_UNTRACED_FD_COUNT 1024
+
 // Include architecture-specific register names
 #if defined(__x86_64__) || defined(_M_X64)
 #include "amd64/registers.h"
@@ -69,11 +75,24 @@
 #define CHANNEL_ACTION_EXIT 3
 #define CHANNEL_ACTION_SKIP 4
 
+/********** Untraced Pipe Operations **********/
+
+/**
+ * Once a command is the only reader or writer of its end of a pipe, reporting each read or write
+ * adds nothing to the build. When the tracer resumes a read or write on a pipe it can set the
+ * channel's pipe_slot to the index of the pipe's epoch counter. The tracee then reads or writes
+ * that file descriptor without reporting until the counter changes. The tracer advances the
+ * counter when a different command starts using the pipe, when a writer closes it, or when the
+ * file descriptor is closed or replaced. A pipe_slot of -1 means the tracee must keep reporting.
+ */
+
 typedef struct tracing_channel {
   sem_t wake_tracee;
   uint8_t state;
   uint8_t action;
   int tid;
+  int32_t pipe_slot;
+  uint32_t pipe_epoch;
   struct user_regs_struct regs;
   size_t buffer_pos;
   char buffer[TRACING_CHANNEL_BUFFER_SIZE];
@@ -82,4 +101,5 @@ typedef struct tracing_channel {
 struct shared_tracing_data {
   sem_t available;
   tracing_channel_t channels[TRACING_CHANNEL_COUNT];
+  uint32_t pipe_epochs[TRACING_PIPE_EPOCH_COUNT];
 };
@@ -15,7 +15,7 @@ void do_audit(std::vector<std::string> args, std::string command_output) noexcep
 
 void do_check(std::vector<std::string> args) noexcept;
 
-void do_trace(std::vector<std::string> args, std::string output) noexcept;
+void do_trace(std::vector<std::string> args, std::string output, std::string command) noexcept;
 
 void do_graph(std::vector<std::string> args,
               std::string output,
@@ -7,13 +7,16 @@
 
 #include "data/DefaultTrace.hh"
 #include "data/PostBuildChecker.hh"
+#include "data/PredicateProgram.hh"
 #include "data/ReadWriteCombiner.hh"
 #include "data/Trace.hh"
+#include "data/TraceOptimizer.hh"
 #include "runtime/Build.hh"
 #include "runtime/env.hh"
 #include "tracing/Tracer.hh"
 #include "ui/commands.hh"
 #include "util/constants.hh"
+#include "util/options.hh"
 #include "util/stats.hh"
 
 namespace fs = std::filesystem;
@@ -27,6 +30,24 @@ using std::string;
 using std::unique_ptr;
 using std::vector;
 
+// Remove any saved predicate program so it is never evaluated against the current build
+static void remove_predicates() noexcept {
+  std::error_code ec;
+  fs::remove(constants::PredicatesFilename, ec);
+}
+
+// Compile and save a predicate program for the committed state of a build. If the build cannot be
+// checked by a program, remove the saved program instead.
+static void save_predicates(const shared_ptr<Command>& root_cmd,
+                            const vector<shared_ptr<Command>>& commands) noexcept {
+  auto program = PredicateProgram::compile(root_cmd, commands);
+  if (program) {
+    program->save(constants::PredicatesFilename, constants::DatabaseFilename);
+  } else {
+    remove_predicates();
+  }
+}
+
 /**
  * Run the `build` subcommand.
  */
@@ -57,10 +78,33 @@ void do_build(vector<string> args,
   // Keep track of the root command
   shared_ptr<Command> root_cmd;
 
+  // The last build saved a predicate program that checks every path it observed or left behind.
+  // If they are all unchanged, this build has nothing to do.
+  auto program =
+      PredicateProgram::load(constants::PredicatesFilename, constants::DatabaseFilename);
+  if (program && program->evaluate()) {
+    LOG(phase) << "Predicate program passed. Skipping build";
+    gather_stats(stats_log_path, stats, 0);
+    write_stats(stats_log_path, stats);
+    return;
+  }
+
+  // Inputs and outputs are only tracked when a predicate program will be compiled from them
+  bool track_inputs_outputs = options::track_inputs_outputs;
+
   LOG(phase) << "Starting build phase 0";
 
-  // Is there a trace to load?
-  if (auto loaded = TraceReader::load(constants::DatabaseFilename); loaded) {
+  // Is there a trace to load? Keep it open so the post-build checks can append to it.
+  auto loaded = TraceReader::load(constants::DatabaseFilename);
+
+  // If the only changes the predicate program found are to inputs of specific commands, restore
+  // the model it saved instead of emulating the loaded trace. Phase 1 reads the loaded trace.
+  bool restored = loaded && program && program->restore(loaded->getCommands());
+  if (restored) {
+    LOG(phase) << "Restored build from predicate program";
+    root_cmd = loaded->getRootCommand();
+
+  } else if (loaded) {
     // Yes. Remember the root command
     root_cmd = loaded->getRootCommand();
 
@@ -95,6 +139,26 @@ void do_build(vector<string> args,
   // Plan the next phase of the build
   root_cmd->planBuild();
 
+  // If no commands need to run, save a predicate program so the next build can skip emulation.
+  // Most builds that reach this point have changes to run, so phase 0 does not track inputs and
+  // outputs. Instead, a build with nothing to run emulates its trace again to track them.
+  bool save_program = loaded && !restored && root_cmd->allFinished();
+  if (save_program && !track_inputs_outputs) {
+    options::track_inputs_outputs = true;
+
+    // Revert the environment to committed state
+    env::rollback();
+
+    // Emulate the trace again, and keep the output as the next input
+    TraceWriter output;
+    Build eval(output, print_to ? *print_to : std::cout);
+    input.sendTo(eval);
+    input = output.getReader();
+
+    root_cmd->planBuild();
+    save_program = root_cmd->allFinished();
+  }
+
   LOG(phase) << "Finished build phase 0";
 
   // Write stats out to CSV & reset counters
@@ -114,9 +178,14 @@ void do_build(vector<string> args,
 
     LOGF(phase, "Starting build phase {}", iteration);
 
-    // Run the trace and send the new trace to output
+    // Run the trace and send the new trace to output. A restored build has not emulated the
+    // loaded trace, so its first phase reads the loaded trace directly.
     Build build(output, print_to ? *print_to : std::cout);
-    input.sendTo(build);
+    if (iteration == 1 && restored) {
+      loaded->sendTo(build);
+    } else {
+      input.sendTo(build);
+    }
 
     // Plan the next iteration
     root_cmd->planBuild();
@@ -138,21 +207,51 @@ void do_build(vector<string> args,
   LOG(phase) << "Committing environment changes";
   env::commitAll();
 
+  // The program is compiled once the environment is committed, so it sees restored outputs
+  if (save_program) save_predicates(root_cmd, loaded->getCommands());
+  options::track_inputs_outputs = track_inputs_outputs;
+
   // If more than one phase of the build ran, then we know the trace could have changed
   if (iteration > 1) {
     LOG(phase) << "Starting post-build checks";
 
-    // Run the post-build checks and send the resulting trace directly to output
-    PostBuildChecker<TraceWriter> output(constants::DatabaseFilename);
-
     // Reset the environment
     env::rollback();
 
-    // Evaluate the trace in the output buffer from the last phase
-    Build build(output, print_to ? *print_to : std::cout);
-    input.sendTo(build);
+    // Track inputs and outputs so a predicate program can be compiled from the final trace
+    options::track_inputs_outputs = true;
+
+    // Run the post-build checks, remove redundant steps, and send the resulting trace directly to
+    // output. If there is a loaded trace, append the new trace to it so unchanged segments are not
+    // written again. Keep the IDs the new trace uses for commands so the predicate program can
+    // save the build's model under them.
+    vector<shared_ptr<Command>> commands;
+    if (loaded && !loaded->needsCompaction()) {
+      PostBuildChecker<TraceOptimizer<TraceWriter>> output(constants::DatabaseFilename, *loaded);
+      Build build(output, print_to ? *print_to : std::cout);
+      input.sendTo(build);
+      commands = output.getCommands();
+
+    } else {
+      PostBuildChecker<TraceOptimizer<TraceWriter>> output(constants::DatabaseFilename);
+      Build build(output, print_to ? *print_to : std::cout);
+      input.sendTo(build);
+      commands = output.getCommands();
+    }
 
     LOG(phase) << "Finished post-build checks";
+
+    // The post-build checks leave the model in the state the next build's phase 0 would reach. If
+    // that phase would find no commands to run, save a predicate program so the next build can
+    // skip emulation when nothing changes. A build that did not converge must run again.
+    root_cmd->planBuild();
+    if (root_cmd->allFinished()) {
+      save_predicates(root_cmd, commands);
+    } else {
+      LOG(phase) << "Not saving a predicate program because commands must run again";
+      remove_predicates();
+    }
+    options::track_inputs_outputs = track_inputs_outputs;
   }
 
   gather_stats(stats_log_path, stats, iteration);
@@ -32,8 +32,9 @@ void do_graph(vector<string> args,
               string type,
               bool show_all,
               bool no_render) noexcept {
-  // Turn on input/output tracking
+  // Turn on input/output tracking, and keep every version so the graph shows intermediate versions
   options::track_inputs_outputs = true;
+  options::keep_version_history = true;
 
   if (type.empty() && no_render) type = "dot";
   if (type.empty() && !no_render) type = "png";
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -29,6 +31,9 @@ void do_stats(vector<string> args, bool list_artifacts) noexcept {
   // Turn on input/output tracking
   options::track_inputs_outputs = true;
 
+  // Keep every version so the artifact list shows each artifact's whole history
+  if (list_artifacts) options::keep_version_history = true;
+
   // Reset the stats counters
   reset_stats();
 
@@ -45,14 +50,20 @@ void do_stats(vector<string> args, bool list_artifacts) noexcept {
   cout << "  Steps: " << stats::emulated_steps << endl;
   cout << "  Artifacts: " << stats::artifacts << endl;
   cout << "  Artifact Versions: " << stats::versions << endl;
+  cout << "  Max RSS: " << max_rss_kb() << " KB" << endl;
+
+  // Report how many versions and references each step allocates, and how often the pools
+  // backing them had to go to the heap
+  double steps = std::max(stats::emulated_steps, size_t(1));
+  stats::local.flush();
+  cout << std::fixed << std::setprecision(2);
+  cout << "  Allocations per Step: " << stats::pool_allocations / steps << endl;
+  cout << "  Heap Allocations per Step: " << stats::heap_allocations / steps << endl;
 
   if (list_artifacts) {
     cout << endl;
     cout << "Artifacts:" << endl;
-    for (const auto& weak_artifact : env::getArtifacts()) {
-      auto a = weak_artifact.lock();
-      if (!a) continue;
-
+    env::getArtifacts().forEach([](const auto& a) {
       if (a->getName().empty()) {
         cout << "  " << a->getTypeName() << ": <anonymous>" << endl;
       } else {
@@ -65,6 +76,6 @@ void do_stats(vector<string> args, bool list_artifacts) noexcept {
         index++;
       }
       cout << endl;
-    }
+    });
   }
 }
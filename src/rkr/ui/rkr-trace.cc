@@ -1,30 +1,53 @@
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "data/Trace.hh"
+#include "runtime/Command.hh"
 #include "ui/commands.hh"
 #include "util/TracePrinter.hh"
 #include "util/constants.hh"
 
 using std::cout;
 using std::ofstream;
+using std::shared_ptr;
 using std::string;
 using std::vector;
 
 /**
  * Run the `trace` subcommand
  * \param output    The name of the output file, or "-" for stdout
+ * \param command   If non-empty, only print steps from commands whose names contain this text
+ *                  and from their descendants
  */
-void do_trace(vector<string> args, string output) noexcept {
+void do_trace(vector<string> args, string output, string command) noexcept {
   auto trace = TraceReader::load(constants::DatabaseFilename);
   FAIL_IF(!trace) << "A trace could not be loaded. Run a full build first.";
 
   // Are we printing to stdout or a file?
-  if (output == "-") {
-    trace->sendTo(TracePrinter(cout));
-  } else {
-    trace->sendTo(TracePrinter(ofstream(output)));
+  ofstream file;
+  if (output != "-") file.open(output);
+  TracePrinter printer(output == "-" ? cout : file);
+
+  // Without a command filter, print the whole trace
+  if (command.empty()) {
+    trace->sendTo(printer);
+    return;
+  }
+
+  // Find the matching commands. This reads the command records, but skips every step.
+  vector<shared_ptr<Command>> matches;
+  for (const auto& c : trace->getCommands()) {
+    if (c->getFullName().find(command) != string::npos) matches.push_back(c);
   }
+
+  if (matches.empty()) {
+    WARN << "No commands in the trace match " << command;
+    return;
+  }
+
+  // Print steps only from the matching commands and their descendants
+  trace->sendTo(printer, matches);
 }
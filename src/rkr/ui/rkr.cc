@@ -109,6 +109,10 @@ int main(int argc, char* argv[]) noexcept {
       ->description("Disable the build cache")
       ->group("Optimizations");
 
+  app.add_flag("--lazy-outputs", options::lazy_outputs,
+               "Leave cached intermediate files off the filesystem until a command needs them")
+      ->group("Optimizations");
+
   /************* Build Subcommand *************/
   auto build = app.add_subcommand("build", "Perform a build (default)");
 
@@ -161,6 +165,10 @@ int main(int argc, char* argv[]) noexcept {
   auto trace = app.add_subcommand("trace", "Print a build trace in human-readable format");
   trace->add_option("-o,--output", trace_output, "Output file for the trace (default: -)");
 
+  string trace_command;
+  trace->add_option("-c,--command", trace_command,
+                    "Only print steps from commands that contain this text, and their children");
+
   /************* Graph Subcommand *************/
   // Leave output file and type empty for later default processing
   string graph_output;
@@ -197,7 +205,7 @@ int main(int argc, char* argv[]) noexcept {
   // check subcommand
   check->final_callback([&] { do_check(args); });
   // trace subcommand
-  trace->final_callback([&] { do_trace(args, trace_output); });
+  trace->final_callback([&] { do_trace(args, trace_output, trace_command); });
   // graph subcommand
   graph->final_callback([&] { do_graph(args, graph_output, graph_type, show_all, no_render); });
   // stats subcommand
@@ -0,0 +1,32 @@
+#include "InternedPath.hh"
+
+#include <deque>
+#include <string_view>
+#include <unordered_map>
+
+using std::deque;
+using std::string_view;
+using std::unordered_map;
+
+/// Every interned path, indexed by ID. A deque never moves its elements, so the strings in these
+/// paths can be viewed by the map below.
+static deque<fs::path> paths = {fs::path()};
+
+/// The IDs of interned paths, keyed by views of the paths' strings
+static unordered_map<string_view, InternedPath::ID> path_ids = {{string_view(), 0}};
+
+// Intern a path
+InternedPath InternedPath::intern(string_view p) noexcept {
+  auto iter = path_ids.find(p);
+  if (iter != path_ids.end()) return InternedPath(iter->second);
+
+  ID id = paths.size();
+  const auto& stored = paths.emplace_back(p);
+  path_ids.emplace(stored.native(), id);
+  return InternedPath(id);
+}
+
+// Get the path an interned path handle refers to
+const fs::path& InternedPath::getPath() const noexcept {
+  return paths[_id];
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <string_view>
+
+#include <fmt/core.h>
+#include <fmt/ostream.h>
+
+namespace fs = std::filesystem;
+
+/**
+ * An InternedPath is a 32-bit handle to a path in a global table. A path is interned once when it
+ * enters rkr, either from a traced syscall or from a loaded trace. After that, the tracer, IR
+ * steps, the build, and the trace writer pass the handle instead of the path. The path itself is
+ * only used to resolve it in the filesystem model or to print it.
+ *
+ * Interned paths are never removed, so a handle stays valid for the rest of the rkr process. Paths
+ * must only be interned from the main thread.
+ */
+class InternedPath {
+ public:
+  /// The type of an interned path's ID
+  using ID = uint32_t;
+
+  /// Create a handle to the empty path
+  InternedPath() noexcept = default;
+
+  /// Intern a path, or get the handle for a path that has already been interned. The path is
+  /// taken as a string view, so a new path is only allocated if it has not been interned yet.
+  static InternedPath intern(std::string_view p) noexcept;
+
+  /// Get this path's ID, which is its index in the global table
+  ID getID() const noexcept { return _id; }
+
+  /// Get the path this handle refers to
+  const fs::path& getPath() const noexcept;
+
+  /// Interned paths are equal if and only if their handles are equal
+  bool operator==(InternedPath other) const noexcept { return _id == other._id; }
+  bool operator!=(InternedPath other) const noexcept { return _id != other._id; }
+
+  /// Print an interned path
+  friend std::ostream& operator<<(std::ostream& o, InternedPath p) noexcept {
+    return o << p.getPath();
+  }
+
+ private:
+  /// Create a handle for an existing entry in the table
+  explicit InternedPath(ID id) noexcept : _id(id) {}
+
+  /// The index of this path in the global table. Path zero is the empty path.
+  ID _id = 0;
+};
+
+template <>
+struct fmt::formatter<InternedPath> : fmt::ostream_formatter {};
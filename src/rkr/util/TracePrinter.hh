@@ -7,6 +7,7 @@
 #include "data/IRSink.hh"
 #include "data/IRSource.hh"
 #include "runtime/Ref.hh"
+#include "util/InternedPath.hh"
 #include "util/wrappers.hh"
 #include "versions/ContentVersion.hh"
 #include "versions/MetadataVersion.hh"
@@ -61,7 +62,7 @@ class TracePrinter : public IRSink {
 
   virtual void symlinkRef(const IRSource& source,
                           const std::shared_ptr<Command>& c,
-                          fs::path target,
+                          const fs::path& target,
                           Ref::ID output) noexcept override {
     _out << SymlinkRefPrinter{c, target, output} << std::endl;
   }
@@ -76,7 +77,7 @@ class TracePrinter : public IRSink {
   virtual void pathRef(const IRSource& source,
                        const std::shared_ptr<Command>& c,
                        Ref::ID base,
-                       fs::path path,
+                       InternedPath path,
                        AccessFlags flags,
                        Ref::ID output) noexcept override {
     _out << PathRefPrinter{c, base, path, flags, output} << std::endl;
@@ -123,7 +124,7 @@ class TracePrinter : public IRSink {
                             const std::shared_ptr<Command>& c,
                             Scenario scenario,
                             Ref::ID ref,
-                            std::shared_ptr<ContentVersion> expected) noexcept override {
+                            const std::shared_ptr<ContentVersion>& expected) noexcept override {
     _out << MatchContentPrinter{c, scenario, ref, expected} << std::endl;
   }
 
@@ -137,7 +138,7 @@ class TracePrinter : public IRSink {
   virtual void updateContent(const IRSource& source,
                              const std::shared_ptr<Command>& c,
                              Ref::ID ref,
-                             std::shared_ptr<ContentVersion> written) noexcept override {
+                             const std::shared_ptr<ContentVersion>& written) noexcept override {
     _out << UpdateContentPrinter{c, ref, written} << std::endl;
   }
 
@@ -145,7 +146,7 @@ class TracePrinter : public IRSink {
   virtual void addEntry(const IRSource& source,
                         const std::shared_ptr<Command>& c,
                         Ref::ID dir,
-                        std::string name,
+                        const std::string& name,
                         Ref::ID target) noexcept override {
     _out << AddEntryPrinter{c, dir, name, target} << std::endl;
   }
@@ -154,7 +155,7 @@ class TracePrinter : public IRSink {
   virtual void removeEntry(const IRSource& source,
                            const std::shared_ptr<Command>& c,
                            Ref::ID dir,
-                           std::string name,
+                           const std::string& name,
                            Ref::ID target) noexcept override {
     _out << RemoveEntryPrinter{c, dir, name, target} << std::endl;
   }
@@ -162,7 +163,7 @@ class TracePrinter : public IRSink {
   virtual void launch(const IRSource& source,
                       const std::shared_ptr<Command>& c,
                       const std::shared_ptr<Command>& child,
-                      std::list<std::tuple<Ref::ID, Ref::ID>> refs) noexcept override {
+                      const std::list<std::tuple<Ref::ID, Ref::ID>>& refs) noexcept override {
     _out << LaunchPrinter{c, child, refs} << std::endl;
   }
 
@@ -265,7 +266,7 @@ class TracePrinter : public IRSink {
   struct PathRefPrinter {
     std::shared_ptr<Command> c;
     Ref::ID base;
-    fs::path path;
+    InternedPath path;
     AccessFlags flags;
     Ref::ID output;
 
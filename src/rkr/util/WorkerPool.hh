@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+/**
+ * A WorkerPool runs tasks on a fixed set of background threads. The threads are started when the
+ * first task is submitted, so a pool that is never used costs nothing. Each submitted task returns
+ * a future the caller waits on when it needs the task's result.
+ *
+ * When the pool is destroyed, its threads finish every submitted task before the destructor
+ * returns. A caller may still hold a future for any of those tasks, so none are dropped.
+ */
+class WorkerPool {
+ public:
+  /// Create a pool with up to a given number of threads, limited to the number of cores
+  explicit WorkerPool(size_t max_threads) noexcept :
+      _max_threads(std::max<size_t>(1, std::min<size_t>(max_threads,
+                                                        std::thread::hardware_concurrency()))) {}
+
+  /// Stop the pool's threads once every submitted task is finished
+  ~WorkerPool() noexcept {
+    // A forked child has a copy of the pool, but none of its threads. Destroying the condition
+    // variable would wait for those threads, so the child leaves the pool's state alone.
+    if (::getpid() != _pid) {
+      for (auto& worker : _workers) {
+        worker.detach();
+      }
+      _state.release();
+      return;
+    }
+
+    {
+      std::lock_guard lock(_state->mutex);
+      _state->stopping = true;
+    }
+    _state->ready.notify_all();
+
+    for (auto& worker : _workers) {
+      worker.join();
+    }
+  }
+
+  // Disallow copy and move
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  /// Run a task on a background thread, and return a future for the task's result
+  template <typename F>
+  auto submit(F f) noexcept -> std::future<decltype(f())> {
+    auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+    auto result = task->get_future();
+
+    {
+      std::lock_guard lock(_state->mutex);
+      _state->tasks.emplace_back([task] { (*task)(); });
+
+      // Start another thread if every running thread may be busy
+      if (_workers.size() < _max_threads && _state->tasks.size() > _state->idle) {
+        _workers.emplace_back([this] { run(); });
+      }
+    }
+    _state->ready.notify_one();
+
+    return result;
+  }
+
+ private:
+  /// Run tasks on a worker thread until the pool is destroyed and no tasks are left
+  void run() noexcept {
+    std::unique_lock lock(_state->mutex);
+    while (true) {
+      _state->idle++;
+      _state->ready.wait(lock, [this] { return _state->stopping || !_state->tasks.empty(); });
+      _state->idle--;
+
+      if (_state->tasks.empty()) return;
+
+      auto task = std::move(_state->tasks.front());
+      _state->tasks.pop_front();
+
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  /// The state shared between the pool and its threads
+  struct State {
+    /// Tasks waiting for a thread
+    std::deque<std::function<void()>> tasks;
+
+    /// The number of threads waiting for a task
+    size_t idle = 0;
+
+    /// Set when the pool is destroyed. Threads exit once the task queue is empty.
+    bool stopping = false;
+
+    /// The lock that protects the task queue and counters
+    std::mutex mutex;
+
+    /// Signaled when a task is added or the pool is stopping
+    std::condition_variable ready;
+  };
+
+  /// The process that owns this pool's threads
+  pid_t _pid = ::getpid();
+
+  /// The maximum number of threads this pool will start
+  size_t _max_threads;
+
+  /// The pool's threads
+  std::vector<std::thread> _workers;
+
+  /// The task queue and the synchronization state for the pool's threads
+  std::unique_ptr<State> _state = std::make_unique<State>();
+};
@@ -12,6 +12,9 @@ namespace constants {
   /// What is the name of the build database?
   const fs::path DatabaseFilename = OutputDir / "db";
 
+  /// Where is the predicate program for the build database saved?
+  const fs::path PredicatesFilename = OutputDir / "predicates";
+
   /// What is the name of the new build database?
   const fs::path NewDatabaseFilename = OutputDir / "newdb";
 
@@ -19,6 +19,10 @@ namespace options {
   /// Should commands keep a precise record of their inputs and outputs? Used for graph.
   inline bool track_inputs_outputs = false;
 
+  /// Should artifacts keep every version they have had, including intermediate versions nothing
+  /// refers to anymore? Used for graph and the artifact list in stats.
+  inline bool keep_version_history = false;
+
   /// When set, disable color terminal output
   inline bool disable_color = false;
 
@@ -32,6 +36,9 @@ namespace options {
   /// Enable file-staging cache
   inline bool enable_cache = true;
 
+  /// Leave cached intermediate files off the filesystem until a traced command needs them
+  inline bool lazy_outputs = false;
+
   /// Inject the shared memory tracing library
   inline bool inject_tracing_lib = true;
 
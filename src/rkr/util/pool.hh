@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#include "util/log.hh"
+#include "util/stats.hh"
+
+/**
+ * Versions and references are created at a high rate while a build is emulated, and most live for
+ * the rest of the build. Instead of a separate heap allocation for each one, these objects (along
+ * with their shared_ptr control blocks) are carved out of large chunks. Freed blocks go on a free
+ * list for their size class and are reused by the next object of the same size.
+ *
+ * Each thread has its own chunks, free lists, and allocation counters, so trace loading threads can
+ * allocate without locking or atomic updates. A block freed on a different thread simply joins that
+ * thread's free list. When a thread exits, its free blocks and the unused part of its chunk are
+ * handed to a shared list that other threads draw from before they request a new chunk. Chunks are
+ * never returned to the system; they live as long as the rkr process.
+ */
+namespace pool {
+  enum : size_t {
+    /// The number of bytes requested from the system each time a size class runs out of blocks
+    ChunkSize = 64 * 1024,
+
+    /// Block sizes are rounded up to a multiple of this alignment
+    BlockAlign = alignof(std::max_align_t)
+  };
+
+  /// Round an object size up to the block size for its size class
+  constexpr size_t blockSize(size_t size) noexcept {
+    return (size + BlockAlign - 1) / BlockAlign * BlockAlign;
+  }
+
+  /// Get memory from the heap. Allocation failure is fatal, so pooled allocation never throws.
+  inline void* allocateChunk(size_t size) noexcept {
+    void* p = ::operator new(size, std::nothrow);
+    FAIL_IF(p == nullptr) << "Out of memory allocating " << size << " bytes";
+    return p;
+  }
+
+  /// Blocks and chunks are handed out from per-thread storage for each block size
+  template <size_t Size>
+  class SizeClass {
+   public:
+    /// Take a block from the free list, or from the current chunk if the free list is empty
+    static void* allocate() noexcept {
+      stats::local.pool_allocations++;
+
+      if (_free != nullptr) {
+        auto block = _free;
+        _free = block->next;
+        return block;
+      }
+
+      if (_next == _end) {
+        // Make sure this thread's blocks are handed back when it exits
+        _exit_hook.arm();
+
+        // Reuse blocks left behind by threads that have exited before asking for a new chunk
+        if (auto block = takeShared(); block != nullptr) {
+          _free = block->next;
+          return block;
+        }
+
+        stats::local.heap_allocations++;
+        _next = static_cast<char*>(allocateChunk(ChunkSize / Size * Size));
+        _end = _next + ChunkSize / Size * Size;
+      }
+
+      void* block = _next;
+      _next += Size;
+      return block;
+    }
+
+    /// Return a block to this thread's free list
+    static void release(void* p) noexcept {
+      if (_free == nullptr) _exit_hook.arm();
+
+      auto block = static_cast<FreeBlock*>(p);
+      block->next = _free;
+      _free = block;
+    }
+
+   private:
+    /// A block on the free list holds a pointer to the next free block
+    struct FreeBlock {
+      FreeBlock* next;
+    };
+
+    /// Take every block from the shared list, or return nullptr if it is empty
+    static FreeBlock* takeShared() noexcept {
+      std::lock_guard lock(_shared_mutex);
+      return std::exchange(_shared, nullptr);
+    }
+
+    /// Hand this thread's free list and the rest of its current chunk to the shared list
+    static void giveShared() noexcept {
+      for (; _next != _end; _next += Size) {
+        auto block = reinterpret_cast<FreeBlock*>(_next);
+        block->next = _free;
+        _free = block;
+      }
+
+      if (_free == nullptr) return;
+
+      auto last = _free;
+      while (last->next != nullptr) last = last->next;
+
+      std::lock_guard lock(_shared_mutex);
+      last->next = _shared;
+      _shared = std::exchange(_free, nullptr);
+    }
+
+    /// A thread-local object whose destructor returns the thread's blocks when the thread exits.
+    /// Thread-local destructors only run for objects a thread has used, so arm() must be called
+    /// before the thread holds any blocks.
+    struct ExitHook {
+      void arm() noexcept {}
+      ~ExitHook() noexcept { giveShared(); }
+    };
+
+    static_assert(Size >= sizeof(FreeBlock), "Pool blocks must be large enough for a free list");
+    static_assert(Size <= ChunkSize, "Pool blocks must fit in a chunk");
+
+    /// The list of freed blocks available for reuse
+    inline static thread_local FreeBlock* _free = nullptr;
+
+    /// The next unused byte in the current chunk
+    inline static thread_local char* _next = nullptr;
+
+    /// The end of the current chunk
+    inline static thread_local char* _end = nullptr;
+
+    /// Hands this thread's blocks to the shared list on thread exit
+    inline static thread_local ExitHook _exit_hook;
+
+    /// Blocks left behind by threads that have exited
+    inline static FreeBlock* _shared = nullptr;
+
+    /// Protects the shared list
+    inline static std::mutex _shared_mutex;
+  };
+
+  /// A standard allocator that takes single objects from a pool. Arrays use the heap.
+  template <typename T>
+  class Allocator {
+   public:
+    using value_type = T;
+
+    Allocator() noexcept = default;
+
+    template <typename U>
+    Allocator(const Allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) noexcept {
+      static_assert(alignof(T) <= BlockAlign, "Pooled objects cannot be over-aligned");
+      if (n != 1) {
+        stats::local.heap_allocations++;
+        return static_cast<T*>(allocateChunk(n * sizeof(T)));
+      }
+      return static_cast<T*>(SizeClass<blockSize(sizeof(T))>::allocate());
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+      if (n != 1) {
+        ::operator delete(p);
+      } else {
+        SizeClass<blockSize(sizeof(T))>::release(p);
+      }
+    }
+
+    template <typename U>
+    bool operator==(const Allocator<U>&) const noexcept {
+      return true;
+    }
+
+    template <typename U>
+    bool operator!=(const Allocator<U>&) const noexcept {
+      return false;
+    }
+  };
+}
+
+/// Create a shared object in a pool. Use this in place of std::make_shared for versions and refs.
+template <typename T, typename... Args>
+std::shared_ptr<T> make_pooled(Args&&... args) noexcept {
+  return std::allocate_shared<T>(pool::Allocator<T>(), std::forward<Args>(args)...);
+}
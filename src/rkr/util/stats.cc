@@ -5,6 +5,8 @@
 #include <optional>
 #include <string>
 
+#include <sys/resource.h>
+
 using std::endl;
 using std::fstream;
 using std::optional;
@@ -16,7 +18,9 @@ namespace fs = std::filesystem;
 #define HEADER                                                                         \
   {                                                                                    \
     "phase", "emulated_commands", "traced_commands", "emulated_steps", "traced_steps", \
-        "artifacts", "versions", "ptrace_stops", "syscalls", "elapsed_ns"              \
+        "replayed_steps", "artifacts", "versions", "max_rss_kb",                       \
+        "pool_allocations", "heap_allocations", "ptrace_stops", "syscalls",            \
+        "db_bytes_written", "staged_bytes", "staged_bytes_per_sec", "elapsed_ns"       \
   }
 
 /**
@@ -57,6 +61,15 @@ int stats_header(string& header) {
   return stats_len;
 }
 
+/**
+ * Get the peak resident set size of this process, in kilobytes.
+ */
+size_t max_rss_kb() noexcept {
+  struct rusage usage;
+  if (::getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  return usage.ru_maxrss;
+}
+
 /**
  * Write stats to CSV.
  */
@@ -94,6 +107,9 @@ void gather_stats(optional<fs::path> p, optional<string>& stats_opt, int phase)
 
     auto end_time = std::chrono::high_resolution_clock::now();
 
+    // Include allocations counted on this thread since the last time stats were gathered
+    stats::local.flush();
+
     // Add data to the stats value
     stats_opt.value() += prefix;
     stats_opt.value() += q(to_string(phase)) + ",";
@@ -101,10 +117,23 @@ void gather_stats(optional<fs::path> p, optional<string>& stats_opt, int phase)
     stats_opt.value() += q(to_string(stats::traced_commands)) + ",";
     stats_opt.value() += q(to_string(stats::emulated_steps)) + ",";
     stats_opt.value() += q(to_string(stats::traced_steps)) + ",";
+    stats_opt.value() += q(to_string(stats::replayed_steps)) + ",";
     stats_opt.value() += q(to_string(stats::artifacts)) + ",";
     stats_opt.value() += q(to_string(stats::versions)) + ",";
+    stats_opt.value() += q(to_string(max_rss_kb())) + ",";
+    stats_opt.value() += q(to_string(stats::pool_allocations)) + ",";
+    stats_opt.value() += q(to_string(stats::heap_allocations)) + ",";
     stats_opt.value() += q(to_string(stats::ptrace_stops)) + ",";
     stats_opt.value() += q(std::to_string(stats::syscalls)) + ",";
+    stats_opt.value() += q(std::to_string(stats::db_bytes_written)) + ",";
+    stats_opt.value() += q(std::to_string(stats::staged_bytes)) + ",";
+
+    // Report the rate files were staged in from the cache, including copies made in parallel
+    size_t staged_bytes_per_sec = 0;
+    if (stats::staging_ns > 0) {
+      staged_bytes_per_sec = stats::staged_bytes * 1'000'000'000.0 / stats::staging_ns;
+    }
+    stats_opt.value() += q(std::to_string(staged_bytes_per_sec)) + ",";
     stats_opt.value() += q(std::to_string((end_time - stats::start_time).count()));
   }
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <cstddef>
 #include <filesystem>
@@ -24,17 +25,56 @@ namespace stats {
   /// The number of traced IR steps
   inline size_t traced_steps = 0;
 
+  /// The number of IR steps replayed after being deferred until their command launched
+  inline size_t replayed_steps = 0;
+
   /// The total number of artifacts
   inline size_t artifacts = 0;
 
-  /// The total number of versions
-  inline size_t versions = 0;
+  /// The total number of versions. Versions may be created by trace loading threads.
+  inline std::atomic<size_t> versions = 0;
+
+  /// The number of versions and references allocated from pools. These may be allocated by trace
+  /// loading threads, which count in stats::local and add their totals here.
+  inline std::atomic<size_t> pool_allocations = 0;
+
+  /// The number of heap allocations made to back pools of versions and references
+  inline std::atomic<size_t> heap_allocations = 0;
+
+  /// Counters bumped on hot paths. Each thread keeps its own plain counts and adds them to the
+  /// shared totals when the thread exits or when stats are gathered.
+  struct LocalCounters {
+    size_t pool_allocations = 0;
+    size_t heap_allocations = 0;
+
+    /// Add this thread's counts to the shared totals and start counting from zero
+    void flush() noexcept {
+      stats::pool_allocations += pool_allocations;
+      stats::heap_allocations += heap_allocations;
+      pool_allocations = 0;
+      heap_allocations = 0;
+    }
+
+    ~LocalCounters() noexcept { flush(); }
+  };
+
+  /// The calling thread's counters
+  inline thread_local LocalCounters local;
 
   /// The total number of ptrace stops
   inline size_t ptrace_stops = 0;
 
   /// The total number of traced syscalls
   inline size_t syscalls = 0;
+
+  /// The number of bytes written to the build database
+  inline size_t db_bytes_written = 0;
+
+  /// The number of bytes copied out of the cache when committing files
+  inline size_t staged_bytes = 0;
+
+  /// The time spent copying files out of the cache, in nanoseconds
+  inline size_t staging_ns = 0;
 }
 
 /// Reset all stats counters to their default values
@@ -44,12 +84,25 @@ inline static void reset_stats() noexcept {
   stats::traced_commands = 0;
   stats::emulated_steps = 0;
   stats::traced_steps = 0;
+  stats::replayed_steps = 0;
   stats::artifacts = 0;
   stats::versions = 0;
+  stats::pool_allocations = 0;
+  stats::heap_allocations = 0;
+  stats::local.pool_allocations = 0;
+  stats::local.heap_allocations = 0;
   stats::ptrace_stops = 0;
   stats::syscalls = 0;
+  stats::db_bytes_written = 0;
+  stats::staged_bytes = 0;
+  stats::staging_ns = 0;
 }
 
+/**
+ * Get the peak resident set size of this process, in kilobytes.
+ */
+size_t max_rss_kb() noexcept;
+
 /**
  * Write stats to CSV.
  */
@@ -0,0 +1,49 @@
+#include "DirListVersion.hh"
+
+#include <iomanip>
+#include <ostream>
+
+#include "blake3.h"
+
+using std::ostream;
+
+// Get the digest of this version's sorted entries
+const DirListVersion::Digest& DirListVersion::getDigest() noexcept {
+  if (!_digest.has_value()) {
+    ASSERT(_has_entries) << "Directory listing has neither entries nor a digest";
+
+    // Hash each entry name, including its terminating null byte so names cannot run together
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    for (const auto& entry : _entries) {
+      blake3_hasher_update(&hasher, entry.c_str(), entry.native().size() + 1);
+    }
+
+    Digest digest;
+    blake3_hasher_finalize(&hasher, digest.data(), digest.size());
+    _digest = digest;
+  }
+
+  return _digest.value();
+}
+
+// Print this version
+ostream& DirListVersion::print(ostream& o) const noexcept {
+  // A version loaded from a trace only has a digest, so print the start of it
+  if (!_has_entries) {
+    o << "[dir: " << _entry_count << " entries, digest ";
+    for (size_t i = 0; i < 4; i++) {
+      o << std::setfill('0') << std::setw(2) << std::hex << static_cast<int>(_digest.value()[i]);
+    }
+    return o << std::dec << "]";
+  }
+
+  o << "[dir: {";
+  bool first = true;
+  for (const auto& entry : _entries) {
+    if (!first) o << ", ";
+    first = false;
+    o << entry;
+  }
+  return o << "}]";
+}
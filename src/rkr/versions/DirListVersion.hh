@@ -1,7 +1,10 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <filesystem>
 #include <memory>
+#include <optional>
 #include <ostream>
 #include <set>
 #include <string>
@@ -15,43 +18,63 @@ namespace fs = std::filesystem;
  * A DirListVersion stores a list of all entries in a directory. This version is created
  * on-demand when a command lists the contents of a directory. These versions can be matched against
  * a directory, but are never used to update the contents of a directory.
+ *
+ * Listings are compared by a digest of their sorted entries. Versions loaded from a trace only
+ * have the digest and the number of entries, since the names are only useful for printing.
  */
 class DirListVersion : public ContentVersion {
  public:
+  /// The type of a digest of a directory listing
+  using Digest = std::array<uint8_t, 16>;
+
   DirListVersion() noexcept = default;
 
+  /// Create a version for a listing with a known digest, without its entries
+  DirListVersion(Digest digest, size_t entry_count) noexcept :
+      _digest(digest), _entry_count(entry_count), _has_entries(false) {}
+
   /// Check if this list matches another list
   virtual bool matches(std::shared_ptr<ContentVersion> other) noexcept override {
     auto other_list = other->as<DirListVersion>();
     if (!other_list) return false;
-    return _entries == other_list->_entries;
+    return getEntryCount() == other_list->getEntryCount() &&
+           getDigest() == other_list->getDigest();
   }
 
   /// Get the name for the type of version this is
   virtual std::string getTypeName() const noexcept override { return "dir list"; }
 
   /// Print this version
-  virtual std::ostream& print(std::ostream& o) const noexcept override {
-    o << "[dir: {";
-    bool first = true;
-    for (const auto& entry : _entries) {
-      if (!first) o << ", ";
-      first = false;
-      o << entry;
-    }
-    return o << "}]";
-  }
+  virtual std::ostream& print(std::ostream& o) const noexcept override;
 
   /// Add an entry to this listed directory version
-  void addEntry(fs::path name) noexcept { _entries.insert(name); }
+  void addEntry(fs::path name) noexcept {
+    _entries.insert(name);
+    _digest.reset();
+  }
 
   /// Remove an entry from this listed directory version
-  void removeEntry(fs::path name) noexcept { _entries.erase(name); }
+  void removeEntry(fs::path name) noexcept {
+    _entries.erase(name);
+    _digest.reset();
+  }
 
-  /// Get the entries in this version
-  const std::set<fs::path>& getEntries() const noexcept { return _entries; }
+  /// Get the number of entries in this version
+  size_t getEntryCount() const noexcept { return _has_entries ? _entries.size() : _entry_count; }
+
+  /// Get the digest of this version's sorted entries
+  const Digest& getDigest() noexcept;
 
  private:
-  /// The names of entries in the directory
+  /// The names of entries in the directory, if they are known
   std::set<fs::path> _entries;
+
+  /// The digest of the entries, computed when it is first needed
+  std::optional<Digest> _digest;
+
+  /// The number of entries in a listing that was loaded without its entries
+  size_t _entry_count = 0;
+
+  /// Are the names of the entries known?
+  bool _has_entries = true;
 };
\ No newline at end of file
@@ -1,7 +1,11 @@
 #include "FileVersion.hh"
 
 #include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
 #include <filesystem>
+#include <future>
 #include <iomanip>
 #include <memory>
 #include <optional>
@@ -17,7 +21,9 @@
 #include "blake3.h"
 #include "util/constants.hh"
 #include "util/log.hh"
+#include "util/WorkerPool.hh"
 #include "util/options.hh"
+#include "util/stats.hh"
 #include "util/wrappers.hh"
 
 using std::nullopt;
@@ -32,6 +38,33 @@ namespace fs = std::filesystem;
 // The number of bytes read from a file at once when using read() for blake3 hashing
 enum : size_t { BLAKE3BUFSZ = 65536 };
 
+/// The maximum number of threads that fingerprint and cache files in the background
+enum : size_t { MaxBackgroundWorkers = 4 };
+
+/// The pool of threads that fingerprint and cache files in the background
+static WorkerPool background_workers(MaxBackgroundWorkers);
+
+/// The maximum number of cached files copied at once during a parallel commit. Each copy holds two
+/// open file descriptors until it finishes.
+enum : size_t { MaxPendingStages = 64 };
+
+/// A copy from the cache that runs on a background thread
+struct PendingStage {
+  fs::path path;
+  fs::path hash_file;
+  off_t len;
+  std::future<int> error;
+};
+
+/// Are cached files currently being staged in parallel?
+static bool parallel_staging = false;
+
+/// Copies from the cache that have been started but not yet collected
+static std::deque<PendingStage> pending_stages;
+
+/// When the first copy of the current parallel commit started
+static optional<std::chrono::high_resolution_clock::time_point> parallel_staging_start;
+
 /// Convert a BLAKE3 byte array to a hexadecimal string
 static string b3hex(FileVersion::Hash b3hash) noexcept {
   stringstream ss;
@@ -41,55 +74,84 @@ static string b3hex(FileVersion::Hash b3hash) noexcept {
   return ss.str();
 }
 
-/// Return a BLAKE3 hash for the contents of the file at the given path.
-static optional<FileVersion::Hash> blake3(fs::path path, struct stat& statbuf) noexcept {
+/// Compute a BLAKE3 hash for the contents of an open file. Returns true if the file was mmapped,
+/// or false if it was hashed with read() calls. This does not log, so background threads use it.
+static bool blake3(int fd, off_t size, FileVersion::Hash& output) noexcept {
   // initialize hasher
   blake3_hasher hasher;
   blake3_hasher_init(&hasher);
 
-  // read from given file
-  LOG(artifact) << "Fingerprinting " << path;
-  int fd = ::open(path.c_str(), O_RDONLY);
-  if (fd < 0) {
-    LOG(artifact) << "Unable to fingerprint file " << path << ": " << ERR;
-    return nullopt;
-  }
-
-  // create output array
-  FileVersion::Hash output;
-
   // try to mmap the file
-  void* p = ::mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  void* p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
 
   // Did the mmap call succeed?
-  if (p == MAP_FAILED) {
-    // No. Fall back to read() calls
-    LOG(artifact) << "Unable to mmap file " << path << ": " << ERR;
+  bool mapped = p != MAP_FAILED;
+  if (mapped) {
+    // Yes. Now p points to the file data. Send it all at once.
+    blake3_hasher_update(&hasher, p, size);
 
-    // Buffer for reading blocks from the file
+    // Unmap
+    ::munmap(p, size);
+
+  } else {
+    // No. Fall back to read() calls
     char buf[BLAKE3BUFSZ];
 
     // compute hash incrementally for each chunk read
+    ::lseek(fd, 0, SEEK_SET);
     ssize_t n;
     while ((n = ::read(fd, buf, sizeof(buf))) > 0) {
       blake3_hasher_update(&hasher, buf, n);
     }
+  }
 
-  } else {
-    LOG(artifact) << "Hashing file " << path << " from mmapped data.";
-    // Yes. Now p points to the file data. Send it all at once.
-    blake3_hasher_update(&hasher, p, statbuf.st_size);
+  // finalize the hash
+  blake3_hasher_finalize(&hasher, output.data(), BLAKE3_OUT_LEN);
 
-    // Unmap
-    ::munmap(p, statbuf.st_size);
+  return mapped;
+}
+
+/// Copy the contents of one open file to another and compute a BLAKE3 hash of the bytes copied, so
+/// the source is only read once. This does not log, so background threads use it.
+static bool blake3_copy(int src_fd, int dst_fd, FileVersion::Hash& output) noexcept {
+  blake3_hasher hasher;
+  blake3_hasher_init(&hasher);
+
+  char buf[BLAKE3BUFSZ];
+  ssize_t bytes_read;
+  while ((bytes_read = ::read(src_fd, buf, sizeof(buf))) > 0) {
+    blake3_hasher_update(&hasher, buf, bytes_read);
+    if (::write(dst_fd, buf, bytes_read) != bytes_read) return false;
+  }
+  if (bytes_read < 0) return false;
+
+  blake3_hasher_finalize(&hasher, output.data(), BLAKE3_OUT_LEN);
+  return true;
+}
+
+/// Return a BLAKE3 hash for the contents of the file at the given path.
+static optional<FileVersion::Hash> blake3(fs::path path, struct stat& statbuf) noexcept {
+  // read from given file
+  LOG(artifact) << "Fingerprinting " << path;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(artifact) << "Unable to fingerprint file " << path << ": " << ERR;
+    return nullopt;
+  }
+
+  // create output array
+  FileVersion::Hash output;
+
+  // Hash the file
+  if (blake3(fd, statbuf.st_size, output)) {
+    LOG(artifact) << "Hashed file " << path << " from mmapped data.";
+  } else {
+    LOG(artifact) << "Unable to mmap file " << path << ". Hashed it with read() calls instead.";
   }
 
   // Close the file
   ::close(fd);
 
-  // finalize the hash
-  blake3_hasher_finalize(&hasher, output.data(), BLAKE3_OUT_LEN);
-
   return output;
 }
 
@@ -107,6 +169,8 @@ static fs::path hashPath(FileVersion::Hash& hash) noexcept {
 
 /// Tell the garbage collector to preserve this version.
 void FileVersion::gcLink() noexcept {
+  waitForBackground();
+
   // If this file is not cached, there's nothing to do.
   if (!_cached) return;
 
@@ -151,11 +215,13 @@ void FileVersion::gcLink() noexcept {
 
 // Is this version saved in a way that can be committed?
 bool FileVersion::canCommit() const noexcept {
+  waitForBackground();
   return _empty || (options::enable_cache && _cached);
 }
 
 /// Commit this version to the filesystem
 void FileVersion::commit(fs::path path, mode_t mode) noexcept {
+  waitForBackground();
   ASSERT(canCommit()) << "Attempted to commit unsaved version " << this << " to " << path;
 
   // is this an empty file?
@@ -188,6 +254,8 @@ void FileVersion::commitEmptyFile(fs::path path, mode_t mode) noexcept {
 
 /// Save a fingerprint of this version
 void FileVersion::fingerprint(fs::path path, FingerprintType type) noexcept {
+  waitForBackground();
+
   // If no fingerprint was requested, return immediately
   if (type == FingerprintType::None) return;
 
@@ -224,10 +292,49 @@ void FileVersion::fingerprint(fs::path path, FingerprintType type) noexcept {
 }
 
 void FileVersion::makeEmptyFingerprint() noexcept {
+  waitForBackground();
+
   // it is not necessary to fingerprint or cache empty files
   _empty = true;
 }
 
+/// Copy the contents of one open file to another. This does not log, so background threads use it.
+static bool copy_fd(int src_fd, int dst_fd, off_t len) noexcept {
+  while (len > 0) {
+    ssize_t bytes_cp = ::copy_file_range(src_fd, nullptr, dst_fd, nullptr, len, 0);
+    if (bytes_cp == -1 && errno == EXDEV) break;
+    if (bytes_cp <= 0) return bytes_cp == 0;
+    len -= bytes_cp;
+  }
+
+  // Fall back to read() and write() calls when copying across devices
+  if (len > 0) {
+    char buf[BLAKE3BUFSZ];
+    ssize_t bytes_read;
+    while ((bytes_read = ::read(src_fd, buf, sizeof(buf))) > 0) {
+      if (::write(dst_fd, buf, bytes_read) != bytes_read) return false;
+    }
+    if (bytes_read < 0) return false;
+  }
+
+  return true;
+}
+
+/// Wait for the oldest copy from the cache in a parallel commit to finish
+static void collectPendingStage() noexcept {
+  auto stage = std::move(pending_stages.front());
+  pending_stages.pop_front();
+
+  errno = stage.error.get();
+  FAIL_IF(errno != 0) << "Could not copy cache file " << stage.hash_file << " to stage location "
+                      << stage.path << ": " << ERR;
+
+  stats::staged_bytes += stage.len;
+
+  LOG(cache) << "Staged in file version at path " << stage.path << " from cache file "
+             << stage.hash_file;
+}
+
 /// Restores a file to the given path from the cache.
 /// Returns true if the cache file exists and restoration was successful.
 /// The exact error message can be printed by the caller by inspecting errno.
@@ -248,29 +355,65 @@ bool FileVersion::stage(fs::path path, mode_t mode) noexcept {
                         << hash_file << ": " << ERR;
 
   // Open source and destination fds
-  int src_fd = ::open(hash_file.c_str(), O_RDONLY);
+  int src_fd = ::open(hash_file.c_str(), O_RDONLY | O_CLOEXEC);
   FAIL_IF(src_fd == -1) << "Unable to open cache file " << hash_file << ": " << ERR;
-  int dst_fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, mode);
+  int dst_fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, mode);
   FAIL_IF(dst_fd == -1) << "Unable to create stage file " << path << ": " << ERR;
 
-  // copy file to cache using non-POSIX fast copy
-  loff_t bytes_cp;
-  do {
-    bytes_cp = ::copy_file_range(src_fd, NULL, dst_fd, NULL, len, 0);
-    FAIL_IF(bytes_cp == -1) << "Could not copy cache file " << hash_file << " to stage location "
-                            << path << ": " << ERR;
+  // During a parallel commit the file now exists, so later links, renames, and metadata changes
+  // can go ahead in order while its contents are copied on a background thread.
+  if (parallel_staging) {
+    if (pending_stages.size() >= MaxPendingStages) collectPendingStage();
+    if (!parallel_staging_start.has_value()) {
+      parallel_staging_start = std::chrono::high_resolution_clock::now();
+    }
 
-    len -= bytes_cp;
-  } while (len > 0 && bytes_cp > 0);
+    auto error = background_workers.submit([=] {
+      int rc = copy_fd(src_fd, dst_fd, len) ? 0 : errno;
+      ::close(src_fd);
+      ::close(dst_fd);
+      return rc;
+    });
+    pending_stages.push_back(PendingStage{path, hash_file, len, std::move(error)});
+    return true;
+  }
+
+  // copy file to cache using non-POSIX fast copy
+  auto start = std::chrono::high_resolution_clock::now();
+  FAIL_IF(!copy_fd(src_fd, dst_fd, len))
+      << "Could not copy cache file " << hash_file << " to stage location " << path << ": " << ERR;
 
   close(src_fd);
   close(dst_fd);
 
+  stats::staged_bytes += len;
+  stats::staging_ns += (std::chrono::high_resolution_clock::now() - start).count();
+
   LOG(cache) << "Staged in file version at path " << path << " from cache file " << hash_file;
 
   return true;
 }
 
+/// Start staging cached files in parallel
+void FileVersion::beginParallelStaging() noexcept {
+  parallel_staging = true;
+}
+
+/// Wait for every cached file staged in parallel to finish copying
+void FileVersion::finishParallelStaging() noexcept {
+  while (!pending_stages.empty()) {
+    collectPendingStage();
+  }
+
+  if (parallel_staging_start.has_value()) {
+    auto elapsed = std::chrono::high_resolution_clock::now() - parallel_staging_start.value();
+    stats::staging_ns += elapsed.count();
+    parallel_staging_start.reset();
+  }
+
+  parallel_staging = false;
+}
+
 bool fast_copy(fs::path src, fs::path dest) noexcept {
   // Get the length of the src file
   loff_t len = fileLength(src);
@@ -338,6 +481,8 @@ bool fast_copy(fs::path src, fs::path dest) noexcept {
 }
 
 void FileVersion::cache(fs::path path) noexcept {
+  waitForBackground();
+
   // Don't cache if already cached
   if (_cached) {
     LOG(artifact) << "Not caching version " << this << " at path " << path
@@ -383,8 +528,145 @@ void FileVersion::cache(fs::path path) noexcept {
   }
 }
 
+/// Fingerprint this version, and possibly cache it, on a background thread
+void FileVersion::fingerprintInBackground(fs::path path,
+                                          FingerprintType type,
+                                          bool cache) noexcept {
+  waitForBackground();
+
+  // Skip any work that has already been done. Caching requires a full fingerprint.
+  bool need_mtime = type != FingerprintType::None && !_mtime.has_value();
+  bool need_hash = (type == FingerprintType::Full || cache) && !_hash.has_value();
+  cache = cache && !_cached;
+  if (!need_mtime && !need_hash && !cache) return;
+
+  // Take a snapshot of the file's state now. The background work is discarded if the file no
+  // longer matches the snapshot when it is read.
+  struct stat snapshot;
+  if (::lstat(path.c_str(), &snapshot) != 0) {
+    LOG(cache) << "Failed stat call in FileVersion::fingerprintInBackground(" << path
+               << "): " << ERR;
+    return;
+  }
+
+  // The quick fingerprint comes straight from the snapshot
+  _empty = snapshot.st_size == 0;
+  _mtime = snapshot.st_mtim;
+
+  // Only regular files are hashed, and empty files are never cached
+  if (!S_ISREG(snapshot.st_mode)) return;
+  cache = cache && !_empty;
+  if (!need_hash && !cache) return;
+
+  LOG(cache) << "Fingerprinting " << (cache ? "and caching " : "") << "version " << this
+             << " at path " << path << " in the background";
+
+  _background = background_workers.submit([=, known_hash = _hash] {
+    return collectInBackground(path, snapshot, cache, known_hash);
+  });
+}
+
+/// Do two stat results describe the same file with no visible modification? Timestamps only change
+/// once per clock tick, so this cannot rule out a write in the same tick as the first stat.
+static bool unchanged(const struct stat& before, const struct stat& after) noexcept {
+  return before.st_dev == after.st_dev && before.st_ino == after.st_ino &&
+         before.st_size == after.st_size && before.st_mtim.tv_sec == after.st_mtim.tv_sec &&
+         before.st_mtim.tv_nsec == after.st_mtim.tv_nsec &&
+         before.st_ctim.tv_sec == after.st_ctim.tv_sec &&
+         before.st_ctim.tv_nsec == after.st_ctim.tv_nsec;
+}
+
+// Collect a fingerprint, and possibly cache the file, on a background thread. This runs without
+// access to the version, and must not log.
+FileVersion::BackgroundResult FileVersion::collectInBackground(fs::path path,
+                                                               struct stat snapshot,
+                                                               bool cache,
+                                                               optional<Hash> known_hash) noexcept {
+  BackgroundResult result;
+
+  // Has the file changed since the snapshot was taken?
+  struct stat before;
+  if (::lstat(path.c_str(), &before) != 0 || !unchanged(snapshot, before)) return result;
+
+  // A file that is already hashed and in the cache does not need to be read again
+  if (known_hash.has_value() && fileExists(constants::CacheDir / hashPath(known_hash.value()))) {
+    result.valid = true;
+    result.cached = true;
+    return result;
+  }
+
+  // Files opened here are close-on-exec, so a command launched meanwhile does not inherit them
+  int src_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0) return result;
+
+  // Copy the file into a temporary cache file, hashing the bytes as they are copied. The hash then
+  // describes exactly the bytes in the cache, even if the original is modified during the copy.
+  fs::path temp_file;
+  Hash hash;
+  if (cache) {
+    std::error_code ec;
+    fs::create_directories(constants::CacheDir, ec);
+    string temp_template = (constants::CacheDir / "tmp.XXXXXX").string();
+    int temp_fd = ::mkostemp(temp_template.data(), O_CLOEXEC);
+    if (temp_fd >= 0) temp_file = temp_template;
+    bool copied = temp_fd >= 0 && blake3_copy(src_fd, temp_fd, hash);
+    if (temp_fd >= 0) ::close(temp_fd);
+    if (!copied) {
+      ::close(src_fd);
+      if (!temp_file.empty()) ::unlink(temp_file.c_str());
+      return result;
+    }
+
+  } else {
+    blake3(src_fd, snapshot.st_size, hash);
+  }
+  result.hash = hash;
+
+  ::close(src_fd);
+
+  // Discard the result if the file was replaced or modified while it was read, or if the bytes read
+  // do not match the hash this version already has
+  struct stat after;
+  if ((known_hash.has_value() && known_hash != result.hash) ||
+      ::lstat(path.c_str(), &after) != 0 || !unchanged(snapshot, after)) {
+    if (!temp_file.empty()) ::unlink(temp_file.c_str());
+    return BackgroundResult();
+  }
+
+  // Move the cached copy into place
+  if (!temp_file.empty()) {
+    fs::path hash_file = constants::CacheDir / hashPath(result.hash.value());
+    std::error_code ec;
+    fs::create_directories(hash_file.parent_path(), ec);
+    result.cached = ::rename(temp_file.c_str(), hash_file.c_str()) == 0;
+    if (!result.cached) ::unlink(temp_file.c_str());
+  }
+
+  result.valid = true;
+  return result;
+}
+
+// Apply the result of background fingerprinting to this version
+void FileVersion::applyBackground() noexcept {
+  auto result = _background.get();
+
+  if (!result.valid) {
+    LOG(cache) << "Discarded background fingerprint for version " << this
+               << " because the file changed while it was read";
+    return;
+  }
+
+  if (!_hash.has_value()) _hash = result.hash;
+  _cached = _cached || result.cached;
+
+  LOG(cache) << "Collected background fingerprint for version " << this;
+}
+
 /// Compare to another fingerprint instance
 bool FileVersion::fingerprints_match(shared_ptr<FileVersion> other) const noexcept {
+  waitForBackground();
+  other->waitForBackground();
+
   // Two empty files are always equivalent
   if (_empty && other->_empty) {
     LOG(artifact) << "Not checking equality for fingerprint: both files are empty.";
@@ -417,6 +699,8 @@ bool FileVersion::fingerprints_match(shared_ptr<FileVersion> other) const noexce
 
 /// Pretty printer
 ostream& FileVersion::print(ostream& o) const noexcept {
+  waitForBackground();
+
   // is empty
   if (_empty) return o << "[file content: empty]";
 
@@ -478,6 +762,9 @@ bool FileVersion::canCoalesceWith(std::shared_ptr<ContentVersion> other) const n
   auto other_fv = other->as<FileVersion>();
   if (!other_fv) return false;
 
+  waitForBackground();
+  other_fv->waitForBackground();
+
   // If one version is empty and the other is not, the writes cannot be coalesced
   if (_empty != other_fv->_empty) return false;
 
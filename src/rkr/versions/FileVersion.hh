@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <ctime>
 #include <filesystem>
+#include <future>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -37,6 +38,7 @@ class FileVersion final : public ContentVersion {
 
   /// Get the name for this type of version
   virtual std::string getTypeName() const noexcept override {
+    waitForBackground();
     if (_empty) {
       return "file content (empty)";
     } else if (_cached) {
@@ -55,6 +57,10 @@ class FileVersion final : public ContentVersion {
   /// Save a fingerprint of this version
   void fingerprint(fs::path path, FingerprintType type) noexcept;
 
+  /// Fingerprint this version on a background thread, and cache it too if requested. Anything that
+  /// later needs the fingerprint or cached copy waits for the background work to finish.
+  void fingerprintInBackground(fs::path path, FingerprintType type, bool cache) noexcept;
+
   /// Save an empty fingerprint of this version
   void makeEmptyFingerprint() noexcept;
 
@@ -73,19 +79,64 @@ class FileVersion final : public ContentVersion {
   /// Tell the garbage collector to preserve this version.
   virtual void gcLink() noexcept override;
 
+  /// Start staging cached files in parallel. Until finishParallelStaging is called, committing a
+  /// cached version creates the file right away, but copies its contents on a background thread.
+  static void beginParallelStaging() noexcept;
+
+  /// Wait for all cached files staged in parallel to finish copying
+  static void finishParallelStaging() noexcept;
+
   /// Check if this file version is empty
-  bool isEmpty() const noexcept { return _empty; }
+  bool isEmpty() const noexcept {
+    waitForBackground();
+    return _empty;
+  }
 
   /// Check if this file version is cached
-  bool isCached() const noexcept { return _cached; }
+  bool isCached() const noexcept {
+    waitForBackground();
+    return _cached;
+  }
 
   /// Get this version's modification time
-  const std::optional<struct timespec>& getModificationTime() const noexcept { return _mtime; }
+  const std::optional<struct timespec>& getModificationTime() const noexcept {
+    waitForBackground();
+    return _mtime;
+  }
 
   /// Get this version's hash
-  const std::optional<Hash>& getHash() const noexcept { return _hash; }
+  const std::optional<Hash>& getHash() const noexcept {
+    waitForBackground();
+    return _hash;
+  }
 
  private:
+  /// The fingerprint and cache state collected by a background worker
+  struct BackgroundResult {
+    /// Is this result usable? A result is discarded if the file changed while it was read.
+    bool valid = false;
+
+    /// The hash of the file's contents
+    std::optional<Hash> hash;
+
+    /// Was the file copied into the cache?
+    bool cached = false;
+  };
+
+  /// Collect a fingerprint, and possibly cache the file, on a background thread
+  static BackgroundResult collectInBackground(fs::path path,
+                                              struct stat snapshot,
+                                              bool cache,
+                                              std::optional<Hash> known_hash) noexcept;
+
+  /// Wait for background fingerprinting to finish, then apply its result to this version
+  void waitForBackground() const noexcept {
+    if (_background.valid()) const_cast<FileVersion*>(this)->applyBackground();
+  }
+
+  /// Apply the result of finished background fingerprinting to this version
+  void applyBackground() noexcept;
+
   /// Compare to another fingerprint instance
   bool fingerprints_match(std::shared_ptr<FileVersion> other) const noexcept;
 
@@ -110,4 +161,7 @@ class FileVersion final : public ContentVersion {
 
   /// Transient field: has this version been linked into the new cache directory?
   bool _linked = false;
+
+  /// Transient field: background fingerprinting that has not been applied to this version yet
+  std::future<BackgroundResult> _background;
 };
@@ -0,0 +1,74 @@
+Check that repeated nop builds skip emulation, and that changes still trigger a rebuild
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr myfile
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
+
+Run the first build
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  ./A
+  cat inputA
+  ./B
+  cat inputB
+
+Run a rebuild. The first build saved a predicate program, so nothing needs to run
+  $ rkr --show
+
+Run another rebuild, which should skip emulation
+  $ rkr --show --log phase
+  (phase) Predicate program passed. Skipping build
+
+Change inputB
+  $ echo " frodo" > inputB
+
+Run a rebuild
+  $ rkr --show
+  cat inputB
+
+Check the output
+  $ cat myfile
+  hello frodo
+
+Remove the output
+  $ rm myfile
+
+Run a rebuild, which should commit the cached output
+  $ rkr --show
+
+Check the output
+  $ cat myfile
+  hello frodo
+
+Wait so the outputs are older than any new predicate program, then run a rebuild with nothing to do
+  $ sleep 0.1
+  $ rkr --show
+
+Change inputB to a different length
+  $ echo " samwise" > inputB
+
+Run a rebuild, which restores the model saved with the predicate program instead of emulating
+  $ rkr --show --log phase
+  (phase) Starting build phase 0
+  (phase) Restored build from predicate program
+  (phase) Finished build phase 0
+  (phase) Starting build phase 1
+  cat inputB
+  (phase) Finished build phase 1
+  (phase) Committing environment changes
+  (phase) Starting post-build checks
+  (phase) Finished post-build checks
+
+Check the output
+  $ cat myfile
+  hello samwise
+
+Clean up
+  $ rm -rf .rkr myfile
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
@@ -0,0 +1,35 @@
+Check that the trace can be printed for a single command and its descendants
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr myfile
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
+
+Run the first build
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  ./A
+  cat inputA
+  ./B
+  cat inputB
+
+Print the steps for ./B, which should include its child but no other commands
+  $ rkr trace --command ./B | sed 's/^\[Command \([^]]*\)\].*/\1/' | sort -u
+  ./B
+  cat inputB
+
+The steps for a command should match the full trace
+  $ rkr trace | grep '^\[Command cat inputA\]' > full.out
+  $ rkr trace --command "cat inputA" > filtered.out
+  $ cmp full.out filtered.out
+
+A filter that matches nothing prints no steps
+  $ rkr trace --command nomatch
+  (warning) No commands in the trace match nomatch
+
+Clean up
+  $ rm -rf .rkr myfile full.out filtered.out
@@ -0,0 +1,55 @@
+Check that a rebuild appends to the existing trace instead of rewriting it
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr myfile
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
+
+Run the first build
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  ./A
+  cat inputA
+  ./B
+  cat inputB
+
+Save a copy of the trace
+  $ cp .rkr/db db.orig
+
+Change inputB
+  $ echo " frodo" > inputB
+
+Run a rebuild
+  $ rkr --show
+  cat inputB
+
+Check the output
+  $ cat myfile
+  hello frodo
+
+Everything after the header of the original trace should be unchanged
+  $ cmp -i 16 -n $(($(stat -c %s db.orig) - 16)) db.orig .rkr/db
+
+Run another rebuild, which should do nothing now
+  $ rkr --show
+
+A build that stops while appending leaves unused bytes after the last index it wrote
+  $ head -c 4096 /dev/zero >> .rkr/db
+
+Change inputB again and rebuild from the appended trace
+  $ echo " again" > inputB
+  $ rkr --show
+  cat inputB
+
+Check the output
+  $ cat myfile
+  hello again
+
+Clean up
+  $ rm -rf .rkr myfile db.orig
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
@@ -0,0 +1,41 @@
+Close a pipe with close_range, then reuse its file descriptor number for a file. Reads from the file must still be traced.
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr reuse output
+  $ echo "hello" > input
+
+Run the first build
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  gcc -o reuse reuse.c
+  cc1 * (glob)
+  as * (glob)
+  collect2 * (glob)
+  ld * (glob)
+  ./reuse
+
+Check the output
+  $ cat output
+  hello
+
+Run a rebuild, which should do nothing
+  $ rkr --show
+
+Change the input file, which the program read through the reused file descriptor
+  $ echo "goodbye" > input
+
+Run a rebuild, which should run the program again
+  $ rkr --show
+  ./reuse
+
+Check the output
+  $ cat output
+  goodbye
+
+Clean up
+  $ rm -rf .rkr reuse output
+  $ echo "hello" > input
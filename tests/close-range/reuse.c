@@ -0,0 +1,30 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int main() {
+  // Read from a pipe a few times so the reads can skip reporting
+  int fds[2];
+  if (pipe(fds)) return 1;
+
+  char c;
+  for (int i = 0; i < 4; i++) {
+    if (write(fds[1], "x", 1) != 1) return 1;
+    if (read(fds[0], &c, 1) != 1) return 1;
+  }
+
+  // Close the read end of the pipe with close_range, then reuse its number for a file
+  if (syscall(SYS_close_range, fds[0], fds[0], 0)) return 1;
+  int fd = open("input", O_RDONLY);
+  if (fd != fds[0]) return 1;
+
+  // Copy the file to stdout
+  char buf[64];
+  ssize_t bytes;
+  while ((bytes = read(fd, buf, sizeof(buf))) > 0) {
+    if (write(STDOUT_FILENO, buf, bytes) != bytes) return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,33 @@
+Run a command that is emulated while its traced parent runs again. The command launches a child,
+then writes a file the child reads. Its deferred steps must be emulated in trace order, so the
+child sees the write.
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr message output
+  $ echo 1 > trigger
+
+Run the first build
+  $ rkr > /dev/null 2>&1
+
+Check the output
+  $ cat output
+  hello
+
+Change the trigger. Only the Rikerfile should run again
+  $ echo 2 > trigger
+  $ rkr --show
+  Rikerfile
+
+Check the output
+  $ cat output
+  hello
+
+Run a rebuild, which should do nothing
+  $ rkr --show
+
+Clean up
+  $ rm -rf .rkr message output
+  $ echo 1 > trigger
@@ -0,0 +1,7 @@
+# Launch a child that reads the message after this script writes it
+sh -c "sleep 0.5; cat message > output" &
+echo "hello" > message
+wait
+
+# Leave nothing on the filesystem for the child's read to find by accident
+rm message
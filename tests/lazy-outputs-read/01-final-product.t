@@ -0,0 +1,41 @@
+Keep a final product on the filesystem with lazy outputs enabled, even though a later command reads it.
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr intermediate output
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
+
+Run the first build
+  $ rkr --show --lazy-outputs
+  rkr-launch
+  Rikerfile
+  ./compile
+  cat inputA
+  ./link
+  cat intermediate inputB
+  cat output
+  hello world
+
+Remove both outputs
+  $ rm intermediate output
+
+Run a rebuild. The final output is restored even though cat reads it, but the intermediate is not.
+  $ rkr --show --lazy-outputs
+
+Check the output
+  $ cat output
+  hello world
+
+  $ test -e intermediate
+  [1]
+
+Run another rebuild, which should do nothing
+  $ rkr --show --lazy-outputs
+  $ cat output
+  hello world
+
+Clean up
+  $ rm -rf .rkr intermediate output
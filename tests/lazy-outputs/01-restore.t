@@ -0,0 +1,55 @@
+Restore removed outputs with lazy outputs enabled. Only the final output should come back.
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr intermediate output
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
+
+Run the first build
+  $ rkr --show --lazy-outputs
+  rkr-launch
+  Rikerfile
+  ./compile
+  cat inputA
+  ./link
+  cat intermediate inputB
+
+Check the output
+  $ cat output
+  hello world
+
+Remove both outputs
+  $ rm intermediate output
+
+Run a rebuild, which should only restore the final output from the cache
+  $ rkr --show --lazy-outputs
+
+Check the output
+  $ cat output
+  hello world
+
+The intermediate file is still in the cache, but not on the filesystem
+  $ test -e intermediate
+  [1]
+
+Run another rebuild, which should do nothing
+  $ rkr --show --lazy-outputs
+  $ test -e intermediate
+  [1]
+
+Remove the final output again, and make sure it is restored
+  $ rm output
+  $ rkr --show --lazy-outputs
+  $ cat output
+  hello world
+
+Run a rebuild without lazy outputs, which restores the intermediate file too
+  $ rkr --show
+  $ cat intermediate
+  hello (no-eol)
+
+Clean up
+  $ rm -rf .rkr intermediate output
@@ -0,0 +1,45 @@
+Rerun a command that reads an intermediate file that was left in the cache
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr intermediate output
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
+
+Run the first build
+  $ rkr --show --lazy-outputs
+  rkr-launch
+  Rikerfile
+  ./compile
+  cat inputA
+  ./link
+  cat intermediate inputB
+
+Remove both outputs and restore only the final output
+  $ rm intermediate output
+  $ rkr --show --lazy-outputs
+  $ test -e intermediate
+  [1]
+
+Change inputB
+  $ echo " frodo" > inputB
+
+Run a rebuild. The intermediate file is committed when the traced command reads it.
+  $ rkr --show --lazy-outputs
+  cat intermediate inputB
+
+Check the output
+  $ cat output
+  hello frodo
+  $ cat intermediate
+  hello (no-eol)
+
+Run another rebuild, which should do nothing
+  $ rkr --show --lazy-outputs
+
+Clean up
+  $ rm -rf .rkr intermediate output
+  $ echo -n "hello" > inputA
+  $ echo " world" > inputB
@@ -0,0 +1,24 @@
+Move to test directory
+  $ cd $TESTDIR
+
+Clean up any leftover state
+  $ rm -rf .rkr output
+  $ seq 1 200000 > input
+
+Run the build, which streams the input through several pipe buffers
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+
+Check the output
+  $ cat output
+  140951
+
+Rebuild, which should do nothing
+  $ rkr --show
+
+Clean up
+  $ rm -rf .rkr output input
@@ -0,0 +1,37 @@
+Move to test directory
+  $ cd $TESTDIR
+
+Clean up any leftover state
+  $ rm -rf .rkr output
+  $ seq 1 200000 > input
+
+Run the build
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+
+Check the output
+  $ cat output
+  140951
+
+Now change the input
+  $ seq 1 300000 > input
+
+Run a rebuild. Only the pipeline should run.
+  $ rkr --show
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+  ((cat input)|(tr 1 x)|(grep -c x)) (re)
+
+Check the output
+  $ cat output
+  181902
+
+Rebuild again, which should do nothing
+  $ rkr --show
+
+Clean up
+  $ rm -rf .rkr output input
@@ -0,0 +1,48 @@
+Check that a deleted predicate program is saved again, and that a build a program cannot check
+removes the saved program
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr output list-tmp
+  $ echo "hello" > input
+
+Run the first build, which saves a predicate program
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  cat input
+  $ test -f .rkr/predicates
+
+Delete the program. The next build must emulate the trace, then save the program again
+  $ rm .rkr/predicates
+  $ rkr --show --log phase
+  (phase) Starting build phase 0
+  (phase) Finished build phase 0
+  (phase) Committing environment changes
+  $ test -f .rkr/predicates
+
+Run a rebuild, which should skip emulation
+  $ rkr --show --log phase
+  (phase) Predicate program passed. Skipping build
+
+Make the build list /tmp. The saved program must be removed, and no new program saved
+  $ sleep 0.1
+  $ touch list-tmp
+  $ rkr --show --log phase
+  (phase) Starting build phase 0
+  (phase) Finished build phase 0
+  (phase) Starting build phase 1
+  Rikerfile
+  ls /tmp
+  (phase) Finished build phase 1
+  (phase) Committing environment changes
+  (phase) Starting post-build checks
+  (phase) Finished post-build checks
+  (phase) Not saving a predicate program for inputs it cannot check
+  $ test -f .rkr/predicates
+  [1]
+
+Clean up
+  $ rm -rf .rkr output list-tmp
@@ -0,0 +1,37 @@
+Check that a predicate program notices a new file in /tmp that the build looked for
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr out1 out2 out3 /tmp/rkr-predicates-extra
+  $ echo "hello" > input
+
+Run the first build
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  cat input
+  sort input
+  cat /tmp/rkr-predicates-extra
+
+Run a rebuild with nothing to do, then one that should skip emulation
+  $ rkr --show
+  $ rkr --show --log phase
+  (phase) Predicate program passed. Skipping build
+
+Create the file the build looked for in /tmp
+  $ echo "extra" > /tmp/rkr-predicates-extra
+
+Run a rebuild, which must not skip emulation
+  $ rkr --show
+  cat /tmp/rkr-predicates-extra
+  Rikerfile
+
+Check the output
+  $ cat out3
+  extra
+
+Clean up
+  $ rm -rf .rkr out1 out2 out3 /tmp/rkr-predicates-extra
+  $ echo "hello" > input
@@ -0,0 +1,71 @@
+Check that a predicate program restores a build only when it can tell which commands a change affects
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr out1 out2 out3 /tmp/rkr-predicates-extra
+  $ echo "hello" > input
+
+Run the first build, then a rebuild with nothing to do
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  cat input
+  sort input
+  cat /tmp/rkr-predicates-extra
+  $ rkr --show
+
+Change the input to a different size. Both commands that read it must run again
+  $ sleep 0.1
+  $ echo "goodbye" > input
+  $ rkr --show --log phase
+  (phase) Starting build phase 0
+  (phase) Restored build from predicate program
+  (phase) Finished build phase 0
+  (phase) Starting build phase 1
+  cat input
+  sort input
+  (phase) Finished build phase 1
+  (phase) Committing environment changes
+  (phase) Starting post-build checks
+  (phase) Finished post-build checks
+
+Check the output
+  $ cat out1 out2
+  goodbye
+  goodbye
+
+Run a rebuild with nothing to do
+  $ sleep 0.1
+  $ rkr --show > /dev/null 2>&1
+
+Touch the input without changing it. Its hash still matches, so the build is skipped
+  $ sleep 0.1
+  $ touch input
+  $ rkr --show --log phase
+  (phase) Predicate program passed. Skipping build
+
+Change the input without changing its size. Its hash shows which commands read it
+  $ sleep 0.1
+  $ echo "so long" > input
+  $ rkr --show --log phase
+  (phase) Starting build phase 0
+  (phase) Restored build from predicate program
+  (phase) Finished build phase 0
+  (phase) Starting build phase 1
+  cat input
+  sort input
+  (phase) Finished build phase 1
+  (phase) Committing environment changes
+  (phase) Starting post-build checks
+  (phase) Finished post-build checks
+
+Check the output
+  $ cat out1 out2
+  so long
+  so long
+
+Clean up
+  $ rm -rf .rkr out1 out2 out3
+  $ echo "hello" > input
@@ -0,0 +1,36 @@
+Check that a command's repeated lookups of a missing file are saved once, and that creating the
+file still reruns the command
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr missing output
+  $ echo "hello" > input
+
+Run the first build
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  cat input
+
+The Rikerfile looks for the missing file twice, but the saved trace only checks it once
+  $ rkr trace | grep -c '"missing"'
+  1
+
+Run a rebuild, which should do nothing
+  $ rkr --show
+
+Create the missing file and rebuild
+  $ touch missing
+  $ rkr --show
+  Rikerfile
+  found missing
+  found missing again
+
+Check the output
+  $ cat output
+  hello
+
+Clean up
+  $ rm -rf .rkr missing output input
@@ -0,0 +1,38 @@
+Resolve a path, rename a directory it passes through, and resolve it again. The second resolution
+must not reuse the entries found by the first.
+
+Move to test directory
+  $ cd $TESTDIR
+
+Prepare for a clean run
+  $ rm -rf .rkr dir moved out1 out2 out3
+
+Run the first build
+  $ rkr --show
+  rkr-launch
+  Rikerfile
+  mkdir -p dir/sub
+  cat dir/sub/file
+  mv dir moved
+  cat dir/sub/file
+  cat moved/sub/file
+  rm -r moved
+
+Check the output
+  $ cat out1 out2 out3
+  hello
+  cat: dir/sub/file: No such file or directory
+  hello
+
+Remove the predicate program so the rebuild emulates every resolution. Nothing should run
+  $ rm -f .rkr/predicates
+  $ rkr --show
+
+Check the output
+  $ cat out1 out2 out3
+  hello
+  cat: dir/sub/file: No such file or directory
+  hello
+
+Clean up
+  $ rm -rf .rkr dir moved out1 out2 out3
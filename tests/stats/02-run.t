@@ -17,14 +17,20 @@ Verify the output is correct
     Steps: [0-9]+ (re)
     Artifacts: [0-9]+ (re)
     Artifact Versions: [0-9]+ (re)
+    Max RSS: [0-9]+ KB (re)
+    Allocations per Step: [0-9]+\.[0-9]{2} (re)
+    Heap Allocations per Step: [0-9]+\.[0-9]{2} (re)
 
 Verify the -a output is correct
-  $ rkr stats -a | head -n 8
+  $ rkr stats -a | head -n 11
   Build Statistics:
     Commands: [0-9]+ (re)
     Steps: [0-9]+ (re)
     Artifacts: [0-9]+ (re)
     Artifact Versions: [0-9]+ (re)
+    Max RSS: [0-9]+ KB (re)
+    Allocations per Step: [0-9]+\.[0-9]{2} (re)
+    Heap Allocations per Step: [0-9]+\.[0-9]{2} (re)
   
   Artifacts:
     .+ (re)
\ No newline at end of file
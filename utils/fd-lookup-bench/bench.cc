@@ -0,0 +1,101 @@
+/**
+ * Microbenchmark for file descriptor lookups in syscall handlers.
+ *
+ * Every traced read, write, and close looks up an fd in the process' table and then looks up the
+ * resulting Ref::ID in the command's reference table. This benchmark times that lookup path with
+ * FDTable against the std::map table processes used before, along with the cost of copying a
+ * table on fork. Run bench.sh to build and run it.
+ */
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "tracing/FDTable.hh"
+
+using std::map;
+using std::vector;
+
+using Clock = std::chrono::steady_clock;
+
+/// The number of lookups timed for each table
+constexpr size_t Lookups = 50'000'000;
+
+/// The number of fork copies timed for each table
+constexpr size_t Forks = 5'000'000;
+
+/// A stand-in for the command's reference table
+struct RefEntry {
+  uint64_t ref;
+  size_t uses;
+};
+
+/// Report the time per operation for a benchmark
+template <typename F>
+void run(const char* name, size_t count, F f) {
+  auto start = Clock::now();
+  uint64_t result = f();
+  auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+  printf("%-24s %8.2f ns/op  (checksum %lu)\n", name, elapsed / count, result);
+}
+
+int main() {
+  // A typical process has stdio, a few open files, and bash's saved fd 255
+  vector<int> open_fds = {0, 1, 2, 3, 4, 5, 6, 7, 10, 255};
+
+  map<int, FDTable::FileDescriptor> map_table;
+  FDTable dense_table;
+  for (size_t i = 0; i < open_fds.size(); i++) {
+    Ref::ID ref = Ref::ReservedRefs + i;
+    map_table.emplace(open_fds[i], FDTable::FileDescriptor{ref, false});
+    dense_table.set(open_fds[i], FDTable::FileDescriptor{ref, false});
+  }
+
+  vector<RefEntry> refs(Ref::ReservedRefs + open_fds.size());
+  for (size_t i = 0; i < refs.size(); i++) refs[i] = {i * 7, 1};
+
+  // Syscalls mostly use low fds, so draw fds from a fixed pseudo-random sequence over the table
+  vector<int> sequence(4096);
+  std::mt19937 rng(1);
+  for (auto& fd : sequence) fd = open_fds[rng() % open_fds.size()];
+
+  run("std::map lookup", Lookups, [&] {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < Lookups; i++) {
+      auto iter = map_table.find(sequence[i % sequence.size()]);
+      sum += refs[std::get<0>(iter->second)].ref;
+    }
+    return sum;
+  });
+
+  run("FDTable lookup", Lookups, [&] {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < Lookups; i++) {
+      auto desc = dense_table.find(sequence[i % sequence.size()]);
+      sum += refs[std::get<0>(*desc)].ref;
+    }
+    return sum;
+  });
+
+  run("std::map fork", Forks, [&] {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < Forks; i++) {
+      auto copy = map_table;
+      sum += copy.size();
+    }
+    return sum;
+  });
+
+  run("FDTable fork", Forks, [&] {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < Forks; i++) {
+      auto copy = dense_table;
+      sum += copy.contains(1);
+    }
+    return sum;
+  });
+
+  return 0;
+}
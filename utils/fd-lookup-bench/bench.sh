@@ -0,0 +1,10 @@
+#!/bin/sh -x
+
+ROOT=../..
+
+# build the benchmark
+clang++ -O3 -DNDEBUG --std=c++17 -I$ROOT/src/common -I$ROOT/src/rkr -I$ROOT/deps/fmt/include \
+  -DFMT_HEADER_ONLY bench.cc -o bench
+
+# run it
+./bench